@@ -0,0 +1,175 @@
+// *****************************************************************************
+// recorder_aggregate.c                                         Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Merge the shared-memory channels of several running programs
+//
+//     Each program is identified by its RECORDER_SHARE file. The merged
+//     channels are exported in a single file, so that one recorder_scope
+//     can show all programs, and commands sent by the scope are forwarded
+//     to all of them.
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU Lesser General Public License v2+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+static volatile sig_atomic_t aggregate_running = 1;
+
+
+static void aggregate_stop(int sig)
+// ----------------------------------------------------------------------------
+//   Stop aggregating when interrupted
+// ----------------------------------------------------------------------------
+{
+    (void) sig;
+    aggregate_running = 0;
+}
+
+
+static int usage(const char *program)
+// ----------------------------------------------------------------------------
+//   Show the command-line options
+// ----------------------------------------------------------------------------
+{
+    fprintf(stderr,
+            "Usage: %s [-o file] [-n pattern] [-d ms] [-c config] "
+            "[-t seconds] [label=]file...\n"
+            "  -o file:    Export merged channels to file"
+            " (default: /tmp/recorder_aggregate)\n"
+            "  -n pattern: Regular expression for channel names"
+            " (default: .*)\n"
+            "  -d ms:      Keep at most one sample every ms milliseconds\n"
+            "  -c config:  Send configuration to all programs,"
+            " including when they restart\n"
+            "  -t seconds: Stop aggregating after the given time\n"
+            "  file:       RECORDER_SHARE file of a program, the label"
+            " defaulting to the file name\n"
+            "Use RECORDER_SHARE=file recorder_scope to view merged channels\n",
+            program);
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+// ----------------------------------------------------------------------------
+//   Aggregate the given programs until interrupted
+// ----------------------------------------------------------------------------
+{
+    const char  *output   = "/tmp/recorder_aggregate";
+    const char  *pattern  = ".*";
+    double       period   = 0;
+    double       duration = 0;
+    const char **configs  = calloc(argc, sizeof(const char *));
+    unsigned     count    = 0;
+    unsigned     sources  = 0;
+    unsigned     c;
+    int          a;
+
+    recorder_trace_set(getenv("RECORDER_TRACES"));
+    recorder_trace_set(getenv("RECORDER_TWEAKS"));
+
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+            output = argv[++a];
+        else if (strcmp(argv[a], "-n") == 0 && a + 1 < argc)
+            pattern = argv[++a];
+        else if (strcmp(argv[a], "-d") == 0 && a + 1 < argc)
+            period = atof(argv[++a]);
+        else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc)
+            configs[count++] = argv[++a];
+        else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+            duration = atof(argv[++a]);
+        else if (argv[a][0] == '-')
+            return usage(argv[0]);
+        else
+            sources++;
+    }
+    if (!sources)
+        return usage(argv[0]);
+
+    recorder_chans_p chans = recorder_chans_new(output);
+    if (!chans)
+    {
+        fprintf(stderr, "%s: Unable to create channels in %s\n",
+                argv[0], output);
+        return 1;
+    }
+
+    signal(SIGINT, aggregate_stop);
+    signal(SIGTERM, aggregate_stop);
+
+    // Configurations are sent to each program when it is opened
+    recorder_aggregate_p aggregate =
+        recorder_aggregate_new(chans, pattern,
+                               (uintptr_t) (period * RECORDER_HZ / 1000));
+    for (c = 0; c < count; c++)
+        recorder_aggregate_configure(aggregate, configs[c]);
+    for (a = 1; a < argc; a++)
+    {
+        if (argv[a][0] == '-')
+        {
+            a++;
+            continue;
+        }
+
+        // A label may be given as label=file
+        char *label = strdup(argv[a]);
+        char *file  = strchr(label, '=');
+        if (file)
+            *file++ = 0;
+        if (!recorder_aggregate_add(aggregate, file ? file : label,
+                                    file ? label : NULL))
+            fprintf(stderr, "%s: Waiting for %s\n", argv[0], argv[a]);
+        free(label);
+    }
+
+    struct timespec tm;
+    tm.tv_sec  = 0;
+    tm.tv_nsec = 100000000;
+    uintptr_t start = recorder_tick();
+    while (aggregate_running)
+    {
+        if (duration > 0 && recorder_tick() - start >= duration * RECORDER_HZ)
+            break;
+        nanosleep(&tm, NULL);
+    }
+
+    uint64_t lost = recorder_aggregate_lost(aggregate);
+    recorder_aggregate_delete(aggregate);
+    recorder_chans_delete(chans);
+    free(configs);
+
+    fprintf(stderr, "%s: Aggregated %u programs, lost %lu samples\n",
+            argv[0], sources, (unsigned long) lost);
+    return 0;
+}
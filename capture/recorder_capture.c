@@ -0,0 +1,159 @@
+// *****************************************************************************
+// recorder_capture.c                                           Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Stream the shared-memory channels of a running program to a file
+//
+//     The channels are those exported with RECORDER_SHARE and the
+//     'export' trace command, as shown by recorder_scope. The capture
+//     can be replayed later with recorder_scope -p file.
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU Lesser General Public License v2+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static volatile sig_atomic_t capture_running = 1;
+
+
+static void capture_stop(int sig)
+// ----------------------------------------------------------------------------
+//   Stop capturing when interrupted
+// ----------------------------------------------------------------------------
+{
+    (void) sig;
+    capture_running = 0;
+}
+
+
+static int usage(const char *program)
+// ----------------------------------------------------------------------------
+//   Show the command-line options
+// ----------------------------------------------------------------------------
+{
+    fprintf(stderr,
+            "Usage: %s [-o file] [-i ms] [-t seconds] [pattern]\n"
+            "  -o file:    Write the capture to file (default: capture.rcap)\n"
+            "  -i ms:      Poll channels every ms milliseconds (default: 1)\n"
+            "  -t seconds: Stop capturing after the given time\n"
+            "  pattern:    Regular expression for channel names (default: .*)\n"
+            "The channels are read from $RECORDER_SHARE"
+            " (default: /tmp/recorder_share)\n",
+            program);
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+// ----------------------------------------------------------------------------
+//   Capture the selected channels until interrupted
+// ----------------------------------------------------------------------------
+{
+    const char *output   = "capture.rcap";
+    const char *pattern  = ".*";
+    unsigned    interval = 1;
+    double      duration = 0;
+    int         a;
+
+    recorder_trace_set(getenv("RECORDER_TRACES"));
+    recorder_trace_set(getenv("RECORDER_TWEAKS"));
+
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+            output = argv[++a];
+        else if (strcmp(argv[a], "-i") == 0 && a + 1 < argc)
+            interval = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+            duration = atof(argv[++a]);
+        else if (argv[a][0] == '-')
+            return usage(argv[0]);
+        else
+            pattern = argv[a];
+    }
+
+    const char      *share = recorder_export_file();
+    recorder_chans_p chans = recorder_chans_open(share);
+    if (!chans)
+    {
+        fprintf(stderr, "%s: Unable to open channels in %s\n", argv[0], share);
+        return 1;
+    }
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: Unable to create %s\n", argv[0], output);
+        recorder_chans_close(chans);
+        return 1;
+    }
+
+    signal(SIGINT, capture_stop);
+    signal(SIGTERM, capture_stop);
+
+    recorder_capture_p capture  = recorder_capture_new(chans, pattern, fd);
+    uintptr_t          start    = recorder_tick();
+    uintptr_t          flushed  = start;
+    uint64_t           samples  = 0;
+    struct timespec    tm;
+    tm.tv_sec  = interval / 1000;
+    tm.tv_nsec = interval % 1000 * 1000000;
+
+    while (capture_running && recorder_chans_valid(chans))
+    {
+        size_t    polled = recorder_capture_poll(capture);
+        uintptr_t now    = recorder_tick();
+        samples += polled;
+
+        // Write partial chunks and look for new channels every second
+        if (now - flushed >= RECORDER_HZ)
+        {
+            recorder_capture_flush(capture);
+            flushed = now;
+        }
+        if (duration > 0 && now - start >= duration * RECORDER_HZ)
+            break;
+        if (!polled)
+            nanosleep(&tm, NULL);
+    }
+
+    uint64_t lost = recorder_capture_lost(capture);
+    recorder_capture_delete(capture);
+    close(fd);
+    recorder_chans_close(chans);
+
+    fprintf(stderr, "%s: Captured %lu samples to %s, lost %lu\n",
+            argv[0], (unsigned long) samples, output, (unsigned long) lost);
+    return 0;
+}
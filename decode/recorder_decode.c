@@ -0,0 +1,88 @@
+// *****************************************************************************
+// recorder_decode.c                                            Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Show the content of binary recorder dumps as text
+//
+//     Binary dumps are written by recorder_dump_binary(), or by the
+//     'dump_binary' and 'output_binary' trace commands. The output is the
+//     same as for recorder_dump(), and can be configured with the same
+//     tweaks, e.g. RECORDER_TRACES=recorder_location recorder_decode file
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU Lesser General Public License v2+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static int decode(const char *program, const char *name)
+// ----------------------------------------------------------------------------
+//   Decode one file, '-' being the standard input
+// ----------------------------------------------------------------------------
+{
+    int fd = strcmp(name, "-") == 0 ? 0 : open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: Unable to open %s\n", program, name);
+        return 1;
+    }
+
+    unsigned decoded = recorder_decode_binary(fd);
+    if (fd)
+        close(fd);
+    if (!decoded)
+    {
+        fprintf(stderr, "%s: No recorder entry found in %s\n", program, name);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+// ----------------------------------------------------------------------------
+//   Decode the files given as arguments, or standard input
+// ----------------------------------------------------------------------------
+{
+    int a;
+    int status = 0;
+
+    recorder_trace_set(getenv("RECORDER_TRACES"));
+    recorder_trace_set(getenv("RECORDER_TWEAKS"));
+    recorder_configure_output(stdout);
+
+    if (argc < 2)
+        return decode(argv[0], "-");
+
+    for (a = 1; a < argc; a++)
+        status |= decode(argv[0], argv[a]);
+    return status;
+}
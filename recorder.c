@@ -57,6 +57,20 @@
 #include <sys/mman.h>
 #endif // HAVE_SYS_MMAN_H
 #include <sys/stat.h>
+#include <time.h>
+#include <sched.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#endif // __GNUC__ && __x86_64__
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif // HAVE_LINUX_FUTEX_H
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif // HAVE_LINUX_MEMPOLICY_H
 
 
 
@@ -137,7 +151,27 @@ enum
     ,
 
     // Signals where the signal handler should exit
-    RECORDER_SIGNALS_EXITING = RECORDER_SIGNALS_MASK&~RECORDER_SIGNALS_REPEATING
+    RECORDER_SIGNALS_EXITING = RECORDER_SIGNALS_MASK&~RECORDER_SIGNALS_REPEATING,
+
+    // Bits below the time stamp in the order when in scalable order mode
+    RECORDER_SCALABLE_ORDER_SHIFT = 8,
+
+    // Number of traced entries waiting to be formatted in async mode
+    RECORDER_TRACE_QUEUE_SIZE = 1024,
+
+    // Continuation entries: marker values, arguments, max entries per record
+    RECORDER_EXTRA_MARKER = 1,
+    RECORDER_EXTRA_LIMIT  = 0x100,
+    RECORDER_EXTRA_ARGS   = 6,
+    RECORDER_RECORD_SLOTS = 4,
+
+    // Maximum number of NUMA nodes considered for placing sharded rings
+    RECORDER_NUMA_NODES = 64,
+
+    // Clock used for ticks, published in shared memory to align time stamps
+    RECORDER_TICK_OTHER         = 0,
+    RECORDER_TICK_GETTIMEOFDAY  = 1,
+    RECORDER_TICK_MONOTONIC     = 2
 };
 
 
@@ -166,12 +200,23 @@ RECORDER_TWEAK_DEFINE(recorder_signals_exiting,
                       "Recorder default mask for signals that will exit");
 RECORDER_TWEAK_DEFINE(recorder_dump_sleep, 100,
                       "Sleep time between background dumps (ms)");
+RECORDER_TWEAK_DEFINE(recorder_dump_events, 1,
+                      "Set to wait for events instead of polling (if possible)");
+RECORDER_TWEAK_DEFINE(recorder_dump_batch, 1000,
+                      "Minimum time between background dump wakeups (us)");
 RECORDER_TWEAK_DEFINE(recorder_export_size, 2048,
                       "Number of samples stored when exporting records");
+RECORDER_TWEAK_DEFINE(recorder_export_columns, 0,
+                      "Set to export channels as columns sharing time stamps");
+RECORDER_TWEAK_DEFINE(recorder_export_reserve,
+                      RECORDER_64BIT ? 256 << 20 : 16 << 20,
+                      "Address space reserved for export channels (bytes)");
+RECORDER_TWEAK_DEFINE(recorder_export_huge_pages, 1,
+                      "Set to ask for huge pages backing export channels");
 RECORDER_TWEAK_DEFINE(recorder_configuration_sleep, 100,
                       "Sleep time between configuration checks (ms)");
 RECORDER_TWEAK_DEFINE(recorder_time_precision,
-                        RECORDER_HZ > 100000 ?  6
+                        RECORDER_HZ > 100000 ?  6 // Set to 9 to show ns
                       : RECORDER_HZ >  10000 ?  5
                       : RECORDER_HZ >   1000 ?  4
                       : RECORDER_HZ >    100 ?  3
@@ -181,6 +226,16 @@ RECORDER_TWEAK_DEFINE(recorder_time_precision,
                       "Precision for displaying time");
 RECORDER_TWEAK_DEFINE(recorder_alt_stack_size, SIGSTKSZ,
                       "Size of alternate stack for recorder (0 to disable)");
+RECORDER_TWEAK_DEFINE(recorder_scalable_order, 0,
+                      "Set to order records by time stamp, not global counter");
+RECORDER_TWEAK_DEFINE(recorder_trace_async, 0,
+                      "Set to format traces in a background thread");
+RECORDER_TWEAK_DEFINE(recorder_inline_strings, 0,
+                      "Max length of strings copied in records (0 to disable)");
+RECORDER_TWEAK_DEFINE(recorder_stats_period, 100,
+                      "Default period for publishing recorder statistics (ms)");
+RECORDER_TWEAK_DEFINE(recorder_aggregate_sleep, 1,
+                      "Sleep time when aggregated processes are idle (ms)");
 
 // Display tweaks
 RECORDER_TWEAK_DEFINE(recorder_location, 0,
@@ -261,7 +316,6 @@ static inline void pattern_free(pattern_t *re)
 //
 // ============================================================================
 
-size_t    recorder_chan_write(recorder_chan_p chan, const void *ptr, size_t cnt);
 size_t    recorder_chan_writable(recorder_chan_p chan);
 ringidx_t recorder_chan_writer(recorder_chan_p chan);
 ringidx_t recorder_chan_reader(recorder_chan_p chan);
@@ -283,6 +337,23 @@ static void recorder_format_entry(recorder_show_fn show,
                                   uintptr_t order,
                                   uintptr_t timestamp,
                                   const char *message);
+static void recorder_format_located(recorder_show_fn show,
+                                    void *output,
+                                    const char *label,
+                                    const char *location,
+                                    uintptr_t order,
+                                    uintptr_t timestamp,
+                                    const char *message,
+                                    int fileline);
+static void recorder_trace_ring_entry(recorder_info *info,
+                                      recorder_ring_p ring,
+                                      recorder_entry *entry);
+static unsigned recorder_binary_sort(const char *what, int fd);
+static void recorder_dump_wakeup(void);
+static void recorder_doorbell_ring(uint32_t *doorbell, bool shared);
+static void recorder_doorbell_wait(uint32_t *doorbell, uint32_t seen,
+                                   unsigned sleep_ms, bool shared);
+static uint64_t recorder_tick_reference(uint64_t *origin, uint32_t *clock);
 
 static void *              recorder_output        = NULL;
 static recorder_show_fn    recorder_show          = recorder_print;
@@ -290,1965 +361,7426 @@ static recorder_format_fn  recorder_format        = recorder_format_entry;
 static recorder_type_fn    recorder_types[256]    = { };
 static uint8_t            *recorder_alt_stack     = NULL;
 static uintptr_t           recorder_time_at_start = 0;
+static int                 recorder_binary_output = -1;
+static unsigned            recorder_dump_waiting  = 0;
+
+/// Counters for recorder_stats_publish, only updated while it is active
+static unsigned  recorder_stats_interval   = 0;
+static unsigned  recorder_stats_started    = 0;
+static uintptr_t recorder_stats_dumps      = 0;
+static uintptr_t recorder_stats_dump_ticks = 0;
+static uintptr_t recorder_stats_trace_lag  = 0;
 
 
 
 // ============================================================================
 //
-//   Recording data
+//   Sharded recorders
 //
 // ============================================================================
 
-ringidx_t recorder_append(recorder_info *rec,
-                          const char *where,
-                          const char *format,
-                          uintptr_t a0,
-                          uintptr_t a1,
-                          uintptr_t a2,
-                          uintptr_t a3)
+/// Number of threads that were assigned a shard
+static unsigned recorder_shard_threads = 0;
+
+/// Shard assigned to the current thread, 0 if not assigned yet
+static RECORDER_THREAD_LOCAL unsigned recorder_shard_thread = 0;
+
+/// NUMA node the current thread was running on when assigned a shard
+static RECORDER_THREAD_LOCAL unsigned recorder_shard_node = 0;
+
+/// Number of NUMA nodes, 0 until it has been looked up
+static unsigned recorder_numa_nodes = 0;
+
+/// Number of threads that were assigned a shard on each NUMA node
+static unsigned recorder_numa_threads[RECORDER_NUMA_NODES];
+
+
+static unsigned recorder_numa_node(void)
 // ----------------------------------------------------------------------------
-//  Enter a record entry in ring buffer with given set of args
+//   Return the NUMA node the current thread is running on
 // ----------------------------------------------------------------------------
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = recorder_tick();
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_ring_fetch_add(ring->commit, 1);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+#if HAVE_LINUX_MEMPOLICY_H && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 &&
+        node < RECORDER_NUMA_NODES)
+        return node;
+#endif // HAVE_LINUX_MEMPOLICY_H && SYS_getcpu
+    return 0;
 }
 
 
-ringidx_t recorder_append2(recorder_info *rec,
-                           const char *where,
-                           const char *format,
-                           uintptr_t a0,
-                           uintptr_t a1,
-                           uintptr_t a2,
-                           uintptr_t a3,
-                           uintptr_t a4,
-                           uintptr_t a5,
-                           uintptr_t a6,
-                           uintptr_t a7)
+static unsigned recorder_numa_init(void)
 // ----------------------------------------------------------------------------
-//   Enter a double record (up to 8 args)
+//   Look up the number of NUMA nodes, unless RECORDER_NUMA=0
 // ----------------------------------------------------------------------------
+//   The result does not change, so concurrent lookups are harmless
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 2);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = recorder_tick();
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_entry *entry2 = &data[(writer+1) % size];
-    entry2->format = NULL;
-    entry2->order = entry->order;
-    entry2->timestamp = entry->timestamp;
-    entry2->where = where;
-    entry2->args[0] = a4;
-    entry2->args[1] = a5;
-    entry2->args[2] = a6;
-    entry2->args[3] = a7;
-    recorder_ring_fetch_add(ring->commit, 2);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+    unsigned nodes = recorder_numa_nodes;
+    if (nodes)
+        return nodes;
+
+    nodes = 1;
+    const char *numa = getenv("RECORDER_NUMA");
+    if (!numa || atoi(numa) != 0)
+    {
+        // The file contains a list of ranges, e.g. "0-1,3"
+        FILE *online = fopen("/sys/devices/system/node/online", "r");
+        if (online)
+        {
+            char buffer[256];
+            if (fgets(buffer, sizeof(buffer), online))
+            {
+                char *p = buffer;
+                while (*p)
+                {
+                    if (isdigit(*p))
+                    {
+                        unsigned long last = strtoul(p, &p, 10);
+                        if (last + 1 > nodes)
+                            nodes = last + 1;
+                    }
+                    else
+                    {
+                        p++;
+                    }
+                }
+            }
+            fclose(online);
+        }
+        if (nodes > RECORDER_NUMA_NODES)
+            nodes = RECORDER_NUMA_NODES;
+    }
+    recorder_numa_nodes = nodes;
+    return nodes;
 }
 
 
-ringidx_t recorder_append3(recorder_info *rec,
-                           const char *where,
-                           const char *format,
-                           uintptr_t a0,
-                           uintptr_t a1,
-                           uintptr_t a2,
-                           uintptr_t a3,
-                           uintptr_t a4,
-                           uintptr_t a5,
-                           uintptr_t a6,
-                           uintptr_t a7,
-                           uintptr_t a8,
-                           uintptr_t a9,
-                           uintptr_t a10,
-                           uintptr_t a11)
+static void *recorder_numa_alloc(size_t size, unsigned node)
 // ----------------------------------------------------------------------------
-//   Record a triple entry (up to 12 args)
+//   Default allocation for shard rings, with a preference for given node
 // ----------------------------------------------------------------------------
+//   Pages are only bound here, they are faulted in by the recording threads
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 3);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = recorder_tick();
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_entry *entry2 = &data[(writer+1) % size];
-    entry2->format = NULL;
-    entry2->order = entry->order;
-    entry2->timestamp = entry->timestamp;
-    entry2->where = where;
-    entry2->args[0] = a4;
-    entry2->args[1] = a5;
-    entry2->args[2] = a6;
-    entry2->args[3] = a7;
-    recorder_entry *entry3 = &data[(writer+2) % size];
-    entry3->format = NULL;
-    entry3->order = entry->order;
-    entry3->timestamp = entry->timestamp;
-    entry3->where = where;
-    entry3->args[0] = a8;
-    entry3->args[1] = a9;
-    entry3->args[2] = a10;
-    entry3->args[3] = a11;
-    recorder_ring_fetch_add(ring->commit, 3);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+#if HAVE_SYS_MMAN_H
+    void *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+#if HAVE_LINUX_MEMPOLICY_H && defined(SYS_mbind)
+    unsigned long mask = 1UL << node;
+    if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED,
+                &mask, 8 * sizeof(mask), 0) != 0)
+        record(recorder_warning, "Unable to bind %zu bytes to node %u: %s",
+               size, node, strerror(errno));
+#endif // HAVE_LINUX_MEMPOLICY_H && SYS_mbind
+    return ptr;
+#else // !HAVE_SYS_MMAN_H
+    (void) node;
+    return malloc(size);
+#endif // HAVE_SYS_MMAN_H
 }
 
 
-ringidx_t recorder_append_fast(recorder_info *rec,
-                               const char *where,
-                               const char *format,
-                               uintptr_t a0,
-                               uintptr_t a1,
-                               uintptr_t a2,
-                               uintptr_t a3)
+/// Function used to allocate shard rings on NUMA nodes
+static recorder_alloc_fn recorder_alloc = recorder_numa_alloc;
+
+
+recorder_alloc_fn recorder_configure_alloc(recorder_alloc_fn alloc)
 // ----------------------------------------------------------------------------
-//  Enter a record entry in ring buffer with given set of args
+//   Configure the function used to place shard rings on NUMA nodes
 // ----------------------------------------------------------------------------
+//   This only applies to sharded recorders activated after the call
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = data[(writer - 1) % size].timestamp;
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_ring_fetch_add(ring->commit, 1);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+    record(recorder, "Configure alloc %p from %p", alloc, recorder_alloc);
+    recorder_alloc_fn previous = recorder_alloc;
+    recorder_alloc = alloc ? alloc : recorder_numa_alloc;
+    return previous;
 }
 
 
-ringidx_t recorder_append_fast2(recorder_info *rec,
-                                const char *where,
-                                const char *format,
-                                uintptr_t a0,
-                                uintptr_t a1,
-                                uintptr_t a2,
-                                uintptr_t a3,
-                                uintptr_t a4,
-                                uintptr_t a5,
-                                uintptr_t a6,
-                                uintptr_t a7)
+static inline unsigned recorder_ring_count(recorder_info *rec)
 // ----------------------------------------------------------------------------
-//   Enter a double record (up to 8 args)
+//   Return the number of rings in a recorder
 // ----------------------------------------------------------------------------
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 2);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = data[(writer - 1) % size].timestamp;
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_entry *entry2 = &data[(writer+1) % size];
-    entry2->format = NULL;
-    entry2->order = entry->order;
-    entry2->timestamp = entry->timestamp;
-    entry2->where = where;
-    entry2->args[0] = a4;
-    entry2->args[1] = a5;
-    entry2->args[2] = a6;
-    entry2->args[3] = a7;
-    recorder_ring_fetch_add(ring->commit, 2);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+    recorder_shards *shards = rec->shards;
+    return shards ? shards->count + 1 : 1;
 }
 
 
-ringidx_t recorder_append_fast3(recorder_info *rec,
-                                const char *where,
-                                const char *format,
-                                uintptr_t a0,
-                                uintptr_t a1,
-                                uintptr_t a2,
-                                uintptr_t a3,
-                                uintptr_t a4,
-                                uintptr_t a5,
-                                uintptr_t a6,
-                                uintptr_t a7,
-                                uintptr_t a8,
-                                uintptr_t a9,
-                                uintptr_t a10,
-                                uintptr_t a11)
+static inline recorder_ring_p recorder_shard_ring(recorder_info *rec,
+                                                  unsigned index)
 // ----------------------------------------------------------------------------
-//   Record a triple entry (up to 12 args)
+//   Return the ring at the given index, index 0 being the recorder ring
 // ----------------------------------------------------------------------------
 {
-    recorder_ring_p ring   = &rec->ring;
-    recorder_entry *data   = rec->data;
-    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 3);
-    size_t          size   = ring->size;
-    recorder_entry *entry  = &data[writer % size];
-    entry->format = format;
-    entry->order = recorder_ring_fetch_add(recorder_order, 1);
-    entry->timestamp = data[(writer - 1) % size].timestamp;
-    entry->where = where;
-    entry->args[0] = a0;
-    entry->args[1] = a1;
-    entry->args[2] = a2;
-    entry->args[3] = a3;
-    recorder_entry *entry2 = &data[(writer+1) % size];
-    entry2->format = NULL;
-    entry2->order = entry->order;
-    entry2->timestamp = entry->timestamp;
-    entry2->where = where;
-    entry2->args[0] = a4;
-    entry2->args[1] = a5;
-    entry2->args[2] = a6;
-    entry2->args[3] = a7;
-    recorder_entry *entry3 = &data[(writer+2) % size];
-    entry3->format = NULL;
-    entry3->order = entry->order;
-    entry3->timestamp = entry->timestamp;
-    entry3->where = where;
-    entry3->args[0] = a8;
-    entry3->args[1] = a9;
-    entry3->args[2] = a10;
-    entry3->args[3] = a11;
-    recorder_ring_fetch_add(ring->commit, 3);
-    if (rec->trace)
-        recorder_trace_entry(rec, entry);
-    return writer;
+    if (index == 0)
+        return &rec->ring;
+    recorder_shards *shards = rec->shards;
+    if (shards->placed)
+        return shards->placed[index - 1];
+    char *first = (char *) shards->first;
+    return (recorder_ring_p) (first + (index - 1) * shards->stride);
+}
+
+
+static inline recorder_ring_p recorder_thread_ring(recorder_info *rec)
+// ----------------------------------------------------------------------------
+//   Return the ring the current thread should record into
+// ----------------------------------------------------------------------------
+//   Threads are assigned shards round-robin the first time they record
+//   into a sharded recorder, and keep the same shard for all recorders.
+//   When rings were placed on NUMA nodes, ring N lives on node N % nodes,
+//   and threads go round-robin among the rings of the node they run on.
+{
+    recorder_shards *shards = rec->shards;
+    if (!shards)
+        return &rec->ring;
+
+    unsigned thread = recorder_shard_thread;
+    if (!thread)
+    {
+        thread = recorder_ring_add_fetch(recorder_shard_threads, 1);
+        if (recorder_numa_nodes > 1)
+        {
+            unsigned node = recorder_numa_node();
+            recorder_shard_node = node;
+            thread = recorder_ring_add_fetch(recorder_numa_threads[node], 1);
+        }
+        recorder_shard_thread = thread;
+    }
+
+    unsigned rings = shards->count + 1;
+    unsigned nodes = recorder_numa_nodes;
+    unsigned node  = recorder_shard_node;
+    if (shards->placed && node < rings)
+    {
+        unsigned local = (rings - node + nodes - 1) / nodes;
+        return recorder_shard_ring(rec, node + nodes * ((thread - 1) % local));
+    }
+    return recorder_shard_ring(rec, (thread - 1) % rings);
 }
 
 
 
 // ============================================================================
 //
-//    Recorder dump utility
+//   Recording data
 //
 // ============================================================================
 
-/// Global counter indicating the order of entries across recorders.
-uintptr_t recorder_order = 0;
+/// Last order given to an entry by this thread in scalable order mode
+static RECORDER_THREAD_LOCAL uintptr_t recorder_thread_order = 0;
 
-// Check if we are currently dumping the recorder
-static unsigned recorder_dumping = 0;
+/// Set once entries were ordered from their time stamps
+static bool recorder_scalable_ordered = false;
 
-/// List of the currently active flight recorders (ring buffers)
-static recorder_info * recorders = NULL;
 
-/// List of the currently active tweaks
-static recorder_tweak *tweaks = NULL;
+static void recorder_scalable_order_end(void)
+// ----------------------------------------------------------------------------
+//   Make orders from the counter follow those computed from time stamps
+// ----------------------------------------------------------------------------
+//   Orders computed from time stamps are below that of the next tick
+{
+    bool scalable = true;
+    if (!recorder_ring_compare_exchange(recorder_scalable_ordered,
+                                        scalable, false))
+        return;
+    uintptr_t next = (recorder_tick() + 1) << RECORDER_SCALABLE_ORDER_SHIFT;
+    uintptr_t order = recorder_order;
+    while (order < next &&
+           !recorder_ring_compare_exchange(recorder_order, order, next))
+        continue;
+}
 
-// The current indent for output
-static unsigned indent = 0;
 
-static void recorder_dump_entry(recorder_info      *rec,
-                                recorder_entry     *entry,
-                                recorder_format_fn  format,
-                                recorder_show_fn    show,
-                                void               *output)
+static inline uintptr_t recorder_next_order(uintptr_t timestamp)
 // ----------------------------------------------------------------------------
-//  Dump a recorder entry in a buffer between dst and dst_end, return last pos
+//   Return the order for a new entry
 // ----------------------------------------------------------------------------
+//   By default, the order comes from the global recorder_order counter.
+//   In scalable mode, it is computed from the time stamp, so that the only
+//   shared cache line written while recording is the ring itself.
+//   The low bits keep entries from one thread within one tick in order.
+//   The global order is rebuilt in the order entries are dumped.
 {
-    char buffer[256];
-    char format_buffer[32];
+    if (!RECORDER_TWEAK(recorder_scalable_order) || sizeof(uintptr_t) < 8)
+    {
+        if (recorder_scalable_ordered)
+            recorder_scalable_order_end();
+        return recorder_ring_fetch_add(recorder_order, 1);
+    }
 
-    const char     *label         = rec->name;
-    char           *dst           = buffer;
-    char           *dst_end       = buffer + sizeof buffer - 1;
-    const char     *fmt           = entry->format;
-    unsigned        arg_index     = 0;
-    const unsigned  max_arg_index = array_size(entry->args);
-    unsigned        colons        = 0;
-    unsigned        nextindent    = indent;
+    if (!recorder_scalable_ordered)
+        recorder_scalable_ordered = true;
+    uintptr_t order = timestamp << RECORDER_SCALABLE_ORDER_SHIFT;
+    uintptr_t last = recorder_thread_order;
+    if (order <= last)
+        order = last + 1;
+    recorder_thread_order = order;
+    return order;
+}
 
-    // Exit if we get there for a long-format second entry
-    if (!fmt)
-        return;
 
-    // Apply formatting. This complicated loop is because
-    // we need to detect floating-point values, which are passed
-    // differently on many architectures such as x86 or ARM
-    // (passed in different registers). So we detect them from the format,
-    // convert intptr_t to float or double depending on its size,
-    // and call the variadic snprintf passing a double value that will
-    // naturally go in the right register. A bit ugly.
-    bool finished_in_newline = false;
-    while (dst < dst_end)
+static inline void recorder_committed(recorder_ring_p ring, ringidx_t commit)
+// ----------------------------------------------------------------------------
+//   Wake up the background dump if it waits and the ring was empty
+// ----------------------------------------------------------------------------
+//   Rings that are not dumped never become empty, so they never wake it up
+{
+    if (recorder_dump_waiting && commit == ring->reader)
+        recorder_dump_wakeup();
+}
+
+
+static inline const recorder_format_info *
+recorder_format_described(const char *format)
+// ----------------------------------------------------------------------------
+//   Return the description the compiler placed before a format, if any
+// ----------------------------------------------------------------------------
+{
+    if (*format != RECORDER_FORMAT_DESCRIBED)
+        return NULL;
+    return (const recorder_format_info *) (format -
+                                           sizeof(recorder_format_info));
+}
+
+
+static inline const char *recorder_format_text(const char *format)
+// ----------------------------------------------------------------------------
+//   Return the text of a format, skipping the mark of a description
+// ----------------------------------------------------------------------------
+{
+    return format + (*format == RECORDER_FORMAT_DESCRIBED);
+}
+
+
+static unsigned recorder_string_mask(const char *fmt, bool safe_strings)
+// ----------------------------------------------------------------------------
+//   Return a bit mask of the arguments that are safe (%+s) or unsafe strings
+// ----------------------------------------------------------------------------
+//   This follows the same rules as recorder_dump_entry to count arguments
+{
+    const recorder_format_info *info = recorder_format_described(fmt);
+    unsigned mask = 0;
+    unsigned arg  = 0;
+    char     c;
+
+    if (info)
+        return safe_strings ? info->safe : info->strings;
+
+    while ((c = *fmt++))
     {
-        char c = *fmt++;
         if (c != '%')
+            continue;
+
+        bool safe = false;
+        bool done = false;
+        while (!done)
         {
-            *dst = c;
-            if (!c)
-                break;
-            dst++;
-            if (c == ':')
+            c = *fmt++;
+            if (recorder_types[(uint8_t) c])
             {
-                // Skip file:line:
-                colons++;
+                arg++;
+                break;
             }
-            else if (colons == 2)
+            switch(c)
             {
-                // Check if first character marks indentation
-                switch(c)
-                {
-                case '>': nextindent = indent + 1; dst--; break;
-                case '<': nextindent = --indent;   dst--; break;
-                case '=': nextindent = indent = 0; dst--; break;
-                }
-                colons++;
+            case 's': case 'S':
+                if (safe == safe_strings)
+                    mask |= 1U << arg;
+                /* Falls through */
+            case 'f': case 'F': case 'g': case 'G': case 'e': case 'E':
+            case 'a': case 'A': case 'b': case 'c': case 'C':
+            case 'd': case 'D': case 'i': case 'o': case 'O':
+            case 'u': case 'U': case 'x': case 'X': case 'p':
+                arg++;
+                done = true;
+                break;
+            case '%':
+                done = true;
+                break;
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+            case '.': case '-': case 'l': case 'L': case 'h':
+            case 'j': case 't': case 'z': case 'q': case 'v':
+#ifdef _WIN32
+            case 'I':
+#endif
+                break;
+            case '+':
+                safe = true;
+                break;
+            case 'n':
+            case '*':
+                arg++;
+                break;
+            default:
+                return mask;
             }
         }
-        else
-        {
-            char     *fmt_copy       = format_buffer;
-            char     *fmt_end        = format_buffer + sizeof format_buffer - 1;
-            bool      floating_point = false;
-            recorder_type_fn special = NULL;
-            bool      done           = false;
-            bool      unsupported    = false;
-            bool      safe_pointer   = false;
-            int       fields[2]      = { 0 };
-            unsigned  field_cnt      = 0;
-            *fmt_copy++ = c;
-            while (!done && fmt_copy < fmt_end)
-            {
-                c = *fmt++;
-                *fmt_copy++ = c;
+    }
+    return mask;
+}
 
-                special = recorder_types[(uint8_t) c];
-                if (special)
-                    break;
 
-                switch(c)
-                {
-                case 'f': case 'F':  // Floating point formatting
-                case 'g': case 'G':
-                case 'e': case 'E':
-                case 'a': case 'A':
-                    floating_point = true;
-                    /* Falls through */
-                case 'b':           // Integer formatting
-                case 'c': case 'C':
-                case 's': case 'S':
-                case 'd': case 'D':
-                case 'i':
-                case 'o': case 'O':
-                case 'u': case 'U':
-                case 'x':
-                case 'X':
-                case 'p':
-                case '%':
-                case 0:             // End of string
-                    done = true;
-                    break;
+// Unsafe string masks by format, per thread to avoid sharing cache lines
+enum { RECORDER_STRING_MASKS = 64 };   // Formats in cache, power of 2
 
-                    // GCC: case '0' ... '9', not supported on IAR
-                case '0': case '1': case '2': case '3': case '4':
-                case '5': case '6': case '7': case '8': case '9':
-                case '.':
-                case '-':
-                case 'l': case 'L':
-                case 'h':
-                case 'j':
-                case 't':
-                case 'z':
-                case 'q':
-                case 'v':
-#ifdef _WIN32
-                    // On Windows size specifiers "I", "I32", "I64"
-                case 'I':
-#endif
-                    break;
-                case '+':
-                    safe_pointer = true;
-                    break;
-                case 'n':           // Expect two args
-                case '*':
-                    // Check for long entry, need to skip to next entry
-                    if (arg_index >= max_arg_index)
-                    {
-                        recorder_ring_p ring = &rec->ring;
-                        recorder_entry *base = (recorder_entry *) (ring + 1);
-                        ringidx_t idx = entry - base;
-                        entry = &base[(idx + 1) % ring->size];
-                        arg_index = 0;
-                    }
-                    unsupported = field_cnt >= 2;
-                    if (!unsupported)
-                        fields[field_cnt++] = (int) entry->args[arg_index++];
-                    break;
+typedef struct recorder_string_mask_slot
+// ----------------------------------------------------------------------------
+//   A cached unsafe string mask for a format
+// ----------------------------------------------------------------------------
+{
+    const char *format;
+    unsigned    mask;
+    unsigned    generation;
+} recorder_string_mask_slot;
 
-                default:
-                    unsupported = true;
-                    break;
-                }
-            }
-            if (!c || unsupported)
-                break;
-            bool is_string = (c == 's' || c == 'S');
-            if (is_string && !safe_pointer && recorder_dumping)
-                fmt_copy[-1] = 'p'; // Replace with a pointer if not tracing
-            *fmt_copy++ = 0;
+static RECORDER_THREAD_LOCAL recorder_string_mask_slot
+                             recorder_string_masks[RECORDER_STRING_MASKS];
 
-            // Check for long entry, need to skip to next entry
-            if (arg_index >= max_arg_index)
-            {
-                recorder_ring_p ring = &rec->ring;
-                recorder_entry *base = (recorder_entry *) (ring + 1);
-                ringidx_t idx = entry - base;
-                entry = &base[(idx + 1) % ring->size];
-                arg_index = 0;
-            }
+// Incremented when recorder_configure_type changes how arguments are counted
+static unsigned recorder_string_masks_generation = 0;
 
-            // Warning: It is important for correctness that only
-            // one call to snprintf happens per loop, since snprintf
-            // return value can be larger than what is actually written.
-            if (special)
-            {
-                uintptr_t arg = entry->args[arg_index++];
-                intptr_t tracing = recorder_dumping ? 0 : rec->trace;
-                dst += special(safe_pointer | tracing,
-                               format_buffer, dst, dst_end - dst, arg);
-            }
-            else if (floating_point)
-            {
-                double arg;
-                if (sizeof(intptr_t) == sizeof(float))
-                {
-                    union { float f; intptr_t i; } u;
-                    u.i = entry->args[arg_index++];
-                    arg = (double) u.f;
-                }
-                else
-                {
-                    union { double d; intptr_t i; } u;
-                    u.i = entry->args[arg_index++];
-                    arg = u.d;
-                }
-                switch(field_cnt)
-                {
-                case 0:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, arg);
-                    break;
-                case 1:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, fields[0], arg);
-                    break;
-                case 2:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, fields[0], fields[1], arg);
-                    break;
-                }
-            }
-            else
-            {
-                intptr_t arg = entry->args[arg_index++];
-                if (is_string && arg == 0)
-                    arg = (intptr_t) "<NULL>";
-                switch (field_cnt)
-                {
-                case 0:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, arg);
-                    break;
-                case 1:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, fields[0], arg);
-                    break;
-                case 2:
-                    dst += snprintf(dst, dst_end - dst,
-                                    format_buffer, fields[0], fields[1], arg);
-                    break;
-                }
-            }
-        }
-        finished_in_newline = c == '\n';
-    }
-    // Check if snprintf returned a value beyond the buffer
-    if (dst > dst_end)
-        dst = dst_end;
-    if (finished_in_newline)
-        dst--;
-    *dst++ = 0;
 
-    format(show, output, label,
-           entry->where, entry->order, entry->timestamp, buffer);
-    indent = nextindent;
+static inline unsigned recorder_unsafe_string_mask(const char *format)
+// ----------------------------------------------------------------------------
+//   Return the mask of unsafe string arguments, parsing the format once
+// ----------------------------------------------------------------------------
+{
+    size_t   index      = ((uintptr_t) format >> 3) & (RECORDER_STRING_MASKS-1);
+    unsigned generation = recorder_string_masks_generation;
+    recorder_string_mask_slot *slot = &recorder_string_masks[index];
+    if (slot->format != format || slot->generation != generation)
+    {
+        slot->format = format;
+        slot->mask = recorder_string_mask(format, false);
+        slot->generation = generation;
+    }
+    return slot->mask;
 }
 
 
-
-// ============================================================================
-//
-//    Default output prints things to stderr
-//
-// ============================================================================
-
-void *recorder_configure_output(void *output)
+typedef struct recorder_extra
 // ----------------------------------------------------------------------------
-//   Configure the output stream
+//   A continuation entry holding more arguments or an inline string
 // ----------------------------------------------------------------------------
+//   The marker is where the first entry has its format, and is a small value
+//   that cannot be a format pointer. In the first continuation, it also holds
+//   the index + 1 of the string argument copied in the last continuation.
+//   The order is that of the first entry, to detect stale continuations.
 {
-    record(recorder, "Configure output %p from %p", output, recorder_output);
-    void *previous = recorder_output;
-    recorder_output = output;
-    return previous;
-}
+    uintptr_t   marker;                         // Continuation marker
+    uintptr_t   order;                          // Order of first entry
+    uintptr_t   args[RECORDER_EXTRA_ARGS];      // Arguments or inline string
+} recorder_extra;
 
 
-static unsigned recorder_print(const char *ptr, size_t len, void *file_arg)
+static inline bool recorder_is_extra(const recorder_entry *entry)
 // ----------------------------------------------------------------------------
-//   The default printing function - prints to standard error
+//   Check if an entry is a continuation of the previous one
 // ----------------------------------------------------------------------------
-//   This uses 'write' in order to avoid buffered output, which proves
-//   unreliable on the alternate stack (sigaltstack) because it uses malloc
 {
-    int fd = file_arg >= (void *) 0x100
-        ? fileno((FILE *) file_arg)
-        : file_arg
-        ? (int) (intptr_t) file_arg
-        : 2;
-    return (unsigned) write(fd, ptr, len) + write(fd, "\n", 1);
+    return (uintptr_t) entry->format < RECORDER_EXTRA_LIMIT;
 }
 
 
-recorder_show_fn  recorder_configure_show(recorder_show_fn show)
+static inline uintptr_t recorder_last_timestamp(recorder_entry *data,
+                                                ringidx_t writer,
+                                                size_t size)
 // ----------------------------------------------------------------------------
-//   Configure the function used to output data to the stream
+//   Return the time stamp of the record before writer, for fast records
 // ----------------------------------------------------------------------------
 {
-    record(recorder, "Configure show %p from %p", show, recorder_show);
-    recorder_show_fn previous = recorder_show;
-    recorder_show = show;
-    return previous;
+    recorder_entry *last = &data[(writer - 1) & (size - 1)];
+    unsigned        e;
+    for (e = 2; e <= RECORDER_RECORD_SLOTS && recorder_is_extra(last); e++)
+        last = &data[(writer - e) & (size - 1)];
+    return last->timestamp;
 }
 
 
+// Sampling state for the recorders used by the current thread
+enum { RECORDER_SAMPLERS = 64 };
 
-// ============================================================================
-//
-//    Default format for recorder entries
-//
-// ============================================================================
-
-// Truly shocking that Visual Studio before 2015 does not have a working
-// snprintf or vsnprintf. Note that the proposed replacements are not accurate
-// since they return -1 on overflow instead of the length that would have
-// been written as the standard mandates.
-// http://stackoverflow.com/questions/2915672/snprintf-and-visual-studio-2010.
-#if defined(_MSC_VER) && _MSC_VER < 1900
-#  define snprintf  _snprintf
-#endif
-
-static void recorder_format_entry(recorder_show_fn show,
-                                  void *output,
-                                  const char *label,
-                                  const char *function_name,
-                                  uintptr_t order,
-                                  uintptr_t timestamp,
-                                  const char *message)
+typedef struct recorder_sampler
 // ----------------------------------------------------------------------------
-//   Default formatting for the entries
+//   Per-thread sampling state for one recorder
 // ----------------------------------------------------------------------------
 {
-    char buffer[256];
-    char *dst = buffer;
-    char *dst_end = buffer + sizeof buffer;
+    recorder_info      *rec;
+    uint32_t            generation;     // Generation of rec->sampling
+    uint32_t            count;          // Position in the sampling period
+    uint32_t            kept;           // Records kept in current second
+    uint32_t            skipped;        // Drops since the clock was read
+    uintptr_t           window;         // Start of current second
+    uintptr_t           dropped;        // Dropped, not yet added to rec
+} recorder_sampler;
 
-#define rsnprintf(...)                                                  \
-    snprintf(dst, dst_end >= dst ? dst_end - dst : 0,  __VA_ARGS__)
+static RECORDER_THREAD_LOCAL recorder_sampler
+recorder_samplers[RECORDER_SAMPLERS];
 
-    // Look for file:line: in the input message
-    const char *end_of_fileline = message;
-    for (int colon = 0; colon < 2; colon++)
-        while (*end_of_fileline && *end_of_fileline++ != ':')
-            /* Empty */;
-    if (*end_of_fileline == 0)       // Play it ultra-safe
-        end_of_fileline = message;
 
-    int size = (int) RECORDER_TWEAK(recorder_location);
-    if (size)
+static bool recorder_sample(recorder_info *rec)
+// ----------------------------------------------------------------------------
+//   Check if a record is kept by sampling and rate limiting
+// ----------------------------------------------------------------------------
+//   The counters are per thread, so that dropping a record does not touch
+//   shared memory. Dropped records are added to rec->sampling.dropped when
+//   the thread keeps a record or uses the slot for another recorder.
+//   The rate limit therefore also applies separately to each thread.
+{
+    recorder_sampling *sampling = &rec->sampling;
+    recorder_sampler  *s        = &recorder_samplers[((uintptr_t) rec / 64)
+                                                     % RECORDER_SAMPLERS];
+    bool               keep     = true;
+
+    if (s->rec != rec || s->generation != sampling->generation)
     {
-        int fileline_size = (int) (end_of_fileline - message);
-        if (size != 1)
-            dst += rsnprintf("%*.*s", size, fileline_size, message);
-        else
-            dst += rsnprintf("%.*s", fileline_size, message);
+        if (s->dropped)
+            recorder_ring_fetch_add(s->rec->sampling.dropped, s->dropped);
+        s->rec = rec;
+        s->generation = sampling->generation;
+        s->count = 0;
+        s->kept = 0;
+        s->skipped = 0;
+        s->dropped = 0;
     }
-    message = end_of_fileline;
 
-    size = (int) RECORDER_TWEAK(recorder_function);
-    if (size)
+    if (sampling->every)
     {
-        if (size != 1)
-            dst += rsnprintf("%*s:", size, function_name);
-        else
-            dst += rsnprintf("%s:", function_name);
+        keep = s->count < sampling->keep;
+        if (++s->count >= sampling->every)
+            s->count = 0;
     }
-
-    char spacing = '[';
-
-    if (RECORDER_TWEAK(recorder_order))
+    if (keep && sampling->rate)
     {
-        dst += rsnprintf("%c%"PRIdPTR, spacing, order);
-        spacing = ' ';
+        if (s->kept == 0)
+        {
+            s->window = recorder_tick();
+        }
+        else if (s->kept >= sampling->rate)
+        {
+            // Over the limit: check if the window expired on the first
+            // record, then only read the clock every 64 records while the
+            // window remains saturated
+            keep = false;
+            if (s->skipped == 0 || s->skipped >= 64)
+            {
+                uintptr_t now = recorder_tick();
+                s->skipped = 0;
+                keep = now - s->window >= RECORDER_HZ;
+                if (keep)
+                {
+                    s->window = now;
+                    s->kept = 0;
+                }
+            }
+            if (!keep)
+                s->skipped++;
+        }
+        if (keep)
+            s->kept++;
     }
 
-    if (RECORDER_TWEAK(recorder_abstime))
+    if (!keep)
     {
-        uintptr_t abstime = timestamp + recorder_time_at_start;
-        const uintptr_t minute = (uintptr_t) 60 * RECORDER_HZ;
-        uintptr_t minutes = abstime / minute;
-        uintptr_t seconds = abstime % minute;
-        int precision = (int) RECORDER_TWEAK(recorder_time_precision);
-
-        dst += rsnprintf("%c%02"PRIdPTR":%02"PRIdPTR":%0*.*f",
-                         spacing,
-                         minutes / 60,
-                         minutes % 60,
-                         precision + 3, precision,
-                         seconds * (1.0 / RECORDER_HZ));
-        spacing = ' ';
+        s->dropped++;
+        return false;
     }
-
-    if (RECORDER_TWEAK(recorder_reltime))
+    if (s->dropped)
     {
-        dst += rsnprintf("%c%.*f",
-                         spacing,
-                         (int) RECORDER_TWEAK(recorder_time_precision),
-                         (double) timestamp / RECORDER_HZ);
-        spacing = ' ';
+        recorder_ring_fetch_add(sampling->dropped, s->dropped);
+        s->dropped = 0;
     }
+    return true;
+}
 
-    if (spacing != '[')
-        dst += rsnprintf("] ");
 
-    if (RECORDER_TWEAK(recorder_indent))
+static inline ringidx_t recorder_append_entry(recorder_info *rec,
+                                              const char *where,
+                                              const char *format,
+                                              bool fast,
+                                              unsigned count,
+                                              const uintptr_t *args)
+// ----------------------------------------------------------------------------
+//   Enter a record with up to 'count' args, using continuations as needed
+// ----------------------------------------------------------------------------
+//   The first entry holds four arguments, and each continuation six more.
+//   Trailing zero arguments are not stored, since they read back as zero.
+//   If recorder_inline_strings is set, the first %s argument is copied
+//   in a last continuation, so that it can be shown after it is gone.
+{
+    recorder_ring_p ring     = recorder_thread_ring(rec);
+    recorder_entry *data     = (recorder_entry *) (ring + 1);
+    size_t          size     = ring->size;
+    size_t          max_text = RECORDER_TWEAK(recorder_inline_strings);
+    const char     *text     = NULL;
+    size_t          length   = 0;
+    uintptr_t       marker   = RECORDER_EXTRA_MARKER;
+    unsigned        extra    = 0;
+    unsigned        a, e, w;
+
+    if (max_text)
     {
-        unsigned i = indent % RECORDER_TWEAK(recorder_indent);
-        unsigned n = indent / RECORDER_TWEAK(recorder_indent);
-        if (n)
-            dst += rsnprintf("(%u)", n);
-        while (i--)
-            dst += rsnprintf(" ");
+        unsigned mask = recorder_unsafe_string_mask(format);
+        for (a = 0; a < count && mask; a++, mask >>= 1)
+            if (mask & 1)
+                break;
+        text = a < count && mask ? (const char *) args[a] : NULL;
+        if (text)
+        {
+            if (max_text >= sizeof(((recorder_extra *) 0)->args))
+                max_text = sizeof(((recorder_extra *) 0)->args) - 1;
+            const char *end = memchr(text, 0, max_text);
+            length = end ? (size_t) (end - text) : max_text;
+            marker |= (a + 1) << 4;
+            extra++;
+        }
     }
-    dst += rsnprintf("%s: %s", label, message);
+    while (count > 4 && !args[count - 1])
+        count--;
+    if (count > 4)
+        extra += (count - 4 + RECORDER_EXTRA_ARGS - 1) / RECORDER_EXTRA_ARGS;
 
-    // In case snprintf overflowed
-    show(buffer, (dst > dst_end ? dst_end : dst) - buffer, output);
-#undef rsnprintf
+    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1 + extra);
+    recorder_entry *entry  = &data[writer & (size - 1)];
+    entry->format = format;
+    entry->timestamp = fast
+        ? recorder_last_timestamp(data, writer, size)
+        : recorder_tick();
+    entry->order = recorder_next_order(entry->timestamp);
+    entry->where = where;
+    entry->args[0] = args[0];
+    entry->args[1] = args[1];
+    entry->args[2] = args[2];
+    entry->args[3] = args[3];
+    for (e = 1, a = 4; e <= extra; e++)
+    {
+        recorder_entry *next = &data[(writer + e) & (size - 1)];
+        recorder_extra *cont = (recorder_extra *) next;
+        cont->marker = e == 1 ? marker : RECORDER_EXTRA_MARKER;
+        cont->order = entry->order;
+        if (text && e == extra)
+        {
+            char *copy = (char *) cont->args;
+            memcpy(copy, text, length);
+            copy[length] = 0;
+        }
+        else
+        {
+            for (w = 0; w < RECORDER_EXTRA_ARGS; w++)
+                cont->args[w] = a < count ? args[a++] : 0;
+        }
+    }
+    ringidx_t commit = recorder_ring_publish(ring, writer, 1 + extra);
+    recorder_committed(ring, commit);
+    if (rec->trace)
+        recorder_trace_ring_entry(rec, ring, entry);
+    return writer;
 }
 
 
-recorder_format_fn recorder_configure_format(recorder_format_fn format)
+static inline ringidx_t recorder_append_args(recorder_info *rec,
+                                             const char *where,
+                                             const char *format,
+                                             bool fast,
+                                             unsigned count,
+                                             const uintptr_t *args)
 // ----------------------------------------------------------------------------
-//   Configure the function used to format entries
+//   Enter a record unless it is dropped by sampling
 // ----------------------------------------------------------------------------
 {
-    record(recorder, "Configure format %p from %p", format, recorder_format);
-    recorder_format_fn previous = recorder_format;
-    recorder_format = format;
-    return previous;
+    if ((rec->sampling.every | rec->sampling.rate) && !recorder_sample(rec))
+        return (ringidx_t) -1;
+    return recorder_append_entry(rec, where, format, fast, count, args);
 }
 
 
-recorder_type_fn recorder_configure_type(uint8_t id,
-                                         recorder_type_fn type)
+ringidx_t recorder_append(recorder_info *rec,
+                          const char *where,
+                          const char *format,
+                          uintptr_t a0,
+                          uintptr_t a1,
+                          uintptr_t a2,
+                          uintptr_t a3)
 // ----------------------------------------------------------------------------
-//    Register a formatting function for specific data types
+//  Enter a record entry in ring buffer with given set of args
 // ----------------------------------------------------------------------------
 {
-    recorder_type_fn previous = recorder_types[id];
-    record(recorder, "Configure type '%c' to %p from %p", id, type, previous);
-    recorder_types[id] = type;
-    return previous;
+    uintptr_t args[] = { a0, a1, a2, a3 };
+    return recorder_append_args(rec, where, format, false, 4, args);
 }
 
 
-static recorder_entry *recorder_peek(recorder_ring_p ring)
+ringidx_t recorder_append2(recorder_info *rec,
+                           const char *where,
+                           const char *format,
+                           uintptr_t a0,
+                           uintptr_t a1,
+                           uintptr_t a2,
+                           uintptr_t a3,
+                           uintptr_t a4,
+                           uintptr_t a5,
+                           uintptr_t a6,
+                           uintptr_t a7)
 // ----------------------------------------------------------------------------
-//   Peek the next entry that would be read in the ring and advance by 1
+//   Enter a double record (up to 8 args)
 // ----------------------------------------------------------------------------
 {
-    recorder_entry *data      = (recorder_entry *) (ring + 1);
-    const size_t    size      = ring->size;
-    ringidx_t       reader    = ring->reader;
-    ringidx_t       commit    = ring->commit;
-    size_t          written   = commit - reader;
-    if (written >= size)
-    {
-        ringidx_t minR = commit - size + 1;
-        ringidx_t skip = minR - reader;
-        recorder_ring_add_fetch(ring->overflow, skip);
-        reader = recorder_ring_add_fetch(ring->reader, skip);
-        written = commit - reader;
-    }
-    return written ? data + reader % size : NULL;
+    uintptr_t args[] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+    return recorder_append_args(rec, where, format, false, 8, args);
 }
 
 
-unsigned recorder_sort(const char *what,
-                       recorder_format_fn format,
-                       recorder_show_fn show, void *output)
+ringidx_t recorder_append3(recorder_info *rec,
+                           const char *where,
+                           const char *format,
+                           uintptr_t a0,
+                           uintptr_t a1,
+                           uintptr_t a2,
+                           uintptr_t a3,
+                           uintptr_t a4,
+                           uintptr_t a5,
+                           uintptr_t a6,
+                           uintptr_t a7,
+                           uintptr_t a8,
+                           uintptr_t a9,
+                           uintptr_t a10,
+                           uintptr_t a11)
 // ----------------------------------------------------------------------------
-//   Dump all entries, sorted by their global 'order' field
+//   Record a triple entry (up to 12 args)
 // ----------------------------------------------------------------------------
 {
-    recorder_entry *entry;
-    unsigned        dumped = 0;
+    uintptr_t args[] = { a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11 };
+    return recorder_append_args(rec, where, format, false, 12, args);
+}
 
-    pattern_t re;
-    int status = what ? pattern_comp(&re, what) : 0;
 
-    recorder_ring_fetch_add(recorder_dumping, 1);
-    while (status == 0)
-    {
-        uintptr_t       lowest_order = ~0UL;
-        recorder_entry *lowest_entry = NULL;
-        recorder_info  *lowest_rec   = NULL;
-        recorder_info  *rec;
+ringidx_t recorder_append_fast(recorder_info *rec,
+                               const char *where,
+                               const char *format,
+                               uintptr_t a0,
+                               uintptr_t a1,
+                               uintptr_t a2,
+                               uintptr_t a3)
+// ----------------------------------------------------------------------------
+//  Enter a record entry in ring buffer with given set of args
+// ----------------------------------------------------------------------------
+{
+    uintptr_t args[] = { a0, a1, a2, a3 };
+    return recorder_append_args(rec, where, format, true, 4, args);
+}
 
-        for (rec = recorders; rec; rec = rec->next)
-        {
-            // Skip recorders that don't match the pattern
-            if (what && !pattern_match(&re, rec->name))
-                continue;
 
-            // Loop while this recorder is readable and we can find next order
-            entry = recorder_peek(&rec->ring);
-            if (entry)
-            {
-                uintptr_t order = entry->order;
-                if (order < lowest_order)
-                {
-                    lowest_rec = rec;
-                    lowest_order = order;
-                    lowest_entry = entry;
-                }
-            }
-        }
-
-        if (!lowest_rec)
-            break;
-
-        recorder_ring_fetch_add(lowest_rec->ring.reader, 1);
-        recorder_dump_entry(lowest_rec, lowest_entry, format, show, output);
-        dumped++;
-    }
-    recorder_ring_fetch_add(recorder_dumping, -1);
-
-    if (what)
-        pattern_free(&re);
-
-    return dumped;
-}
-
-
-unsigned recorder_dump(void)
-// ----------------------------------------------------------------------------
-//   Dump all entries, sorted by their global 'order' field
-// ----------------------------------------------------------------------------
-{
-    record(recorder, "Recorder dump");
-    return recorder_sort(NULL, recorder_format,recorder_show,recorder_output);
-}
-
-
-unsigned recorder_dump_for(const char *what)
+ringidx_t recorder_append_fast2(recorder_info *rec,
+                                const char *where,
+                                const char *format,
+                                uintptr_t a0,
+                                uintptr_t a1,
+                                uintptr_t a2,
+                                uintptr_t a3,
+                                uintptr_t a4,
+                                uintptr_t a5,
+                                uintptr_t a6,
+                                uintptr_t a7)
 // ----------------------------------------------------------------------------
-//   Dump all entries for recorder with names matching 'what'
+//   Enter a double record (up to 8 args)
 // ----------------------------------------------------------------------------
 {
-    record(recorder, "Recorder dump for %+s", what);
-    return recorder_sort(what, recorder_format,recorder_show,recorder_output);
+    uintptr_t args[] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+    return recorder_append_args(rec, where, format, true, 8, args);
 }
 
 
-recorder_info *recorder_list(void)
+ringidx_t recorder_append_fast3(recorder_info *rec,
+                                const char *where,
+                                const char *format,
+                                uintptr_t a0,
+                                uintptr_t a1,
+                                uintptr_t a2,
+                                uintptr_t a3,
+                                uintptr_t a4,
+                                uintptr_t a5,
+                                uintptr_t a6,
+                                uintptr_t a7,
+                                uintptr_t a8,
+                                uintptr_t a9,
+                                uintptr_t a10,
+                                uintptr_t a11)
 // ----------------------------------------------------------------------------
-//   Return the list of recorders
+//   Record a triple entry (up to 12 args)
 // ----------------------------------------------------------------------------
 {
-    return recorders;
+    uintptr_t args[] = { a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11 };
+    return recorder_append_args(rec, where, format, true, 12, args);
 }
 
 
-unsigned recorder_indent(void)
-// ----------------------------------------------------------------------------
-//   Return the current recorder indent level
-// ----------------------------------------------------------------------------
-{
-    return indent;
-};
-
-
 
 // ============================================================================
 //
-//    Implementation of recorder shared memory structures
+//    Async-signal-safe text formatting
 //
 // ============================================================================
+//  When crashing, snprintf() cannot be used because it may allocate memory
+//  or take locks. The functions below format into a caller-provided buffer
+//  without calling any library function, so that dumps work from a signal
+//  handler even if the heap is corrupted.
 
-#define RECORDER_CMD_LEN  1024
+/// Non-zero while dumping from a signal handler
+static unsigned recorder_crashing = 0;
 
-typedef struct recorder_shans
+
+typedef struct recorder_text_buffer
 // ----------------------------------------------------------------------------
-//   Shared-memory information about recorder_chans
+//   A position in a text buffer, with room for a trailing zero at 'end'
 // ----------------------------------------------------------------------------
 {
-    uint32_t        magic;      // Magic number to check structure type
-    uint32_t        version;    // Version number for shared memory format
-    uint32_t        serial;     // Serial ID for the current channels
-    off_t           head;       // First recorder_chan in linked list
-    off_t           free_list;  // Free list
-    off_t           offset;     // Current offset for new recorder_chans
-    recorder_ring_t commands;   // Incoming configuration commands
-    char            commands_buffer[RECORDER_CMD_LEN];
-} recorder_shans, *recorder_shans_p;
+    char       *dst;
+    char       *end;
+} recorder_text_buffer;
 
 
-typedef struct recorder_shan
+typedef struct recorder_conversion
 // ----------------------------------------------------------------------------
-//   A named data recorder_chan in shared memory
+//   A printf-style conversion specification
 // ----------------------------------------------------------------------------
 {
-    recorder_type   type;       // Data type stored in recorder_chan
-    off_t           next;       // Offset to next recorder_chan in linked list
-    off_t           name;       // Offset of name in recorder_shan
-    off_t           description; // Offset of description
-    off_t           unit;       // Offset of measurement unit
-    recorder_data   min;        // Minimum value
-    recorder_data   max;        // Maximum value
-    recorder_ring_t ring;       // Ring data
-} recorder_shan, *recorder_shan_p;
+    int         width;
+    int         precision;              // -1 if not given
+    unsigned    longs;                  // Number of 'l' (and j, z, t, q)
+    unsigned    shorts;                 // Number of 'h'
+    bool        left;                   // '-' flag
+    bool        zero;                   // '0' flag
+    bool        sign;                   // '+' flag
+    bool        space;                  // ' ' flag
+    bool        alternate;              // '#' flag
+    char        kind;                   // Conversion character
+} recorder_conversion;
 
 
-typedef struct recorder_chans
+static inline void recorder_put_char(recorder_text_buffer *b, char c)
 // ----------------------------------------------------------------------------
-//   Information about mapping of shared recorder_chans
+//   Append a character if there is room left
 // ----------------------------------------------------------------------------
 {
-    int             fd;         // File descriptor for mmap
-    uint32_t        serial;     // Serial ID to check if still valid
-    void *          map_addr;   // Address in memory for mmap
-    size_t          map_size;   // Size allocated for mmap
-    recorder_chan_p head;       // First recorder_chan in list
-} recorder_chans_t, *recorder_chans_p;
+    if (b->dst < b->end)
+        *b->dst++ = c;
+}
 
 
-typedef struct recorder_chan
+static void recorder_put_text(recorder_text_buffer *b,
+                              const char *text, size_t len)
 // ----------------------------------------------------------------------------
-//   Accessing a shared memory recorder_chan
+//   Append 'len' characters
 // ----------------------------------------------------------------------------
 {
-    recorder_chans_p chans;
-    off_t            offset;
-    recorder_chan_p  next;
-} recorder_chan_t, *recorder_chan_p;
-
-
-// Map memory in 4K chunks (one page)
-#define MAP_SIZE        4096
+    while (len--)
+        recorder_put_char(b, *text++);
+}
 
 
-static inline recorder_shan_p recorder_shared(recorder_chan_p chan)
+static void recorder_put_field(recorder_text_buffer *b,
+                               const recorder_conversion *conv,
+                               const char *prefix, size_t prefix_len,
+                               const char *body, size_t body_len)
 // ----------------------------------------------------------------------------
-//  Return the recorder_chan shared address
+//   Append a prefix (sign, 0x) and body, padded to the conversion width
 // ----------------------------------------------------------------------------
 {
-    recorder_chans_p  chans    = chan->chans;
-    char             *map_addr = chans->map_addr;
-    recorder_shan_p   shan     = (recorder_shan_p) (map_addr + chan->offset);
-    return shan;
+    int pad = conv->width - (int) (prefix_len + body_len);
+    if (!conv->left && !conv->zero)
+        while (pad-- > 0)
+            recorder_put_char(b, ' ');
+    recorder_put_text(b, prefix, prefix_len);
+    if (!conv->left && conv->zero)
+        while (pad-- > 0)
+            recorder_put_char(b, '0');
+    recorder_put_text(b, body, body_len);
+    while (pad-- > 0)
+        recorder_put_char(b, ' ');
 }
 
 
+static size_t recorder_digits(char *end, uint64_t value, unsigned base,
+                              bool upper, int min_digits)
+// ----------------------------------------------------------------------------
+//   Write digits for value right-aligned before 'end', return count
+// ----------------------------------------------------------------------------
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char       *ptr    = end;
+    while (value || min_digits > 0)
+    {
+        *--ptr = digits[value % base];
+        value /= base;
+        min_digits--;
+    }
+    return end - ptr;
+}
 
-// ============================================================================
-//
-//    Interface for the local process
-//
-// ============================================================================
 
-#ifdef HAVE_SYS_MMAN_H
-static bool recorder_shans_file_extend(int fd, off_t new_size)
+static void recorder_put_integer(recorder_text_buffer *b,
+                                 const recorder_conversion *conv,
+                                 uintptr_t arg)
 // ----------------------------------------------------------------------------
-//    Extend a file to the given size
+//   Format an integer conversion (d, i, u, x, X, o, b, c, p)
 // ----------------------------------------------------------------------------
 {
-    return
-        lseek(fd, new_size-1, SEEK_SET) != -1 &&
-        write(fd, "", 1) == 1;
+    char        buffer[72];
+    char       *end        = buffer + sizeof(buffer);
+    char        prefix[2];
+    size_t      prefix_len = 0;
+    unsigned    base       = 10;
+    bool        is_signed  = false;
+    bool        upper      = false;
+    uint64_t    value;
+    char        kind       = conv->kind;
+
+    switch (kind)
+    {
+    case 'c': case 'C':
+        buffer[0] = (char) arg;
+        recorder_put_field(b, conv, NULL, 0, buffer, 1);
+        return;
+    case 'p':
+        if (!arg)
+        {
+            recorder_put_field(b, conv, NULL, 0, "(nil)", 5);
+            return;
+        }
+        prefix[0] = '0';
+        prefix[1] = 'x';
+        prefix_len = 2;
+        base = 16;
+        value = arg;
+        break;
+    case 'd': case 'i': case 'D':
+        is_signed = true;
+        break;
+    case 'x': case 'X':
+        base = 16;
+        upper = kind == 'X';
+        break;
+    case 'o': case 'O':
+        base = 8;
+        break;
+    case 'b':
+        base = 2;
+        break;
+    }
+
+    if (kind != 'p')
+    {
+        // Truncate the argument according to its size
+        unsigned longs = conv->longs + (kind == 'D' || kind == 'O');
+        if (is_signed)
+        {
+            intptr_t svalue = longs           ? (intptr_t) arg
+                            : conv->shorts > 1 ? (signed char) arg
+                            : conv->shorts     ? (short) arg
+                            :                    (int) arg;
+            value = svalue < 0 ? -(uint64_t) svalue : (uint64_t) svalue;
+            if (svalue < 0)
+                prefix[prefix_len++] = '-';
+            else if (conv->sign)
+                prefix[prefix_len++] = '+';
+            else if (conv->space)
+                prefix[prefix_len++] = ' ';
+        }
+        else
+        {
+            value = longs            ? (uint64_t) arg
+                  : conv->shorts > 1 ? (unsigned char) arg
+                  : conv->shorts     ? (unsigned short) arg
+                  :                    (unsigned) arg;
+            if (conv->alternate && value && base == 16)
+            {
+                prefix[prefix_len++] = '0';
+                prefix[prefix_len++] = upper ? 'X' : 'x';
+            }
+        }
+    }
+
+    int    precision = conv->precision;
+    int    min       = precision < 0 ? 1 : precision;
+    if (min > 64)
+        min = 64;
+    if (kind == 'o' && conv->alternate && min < 2)
+        min = value ? 0 : 1;
+    size_t len = recorder_digits(end, value, base, upper, min);
+    if (kind == 'o' && conv->alternate && end[-(int) len] != '0')
+        end[-(int) ++len] = '0';
+
+    recorder_conversion padded = *conv;
+    padded.zero = conv->zero && precision < 0;
+    recorder_put_field(b, &padded, prefix, prefix_len, end - len, len);
 }
-#endif // HAVE_SYS_MMAN_H
 
 
-recorder_chans_p recorder_chans_new(const char *file)
+static void recorder_put_real(recorder_text_buffer *b,
+                              const recorder_conversion *conv,
+                              double value)
 // ----------------------------------------------------------------------------
-//   Create a new mmap'd file
+//   Format a floating-point conversion (f, e, g, a)
 // ----------------------------------------------------------------------------
+//   This is not as precise as snprintf(), but good enough for a crash dump
 {
-#ifndef HAVE_SYS_MMAN_H
-    // Some version of MinGW do not have <sys/mman.h>
-    record(recorder_error,
-           "Cannot create export channels %s on system without mmap",
-           file);
-    return NULL;
-#else // HAVE_SYS_MMAN_H
-    record(recorder, "Create export channels %s", file);
-    printf("Creating new %s\n", file);
-    if (!file)
+    char        buffer[80];
+    char       *dst        = buffer;
+    char        prefix[1];
+    size_t      prefix_len = 0;
+    char        kind       = conv->kind;
+    bool        upper      = kind >= 'A' && kind <= 'Z';
+    int         precision  = conv->precision < 0 ? 6 : conv->precision;
+    int         exponent   = 0;
+    bool        scientific = kind == 'e' || kind == 'E' ||
+                             kind == 'a' || kind == 'A';
+    bool        general    = kind == 'g' || kind == 'G';
+
+    if (value < 0)
     {
-        record(recorder_error, "NULL export file");
-        return NULL;
+        prefix[prefix_len++] = '-';
+        value = -value;
+    }
+    else if (conv->sign)
+    {
+        prefix[prefix_len++] = '+';
+    }
+    else if (conv->space)
+    {
+        prefix[prefix_len++] = ' ';
     }
 
-    // Open the file
-    int fd = open(file, O_RDWR|O_CREAT|O_TRUNC, (mode_t) 0600);
-    if (fd == -1)
+    if (value != value || value - value != 0.0) // NaN or infinity
     {
-        record(recorder_error,
-               "Unable to create exports file %s: %s (%d)",
-               file, strerror(errno), errno);
-        return NULL;
+        const char *text = value != value
+            ? (upper ? "NAN" : "nan")
+            : (upper ? "INF" : "inf");
+        recorder_conversion padded = *conv;
+        padded.zero = false;
+        recorder_put_field(b, &padded, prefix, prefix_len, text, 3);
+        return;
     }
 
-    // Make sure we have enough space for the data
-    size_t map_size = MAP_SIZE;
-    if (!recorder_shans_file_extend(fd, map_size))
+    if (precision > 17)
+        precision = 17;
+
+    // Compute the decimal exponent
+    if (value != 0.0)
     {
-        record(recorder_error,
-               "Unable to create initial mapping for exports file %s: %s (%d)",
-               file, strerror(errno), errno);
-        close(fd);
-        return NULL;
+        double mantissa = value;
+        while (mantissa >= 10.0)
+        {
+            mantissa /= 10.0;
+            exponent++;
+        }
+        while (mantissa < 1.0)
+        {
+            mantissa *= 10.0;
+            exponent--;
+        }
     }
 
-    // Map space for the recorder_chans
-    off_t  offset   = 0;
-    void  *map_addr = mmap(NULL, map_size,
-                           PROT_READ | PROT_WRITE,
-                           MAP_FILE | MAP_SHARED,
-                           fd, offset);
-    if (map_addr == MAP_FAILED)
+    if (general)
     {
-        record(recorder_error, "Unable to mmap %s: %s (%d)",
-               file, strerror(errno), errno);
-        close(fd);
-        return NULL;
+        if (precision == 0)
+            precision = 1;
+        scientific = exponent < -4 || exponent >= precision;
+        precision = scientific ? precision - 1 : precision - 1 - exponent;
     }
+    if (!scientific && value >= 1e19)
+        scientific = true;
 
-    // Successful: Initialize in-memory recorder_chans list
-    recorder_chans_p chans = malloc(sizeof(recorder_chans_t));
-    chans->fd = fd;
-    chans->map_addr = map_addr;
-    chans->map_size = map_size;
-    chans->head = NULL;
+    // Scale the value to print it as an integer followed by a fraction
+    double scaled = value;
+    if (scientific)
+    {
+        int e;
+        for (e = exponent; e > 0; e--)
+            scaled /= 10.0;
+        for (e = exponent; e < 0; e++)
+            scaled *= 10.0;
+    }
 
-    // Initialize shared-memory data
-    recorder_shans_p shans = map_addr;
-    shans->magic = RECORDER_CHAN_MAGIC;
-    shans->version = RECORDER_CHAN_VERSION;
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    shans->serial = t.tv_usec;
-    shans->head = 0;
-    shans->free_list = 0;
-    shans->offset = sizeof(recorder_shans);
-    recorder_ring_init(&shans->commands,
-                       sizeof(shans->commands_buffer),
-                       sizeof(shans->commands_buffer[0]));
+    uint64_t scale = 1;
+    int      p;
+    for (p = 0; p < precision; p++)
+        scale *= 10;
+    uint64_t integral = (uint64_t) scaled;
+    double   digits_left = (scaled - integral) * scale;
+    uint64_t fraction = (uint64_t) digits_left;
+    double   remainder = digits_left - fraction;
+    if (remainder > 0.5 ||
+        (remainder == 0.5 && ((precision ? fraction : integral) & 1)))
+        fraction++;                     // Round half to even like printf
+    if (fraction >= scale)
+    {
+        fraction -= scale;
+        integral++;
+    }
+    if (scientific && integral >= 10)
+    {
+        integral /= 10;
+        exponent++;
+    }
 
-    return chans;
-#endif // HAVE_SYS_MMAN_H
+    char     digits[24];
+    char    *digits_end = digits + sizeof(digits);
+    size_t   len = recorder_digits(digits_end, integral, 10, false, 1);
+    memcpy(dst, digits_end - len, len);
+    dst += len;
+
+    len = recorder_digits(digits_end, fraction, 10, false, precision);
+    if (general && !conv->alternate)
+        while (len && digits_end[-1] == '0' && precision--)
+            digits_end--, len--;
+    if (len || conv->alternate)
+        *dst++ = '.';
+    memcpy(dst, digits_end - len, len);
+    dst += len;
+
+    if (scientific)
+    {
+        *dst++ = upper ? 'E' : 'e';
+        *dst++ = exponent < 0 ? '-' : '+';
+        len = recorder_digits(digits_end,
+                              exponent < 0 ? -exponent : exponent,
+                              10, false, 2);
+        memcpy(dst, digits_end - len, len);
+        dst += len;
+    }
+
+    recorder_put_field(b, conv, prefix, prefix_len, buffer, dst - buffer);
 }
 
 
-void recorder_chans_delete(recorder_chans_p chans)
+static const char *recorder_parse_conversion(const char *format,
+                                             recorder_conversion *conv,
+                                             const int *fields,
+                                             unsigned field_cnt)
 // ----------------------------------------------------------------------------
-//   Delete the list of exported items from the shared memory area
+//   Parse a conversion after its '%', return the position after its kind
 // ----------------------------------------------------------------------------
 {
-    int i;
-    recorder_info *rec;
-    for (rec = recorders; rec; rec = rec->next)
+    recorder_conversion  init  = { 0, -1, 0, 0, false, false, false, false,
+                                   false, 0 };
+    unsigned             field = 0;
+    char                 c;
+
+    *conv = init;
+
+    // Flags
+    for (;; format++)
     {
-        if (rec->trace == RECORDER_CHAN_MAGIC)
-            rec->trace = 0;
-        for (i = 0; i < (int) array_size(rec->exported); i++)
-            rec->exported[i] = NULL;
+        c = *format;
+        if      (c == '-') conv->left = true;
+        else if (c == '0') conv->zero = true;
+        else if (c == '+') conv->sign = true;
+        else if (c == ' ') conv->space = true;
+        else if (c == '#') conv->alternate = true;
+        else break;
     }
 
-    recorder_chan_p next = NULL;
-    recorder_chan_p chan;
-    for (chan = chans->head; chan; chan = next)
+    // Width
+    if (*format == '*')
     {
-        next = chan->next;
-        recorder_chan_delete(chan);
+        conv->width = field < field_cnt ? fields[field++] : 0;
+        if (conv->width < 0)
+        {
+            conv->left = true;
+            conv->width = -conv->width;
+        }
+        format++;
     }
+    while (*format >= '0' && *format <= '9')
+        conv->width = 10 * conv->width + *format++ - '0';
 
-#ifdef HAVE_SYS_MMAN_H
-    munmap(chans->map_addr, chans->map_size);
-#endif // HAVE_SYS_MMAN_H
-    close(chans->fd);
-    free(chans);
-}
-
-
-recorder_chan_p recorder_chan_new(recorder_chans_p chans,
-                                  recorder_type    type,
-                                  size_t           size,
-                                  const char *     name,
-                                  const char *     description,
-                                  const char *     unit,
-                                  recorder_data    min,
-                                  recorder_data    max)
-// ----------------------------------------------------------------------------
-//    Allocate and create a new recorder_chan
-// ----------------------------------------------------------------------------
-{
-#ifndef HAVE_SYS_MMAN_H
-    record(recorder_error, "recorder_chan_new called on system without mmap");
-    return NULL;
-#else // HAVE_SYS_MMAN_H
-    recorder_shans_p   shans       = chans->map_addr;
-    size_t             offset      = shans->offset;
-    size_t             item_size   = 2 * sizeof(recorder_data);
-
-    size_t             name_len    = strlen(name);
-    size_t             descr_len   = strlen(description);
-    size_t             unit_len    = strlen(unit);
-
-    size_t             name_offs   = sizeof(recorder_shan) + size*item_size;
-    size_t             descr_offs  = name_offs + name_len + 1;
-    size_t             unit_offs   = descr_offs + descr_len + 1;
-
-    size_t             alloc       = unit_offs + unit_len + 1;
-
-    // TODO: Find one from the free list if there is one
-
-    size_t align = sizeof(long double);
-    size_t new_offset = (offset + alloc + align-1) & ~(align-1);
-    if (new_offset >= chans->map_size)
+    // Precision
+    if (*format == '.')
     {
-        size_t map_size = (new_offset / MAP_SIZE + 1) * MAP_SIZE;
-        if (!recorder_shans_file_extend(chans->fd, map_size))
+        format++;
+        conv->precision = 0;
+        if (*format == '*')
         {
-            record(recorder_error,
-                   "Could not extend mapping to %zu bytes: %s (%d)",
-                   map_size, strerror(errno), errno);
-            return NULL;
-        }
-        void *map_addr = mmap(chans->map_addr, map_size,
-                              PROT_READ | PROT_WRITE,
-                              MAP_FILE | MAP_SHARED,
-                              chans->fd, 0);
-        if (map_addr == MAP_FAILED)
-        {
-            record(recorder_error,
-                   "Unable to extend mmap to %zu bytes, errno=%d (%s)",
-                   map_size, errno, strerror(errno));
-            return NULL;
+            conv->precision = field < field_cnt ? fields[field++] : -1;
+            format++;
         }
-
-        // Note that if the new mapping address is different,
-        // all recorder_chan_p become invalid
-        chans->map_size = map_size;
-        chans->map_addr = map_addr;
+        while (*format >= '0' && *format <= '9')
+            conv->precision = 10 * conv->precision + *format++ - '0';
     }
-    shans->offset = new_offset;
-
-    // Initialize recorder_chan fields
-    recorder_shan_p shan = (recorder_shan_p) ((char *) chans->map_addr+offset);
-    char *base = (char *) shan;
-    shan->type = type;
-    shan->next = shans->head;
-    shan->name = name_offs;
-    shan->description = descr_offs;
-    shan->unit = unit_offs;
-    shan->min = min;
-    shan->max = max;
-    memcpy(base + name_offs, name, name_len + 1);
-    memcpy(base + descr_offs, description, descr_len + 1);
-    memcpy(base + unit_offs, unit, unit_len + 1);
-
-    // Initialize ring fields
-    recorder_ring_p ring = &shan->ring;
-    ring->size = size;
-    ring->item_size = item_size;
-    ring->reader = 0;
-    ring->writer = 0;
-    ring->commit = 0;
-    ring->overflow = 0;
 
-    // Link recorder_chan in recorder_chans list
-    shans->head = offset;
-
-    // Create recorder_chan access
-    recorder_chan_p chan = malloc(sizeof(recorder_chan_t));
-    chan->chans = chans;
-    chan->offset = offset;
-    chan->next = chans->head;
-    chans->head = chan;
+    // Size modifiers
+    for (;; format++)
+    {
+        c = *format;
+        if (c == 'l' || c == 'L' || c == 'j' ||
+            c == 'z' || c == 't' || c == 'q')
+            conv->longs++;
+        else if (c == 'h')
+            conv->shorts++;
+#ifdef _WIN32
+        else if (c == 'I' || c == '3' || c == '2' || c == '6' || c == '4')
+            conv->longs++;
+#endif // _WIN32
+        else
+            break;
+    }
 
-    return chan;
-#endif // HAVE_SYS_MMAN_H
+    conv->kind = *format++;
+    return format;
 }
 
 
-void recorder_chan_delete(recorder_chan_p chan)
+static size_t recorder_safe_format(char *dst, size_t size,
+                                   const char *format,
+                                   const int *fields, unsigned field_cnt,
+                                   uintptr_t arg, double real)
 // ----------------------------------------------------------------------------
-//   Delete a recorder_chan
+//   Format one printf-style conversion, without calling snprintf
 // ----------------------------------------------------------------------------
+//   The format is built by recorder_dump_entry, and contains at most one
+//   conversion. 'real' is used for floating-point conversions.
+//   Return the number of characters written, not including trailing 0.
 {
-    recorder_chans_p  chans       = chan->chans;
-    char             *map_addr    = chans->map_addr;
-    intptr_t          chan_offset = chan->offset;
-    recorder_shans_p  shans       = (recorder_shans_p) map_addr;
-    off_t            *last        = &shans->head;
-    off_t             offset;
+    recorder_text_buffer b     = { dst, dst + (size ? size - 1 : 0) };
+    recorder_conversion  conv;
+    char                 c;
 
-    for (offset = *last; offset; offset = *last)
+    while ((c = *format++))
     {
-        recorder_shan_p shan = (recorder_shan_p) (map_addr + offset);
-        if (*last == chan_offset)
+        if (c != '%')
         {
-            *last = shan->next;
-            shan->next = shans->free_list;
-            shans->free_list = chan_offset;
-            break;
+            recorder_put_char(&b, c);
+            continue;
         }
-        last = &shan->next;
-    }
 
-    recorder_chan_p * last_chan;
-    for (last_chan = &chans->head; *last_chan; last_chan = &(*last_chan)->next)
-    {
-        if (*last_chan == chan)
+        format = recorder_parse_conversion(format, &conv, fields, field_cnt);
+        c = conv.kind;
+        switch (c)
         {
-            *last_chan = chan->next;
+        case 's': case 'S':
+        {
+            const char *text = (const char *) arg;
+            size_t      len  = 0;
+            if (!text)
+                text = "(null)";
+            while (text[len] && (conv.precision < 0 ||
+                                 len < (size_t) conv.precision))
+                len++;
+            conv.zero = false;
+            recorder_put_field(&b, &conv, NULL, 0, text, len);
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+            recorder_put_real(&b, &conv, real);
+            break;
+        case '%':
+            recorder_put_char(&b, '%');
+            break;
+        case 0:
+            format--;
+            break;
+        default:
+            recorder_put_integer(&b, &conv, arg);
             break;
         }
     }
 
-    free(chan);
+    *b.dst = 0;
+    return b.dst - dst;
 }
 
 
-size_t recorder_chan_write(recorder_chan_p chan, const void *ptr, size_t count)
+static void recorder_put_string(recorder_text_buffer *b,
+                                const char *text, int width, int precision)
 // ----------------------------------------------------------------------------
-//   Write some data in the recorder_chan
+//   Append a string, like "%*.*s" would
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return recorder_ring_write(&shan->ring, ptr, count, NULL, NULL, NULL);
+    recorder_conversion conv = { 0, -1, 0, 0, false, false, false, false,
+                                 false, 's' };
+    size_t len = 0;
+    if (!text)
+        text = "(null)";
+    while (text[len] && (precision < 0 || len < (size_t) precision))
+        len++;
+    conv.left = width < 0;
+    conv.width = width < 0 ? -width : width;
+    recorder_put_field(b, &conv, NULL, 0, text, len);
 }
 
 
-size_t recorder_chan_writable(recorder_chan_p chan)
+static void recorder_put_decimal(recorder_text_buffer *b,
+                                 intptr_t value, int width)
 // ----------------------------------------------------------------------------
-//    Return number of items that can be written in ring
+//   Append a decimal number, zero-padded to 'width' digits
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return recorder_ring_writable(&shan->ring);
+    recorder_conversion conv = { width, -1, 1, 0, false, true, false, false,
+                                 false, 'd' };
+    recorder_put_integer(b, &conv, (uintptr_t) value);
 }
 
 
-ringidx_t recorder_chan_writer(recorder_chan_p chan)
+static void recorder_put_seconds(recorder_text_buffer *b,
+                                 uintptr_t ticks, int width, int precision)
 // ----------------------------------------------------------------------------
-//    Return current writer index
+//   Append ticks converted to seconds, like "%0*.*f" for ticks / RECORDER_HZ
 // ----------------------------------------------------------------------------
+//   This uses integer arithmetic, so it is exact and async-signal-safe
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->ring.writer;
+    char        buffer[48];
+    char       *end     = buffer + sizeof(buffer);
+    char       *dst     = buffer;
+    uint64_t    seconds = ticks / RECORDER_HZ;
+    uint64_t    rest    = ticks % RECORDER_HZ;
+    uint64_t    scale   = 1;
+    int         exact   = precision < 9 ? precision : 9;
+    int         p;
+    size_t      len;
+
+    for (p = 0; p < exact; p++)
+        scale *= 10;
+    uint64_t fraction = (rest * scale + RECORDER_HZ / 2) / RECORDER_HZ;
+    if (fraction >= scale)
+    {
+        fraction -= scale;
+        seconds++;
+    }
+
+    char digits[24];
+    len = recorder_digits(digits + sizeof(digits), seconds, 10, false, 1);
+    memcpy(dst, digits + sizeof(digits) - len, len);
+    dst += len;
+    if (precision > 0)
+    {
+        *dst++ = '.';
+        len = recorder_digits(digits + sizeof(digits), fraction, 10, false,
+                              exact);
+        memcpy(dst, digits + sizeof(digits) - len, len);
+        dst += len;
+        for (p = exact; p < precision && dst < end; p++)
+            *dst++ = '0';
+    }
+
+    recorder_conversion conv = { width, -1, 0, 0, false, true, false, false,
+                                 false, 'f' };
+    recorder_put_field(b, &conv, NULL, 0, buffer, dst - buffer);
 }
 
 
 
 // ============================================================================
 //
-//    Subscribing to recorder_chans in a remote process
+//    Recorder dump utility
 //
 // ============================================================================
 
-recorder_chans_p recorder_chans_open(const char *file)
-// ----------------------------------------------------------------------------
-//    Map the file in memory, and scan its structure
-// ----------------------------------------------------------------------------
-{
-#ifndef HAVE_SYS_MMAN_H
-    record(recorder_error,
-           "Cannot open export channels %s on system without mmap",
-           file);
-    return NULL;
-#else // HAVE_SYS_MMAN_H
-    record(recorder, "Open export channels %s", file);
-    int fd = open(file, O_RDWR);
-    if (fd == -1)
-    {
-        record(recorder_error,
-               "Unable to open %s for reading: %s (%d)",
-               file, strerror(errno), errno);
-        return NULL;
-    }
-    struct stat stat;
-    if (fstat(fd, &stat) != 0)
-    {
-        record(recorder_error,
-               "Unable to stat %s: %s (%d)",
-               file, strerror(errno), errno);
-        return NULL;
-    }
+/// Global counter indicating the order of entries across recorders.
+uintptr_t recorder_order = 0;
 
-    // Map space for the recorder_chans
-    size_t  map_size = stat.st_size;
-    off_t   offset   = 0;
-    void   *map_addr = mmap(NULL, map_size,
-                            PROT_READ|PROT_WRITE,
-                            MAP_FILE | MAP_SHARED,
-                            fd, offset);
-    recorder_shans_p shans = map_addr;
-    if (map_addr == MAP_FAILED                  ||
-        shans->magic != RECORDER_CHAN_MAGIC     ||
-        shans->version != RECORDER_CHAN_VERSION)
-    {
-        if (map_addr == MAP_FAILED)
-            record(recorder_error,
-                   "Unable to map %s file for reading: %s (%d)",
-                   file, strerror(errno), errno);
-        if (shans->magic == (RECORDER_CHAN_MAGIC ^ RECORDER_64BIT))
-            record(recorder_error,
-                   "Mismatch between 32-bit and 64-bit recorder data");
-        else if (shans->magic != RECORDER_CHAN_MAGIC)
-            record(recorder_error,
-                   "Wrong magic number, got %x instead of %x",
-                   shans->magic, RECORDER_CHAN_MAGIC);
-        if (shans->version != RECORDER_CHAN_VERSION)
-            record(recorder_error,
-                   "Wrong exports file version, got %x instead of %x",
-                   shans->version, RECORDER_CHAN_VERSION);
+// Check if we are currently dumping the recorder
+static unsigned recorder_dumping = 0;
 
-        close(fd);
-        return NULL;
-    }
+// Check if the current thread formats traces after they were recorded
+static RECORDER_THREAD_LOCAL bool recorder_trace_deferred = false;
 
-    int retries = 0;
-    while (retries < 3)
-    {
-        // Successful: Initialize with recorder_chan descriptor
-        recorder_chans_p chans = malloc(sizeof(recorder_chans_t));
-        chans->fd = fd;
-        chans->map_addr = map_addr;
-        chans->map_size = map_size;
-        chans->serial = shans->serial;
-        chans->head = NULL;
+// In scalable order mode, entries are numbered while merged for a dump
+static RECORDER_THREAD_LOCAL bool recorder_merge_numbered = false;
+static uintptr_t                  recorder_merge_order    = 0;
 
-        // Create recorder_chans for all recorder_chans in shared memory
-        recorder_shan_p shan;
-        off_t           off;
-        for (off = shans->head; off; off = shan->next)
-        {
-            shan = (recorder_shan_p) ((char *) map_addr + off);
-            recorder_chan_p chan = malloc(sizeof(recorder_chan_t));
-            chan->chans = chans;
-            chan->offset = off;
-            chan->next = chans->head;
-            chans->head = chan;
-        }
+/// List of the currently active flight recorders (ring buffers)
+static recorder_info * recorders = NULL;
 
-        if (recorder_chans_valid(chans))
-            return chans;
+/// List of the currently active tweaks
+static recorder_tweak *tweaks = NULL;
 
-        // The serial number changed - Program restarted at wrong time?
-        record(recorder_warning,
-               "Export channels serial changed, retry #%d", retries);
-        recorder_chans_close(chans);
-        retries++;
-    }
+/// Sections registered by modules, with recorders and tweaks to activate
+static recorder_section *recorder_sections = NULL;
+static unsigned          recorder_sections_activating = 0;
+static void recorder_sections_activate(void);
 
-    record(recorder_error, "Too many retries mapping %s, giving up", file);
-    return NULL;
-#endif // HAVE_SYS_MMAN_H
+
+static inline recorder_info *recorder_first(void)
+// ----------------------------------------------------------------------------
+//   Return the first active recorder, activating registered sections if any
+// ----------------------------------------------------------------------------
+{
+    if (recorder_sections || recorder_sections_activating)
+        recorder_sections_activate();
+    return recorders;
 }
 
 
-void recorder_chans_close(recorder_chans_p chans)
+typedef struct recorder_record
 // ----------------------------------------------------------------------------
-//   Close shared memory recorder_chans
+//   The entries making up a record in a ring
 // ----------------------------------------------------------------------------
 {
-    recorder_chan_p chan, next;
-    for (chan = chans->head; chan; chan = next)
+    recorder_entry *entry;                      // First entry
+    recorder_extra *extra[RECORDER_RECORD_SLOTS - 1]; // Continuations
+    unsigned        count;                      // Number of continuations
+    unsigned        text;                       // Index + 1 of inline string
+} recorder_record;
+
+
+static void recorder_record_init(recorder_record *record,
+                                 recorder_ring_p ring,
+                                 recorder_entry *entry)
+// ----------------------------------------------------------------------------
+//   Collect the continuation entries that follow the first entry of a record
+// ----------------------------------------------------------------------------
+{
+    recorder_entry *base  = (recorder_entry *) (ring + 1);
+    size_t          size  = ring->size;
+    ringidx_t       idx   = entry - base;
+    unsigned        count = 0;
+
+    while (count + 1 < RECORDER_RECORD_SLOTS && count + 1 < size)
     {
-        next = chan->next;
-        free(chan);
+        recorder_entry *next = &base[(idx + count + 1) & (size - 1)];
+        recorder_extra *cont = (recorder_extra *) next;
+        if (!recorder_is_extra(next) || cont->order != entry->order)
+            break;
+        record->extra[count++] = cont;
     }
-    free (chans);
+    record->entry = entry;
+    record->count = count;
+    record->text = count ? record->extra[0]->marker >> 4 : 0;
 }
 
 
-bool recorder_chans_valid(recorder_chans_p chans)
+static uintptr_t *recorder_record_arg(recorder_record *record, unsigned index)
 // ----------------------------------------------------------------------------
-//   Return true if the open chans is still valid
+//   Return the address of an argument, or NULL if it was not stored
 // ----------------------------------------------------------------------------
 {
-    recorder_shans_p shans = (recorder_shans_p) chans->map_addr;
-    return chans->serial == shans->serial;
+    if (index < array_size(record->entry->args))
+        return &record->entry->args[index];
+    index -= array_size(record->entry->args);
+    unsigned slot = index / RECORDER_EXTRA_ARGS;
+    unsigned args = record->count - (record->text != 0);
+    if (slot >= args)
+        return NULL;
+    return &record->extra[slot]->args[index % RECORDER_EXTRA_ARGS];
 }
 
 
-bool recorder_chans_configure(recorder_chans_p chans,
-                              const char *message)
+static inline uintptr_t recorder_record_value(recorder_record *record,
+                                              unsigned index)
 // ----------------------------------------------------------------------------
-//   Send a configuration message over the shared memory buffer
+//   Return the value of an argument, zero if it was not stored
 // ----------------------------------------------------------------------------
 {
-    recorder_shans_p shans = chans->map_addr;
-    recorder_ring_p  cmds  = &shans->commands;
-    size_t           len   = strlen(message);
-    size_t           avail = recorder_ring_writable(cmds);
-    if (avail < len)
-    {
-        record(recorder_warning,
-               "Insufficient space in command buffer, %u < %u", avail, len);
-        return false;
-    }
-    recorder_ring_write(cmds, message, len, NULL, NULL, NULL);
-    return true;
+    uintptr_t *arg = recorder_record_arg(record, index);
+    return arg ? *arg : 0;
 }
 
 
-recorder_chan_p recorder_chan_find(recorder_chans_p  chans,
-                                   const char       *pattern,
-                                   recorder_chan_p   after)
+static const char *recorder_record_text(recorder_record *record,
+                                        char *buffer, size_t size)
 // ----------------------------------------------------------------------------
-//   Find a recorder_chan with the given name in the recorder_chan list
+//   Copy the inline string, which writers may overwrite while we read it
 // ----------------------------------------------------------------------------
 {
-    pattern_t re;
-    int             status = pattern_comp(&re, pattern);
-    recorder_chan_p first  = after ? after->next : chans->head;
-    recorder_chan_p chan   = NULL;;
+    const char *text = (const char *) record->extra[record->count - 1]->args;
+    size_t      i;
+    for (i = 0; i + 1 < size && text[i]; i++)
+        buffer[i] = text[i];
+    buffer[i] = 0;
+    return buffer;
+}
 
-    if (status == 0)
-    {
-        for (chan = first; chan; chan = chan->next)
+
+// The current indent for output
+static unsigned indent = 0;
+
+
+enum
+// ----------------------------------------------------------------------------
+//   Sizes for the parsed formats cache
+// ----------------------------------------------------------------------------
+{
+    RECORDER_PARSED_SLOTS       = 1024,         // Formats in cache, power of 2
+    RECORDER_PARSED_PROBES      = 8,            // Slots probed for a format
+    RECORDER_PARSED_ARENA       = 64 * 1024,    // Bytes for parsed formats
+    RECORDER_PARSED_CONVERSIONS = 24,           // Conversions in a format
+    RECORDER_PARSED_TEXT        = 255           // Literal text in a format
+};
+
+
+typedef enum recorder_parsed_kind
+// ----------------------------------------------------------------------------
+//   The kinds of conversions in a parsed format
+// ----------------------------------------------------------------------------
+{
+    RECORDER_PARSED_END,                        // End of the format
+    RECORDER_PARSED_INTEGER,                    // Integer, character, pointer
+    RECORDER_PARSED_DIRECT,                     // Same, without snprintf
+    RECORDER_PARSED_STRING,                     // %s
+    RECORDER_PARSED_REAL,                       // Floating-point value
+    RECORDER_PARSED_SPECIAL                     // Custom recorder_types
+} recorder_parsed_kind;
+
+
+typedef struct recorder_parsed_conv
+// ----------------------------------------------------------------------------
+//   A conversion in a parsed format, and the literal text that precedes it
+// ----------------------------------------------------------------------------
+{
+    uint8_t     literal;                        // Bytes of text before
+    uint8_t     kind;                           // recorder_parsed_kind
+    uint8_t     fields;                         // Number of '*' arguments
+    bool        safe;                           // '+' modifier
+    union
+    {
+        char                spec[28];           // Conversion for snprintf
+        recorder_conversion direct;             // For RECORDER_PARSED_DIRECT
+    };
+} recorder_parsed_conv;
+
+
+typedef struct recorder_parsed
+// ----------------------------------------------------------------------------
+//   A format split into literal text and conversions for recorder_dump_entry
+// ----------------------------------------------------------------------------
+//   The literal text, with indentation markers and "%%" resolved, follows
+//   the 'count' conversions, the last of which is RECORDER_PARSED_END.
+{
+    const char *format;                         // Format in the entries
+    unsigned    generation;                     // Generation of the cache
+    int16_t     location;                       // Length of "file:line:"
+    char        indent;                         // '>', '<', '=' or 0
+    uint8_t     count;                          // Number of conversions
+    recorder_parsed_conv conv[];                // Conversions, then text
+} recorder_parsed;
+
+
+typedef struct recorder_parsed_cache
+// ----------------------------------------------------------------------------
+//   Cache of parsed formats, indexed by format address
+// ----------------------------------------------------------------------------
+{
+    recorder_parsed *slots[RECORDER_PARSED_SLOTS];
+    size_t           used;                      // Bytes used in the arena
+    unsigned         generation;                // Incremented to invalidate
+    uintptr_t        arena[RECORDER_PARSED_ARENA / sizeof(uintptr_t)];
+} recorder_parsed_cache;
+
+// Formats of the running process, and of a dump being decoded, if any.
+// Decoded formats are freed once decoded, and their addresses reused, so
+// they use their own cache in order not to fill the arena of this one
+static recorder_parsed_cache                         recorder_parsed_shared;
+static RECORDER_THREAD_LOCAL recorder_parsed_cache * recorder_parsed_decoded;
+
+// Formats parsed again because the arena of the shared cache was full
+static uintptr_t recorder_parsed_uncached = 0;
+
+// Formats are parsed here, to keep dumps on the alternate signal stack small
+static RECORDER_THREAD_LOCAL uintptr_t
+recorder_parsed_local[(sizeof(recorder_parsed) +
+                       RECORDER_PARSED_CONVERSIONS * sizeof(recorder_parsed_conv) +
+                       RECORDER_PARSED_TEXT) / sizeof(uintptr_t) + 1];
+
+
+static inline const char *recorder_parsed_text(const recorder_parsed *parsed)
+// ----------------------------------------------------------------------------
+//   Return the literal text of a parsed format
+// ----------------------------------------------------------------------------
+{
+    return (const char *) &parsed->conv[parsed->count];
+}
+
+
+static void recorder_parse_format(recorder_parsed *parsed, const char *format)
+// ----------------------------------------------------------------------------
+//   Split a format into literal text and conversions
+// ----------------------------------------------------------------------------
+//   The 'parsed' buffer must have room for RECORDER_PARSED_CONVERSIONS and
+//   RECORDER_PARSED_TEXT bytes, since the count is not known in advance.
+//   Text beyond RECORDER_PARSED_TEXT would not fit in the dump buffer.
+//   The literal text is first written after the largest conversion table,
+//   then moved after the actual conversions.
+{
+    char       *text    = (char *) &parsed->conv[RECORDER_PARSED_CONVERSIONS];
+    const char *fmt     = recorder_format_text(format);
+    unsigned    length  = 0;
+    unsigned    start   = 0;
+    unsigned    count   = 0;
+    unsigned    colons  = 0;
+    char        c;
+
+    parsed->format = format;
+    parsed->generation = 0;
+    parsed->location = -1;
+    parsed->indent = 0;
+
+    while (length < RECORDER_PARSED_TEXT && count + 1 < RECORDER_PARSED_CONVERSIONS)
+    {
+        c = *fmt++;
+        if (!c)
+            break;
+
+        if (c != '%')
         {
-            const char *name = recorder_chan_name(chan);
-            if (pattern_match(&re, name))
+            text[length++] = c;
+            if (c == ':')
+            {
+                // Skip file:line:
+                if (++colons == 2 && !count)
+                    parsed->location = length;
+            }
+            else if (colons == 2)
+            {
+                // Check if first character marks indentation
+                switch(c)
+                {
+                case '>': case '<': case '=':
+                    parsed->indent = c;
+                    length--;
+                    break;
+                }
+                colons++;
+            }
+            continue;
+        }
+
+        recorder_parsed_conv *conv     = &parsed->conv[count];
+        char                 *spec     = conv->spec;
+        char                 *spec_end = conv->spec + sizeof(conv->spec) - 1;
+        bool                  done     = false;
+        bool                  valid    = true;
+
+        conv->kind = RECORDER_PARSED_INTEGER;
+        conv->fields = 0;
+        conv->safe = false;
+        *spec++ = c;
+        while (!done && valid)
+        {
+            c = *fmt++;
+            if (spec >= spec_end)
+            {
+                valid = false;
+                break;
+            }
+            *spec++ = c;
+
+            if (recorder_types[(uint8_t) c])
+            {
+                conv->kind = RECORDER_PARSED_SPECIAL;
+                break;
+            }
+
+            switch(c)
+            {
+            case 'f': case 'F':  // Floating point formatting
+            case 'g': case 'G':
+            case 'e': case 'E':
+            case 'a': case 'A':
+                conv->kind = RECORDER_PARSED_REAL;
+                done = true;
+                break;
+            case 's': case 'S':
+                conv->kind = RECORDER_PARSED_STRING;
+                done = true;
+                break;
+            case 'b':           // Integer formatting
+            case 'c': case 'C':
+            case 'd': case 'D':
+            case 'i':
+            case 'o': case 'O':
+            case 'u': case 'U':
+            case 'x':
+            case 'X':
+            case 'p':
+                done = true;
+                break;
+
+                // GCC: case '0' ... '9', not supported on IAR
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+            case '.':
+            case '-':
+            case 'l': case 'L':
+            case 'h':
+            case 'j':
+            case 't':
+            case 'z':
+            case 'q':
+            case 'v':
+#ifdef _WIN32
+                // On Windows size specifiers "I", "I32", "I64"
+            case 'I':
+#endif
+                break;
+            case '+':
+                conv->safe = true;
+                break;
+            case 'n':           // Expect two args
+            case '*':
+                valid = conv->fields < 2;
+                conv->fields++;
+                break;
+            case '%':           // Literal percent sign, not an argument
+                done = true;
+                break;
+
+            default:            // Unsupported, including end of string
+                valid = false;
                 break;
+            }
+        }
+        if (!valid)
+            break;
+        *spec = 0;
+
+        if (c == '%')
+        {
+            text[length++] = c;
+            continue;
+        }
+
+        // Common integer conversions are formatted without snprintf
+        if (conv->kind == RECORDER_PARSED_INTEGER && !conv->fields &&
+            memchr("diuxXocp", c, 8))
+        {
+            recorder_conversion direct;
+            recorder_parse_conversion(conv->spec + 1, &direct, NULL, 0);
+            conv->direct = direct;
+            conv->kind = RECORDER_PARSED_DIRECT;
         }
+        conv->literal = (uint8_t) (length - start);
+        start = length;
+        count++;
     }
-    pattern_free(&re);
-    return chan;
+
+    // Mark the end, and move the text right after the conversions
+    recorder_parsed_conv *end = &parsed->conv[count];
+    end->kind = RECORDER_PARSED_END;
+    end->literal = (uint8_t) (length - start);
+    parsed->count = (uint8_t) (count + 1);
+    memmove(&parsed->conv[count + 1], text, length);
 }
 
 
-const char *recorder_chan_name(recorder_chan_p chan)
+static const recorder_parsed *recorder_parsed_format(const char *format)
 // ----------------------------------------------------------------------------
-//   Return the name for a given recorder_chan
+//   Return the parsed format from the cache, parsing and caching it if needed
+// ----------------------------------------------------------------------------
+//   Writers may dump traces concurrently, so the cache is lock-free.
+//   Entries are never freed: a generation change makes them stale, and
+//   stale slots are reused, but not their arena space. If the arena is
+//   full, return the local parse.
+{
+    recorder_parsed_cache *cache = recorder_parsed_decoded
+                                 ? recorder_parsed_decoded
+                                 : &recorder_parsed_shared;
+    unsigned  generation = cache->generation;
+    uintptr_t hash       = (uintptr_t) format >> 3;
+    size_t    mask       = RECORDER_PARSED_SLOTS - 1;
+    size_t    first      = (size_t) (hash * 0x9E3779B97F4A7C15ULL) & mask;
+    bool      room       = false;
+    size_t    probe;
+
+    for (probe = 0; probe < RECORDER_PARSED_PROBES && !room; probe++)
+    {
+        recorder_parsed **slot = &cache->slots[(first + probe) & mask];
+        recorder_parsed *parsed = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (!parsed || parsed->generation != generation)
+            room = true;
+        else if (parsed->format == format)
+            return parsed;
+    }
+
+    recorder_parsed *local = (recorder_parsed *) recorder_parsed_local;
+    recorder_parse_format(local, format);
+    local->generation = generation;
+    if (!room)
+        return local;
+    size_t size = sizeof(recorder_parsed)
+        + local->count * sizeof(recorder_parsed_conv)
+        + local->conv[local->count - 1].literal;
+    unsigned c;
+    for (c = 0; c + 1 < local->count; c++)
+        size += local->conv[c].literal;
+    size = (size + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+
+    // Allocate room in the arena, unless it is full
+    size_t offset = recorder_ring_fetch_add(cache->used, size);
+    if (offset + size > sizeof(cache->arena))
+    {
+        if (cache == &recorder_parsed_shared)
+            recorder_ring_fetch_add(recorder_parsed_uncached, 1);
+        return local;
+    }
+    recorder_parsed *copy = (recorder_parsed *)
+        ((char *) cache->arena + offset);
+    memcpy(copy, local, size);
+
+    // Insert in an empty or stale slot
+    for (probe = 0; probe < RECORDER_PARSED_PROBES; probe++)
+    {
+        recorder_parsed **slot = &cache->slots[(first + probe) & mask];
+        recorder_parsed *old = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        while (!old || old->generation != generation)
+            if (recorder_ring_compare_exchange(*slot, old, copy))
+                return copy;
+        if (old->format == format)
+            return old;
+    }
+    return copy;
+}
+
+
+static void recorder_dump_entry(recorder_info      *rec,
+                                recorder_ring_p     ring,
+                                recorder_entry     *entry,
+                                recorder_format_fn  format,
+                                recorder_show_fn    show,
+                                void               *output)
+// ----------------------------------------------------------------------------
+//  Dump a recorder entry in a buffer between dst and dst_end, return last pos
+// ----------------------------------------------------------------------------
+//  The format is parsed once and cached. Most of the work is then to copy
+//  literal text and to format the arguments.
+{
+    char buffer[256];
+    char format_buffer[sizeof(((recorder_parsed_conv *) 0)->spec)];
+    char text_buffer[sizeof(((recorder_extra *) 0)->args)];
+
+    const char     *label         = rec->name;
+    char           *dst           = buffer;
+    char           *dst_end       = buffer + sizeof buffer - 1;
+    unsigned        arg_index     = 0;
+    unsigned        nextindent    = indent;
+    uintptr_t       order         = entry->order;
+    bool            dumping       = recorder_dumping || recorder_trace_deferred;
+    bool            newline       = false;
+    recorder_record record;
+    unsigned        c;
+
+    // Exit if we get there for a continuation entry
+    if (recorder_is_extra(entry))
+        return;
+    recorder_record_init(&record, ring, entry);
+
+    const recorder_parsed *parsed = recorder_parsed_format(entry->format);
+    const char *text = recorder_parsed_text(parsed);
+    switch(parsed->indent)
+    {
+    case '>': nextindent = indent + 1; break;
+    case '<': nextindent = --indent;   break;
+    case '=': nextindent = indent = 0; break;
+    }
+
+    // Apply formatting. This complicated loop is because
+    // we need to detect floating-point values, which are passed
+    // differently on many architectures such as x86 or ARM
+    // (passed in different registers). So we detect them from the format,
+    // convert intptr_t to float or double depending on its size,
+    // and call the variadic snprintf passing a double value that will
+    // naturally go in the right register. A bit ugly.
+    for (c = 0; c < parsed->count && dst < dst_end; c++)
+    {
+        const recorder_parsed_conv *conv = &parsed->conv[c];
+        size_t length = conv->literal;
+        if (length > (size_t) (dst_end - dst))
+            length = dst_end - dst;
+        memcpy(dst, text, length);
+        dst += length;
+        text += conv->literal;
+        if (length)
+            newline = dst[-1] == '\n';
+        if (conv->kind == RECORDER_PARSED_END || dst >= dst_end)
+            break;
+
+        const char *spec      = conv->spec;
+        int         fields[2] = { 0 };
+        unsigned    field_cnt = conv->fields;
+        unsigned    f;
+        for (f = 0; f < field_cnt; f++)
+            fields[f] = (int) recorder_record_value(&record, arg_index++);
+
+        bool is_string = conv->kind == RECORDER_PARSED_STRING;
+        bool is_inline = (is_string && !conv->safe && dumping &&
+                          record.text == arg_index + 1);
+        bool is_special = conv->kind == RECORDER_PARSED_SPECIAL;
+        if ((is_string && !conv->safe && dumping && !is_inline) ||
+            (is_special && recorder_crashing))
+        {
+            // Replace with a pointer if not tracing, or for custom formats
+            // when crashing, since they may not be signal-safe
+            size_t spec_len = strlen(spec);
+            memcpy(format_buffer, spec, spec_len + 1);
+            format_buffer[spec_len - 1] = 'p';
+            spec = format_buffer;
+        }
+        newline = false;
+
+        // Warning: It is important for correctness that only
+        // one call to snprintf happens per loop, since snprintf
+        // return value can be larger than what is actually written.
+        // When crashing, use recorder_safe_format instead of snprintf.
+        if (is_special && recorder_crashing)
+        {
+            uintptr_t arg = recorder_record_value(&record, arg_index++);
+            dst += recorder_safe_format(dst, dst_end - dst, spec,
+                                        fields, field_cnt, arg, 0.0);
+        }
+        else if (is_special)
+        {
+            recorder_type_fn special =
+                recorder_types[(uint8_t) spec[strlen(spec) - 1]];
+            uintptr_t arg = recorder_record_value(&record, arg_index++);
+            intptr_t tracing = dumping ? 0 : rec->trace;
+            if (special)
+                dst += special(conv->safe | tracing,
+                               spec, dst, dst_end - dst, arg);
+        }
+        else if (conv->kind == RECORDER_PARSED_DIRECT)
+        {
+            recorder_text_buffer b = { dst, dst_end };
+            uintptr_t arg = recorder_record_value(&record, arg_index++);
+            recorder_put_integer(&b, &conv->direct, arg);
+            dst = b.dst;
+        }
+        else if (conv->kind == RECORDER_PARSED_REAL)
+        {
+            double arg;
+            if (sizeof(intptr_t) == sizeof(float))
+            {
+                union { float f; intptr_t i; } u;
+                u.i = recorder_record_value(&record, arg_index++);
+                arg = (double) u.f;
+            }
+            else
+            {
+                union { double d; intptr_t i; } u;
+                u.i = recorder_record_value(&record, arg_index++);
+                arg = u.d;
+            }
+            if (recorder_crashing)
+                dst += recorder_safe_format(dst, dst_end - dst, spec,
+                                            fields, field_cnt, 0, arg);
+            else switch(field_cnt)
+            {
+            case 0:
+                dst += snprintf(dst, dst_end - dst, spec, arg);
+                break;
+            case 1:
+                dst += snprintf(dst, dst_end - dst, spec, fields[0], arg);
+                break;
+            case 2:
+                dst += snprintf(dst, dst_end - dst,
+                                spec, fields[0], fields[1], arg);
+                break;
+            }
+        }
+        else
+        {
+            intptr_t arg = recorder_record_value(&record, arg_index++);
+            if (is_inline)
+                arg = (intptr_t) recorder_record_text(&record, text_buffer,
+                                                      sizeof(text_buffer));
+            if (is_string && arg == 0)
+                arg = (intptr_t) "<NULL>";
+            if (recorder_crashing)
+                dst += recorder_safe_format(dst, dst_end - dst, spec,
+                                            fields, field_cnt, arg, 0.0);
+            else switch (field_cnt)
+            {
+            case 0:
+                dst += snprintf(dst, dst_end - dst, spec, arg);
+                break;
+            case 1:
+                dst += snprintf(dst, dst_end - dst, spec, fields[0], arg);
+                break;
+            case 2:
+                dst += snprintf(dst, dst_end - dst,
+                                spec, fields[0], fields[1], arg);
+                break;
+            }
+        }
+    }
+    // Check if snprintf returned a value beyond the buffer
+    if (dst > dst_end)
+        dst = dst_end;
+    if (newline)
+        dst--;
+    *dst = 0;
+
+    // In scalable mode, number entries in the order they are merged
+    if (recorder_merge_numbered)
+        order = recorder_ring_fetch_add(recorder_merge_order, 1);
+
+    // The default format does not need to look for the location again
+    if (format == recorder_format_entry)
+        recorder_format_located(show, output, label, entry->where,
+                                order, entry->timestamp, buffer,
+                                parsed->location <= dst - buffer
+                                ? parsed->location : -1);
+    else
+        format(show, output, label,
+               entry->where, order, entry->timestamp, buffer);
+    indent = nextindent;
+}
+
+
+
+// ============================================================================
+//
+//    Default output prints things to stderr
+//
+// ============================================================================
+
+// File descriptor for recorder_output, computed ahead of time for crashes
+static int recorder_output_fd = 2;
+
+
+static int recorder_output_file(void *file_arg)
+// ----------------------------------------------------------------------------
+//   Return the file descriptor for an output, either a FILE * or a small fd
+// ----------------------------------------------------------------------------
+{
+    return file_arg >= (void *) 0x100
+        ? fileno((FILE *) file_arg)
+        : file_arg
+        ? (int) (intptr_t) file_arg
+        : 2;
+}
+
+
+void *recorder_configure_output(void *output)
+// ----------------------------------------------------------------------------
+//   Configure the output stream
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Configure output %p from %p", output, recorder_output);
+    void *previous = recorder_output;
+    recorder_output_fd = recorder_output_file(output);
+    recorder_output = output;
+    return previous;
+}
+
+
+static unsigned recorder_print(const char *ptr, size_t len, void *file_arg)
+// ----------------------------------------------------------------------------
+//   The default printing function - prints to standard error
+// ----------------------------------------------------------------------------
+//   This uses 'write' in order to avoid buffered output, which proves
+//   unreliable on the alternate stack (sigaltstack) because it uses malloc
+{
+    int fd = file_arg == recorder_output
+        ? recorder_output_fd
+        : recorder_output_file(file_arg);
+    return (unsigned) write(fd, ptr, len) + write(fd, "\n", 1);
+}
+
+
+// Buffer for recorder_print_buffered, used by one dumping thread at a time
+static struct recorder_batch
+{
+    unsigned    owned;                          // Claimed by a thread
+    int         fd;                             // Where buffer goes
+    size_t      used;                           // Bytes in buffer
+    char        buffer[64 * 1024];              // Formatted lines
+} recorder_batch = { 0, 2, 0, { 0 } };
+
+// Nesting of dumps in the current thread, and whether it owns the batch
+static RECORDER_THREAD_LOCAL unsigned recorder_batch_depth = 0;
+static RECORDER_THREAD_LOCAL bool     recorder_batch_owner = false;
+
+
+static void recorder_batch_flush(void)
+// ----------------------------------------------------------------------------
+//   Write the lines buffered by the current thread and release the buffer
+// ----------------------------------------------------------------------------
+{
+    if (!recorder_batch_owner)
+        return;
+
+    const char *ptr = recorder_batch.buffer;
+    size_t      len = recorder_batch.used;
+    while (len)
+    {
+        ssize_t written = write(recorder_batch.fd, ptr, len);
+        if (written <= 0)
+            break;
+        ptr += written;
+        len -= written;
+    }
+    recorder_batch.used = 0;
+    recorder_batch_owner = false;
+    __atomic_store_n(&recorder_batch.owned, 0, __ATOMIC_RELEASE);
+}
+
+
+static inline void recorder_batch_begin(void)
+// ----------------------------------------------------------------------------
+//   Start a dump, during which recorder_print_buffered may buffer lines
+// ----------------------------------------------------------------------------
+{
+    recorder_batch_depth++;
+}
+
+
+static inline void recorder_batch_end(void)
+// ----------------------------------------------------------------------------
+//   End a dump, write buffered lines when leaving the outermost one
+// ----------------------------------------------------------------------------
+{
+    if (!--recorder_batch_depth)
+        recorder_batch_flush();
+}
+
+
+unsigned recorder_print_buffered(const char *ptr, size_t len, void *file_arg)
 // ----------------------------------------------------------------------------
+//   Like recorder_print, but write lines in batches while dumping
+// ----------------------------------------------------------------------------
+//   Lines are copied in a static buffer, written when full and at the end
+//   of each dump. Traces outside of dumps and lines of other threads
+//   dumping at the same time are written immediately. When crashing,
+//   lines are also written immediately, in case the dump crashes.
+{
+    int fd = file_arg == recorder_output
+        ? recorder_output_fd
+        : recorder_output_file(file_arg);
+
+    // Write what was buffered if this line does not fit
+    if (recorder_batch_owner &&
+        (recorder_crashing || fd != recorder_batch.fd ||
+         recorder_batch.used + len + 1 > sizeof(recorder_batch.buffer)))
+        recorder_batch_flush();
+
+    if (!recorder_batch_owner && recorder_batch_depth && !recorder_crashing &&
+        len + 1 <= sizeof(recorder_batch.buffer))
+    {
+        unsigned owned = 0;
+        if (recorder_ring_compare_exchange(recorder_batch.owned, owned, 1))
+        {
+            recorder_batch_owner = true;
+            recorder_batch.fd = fd;
+        }
+    }
+
+    if (recorder_batch_owner)
+    {
+        char *dst = recorder_batch.buffer + recorder_batch.used;
+        memcpy(dst, ptr, len);
+        dst[len] = '\n';
+        recorder_batch.used += len + 1;
+        return (unsigned) (len + 1);
+    }
+    return (unsigned) write(fd, ptr, len) + write(fd, "\n", 1);
+}
+
+
+recorder_show_fn  recorder_configure_show(recorder_show_fn show)
+// ----------------------------------------------------------------------------
+//   Configure the function used to output data to the stream
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Configure show %p from %p", show, recorder_show);
+    recorder_show_fn previous = recorder_show;
+    recorder_show = show;
+    return previous;
+}
+
+
+
+// ============================================================================
+//
+//    Default format for recorder entries
+//
+// ============================================================================
+
+// Truly shocking that Visual Studio before 2015 does not have a working
+// snprintf or vsnprintf. Note that the proposed replacements are not accurate
+// since they return -1 on overflow instead of the length that would have
+// been written as the standard mandates.
+// http://stackoverflow.com/questions/2915672/snprintf-and-visual-studio-2010.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#  define snprintf  _snprintf
+#endif
+
+static void recorder_format_entry(recorder_show_fn show,
+                                  void *output,
+                                  const char *label,
+                                  const char *function_name,
+                                  uintptr_t order,
+                                  uintptr_t timestamp,
+                                  const char *message)
+// ----------------------------------------------------------------------------
+//   Default formatting for the entries
+// ----------------------------------------------------------------------------
+{
+    recorder_format_located(show, output, label, function_name,
+                            order, timestamp, message, -1);
+}
+
+
+static void recorder_format_located(recorder_show_fn show,
+                                    void *output,
+                                    const char *label,
+                                    const char *function_name,
+                                    uintptr_t order,
+                                    uintptr_t timestamp,
+                                    const char *message,
+                                    int location)
+// ----------------------------------------------------------------------------
+//   Default formatting, with the length of the file:line: prefix if known
+// ----------------------------------------------------------------------------
+//   This does not use snprintf, so that it can be used from a signal handler
+{
+    char buffer[256];
+    recorder_text_buffer b = { buffer, buffer + sizeof buffer };
+
+    // Look for file:line: in the input message
+    const char *end_of_fileline = message;
+    if (location >= 0)
+    {
+        end_of_fileline += location;
+    }
+    else
+    {
+        for (int colon = 0; colon < 2; colon++)
+            while (*end_of_fileline && *end_of_fileline++ != ':')
+                /* Empty */;
+    }
+    if (*end_of_fileline == 0)       // Play it ultra-safe
+        end_of_fileline = message;
+
+    int size = (int) RECORDER_TWEAK(recorder_location);
+    if (size)
+    {
+        int fileline_size = (int) (end_of_fileline - message);
+        recorder_put_string(&b, message, size != 1 ? size : 0, fileline_size);
+    }
+    message = end_of_fileline;
+
+    size = (int) RECORDER_TWEAK(recorder_function);
+    if (size)
+    {
+        recorder_put_string(&b, function_name, size != 1 ? size : 0, -1);
+        recorder_put_char(&b, ':');
+    }
+
+    char spacing = '[';
+
+    if (RECORDER_TWEAK(recorder_order))
+    {
+        recorder_put_char(&b, spacing);
+        recorder_put_decimal(&b, (intptr_t) order, 0);
+        spacing = ' ';
+    }
+
+    if (RECORDER_TWEAK(recorder_abstime))
+    {
+        uintptr_t abstime = timestamp + recorder_time_at_start;
+        const uintptr_t minute = (uintptr_t) 60 * RECORDER_HZ;
+        uintptr_t minutes = abstime / minute;
+        uintptr_t seconds = abstime % minute;
+        int precision = (int) RECORDER_TWEAK(recorder_time_precision);
+
+        recorder_put_char(&b, spacing);
+        recorder_put_decimal(&b, minutes / 60, 2);
+        recorder_put_char(&b, ':');
+        recorder_put_decimal(&b, minutes % 60, 2);
+        recorder_put_char(&b, ':');
+        recorder_put_seconds(&b, seconds, precision + 3, precision);
+        spacing = ' ';
+    }
+
+    if (RECORDER_TWEAK(recorder_reltime))
+    {
+        recorder_put_char(&b, spacing);
+        recorder_put_seconds(&b, timestamp, 0,
+                             (int) RECORDER_TWEAK(recorder_time_precision));
+        spacing = ' ';
+    }
+
+    if (spacing != '[')
+        recorder_put_text(&b, "] ", 2);
+
+    if (RECORDER_TWEAK(recorder_indent))
+    {
+        unsigned i = indent % RECORDER_TWEAK(recorder_indent);
+        unsigned n = indent / RECORDER_TWEAK(recorder_indent);
+        if (n)
+        {
+            recorder_put_char(&b, '(');
+            recorder_put_decimal(&b, n, 0);
+            recorder_put_char(&b, ')');
+        }
+        while (i--)
+            recorder_put_char(&b, ' ');
+    }
+    recorder_put_string(&b, label, 0, -1);
+    recorder_put_text(&b, ": ", 2);
+    recorder_put_string(&b, message, 0, -1);
+
+    show(buffer, b.dst - buffer, output);
+}
+
+
+recorder_format_fn recorder_configure_format(recorder_format_fn format)
+// ----------------------------------------------------------------------------
+//   Configure the function used to format entries
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Configure format %p from %p", format, recorder_format);
+    recorder_format_fn previous = recorder_format;
+    recorder_format = format;
+    return previous;
+}
+
+
+recorder_type_fn recorder_configure_type(uint8_t id,
+                                         recorder_type_fn type)
+// ----------------------------------------------------------------------------
+//    Register a formatting function for specific data types
+// ----------------------------------------------------------------------------
+{
+    recorder_type_fn previous = recorder_types[id];
+    record(recorder, "Configure type '%c' to %p from %p", id, type, previous);
+    recorder_types[id] = type;
+    recorder_ring_fetch_add(recorder_parsed_shared.generation, 1);
+    recorder_ring_fetch_add(recorder_string_masks_generation, 1);
+    return previous;
+}
+
+
+static recorder_entry *recorder_peek(recorder_ring_p ring)
+// ----------------------------------------------------------------------------
+//   Peek the next entry that would be read in the ring and advance by 1
+// ----------------------------------------------------------------------------
+{
+    recorder_entry *data      = (recorder_entry *) (ring + 1);
+    const size_t    size      = ring->size;
+    ringidx_t       reader    = ring->reader;
+    ringidx_t       commit    = ring->commit;
+    size_t          written   = commit - reader;
+    if (written >= size)
+    {
+        ringidx_t minR = commit - size + 1;
+        ringidx_t skip = minR - reader;
+        recorder_ring_add_fetch(ring->overflow, skip);
+        reader = recorder_ring_add_fetch(ring->reader, skip);
+        written = commit - reader;
+    }
+    return written ? data + (reader & (size - 1)) : NULL;
+}
+
+
+typedef void (*recorder_merge_fn)(recorder_info  *rec,
+                                  recorder_ring_p ring,
+                                  recorder_entry *entry,
+                                  void           *arg);
+
+
+typedef struct recorder_merge_node
+// ----------------------------------------------------------------------------
+//   A ring in the merge heap, keyed by the order of its next entry
+// ----------------------------------------------------------------------------
+{
+    uintptr_t           order;
+    recorder_info      *rec;
+    recorder_ring_p     ring;
+} recorder_merge_node;
+
+
+static void recorder_merge_sift(recorder_merge_node *heap,
+                                unsigned count, unsigned index)
+// ----------------------------------------------------------------------------
+//   Move the node at 'index' down the heap until it is in order
+// ----------------------------------------------------------------------------
+{
+    recorder_merge_node node = heap[index];
+    for (;;)
+    {
+        unsigned child = 2 * index + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && heap[child + 1].order < heap[child].order)
+            child++;
+        if (node.order <= heap[child].order)
+            break;
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = node;
+}
+
+
+static unsigned recorder_merge_linear(const char *what, pattern_t *re,
+                                      recorder_merge_fn emit, void *arg)
+// ----------------------------------------------------------------------------
+//   Emit all entries by scanning all rings for each entry
+// ----------------------------------------------------------------------------
+//   This is slower than the heap, but does not allocate memory, so it is
+//   used when the heap cannot be allocated, notably while crashing
+{
+    recorder_entry *entry;
+    unsigned        dumped = 0;
+
+    for (;;)
+    {
+        uintptr_t       lowest_order = ~0UL;
+        recorder_entry *lowest_entry = NULL;
+        recorder_info  *lowest_rec   = NULL;
+        recorder_ring_p lowest_ring  = NULL;
+        recorder_info  *rec;
+
+        for (rec = recorder_first(); rec; rec = rec->next)
+        {
+            // Skip recorders that don't match the pattern
+            if (what && !pattern_match(re, rec->name))
+                continue;
+
+            // Loop on all rings for sharded recorders
+            unsigned r, rings = recorder_ring_count(rec);
+            for (r = 0; r < rings; r++)
+            {
+                // Check if this ring is readable and has the next order
+                recorder_ring_p ring = recorder_shard_ring(rec, r);
+                entry = recorder_peek(ring);
+                if (entry)
+                {
+                    uintptr_t order = entry->order;
+                    if (order < lowest_order)
+                    {
+                        lowest_rec = rec;
+                        lowest_ring = ring;
+                        lowest_order = order;
+                        lowest_entry = entry;
+                    }
+                }
+            }
+        }
+
+        if (!lowest_rec)
+            break;
+
+        recorder_ring_fetch_add(lowest_ring->reader, 1);
+        emit(lowest_rec, lowest_ring, lowest_entry, arg);
+        dumped++;
+    }
+
+    return dumped;
+}
+
+
+static unsigned recorder_merge_heap(recorder_merge_node *heap, unsigned count,
+                                    recorder_merge_fn emit, void *arg)
+// ----------------------------------------------------------------------------
+//   Emit the entries of the rings in the heap, sorted by 'order'
+// ----------------------------------------------------------------------------
+{
+    recorder_entry *entry;
+    unsigned        dumped = 0;
+    unsigned        r;
+
+    for (r = count / 2; r-- > 0; )
+        recorder_merge_sift(heap, count, r);
+
+    // Emit the lowest entry, then update its ring in the heap
+    while (count)
+    {
+        recorder_ring_p ring = heap[0].ring;
+        entry = recorder_peek(ring);
+        if (!entry)
+        {
+            heap[0] = heap[--count];
+        }
+        else if (entry->order != heap[0].order)
+        {
+            // The entry was overwritten by a writer since we peeked
+            heap[0].order = entry->order;
+        }
+        else
+        {
+            recorder_ring_fetch_add(ring->reader, 1);
+            emit(heap[0].rec, ring, entry, arg);
+            dumped++;
+
+            entry = recorder_peek(ring);
+            if (entry)
+                heap[0].order = entry->order;
+            else
+                heap[0] = heap[--count];
+        }
+        if (count)
+            recorder_merge_sift(heap, count, 0);
+    }
+    return dumped;
+}
+
+
+static void recorder_parsed_report(void)
+// ----------------------------------------------------------------------------
+//   Record the number of formats that could not be cached since last report
+// ----------------------------------------------------------------------------
+//   This is not recorded while parsing, since it would parse another format
+{
+    static uintptr_t reported = 0;
+    uintptr_t        uncached = recorder_parsed_uncached;
+    uintptr_t        shown    = reported;
+    if (uncached == shown ||
+        !recorder_ring_compare_exchange(reported, shown, uncached))
+        return;
+    record(recorder_warning,
+           "Format cache full, parsed %lu formats again (%lu total)",
+           (unsigned long) (uncached - shown), (unsigned long) uncached);
+}
+
+
+static void recorder_sampling_report(const char *what, pattern_t *re)
+// ----------------------------------------------------------------------------
+//   Record the number of records dropped by sampling in dumped recorders
+// ----------------------------------------------------------------------------
+//   Records dropped by other threads are counted when they keep a record
+{
+    recorder_info *rec;
+    unsigned       s;
+
+    for (s = 0; s < RECORDER_SAMPLERS; s++)
+    {
+        recorder_sampler *sampler = &recorder_samplers[s];
+        if (sampler->dropped)
+        {
+            recorder_ring_fetch_add(sampler->rec->sampling.dropped,
+                                    sampler->dropped);
+            sampler->dropped = 0;
+        }
+    }
+
+    for (rec = recorder_first(); rec; rec = rec->next)
+    {
+        if (what && !pattern_match(re, rec->name))
+            continue;
+        uintptr_t dropped = rec->sampling.dropped;
+        uintptr_t shown = rec->sampling.reported;
+        if (dropped == shown ||
+            !recorder_ring_compare_exchange(rec->sampling.reported,
+                                            shown, dropped))
+            continue;
+        uintptr_t args[] = { dropped - shown, dropped, 0, 0 };
+        recorder_append_entry(rec, RECORDER_SOURCE_FUNCTION,
+                              RECORDER_SOURCE_LOCATION
+                              "Dropped %lu records by sampling (%lu total)",
+                              false, 4, args);
+    }
+}
+
+
+static unsigned recorder_merge(const char *what,
+                               recorder_merge_fn emit, void *arg)
+// ----------------------------------------------------------------------------
+//   Emit all entries, sorted by their global 'order' field
+// ----------------------------------------------------------------------------
+//   This is a k-way merge using a min-heap of the readable rings, so that
+//   the cost is O(entries * log(rings)) instead of O(entries * rings).
+//   The pattern is only matched once per recorder, when building the heap.
+{
+    recorder_merge_node *heap   = NULL;
+    recorder_entry      *entry;
+    recorder_info       *rec;
+    unsigned             dumped = 0;
+    unsigned             count  = 0;
+    unsigned             rings  = 0;
+    unsigned             r;
+    uintptr_t            start  = recorder_stats_interval ? recorder_tick() : 0;
+
+    pattern_t re;
+    int status = what ? pattern_comp(&re, what) : 0;
+    if (status)
+        return 0;
+
+    recorder_ring_fetch_add(recorder_dumping, 1);
+    recorder_merge_numbered = RECORDER_TWEAK(recorder_scalable_order) != 0;
+    recorder_batch_begin();
+    recorder_parsed_report();
+    recorder_sampling_report(what, &re);
+
+    // Count the rings to allocate the heap, avoiding malloc when crashing
+    if (!recorder_crashing)
+    {
+        for (rec = recorder_first(); rec; rec = rec->next)
+            rings += recorder_ring_count(rec);
+        heap = malloc(rings * sizeof(recorder_merge_node) + 1);
+    }
+
+    if (!heap)
+    {
+        dumped = recorder_merge_linear(what, &re, emit, arg);
+    }
+    else
+    {
+        // Insert readable rings for recorders that match the pattern
+        for (rec = recorder_first(); rec && count < rings; rec = rec->next)
+        {
+            if (what && !pattern_match(&re, rec->name))
+                continue;
+            unsigned rec_rings = recorder_ring_count(rec);
+            for (r = 0; r < rec_rings && count < rings; r++)
+            {
+                recorder_ring_p ring = recorder_shard_ring(rec, r);
+                entry = recorder_peek(ring);
+                if (entry)
+                {
+                    recorder_merge_node node = { entry->order, rec, ring };
+                    heap[count++] = node;
+                }
+            }
+        }
+        dumped = recorder_merge_heap(heap, count, emit, arg);
+        free(heap);
+    }
+
+    recorder_batch_end();
+    recorder_merge_numbered = false;
+    recorder_ring_fetch_add(recorder_dumping, -1);
+
+    if (what)
+        pattern_free(&re);
+
+    if (start)
+    {
+        recorder_ring_fetch_add(recorder_stats_dumps, 1);
+        recorder_ring_fetch_add(recorder_stats_dump_ticks,
+                                recorder_tick() - start);
+    }
+
+    return dumped;
+}
+
+
+typedef struct recorder_text
+// ----------------------------------------------------------------------------
+//   Arguments for emitting entries as text
+// ----------------------------------------------------------------------------
+{
+    recorder_format_fn  format;
+    recorder_show_fn    show;
+    void               *output;
+} recorder_text;
+
+
+static void recorder_merge_text(recorder_info  *rec,
+                                recorder_ring_p ring,
+                                recorder_entry *entry,
+                                void           *arg)
+// ----------------------------------------------------------------------------
+//   Emit an entry as text
+// ----------------------------------------------------------------------------
+{
+    recorder_text *text = arg;
+    recorder_dump_entry(rec, ring, entry, text->format, text->show, text->output);
+}
+
+
+unsigned recorder_sort(const char *what,
+                       recorder_format_fn format,
+                       recorder_show_fn show, void *output)
+// ----------------------------------------------------------------------------
+//   Dump all entries, sorted by their global 'order' field
+// ----------------------------------------------------------------------------
+{
+    recorder_text text = { format, show, output };
+    return recorder_merge(what, recorder_merge_text, &text);
+}
+
+
+unsigned recorder_dump(void)
+// ----------------------------------------------------------------------------
+//   Dump all entries, sorted by their global 'order' field
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Recorder dump");
+    if (recorder_binary_output >= 0)
+        return recorder_binary_sort(NULL, recorder_binary_output);
+    return recorder_sort(NULL, recorder_format,recorder_show,recorder_output);
+}
+
+
+unsigned recorder_dump_for(const char *what)
+// ----------------------------------------------------------------------------
+//   Dump all entries for recorder with names matching 'what'
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Recorder dump for %+s", what);
+    if (recorder_binary_output >= 0)
+        return recorder_binary_sort(what, recorder_binary_output);
+    return recorder_sort(what, recorder_format,recorder_show,recorder_output);
+}
+
+
+recorder_info *recorder_list(void)
+// ----------------------------------------------------------------------------
+//   Return the list of recorders
+// ----------------------------------------------------------------------------
+{
+    return recorder_first();
+}
+
+
+unsigned recorder_indent(void)
+// ----------------------------------------------------------------------------
+//   Return the current recorder indent level
+// ----------------------------------------------------------------------------
+{
+    return indent;
+};
+
+
+
+// ============================================================================
+//
+//    Snapshots
+//
+// ============================================================================
+//  A snapshot copies the rings of the selected recorders with one memcpy
+//  per ring, so that the entries can be formatted later, e.g. in a low
+//  priority thread, while writers keep using the rings. After the copy,
+//  the writer index tells which entries may have been overwritten while
+//  copying, and those are left out of the snapshot.
+
+typedef struct recorder_snapshot_ring
+// ----------------------------------------------------------------------------
+//   A copy of one ring in a snapshot
+// ----------------------------------------------------------------------------
+{
+    recorder_info      *rec;
+    recorder_ring_p     ring;           // Copy, followed by its entries
+    ringidx_t           start;          // First entry in the copy
+} recorder_snapshot_ring;
+
+
+struct recorder_snapshot
+// ----------------------------------------------------------------------------
+//   The copied rings, followed by the merge heap and the ring copies
+// ----------------------------------------------------------------------------
+{
+    unsigned                    count;
+    recorder_merge_node        *heap;
+    recorder_snapshot_ring      rings[0];
+};
+
+
+static void recorder_snapshot_copy(recorder_snapshot_ring *copy,
+                                   recorder_info *rec,
+                                   recorder_ring_p ring,
+                                   recorder_ring_p target)
+// ----------------------------------------------------------------------------
+//   Copy a ring, keeping only entries that were not overwritten meanwhile
+// ----------------------------------------------------------------------------
+{
+    size_t    size   = ring->size;
+    ringidx_t commit = __atomic_load_n(&ring->commit, __ATOMIC_ACQUIRE);
+    memcpy(target + 1, ring + 1, size * sizeof(recorder_entry));
+
+    // Keep the reads of the copy from moving after the load of the writer
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    ringidx_t writer = __atomic_load_n(&ring->writer, __ATOMIC_RELAXED);
+
+    // A writer that reserved index w during the copy overwrote w - size.
+    // Like recorder_peek, also leave out the oldest entry in a full ring
+    ringidx_t start = writer >= size ? writer - size + 1 : 0;
+    if (start > commit)
+        start = commit;
+
+    target->size = size;
+    target->item_size = sizeof(recorder_entry);
+    target->flags = 0;
+    target->reader = start;
+    target->writer = commit;
+    target->commit = commit;
+    target->overflow = 0;
+
+    copy->rec = rec;
+    copy->ring = target;
+    copy->start = start;
+}
+
+
+recorder_snapshot_p recorder_snapshot(const char *what)
+// ----------------------------------------------------------------------------
+//   Copy the entries of recorders with names matching 'what'
+// ----------------------------------------------------------------------------
+//   Entries are copied whether they were already dumped or not, and the
+//   rings are left unchanged.
+{
+    recorder_snapshot_p snapshot;
+    recorder_info      *rec;
+    unsigned            rings = 0;
+    size_t              bytes = 0;
+    unsigned            r;
+
+    pattern_t re;
+    int status = what ? pattern_comp(&re, what) : 0;
+    if (status)
+    {
+        record(recorder_warning, "Invalid snapshot pattern %s", what);
+        return NULL;
+    }
+
+    for (rec = recorder_first(); rec; rec = rec->next)
+    {
+        if (what && !pattern_match(&re, rec->name))
+            continue;
+        unsigned rec_rings = recorder_ring_count(rec);
+        for (r = 0; r < rec_rings; r++)
+            bytes += sizeof(recorder_ring_t) +
+                recorder_shard_ring(rec, r)->size * sizeof(recorder_entry);
+        rings += rec_rings;
+    }
+
+    size_t header = sizeof(struct recorder_snapshot) +
+        rings * (sizeof(recorder_snapshot_ring) + sizeof(recorder_merge_node));
+    snapshot = malloc(header + bytes);
+    if (snapshot)
+    {
+        char *next = (char *) snapshot + header;
+        char *last = next + bytes;
+        snapshot->count = 0;
+        snapshot->heap = (recorder_merge_node *) &snapshot->rings[rings];
+
+        // Recorders activated meanwhile are inserted at the head of the list
+        for (rec = recorder_first();
+             rec && snapshot->count < rings;
+             rec = rec->next)
+        {
+            if (what && !pattern_match(&re, rec->name))
+                continue;
+            unsigned rec_rings = recorder_ring_count(rec);
+            for (r = 0; r < rec_rings && snapshot->count < rings; r++)
+            {
+                recorder_ring_p ring = recorder_shard_ring(rec, r);
+                size_t ring_bytes = sizeof(recorder_ring_t) +
+                    ring->size * sizeof(recorder_entry);
+                if (next + ring_bytes > last)
+                    break;
+                recorder_snapshot_copy(&snapshot->rings[snapshot->count++],
+                                       rec, ring, (recorder_ring_p) next);
+                next += ring_bytes;
+            }
+        }
+        record(recorder, "Snapshot %p of %u rings for %+s",
+               snapshot, snapshot->count, what ? what : "all recorders");
+    }
+
+    if (what)
+        pattern_free(&re);
+    return snapshot;
+}
+
+
+unsigned recorder_snapshot_sort(recorder_snapshot_p snapshot,
+                                recorder_format_fn format,
+                                recorder_show_fn show, void *output)
+// ----------------------------------------------------------------------------
+//   Dump the entries of a snapshot, sorted by their 'order' field
+// ----------------------------------------------------------------------------
+//   The snapshot is not modified, so it can be dumped multiple times
+{
+    recorder_text text  = { format, show, output };
+    unsigned      count = 0;
+    unsigned      dumped;
+    unsigned      r;
+
+    if (!snapshot)
+        return 0;
+
+    recorder_ring_fetch_add(recorder_dumping, 1);
+    recorder_merge_numbered = RECORDER_TWEAK(recorder_scalable_order) != 0;
+    recorder_batch_begin();
+    for (r = 0; r < snapshot->count; r++)
+    {
+        recorder_snapshot_ring *copy = &snapshot->rings[r];
+        copy->ring->reader = copy->start;
+        recorder_entry *entry = recorder_peek(copy->ring);
+        if (entry)
+        {
+            recorder_merge_node node = { entry->order, copy->rec, copy->ring };
+            snapshot->heap[count++] = node;
+        }
+    }
+    dumped = recorder_merge_heap(snapshot->heap, count,
+                                 recorder_merge_text, &text);
+    recorder_batch_end();
+    recorder_merge_numbered = false;
+    recorder_ring_fetch_add(recorder_dumping, -1);
+    return dumped;
+}
+
+
+unsigned recorder_snapshot_dump(recorder_snapshot_p snapshot)
+// ----------------------------------------------------------------------------
+//   Dump the entries of a snapshot like recorder_dump()
+// ----------------------------------------------------------------------------
+{
+    return recorder_snapshot_sort(snapshot,
+                                  recorder_format, recorder_show,
+                                  recorder_output);
+}
+
+
+void recorder_snapshot_delete(recorder_snapshot_p snapshot)
+// ----------------------------------------------------------------------------
+//   Free the memory used by a snapshot
+// ----------------------------------------------------------------------------
+{
+    free(snapshot);
+}
+
+
+
+// ============================================================================
+//
+//    Binary dump
+//
+// ============================================================================
+//  A binary dump is a sequence of chunks, each starting with a chunk header.
+//  Each dump starts with a header chunk describing the dumped process.
+//  It is followed by:
+//  - String chunks giving the text at some address in the dumped process,
+//    for format strings, function names and safe (%+s) string arguments,
+//  - Recorder chunks giving the name of the recorder at some address,
+//  - Entry chunks containing the raw entries for one record, i.e. one
+//    recorder_entry followed by its continuation entries if any.
+//  String and recorder chunks are written before the entries using them.
+//  Entries are written in order, so that decoding requires no sorting.
+//  Binary dumps can be concatenated, e.g. when using 'output_binary'.
+
+enum
+{
+    RECORDER_BINARY_MAGIC       = 0x4E494252,   // "RBIN"
+    RECORDER_BINARY_VERSION     = RECORDER_VERSION(1,1,0),
+    RECORDER_BINARY_STRING      = 'S',
+    RECORDER_BINARY_RECORDER    = 'R',
+    RECORDER_BINARY_ENTRY       = 'E',
+
+    RECORDER_BINARY_KNOWN       = 1024, // Addresses remembered during a dump
+    RECORDER_BINARY_BUFFER      = 4096, // Size of the output buffer
+    RECORDER_BINARY_ARG_MAX     = 255,  // Longest string argument written
+    RECORDER_BINARY_TEXT_MAX    = 65535,// Longest format or name written
+    RECORDER_BINARY_SLOTS       = RECORDER_RECORD_SLOTS
+};
+
+
+typedef struct recorder_binary_chunk
+// ----------------------------------------------------------------------------
+//   Header for each chunk in a binary dump
+// ----------------------------------------------------------------------------
+{
+    uint32_t    kind;                   // Kind of chunk
+    uint32_t    size;                   // Size of data following the header
+    uint64_t    id;                     // Address in the dumped process
+} recorder_binary_chunk;
+
+
+typedef struct recorder_binary_header
+// ----------------------------------------------------------------------------
+//   Data for the header chunk at the beginning of each binary dump
+// ----------------------------------------------------------------------------
+{
+    uint32_t    version;                // Version of the binary format
+    uint16_t    pointer_size;           // Size of pointers in dumped process
+    uint16_t    entry_size;             // Size of a recorder_entry
+    uint64_t    hz;                     // RECORDER_HZ in the dumped process
+    uint64_t    time_at_start;          // Time of day for the first tick
+} recorder_binary_header;
+
+
+typedef struct recorder_binary_writer
+// ----------------------------------------------------------------------------
+//   State while writing a binary dump, preallocated to avoid malloc()
+// ----------------------------------------------------------------------------
+{
+    int         fd;
+    size_t      used;
+    const void *known[RECORDER_BINARY_KNOWN];
+    uint8_t     buffer[RECORDER_BINARY_BUFFER];
+} recorder_binary_writer;
+
+static recorder_binary_writer recorder_binary;
+static unsigned               recorder_binary_busy = 0;
+
+
+static bool recorder_write_all(int fd, const void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Write all the data, retrying after partial writes and interrupts
+// ----------------------------------------------------------------------------
+{
+    const char *ptr = data;
+    while (size)
+    {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return true;
+}
+
+
+static void recorder_binary_flush(recorder_binary_writer *w)
+// ----------------------------------------------------------------------------
+//   Write the buffered data
+// ----------------------------------------------------------------------------
+{
+    if (w->used)
+        recorder_write_all(w->fd, w->buffer, w->used);
+    w->used = 0;
+}
+
+
+static void recorder_binary_append(recorder_binary_writer *w,
+                                   const void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Buffer data to write in the binary dump
+// ----------------------------------------------------------------------------
+{
+    if (w->used + size > sizeof(w->buffer))
+    {
+        recorder_binary_flush(w);
+        if (size > sizeof(w->buffer))
+        {
+            recorder_write_all(w->fd, data, size);
+            return;
+        }
+    }
+    memcpy(w->buffer + w->used, data, size);
+    w->used += size;
+}
+
+
+static void recorder_binary_chunk_write(recorder_binary_writer *w,
+                                        uint32_t kind, const void *id,
+                                        const void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Write a chunk header followed by its data
+// ----------------------------------------------------------------------------
+{
+    recorder_binary_chunk chunk = { kind, (uint32_t) size, (uintptr_t) id };
+    recorder_binary_append(w, &chunk, sizeof(chunk));
+    recorder_binary_append(w, data, size);
+}
+
+
+static void recorder_binary_string(recorder_binary_writer *w,
+                                   uint32_t kind, const void *id,
+                                   const char *text, size_t max)
+// ----------------------------------------------------------------------------
+//   Write a string chunk, limiting its length to 'max' bytes
+// ----------------------------------------------------------------------------
+{
+    size_t len = 0;
+    while (len < max && text[len])
+        len++;
+    recorder_binary_chunk_write(w, kind, id, text, len);
+}
+
+
+static bool recorder_binary_known(recorder_binary_writer *w,
+                                  const void *address)
+// ----------------------------------------------------------------------------
+//   Return true if address was already written, otherwise remember it
+// ----------------------------------------------------------------------------
+//   If there is no room left, the same data will simply be written again
+{
+    uintptr_t hash = ((uintptr_t) address >> 3) * 0x9E3779B1U;
+    unsigned  probe;
+    for (probe = 0; probe < 8; probe++)
+    {
+        const void **known = &w->known[(hash + probe) % RECORDER_BINARY_KNOWN];
+        if (*known == address)
+            return true;
+        if (!*known)
+        {
+            *known = address;
+            return false;
+        }
+    }
+    return false;
+}
+
+
+
+
+static void recorder_binary_entry(recorder_info  *rec,
+                                  recorder_ring_p ring,
+                                  recorder_entry *entry,
+                                  void           *arg)
+// ----------------------------------------------------------------------------
+//   Emit an entry and the strings and recorder it refers to
+// ----------------------------------------------------------------------------
+{
+    recorder_binary_writer *w      = arg;
+    ringidx_t               ready  = ring->commit - ring->reader;
+    const char             *format = entry->format;
+    recorder_record         record;
+
+    // Continuation entries are written with the first entry
+    if (recorder_is_extra(entry))
+        return;
+
+    // Collect the continuation entries that are already committed
+    recorder_record_init(&record, ring, entry);
+    if (record.count > ready)
+        record.count = ready;
+    unsigned count = record.count + 1;
+
+    const char *where = entry->where;
+    if (!recorder_binary_known(w, rec))
+        recorder_binary_string(w, RECORDER_BINARY_RECORDER,
+                               rec, rec->name, RECORDER_BINARY_TEXT_MAX);
+    if (!recorder_binary_known(w, format))
+        recorder_binary_string(w, RECORDER_BINARY_STRING,
+                               format, recorder_format_text(format),
+                               RECORDER_BINARY_TEXT_MAX);
+    if (where && !recorder_binary_known(w, where))
+        recorder_binary_string(w, RECORDER_BINARY_STRING,
+                               where, where, RECORDER_BINARY_TEXT_MAX);
+
+    // String arguments may change between entries, always write them
+    unsigned mask = recorder_string_mask(format, true);
+    unsigned a;
+    for (a = 0; mask; a++, mask >>= 1)
+    {
+        const char *text = (const char *) recorder_record_value(&record, a);
+        if ((mask & 1) && text)
+            recorder_binary_string(w, RECORDER_BINARY_STRING,
+                                   text, text, RECORDER_BINARY_ARG_MAX);
+    }
+
+    recorder_binary_chunk chunk =
+    {
+        RECORDER_BINARY_ENTRY, count * sizeof(recorder_entry), (uintptr_t) rec
+    };
+    recorder_binary_append(w, &chunk, sizeof(chunk));
+    recorder_binary_append(w, entry, sizeof(recorder_entry));
+    for (a = 0; a < record.count; a++)
+        recorder_binary_append(w, record.extra[a], sizeof(recorder_entry));
+}
+
+
+static unsigned recorder_binary_sort(const char *what, int fd)
+// ----------------------------------------------------------------------------
+//   Write a binary dump of all entries matching 'what'
+// ----------------------------------------------------------------------------
+{
+    recorder_binary_writer *w = &recorder_binary;
+    unsigned idle = 0;
+    if (!recorder_ring_compare_exchange(recorder_binary_busy, idle, 1))
+    {
+        record(recorder_warning, "Binary dump already in progress");
+        return 0;
+    }
+
+    w->fd = fd;
+    w->used = 0;
+    memset(w->known, 0, sizeof(w->known));
+
+    recorder_binary_header header =
+    {
+        RECORDER_BINARY_VERSION,
+        sizeof(void *),
+        sizeof(recorder_entry),
+        RECORDER_HZ,
+        recorder_time_at_start
+    };
+    recorder_binary_chunk_write(w, RECORDER_BINARY_MAGIC, NULL,
+                                &header, sizeof(header));
+    unsigned dumped = recorder_merge(what, recorder_binary_entry, w);
+    recorder_binary_flush(w);
+
+    recorder_ring_fetch_add(recorder_binary_busy, -1);
+    return dumped;
+}
+
+
+unsigned recorder_dump_binary(int fd)
+// ----------------------------------------------------------------------------
+//   Write a binary dump of all entries to the given file descriptor
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Recorder binary dump to fd %d", fd);
+    return recorder_binary_sort(NULL, fd);
+}
+
+
+
+// ============================================================================
+//
+//    Decoding binary dumps
+//
+// ============================================================================
+
+typedef struct recorder_decoded
+// ----------------------------------------------------------------------------
+//   A recorder from a decoded binary dump
+// ----------------------------------------------------------------------------
+{
+    struct recorder_decoded *next;
+    uint64_t                 id;
+    recorder_info            info;
+    recorder_entry           data[RECORDER_BINARY_SLOTS];
+} recorder_decoded;
+
+
+typedef struct recorder_decoded_string
+// ----------------------------------------------------------------------------
+//   A string from a decoded binary dump
+// ----------------------------------------------------------------------------
+{
+    uint64_t    id;
+    char       *text;
+} recorder_decoded_string;
+
+
+typedef struct recorder_decoder
+// ----------------------------------------------------------------------------
+//   The state while decoding a binary dump
+// ----------------------------------------------------------------------------
+{
+    recorder_decoded_string *strings;   // Hash table indexed by address
+    size_t                   count;     // Number of strings in table
+    size_t                   capacity;  // Size of table, power of 2
+    recorder_decoded        *recorders; // Recorders in dump
+    recorder_parsed_cache   *formats;   // Parsed formats, NULL if shared
+} recorder_decoder;
+
+
+static recorder_decoded_string *recorder_decoder_slot(recorder_decoder *d,
+                                                      uint64_t id)
+// ----------------------------------------------------------------------------
+//   Find the slot for a given string address in the hash table
+// ----------------------------------------------------------------------------
+{
+    size_t mask = d->capacity - 1;
+    size_t i    = (size_t) ((id >> 3) * 0x9E3779B97F4A7C15ULL) & mask;
+    while (d->strings[i].text && d->strings[i].id != id)
+        i = (i + 1) & mask;
+    return &d->strings[i];
+}
+
+
+static void recorder_decoder_define(recorder_decoder *d,
+                                    uint64_t id, const char *text)
+// ----------------------------------------------------------------------------
+//   Record the text at a given address, replacing any previous text
+// ----------------------------------------------------------------------------
+{
+    if (2 * (d->count + 1) > d->capacity)
+    {
+        recorder_decoded_string *old = d->strings;
+        size_t                   i, capacity = d->capacity;
+        size_t                   grown = capacity ? 2 * capacity : 256;
+        recorder_decoded_string *strings = calloc(grown, sizeof(*strings));
+        if (!strings)
+        {
+            record(recorder_error, "Unable to decode %zu strings", grown / 2);
+            return;
+        }
+        d->strings = strings;
+        d->capacity = grown;
+        for (i = 0; i < capacity; i++)
+            if (old[i].text)
+                *recorder_decoder_slot(d, old[i].id) = old[i];
+        free(old);
+    }
+
+    recorder_decoded_string *slot = recorder_decoder_slot(d, id);
+    if (slot->text && strcmp(slot->text, text) == 0)
+        return;         // Keep the address, which may be a cached format
+    char *copy = strdup(text);
+    if (!copy)
+    {
+        record(recorder_error, "Unable to decode string at %p",
+               (void *) (uintptr_t) id);
+        return;
+    }
+    if (slot->text)
+    {
+        // The freed address may be reused for another cached format
+        recorder_parsed_cache *cache = d->formats
+                                     ? d->formats
+                                     : &recorder_parsed_shared;
+        free(slot->text);
+        recorder_ring_fetch_add(cache->generation, 1);
+    }
+    else
+        d->count++;
+    slot->id = id;
+    slot->text = copy;
+}
+
+
+static const char *recorder_decoder_text(recorder_decoder *d, uint64_t id)
+// ----------------------------------------------------------------------------
+//   Return the text at a given address in the dumped process
+// ----------------------------------------------------------------------------
+{
+    if (!id || !d->capacity)
+        return NULL;
+    return recorder_decoder_slot(d, id)->text;
+}
+
+
+static recorder_decoded *recorder_decoder_recorder(recorder_decoder *d,
+                                                   uint64_t id)
+// ----------------------------------------------------------------------------
+//   Find the recorder at a given address in the dumped process
+// ----------------------------------------------------------------------------
+{
+    recorder_decoded *rec;
+    for (rec = d->recorders; rec; rec = rec->next)
+        if (rec->id == id)
+            return rec;
+    return NULL;
+}
+
+
+static bool recorder_read_all(int fd, void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Read exactly 'size' bytes, return false at end of file or on error
+// ----------------------------------------------------------------------------
+{
+    char *ptr = data;
+    while (size)
+    {
+        ssize_t got = read(fd, ptr, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        ptr += got;
+        size -= got;
+    }
+    return true;
+}
+
+
+static bool recorder_decode_entry(recorder_decoder *d,
+                                  recorder_decoded *rec,
+                                  const recorder_entry *entries,
+                                  unsigned count,
+                                  double scale)
+// ----------------------------------------------------------------------------
+//   Rebuild an entry with pointers to decoded strings, then show it
+// ----------------------------------------------------------------------------
+{
+    recorder_entry *base = (recorder_entry *) (&rec->info.ring + 1);
+    recorder_record record;
+    unsigned        i;
+
+    memcpy(base, entries, count * sizeof(recorder_entry));
+    const char *format = recorder_decoder_text(d, (uintptr_t) base->format);
+    const char *where  = recorder_decoder_text(d, (uintptr_t) base->where);
+    if (!format)
+        return false;
+
+    base->format = format;
+    base->where = where ? where : "";
+    if (scale != 1.0)
+        base->timestamp = (uintptr_t) (base->timestamp * scale);
+
+    // Slots past the record must not look like continuations
+    for (i = count; i < RECORDER_BINARY_SLOTS; i++)
+        base[i].format = "";
+    rec->info.ring.size = RECORDER_BINARY_SLOTS;
+    recorder_record_init(&record, &rec->info.ring, base);
+    unsigned mask = recorder_string_mask(format, true);
+    for (i = 0; mask; i++, mask >>= 1)
+    {
+        uintptr_t *arg = recorder_record_arg(&record, i);
+        if ((mask & 1) && arg)
+            *arg = (uintptr_t) recorder_decoder_text(d, *arg);
+    }
+
+    recorder_dump_entry(&rec->info, &rec->info.ring, base,
+                        recorder_format, recorder_show, recorder_output);
+    return true;
+}
+
+
+unsigned recorder_decode_binary(int fd)
+// ----------------------------------------------------------------------------
+//   Show the entries in a binary dump read from the given file descriptor
+// ----------------------------------------------------------------------------
+{
+    recorder_decoder       d       = { NULL, 0, 0, NULL, NULL };
+    recorder_binary_chunk  chunk;
+    recorder_binary_header header;
+    char                  *payload = NULL;
+    size_t                 room    = 0;
+    unsigned               decoded = 0;
+    bool                   valid   = false;
+    double                 scale   = 1.0;
+    uintptr_t              start   = recorder_time_at_start;
+
+    // Decoded formats are freed at the end, and their addresses reused.
+    // Parse them in a cache for this decode, or invalidate the shared one
+    d.formats = calloc(1, sizeof(recorder_parsed_cache));
+    if (!d.formats)
+        recorder_ring_fetch_add(recorder_parsed_shared.generation, 1);
+    recorder_parsed_decoded = d.formats;
+    recorder_ring_fetch_add(recorder_dumping, 1);
+    recorder_batch_begin();
+    while (recorder_read_all(fd, &chunk, sizeof(chunk)))
+    {
+        // Reject sizes that the dump could not have written
+        size_t size = chunk.size;
+        size_t max  = chunk.kind == RECORDER_BINARY_ENTRY
+            ? RECORDER_BINARY_SLOTS * sizeof(recorder_entry)
+            : RECORDER_BINARY_TEXT_MAX;
+        if (size > max)
+        {
+            record(recorder_error, "Invalid chunk size %zu in binary dump",
+                   size);
+            break;
+        }
+        if (size >= room)
+        {
+            char *grown = realloc(payload, size + 1);
+            if (!grown)
+            {
+                record(recorder_error, "Unable to read %zu bytes of dump",
+                       size);
+                break;
+            }
+            payload = grown;
+            room = size + 1;
+        }
+        if (!recorder_read_all(fd, payload, size))
+        {
+            record(recorder_error, "Truncated binary dump");
+            break;
+        }
+        payload[size] = 0;
+
+        if (chunk.kind == RECORDER_BINARY_MAGIC)
+        {
+            memset(&header, 0, sizeof(header));
+            memcpy(&header, payload,
+                   chunk.size < sizeof(header) ? chunk.size : sizeof(header));
+            valid = (header.version == RECORDER_BINARY_VERSION &&
+                     header.pointer_size == sizeof(void *) &&
+                     header.entry_size == sizeof(recorder_entry) &&
+                     header.hz != 0);
+            if (!valid)
+            {
+                record(recorder_error,
+                       "Unsupported binary dump version %u, "
+                       "pointer size %u, entry size %u",
+                       header.version, header.pointer_size,
+                       header.entry_size);
+                break;
+            }
+            scale = (double) RECORDER_HZ / header.hz;
+            recorder_time_at_start = (uintptr_t) (header.time_at_start*scale);
+        }
+        else if (!valid)
+        {
+            record(recorder_error, "Input is not a recorder binary dump");
+            break;
+        }
+        else if (chunk.kind == RECORDER_BINARY_STRING)
+        {
+            recorder_decoder_define(&d, chunk.id, payload);
+        }
+        else if (chunk.kind == RECORDER_BINARY_RECORDER)
+        {
+            recorder_decoded *rec = recorder_decoder_recorder(&d, chunk.id);
+            if (!rec)
+            {
+                rec = calloc(1, sizeof(recorder_decoded));
+                if (!rec)
+                {
+                    record(recorder_error, "Unable to decode recorder at %p",
+                           (void *) (uintptr_t) chunk.id);
+                    break;
+                }
+                rec->next = d.recorders;
+                rec->id = chunk.id;
+                rec->info.ring.item_size = sizeof(recorder_entry);
+                d.recorders = rec;
+            }
+            free((char *) rec->info.name);
+            rec->info.name = strdup(payload);
+        }
+        else if (chunk.kind == RECORDER_BINARY_ENTRY)
+        {
+            recorder_decoded *rec = recorder_decoder_recorder(&d, chunk.id);
+            unsigned count = chunk.size / sizeof(recorder_entry);
+            if (!rec || !rec->info.name ||
+                count < 1 || count > RECORDER_BINARY_SLOTS ||
+                !recorder_decode_entry(&d, rec, (recorder_entry *) payload,
+                                       count, scale))
+                record(recorder_warning, "Skipping invalid entry in dump");
+            else
+                decoded++;
+        }
+        else
+        {
+            record(recorder_warning, "Skipping unknown chunk kind %u",
+                   chunk.kind);
+        }
+    }
+    recorder_batch_end();
+    recorder_ring_fetch_add(recorder_dumping, -1);
+    recorder_time_at_start = start;
+    recorder_parsed_decoded = NULL;
+
+    // Release the decoder data
+    while (d.recorders)
+    {
+        recorder_decoded *next = d.recorders->next;
+        free((char *) d.recorders->info.name);
+        free(d.recorders);
+        d.recorders = next;
+    }
+    size_t i;
+    for (i = 0; i < d.capacity; i++)
+        free(d.strings[i].text);
+    free(d.strings);
+    free(d.formats);
+    free(payload);
+
+    return decoded;
+}
+
+
+
+// ============================================================================
+//
+//    Implementation of recorder shared memory structures
+//
+// ============================================================================
+
+#define RECORDER_CMD_LEN  1024
+
+// Blocks in shared memory are allocated in size classes, four per power of
+// two starting at RECORDER_SHANS_MIN_BLOCK, so that they waste less than 25%
+#define RECORDER_SHANS_MIN_BLOCK        64
+#define RECORDER_SHANS_CLASSES          (4 * (8 * sizeof(off_t) - 8))
+
+typedef struct recorder_shans
+// ----------------------------------------------------------------------------
+//   Shared-memory information about recorder_chans
+// ----------------------------------------------------------------------------
+//   Readers map the whole 'reserve' when they open the file, and the writer
+//   never moves its own mapping, so growing the file does not invalidate
+//   anybody. Deleting a channel increments 'generation', since its memory
+//   may then be reused for another channel.
+{
+    uint32_t        magic;      // Magic number to check structure type
+    uint32_t        version;    // Version number for shared memory format
+    uint32_t        serial;     // Serial ID for the current channels
+    uint32_t        generation; // Incremented when channels are deleted
+    off_t           head;       // First recorder_chan in linked list
+    off_t           offset;     // Current offset for new blocks
+    off_t           extent;     // Current size of the file
+    off_t           reserve;    // Size of the address space to map
+    uint64_t        epoch;      // System time at tick 0, in RECORDER_HZ
+    uint64_t        origin;     // Value of the tick clock at tick 0
+    uint32_t        clock;      // Tick clock, RECORDER_TICK_xyz
+    uint32_t        reserved;
+    off_t           free_list[RECORDER_SHANS_CLASSES]; // Free blocks by class
+    uint32_t        doorbell;   // Rung when a command is written
+    recorder_ring_t commands;   // Incoming configuration commands
+    char            commands_buffer[RECORDER_CMD_LEN];
+} recorder_shans, *recorder_shans_p;
+
+
+typedef struct recorder_shblock
+// ----------------------------------------------------------------------------
+//   Header preceding each block allocated in shared memory
+// ----------------------------------------------------------------------------
+{
+    uint32_t        size_class; // Size class of the block
+    uint32_t        reserved;
+    off_t           next;       // Next free block in the same size class
+} recorder_shblock, *recorder_shblock_p;
+
+
+typedef struct recorder_shan
+// ----------------------------------------------------------------------------
+//   A named data recorder_chan in shared memory
+// ----------------------------------------------------------------------------
+{
+    recorder_type   type;       // Data type stored in recorder_chan
+    off_t           next;       // Offset to next recorder_chan in linked list
+    off_t           name;       // Offset of name in recorder_shan
+    off_t           description; // Offset of description
+    off_t           unit;       // Offset of measurement unit
+    recorder_data   min;        // Minimum value
+    recorder_data   max;        // Maximum value
+    off_t           columns;    // Offset of shared columns, 0 if none
+    off_t           column;     // Index of value column if columns
+    recorder_ring_t ring;       // Ring data
+} recorder_shan, *recorder_shan_p;
+
+
+typedef struct recorder_shcols
+// ----------------------------------------------------------------------------
+//   Columns shared by the channels exported from the same recorder
+// ----------------------------------------------------------------------------
+//   The ring indexes rows, and its data is the column of time stamps.
+//   It is followed by one column of values for each channel.
+{
+    uint32_t        count;      // Number of value columns
+    uint32_t        users;      // Number of channels using the columns
+    off_t           values;     // Offset of first value column
+    recorder_ring_t ring;       // Ring data, followed by time stamps
+} recorder_shcols, *recorder_shcols_p;
+
+
+typedef struct recorder_chans
+// ----------------------------------------------------------------------------
+//   Information about mapping of shared recorder_chans
+// ----------------------------------------------------------------------------
+{
+    int             fd;         // File descriptor for mmap
+    uint32_t        serial;     // Serial ID to check if still valid
+    uint32_t        generation; // Generation to check if still valid
+    void *          map_addr;   // Address in memory for mmap
+    size_t          map_size;   // Size allocated for mmap
+    recorder_chan_p head;       // First recorder_chan in list
+} recorder_chans_t, *recorder_chans_p;
+
+
+typedef struct recorder_chan
+// ----------------------------------------------------------------------------
+//   Accessing a shared memory recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_chans_p chans;
+    off_t            offset;
+    recorder_chan_p  next;
+} recorder_chan_t, *recorder_chan_p;
+
+
+// Serializes allocation of channels in shared memory and the channel lists,
+// since exports, statistics and the configuration thread all create them
+static pthread_mutex_t recorder_chans_lock = PTHREAD_MUTEX_INITIALIZER;
+static void recorder_chan_remove(recorder_chan_p chan);
+
+// Grow files in 4K chunks (one page), or 2M chunks if using huge pages
+#define MAP_SIZE        4096
+#define MAP_HUGE_SIZE   (2 << 20)
+
+
+static inline recorder_shan_p recorder_shared(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//  Return the recorder_chan shared address
+// ----------------------------------------------------------------------------
+{
+    recorder_chans_p  chans    = chan->chans;
+    char             *map_addr = chans->map_addr;
+    recorder_shan_p   shan     = (recorder_shan_p) (map_addr + chan->offset);
+    return shan;
+}
+
+
+static inline recorder_shcols_p recorder_shan_columns(recorder_shan_p shan)
+// ----------------------------------------------------------------------------
+//   Return the shared columns for a channel, or NULL if interleaved
+// ----------------------------------------------------------------------------
+{
+    return shan->columns
+        ? (recorder_shcols_p) ((char *) shan + shan->columns)
+        : NULL;
+}
+
+
+static inline recorder_ring_p recorder_shan_ring(recorder_shan_p shan)
+// ----------------------------------------------------------------------------
+//   Return the ring indexing the data for a channel
+// ----------------------------------------------------------------------------
+{
+    recorder_shcols_p cols = recorder_shan_columns(shan);
+    return cols ? &cols->ring : &shan->ring;
+}
+
+
+static inline ringidx_t *recorder_shan_reader(recorder_shan_p shan,
+                                              ringidx_t *reader)
+// ----------------------------------------------------------------------------
+//   Return the reader to use for a channel, by default its own
+// ----------------------------------------------------------------------------
+//   Channels sharing columns share their ring, but each keeps a default
+//   reader in its own otherwise unused ring, so that they read all rows.
+{
+    return reader ? reader : &shan->ring.reader;
+}
+
+
+
+// ============================================================================
+//
+//    Interface for the local process
+//
+// ============================================================================
+
+#ifdef HAVE_SYS_MMAN_H
+static bool recorder_shans_file_extend(int fd, off_t new_size)
+// ----------------------------------------------------------------------------
+//    Extend a file to the given size
+// ----------------------------------------------------------------------------
+{
+    return
+        lseek(fd, new_size-1, SEEK_SET) != -1 &&
+        write(fd, "", 1) == 1;
+}
+#endif // HAVE_SYS_MMAN_H
+
+
+recorder_chans_p recorder_chans_new(const char *file)
+// ----------------------------------------------------------------------------
+//   Create a new mmap'd file
+// ----------------------------------------------------------------------------
+{
+#ifndef HAVE_SYS_MMAN_H
+    // Some version of MinGW do not have <sys/mman.h>
+    record(recorder_error,
+           "Cannot create export channels %s on system without mmap",
+           file);
+    return NULL;
+#else // HAVE_SYS_MMAN_H
+    record(recorder, "Create export channels %s", file);
+    printf("Creating new %s\n", file);
+    if (!file)
+    {
+        record(recorder_error, "NULL export file");
+        return NULL;
+    }
+
+    // Open the file
+    int fd = open(file, O_RDWR|O_CREAT|O_TRUNC, (mode_t) 0600);
+    if (fd == -1)
+    {
+        record(recorder_error,
+               "Unable to create exports file %s: %s (%d)",
+               file, strerror(errno), errno);
+        return NULL;
+    }
+
+    // Make sure we have enough space for the data
+    size_t extent = (sizeof(recorder_shans) / MAP_SIZE + 1) * MAP_SIZE;
+    if (!recorder_shans_file_extend(fd, extent))
+    {
+        record(recorder_error,
+               "Unable to create initial mapping for exports file %s: %s (%d)",
+               file, strerror(errno), errno);
+        close(fd);
+        return NULL;
+    }
+
+    // Map the whole reserved space, the file grows within it
+    size_t map_size = RECORDER_TWEAK(recorder_export_reserve);
+    if (map_size < extent)
+        map_size = extent;
+    off_t  offset   = 0;
+    void  *map_addr = mmap(NULL, map_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_FILE | MAP_SHARED,
+                           fd, offset);
+    if (map_addr == MAP_FAILED)
+    {
+        record(recorder_error, "Unable to mmap %s: %s (%d)",
+               file, strerror(errno), errno);
+        close(fd);
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (RECORDER_TWEAK(recorder_export_huge_pages))
+        madvise(map_addr, map_size, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+
+    // Successful: Initialize in-memory recorder_chans list
+    recorder_chans_p chans = malloc(sizeof(recorder_chans_t));
+    chans->fd = fd;
+    chans->map_addr = map_addr;
+    chans->map_size = map_size;
+    chans->head = NULL;
+
+    // Initialize shared-memory data
+    recorder_shans_p shans = map_addr;
+    shans->magic = RECORDER_CHAN_MAGIC;
+    shans->version = RECORDER_CHAN_VERSION;
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    shans->serial = t.tv_usec;
+    shans->generation = 0;
+    shans->head = 0;
+    shans->offset = sizeof(recorder_shans);
+    shans->extent = extent;
+    shans->reserve = map_size;
+    shans->epoch = recorder_tick_reference(&shans->origin, &shans->clock);
+    shans->reserved = 0;
+    memset(shans->free_list, 0, sizeof(shans->free_list));
+    shans->doorbell = 0;
+    chans->serial = shans->serial;
+    chans->generation = shans->generation;
+    recorder_ring_init(&shans->commands,
+                       sizeof(shans->commands_buffer),
+                       sizeof(shans->commands_buffer[0]));
+
+    return chans;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+void recorder_chans_delete(recorder_chans_p chans)
+// ----------------------------------------------------------------------------
+//   Delete the list of exported items from the shared memory area
+// ----------------------------------------------------------------------------
+{
+    int i;
+    recorder_info *rec;
+    for (rec = recorder_first(); rec; rec = rec->next)
+    {
+        if (rec->trace == RECORDER_CHAN_MAGIC)
+            rec->trace = 0;
+        for (i = 0; i < (int) array_size(rec->exported); i++)
+            rec->exported[i] = NULL;
+    }
+
+    recorder_chan_p next = NULL;
+    recorder_chan_p chan;
+    pthread_mutex_lock(&recorder_chans_lock);
+    for (chan = chans->head; chan; chan = next)
+    {
+        next = chan->next;
+        recorder_chan_remove(chan);
+    }
+    pthread_mutex_unlock(&recorder_chans_lock);
+
+    // Wake up a configuration thread that may be waiting for commands
+    recorder_shans_p shans = chans->map_addr;
+    recorder_doorbell_ring(&shans->doorbell, true);
+
+#ifdef HAVE_SYS_MMAN_H
+    munmap(chans->map_addr, chans->map_size);
+#endif // HAVE_SYS_MMAN_H
+    close(chans->fd);
+    free(chans);
+}
+
+
+#ifdef HAVE_SYS_MMAN_H
+static inline size_t recorder_shans_class_size(unsigned size_class)
+// ----------------------------------------------------------------------------
+//   Size of blocks in a size class, including their header
+// ----------------------------------------------------------------------------
+{
+    size_t base = (size_t) RECORDER_SHANS_MIN_BLOCK << (size_class / 4);
+    return base + base / 4 * (size_class % 4);
+}
+
+
+static size_t recorder_shans_allocate(recorder_chans_p chans, size_t alloc)
+// ----------------------------------------------------------------------------
+//   Allocate shared memory, return its offset, or 0 if it failed
+// ----------------------------------------------------------------------------
+//   Blocks freed by recorder_shans_free are reused for the same size class.
+//   Otherwise, the file grows within the address space mapped initially.
+{
+    recorder_shans_p   shans      = chans->map_addr;
+    char              *map_addr   = chans->map_addr;
+    size_t             needed     = alloc + sizeof(recorder_shblock);
+    unsigned           size_class = 0;
+
+    while (size_class < RECORDER_SHANS_CLASSES &&
+           recorder_shans_class_size(size_class) < needed)
+        size_class++;
+    if (size_class >= RECORDER_SHANS_CLASSES)
+    {
+        record(recorder_error, "Cannot allocate %zu bytes for export", alloc);
+        return 0;
+    }
+
+    // Reuse a free block of the right size if there is one
+    recorder_shblock_p block;
+    size_t             offset = shans->free_list[size_class];
+    if (offset)
+    {
+        block = (recorder_shblock_p) (map_addr + offset);
+        shans->free_list[size_class] = block->next;
+        block->next = 0;
+        memset(block + 1, 0, recorder_shans_class_size(size_class)
+               - sizeof(recorder_shblock));
+        return offset + sizeof(recorder_shblock);
+    }
+
+    size_t align = sizeof(long double);
+    offset = (shans->offset + align-1) & ~(align-1);
+    size_t new_offset = offset + recorder_shans_class_size(size_class);
+    if (new_offset > chans->map_size)
+    {
+        record(recorder_error,
+               "Export channels need %zu bytes, more than the %zu reserved",
+               new_offset, chans->map_size);
+        return 0;
+    }
+    if (new_offset > (size_t) shans->extent)
+    {
+        size_t chunk = RECORDER_TWEAK(recorder_export_huge_pages)
+            ? MAP_HUGE_SIZE
+            : MAP_SIZE;
+        size_t extent = (new_offset + chunk - 1) / chunk * chunk;
+        if (extent > chans->map_size)
+            extent = chans->map_size;
+        if (!recorder_shans_file_extend(chans->fd, extent))
+        {
+            record(recorder_error,
+                   "Could not extend mapping to %zu bytes: %s (%d)",
+                   extent, strerror(errno), errno);
+            return 0;
+        }
+        shans->extent = extent;
+    }
+
+    block = (recorder_shblock_p) (map_addr + offset);
+    block->size_class = size_class;
+    block->reserved = 0;
+    block->next = 0;
+    shans->offset = new_offset;
+    return offset + sizeof(recorder_shblock);
+}
+
+
+static void recorder_shans_free(recorder_chans_p chans, size_t offset)
+// ----------------------------------------------------------------------------
+//   Return a block allocated by recorder_shans_allocate to its free list
+// ----------------------------------------------------------------------------
+{
+    recorder_shans_p   shans = chans->map_addr;
+    recorder_shblock_p block;
+
+    offset -= sizeof(recorder_shblock);
+    block = (recorder_shblock_p) ((char *) chans->map_addr + offset);
+    block->next = shans->free_list[block->size_class];
+    shans->free_list[block->size_class] = offset;
+}
+#endif // HAVE_SYS_MMAN_H
+
+
+static recorder_chan_p recorder_chan_create(recorder_chans_p chans,
+                                            recorder_type    type,
+                                            size_t           size,
+                                            const char *     name,
+                                            const char *     description,
+                                            const char *     unit,
+                                            recorder_data    min,
+                                            recorder_data    max)
+// ----------------------------------------------------------------------------
+//    Allocate and create a new recorder_chan, with recorder_chans_lock held
+// ----------------------------------------------------------------------------
+{
+#ifndef HAVE_SYS_MMAN_H
+    record(recorder_error, "recorder_chan_new called on system without mmap");
+    return NULL;
+#else // HAVE_SYS_MMAN_H
+    size = recorder_ring_round_size(size);
+    size_t             item_size   = 2 * sizeof(recorder_data);
+
+    size_t             name_len    = strlen(name);
+    size_t             descr_len   = strlen(description);
+    size_t             unit_len    = strlen(unit);
+
+    size_t             name_offs   = sizeof(recorder_shan) + size*item_size;
+    size_t             descr_offs  = name_offs + name_len + 1;
+    size_t             unit_offs   = descr_offs + descr_len + 1;
+
+    size_t             alloc       = unit_offs + unit_len + 1;
+
+    size_t             offset      = recorder_shans_allocate(chans, alloc);
+    if (!offset)
+        return NULL;
+    recorder_shans_p   shans       = chans->map_addr;
+
+    // Initialize recorder_chan fields
+    recorder_shan_p shan = (recorder_shan_p) ((char *) chans->map_addr+offset);
+    char *base = (char *) shan;
+    shan->type = type;
+    shan->next = shans->head;
+    shan->name = name_offs;
+    shan->description = descr_offs;
+    shan->unit = unit_offs;
+    shan->min = min;
+    shan->max = max;
+    shan->columns = 0;
+    shan->column = 0;
+    memcpy(base + name_offs, name, name_len + 1);
+    memcpy(base + descr_offs, description, descr_len + 1);
+    memcpy(base + unit_offs, unit, unit_len + 1);
+
+    // Initialize ring fields
+    recorder_ring_p ring = &shan->ring;
+    ring->size = size;
+    ring->item_size = item_size;
+    ring->flags = 0;
+    ring->reader = 0;
+    ring->writer = 0;
+    ring->commit = 0;
+    ring->overflow = 0;
+
+    // Link recorder_chan in recorder_chans list
+    shans->head = offset;
+
+    // Create recorder_chan access
+    recorder_chan_p chan = malloc(sizeof(recorder_chan_t));
+    chan->chans = chans;
+    chan->offset = offset;
+    chan->next = chans->head;
+    chans->head = chan;
+
+    return chan;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+recorder_chan_p recorder_chan_new(recorder_chans_p chans,
+                                  recorder_type    type,
+                                  size_t           size,
+                                  const char *     name,
+                                  const char *     description,
+                                  const char *     unit,
+                                  recorder_data    min,
+                                  recorder_data    max)
+// ----------------------------------------------------------------------------
+//    Allocate and create a new recorder_chan
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&recorder_chans_lock);
+    recorder_chan_p chan = recorder_chan_create(chans, type, size, name,
+                                                description, unit, min, max);
+    pthread_mutex_unlock(&recorder_chans_lock);
+    return chan;
+}
+
+
+static size_t recorder_shcols_new(recorder_chans_p chans,
+                                  unsigned count, size_t size)
+// ----------------------------------------------------------------------------
+//   Allocate columns for 'count' channels, return offset or 0 on failure
+// ----------------------------------------------------------------------------
+{
+#ifndef HAVE_SYS_MMAN_H
+    record(recorder_error, "recorder_shcols_new called on system without mmap");
+    return 0;
+#else // HAVE_SYS_MMAN_H
+    size = recorder_ring_round_size(size);
+    size_t column = size * sizeof(recorder_data);
+    size_t alloc  = sizeof(recorder_shcols) + (count + 1) * column;
+    size_t offset = recorder_shans_allocate(chans, alloc);
+    if (!offset)
+        return 0;
+
+    recorder_shcols_p cols = (recorder_shcols_p) ((char *) chans->map_addr +
+                                                  offset);
+    cols->count = count;
+    cols->users = 0;
+    cols->values = sizeof(recorder_shcols) + column;
+
+    recorder_ring_p ring = &cols->ring;
+    ring->size = size;
+    ring->item_size = sizeof(recorder_data);
+    ring->flags = 0;
+    ring->reader = 0;
+    ring->writer = 0;
+    ring->commit = 0;
+    ring->overflow = 0;
+    return offset;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+static void recorder_chan_remove(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Delete a recorder_chan with recorder_chans_lock held
+// ----------------------------------------------------------------------------
+{
+    recorder_chans_p  chans       = chan->chans;
+    char             *map_addr    = chans->map_addr;
+    intptr_t          chan_offset = chan->offset;
+    recorder_shans_p  shans       = (recorder_shans_p) map_addr;
+    off_t            *last        = &shans->head;
+    off_t             offset;
+
+    for (offset = *last; offset; offset = *last)
+    {
+        recorder_shan_p shan = (recorder_shan_p) (map_addr + offset);
+        if (*last == chan_offset)
+        {
+            *last = shan->next;
+
+            // Readers must reopen before the memory gets reused
+            __atomic_add_fetch(&shans->generation, 1, __ATOMIC_RELEASE);
+#ifdef HAVE_SYS_MMAN_H
+            recorder_shcols_p cols = recorder_shan_columns(shan);
+            if (cols && --cols->users == 0)
+                recorder_shans_free(chans, (char *) cols - map_addr);
+            recorder_shans_free(chans, chan_offset);
+#endif // HAVE_SYS_MMAN_H
+            break;
+        }
+        last = &shan->next;
+    }
+
+    recorder_chan_p * last_chan;
+    for (last_chan = &chans->head; *last_chan; last_chan = &(*last_chan)->next)
+    {
+        if (*last_chan == chan)
+        {
+            *last_chan = chan->next;
+            break;
+        }
+    }
+
+    free(chan);
+}
+
+
+void recorder_chan_delete(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Delete a recorder_chan, and its columns if it was their last user
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&recorder_chans_lock);
+    recorder_chan_remove(chan);
+    pthread_mutex_unlock(&recorder_chans_lock);
+}
+
+
+size_t recorder_chan_write(recorder_chan_p chan, const void *ptr, size_t count)
+// ----------------------------------------------------------------------------
+//   Write some data in the recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    if (shan->columns)
+    {
+        record(recorder_error, "Cannot write to column channel %+s",
+               (const char *) shan + shan->name);
+        return 0;
+    }
+    return recorder_ring_write(&shan->ring, ptr, count, NULL, NULL, NULL);
+}
+
+
+size_t recorder_chan_writable(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//    Return number of items that can be written in ring
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return recorder_ring_writable(recorder_shan_ring(shan));
+}
+
+
+ringidx_t recorder_chan_writer(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//    Return current writer index
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return recorder_shan_ring(shan)->writer;
+}
+
+
+
+// ============================================================================
+//
+//    Subscribing to recorder_chans in a remote process
+//
+// ============================================================================
+
+recorder_chans_p recorder_chans_open(const char *file)
+// ----------------------------------------------------------------------------
+//    Map the file in memory, and scan its structure
+// ----------------------------------------------------------------------------
+{
+#ifndef HAVE_SYS_MMAN_H
+    record(recorder_error,
+           "Cannot open export channels %s on system without mmap",
+           file);
+    return NULL;
+#else // HAVE_SYS_MMAN_H
+    record(recorder, "Open export channels %s", file);
+    int fd = open(file, O_RDWR);
+    if (fd == -1)
+    {
+        record(recorder_error,
+               "Unable to open %s for reading: %s (%d)",
+               file, strerror(errno), errno);
+        return NULL;
+    }
+
+    // Check the header before mapping the space reserved by the writer
+    recorder_shans header;
+    ssize_t        got = pread(fd, &header, sizeof(header), 0);
+    if (got < (ssize_t) (sizeof(header.magic) + sizeof(header.version)))
+        header.magic = header.version = 0;
+    if (got != sizeof(header)                   ||
+        header.magic != RECORDER_CHAN_MAGIC     ||
+        header.version != RECORDER_CHAN_VERSION)
+    {
+        if (header.magic == (RECORDER_CHAN_MAGIC ^ RECORDER_64BIT))
+            record(recorder_error,
+                   "Mismatch between 32-bit and 64-bit recorder data");
+        else if (header.magic != RECORDER_CHAN_MAGIC)
+            record(recorder_error,
+                   "Wrong magic number, got %x instead of %x",
+                   header.magic, RECORDER_CHAN_MAGIC);
+        else if (header.version != RECORDER_CHAN_VERSION)
+            record(recorder_error,
+                   "Wrong exports file version, got %x instead of %x",
+                   header.version, RECORDER_CHAN_VERSION);
+        else
+            record(recorder_error, "Truncated exports file %s", file);
+        close(fd);
+        return NULL;
+    }
+
+    // Map the whole space, so that the file can grow while we read it
+    size_t  map_size = header.reserve;
+    off_t   offset   = 0;
+    void   *map_addr = mmap(NULL, map_size,
+                            PROT_READ|PROT_WRITE,
+                            MAP_FILE | MAP_SHARED,
+                            fd, offset);
+    if (map_addr == MAP_FAILED)
+    {
+        record(recorder_error,
+               "Unable to map %s file for reading: %s (%d)",
+               file, strerror(errno), errno);
+        close(fd);
+        return NULL;
+    }
+    recorder_shans_p shans = map_addr;
+
+    // Successful: Initialize with recorder_chan descriptor
+    recorder_chans_p chans = malloc(sizeof(recorder_chans_t));
+    chans->fd = fd;
+    chans->map_addr = map_addr;
+    chans->map_size = map_size;
+
+    int retries = 0;
+    while (retries < 3)
+    {
+        chans->serial = shans->serial;
+        chans->generation = __atomic_load_n(&shans->generation,
+                                            __ATOMIC_ACQUIRE);
+        chans->head = NULL;
+
+        // Create recorder_chans for all recorder_chans in shared memory
+        recorder_shan_p shan;
+        off_t           off;
+        for (off = shans->head; off; off = shan->next)
+        {
+            shan = (recorder_shan_p) ((char *) map_addr + off);
+            recorder_chan_p chan = malloc(sizeof(recorder_chan_t));
+            chan->chans = chans;
+            chan->offset = off;
+            chan->next = chans->head;
+            chans->head = chan;
+        }
+
+        if (recorder_chans_valid(chans))
+            return chans;
+
+        // The serial number changed - Program restarted at wrong time?
+        record(recorder_warning,
+               "Export channels serial changed, retry #%d", retries);
+        recorder_chan_p chan, next;
+        for (chan = chans->head; chan; chan = next)
+        {
+            next = chan->next;
+            free(chan);
+        }
+        retries++;
+    }
+
+    record(recorder_error, "Too many retries mapping %s, giving up", file);
+    chans->head = NULL;
+    recorder_chans_close(chans);
+    return NULL;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+void recorder_chans_close(recorder_chans_p chans)
+// ----------------------------------------------------------------------------
+//   Close shared memory recorder_chans
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p chan, next;
+    for (chan = chans->head; chan; chan = next)
+    {
+        next = chan->next;
+        free(chan);
+    }
+#ifdef HAVE_SYS_MMAN_H
+    munmap(chans->map_addr, chans->map_size);
+#endif // HAVE_SYS_MMAN_H
+    close(chans->fd);
+    free (chans);
+}
+
+
+bool recorder_chans_valid(recorder_chans_p chans)
+// ----------------------------------------------------------------------------
+//   Return true if the open chans is still valid
+// ----------------------------------------------------------------------------
+//   Creating channels keeps existing chans valid, deleting them does not
+{
+    recorder_shans_p shans = (recorder_shans_p) chans->map_addr;
+    return chans->serial == shans->serial &&
+        chans->generation == __atomic_load_n(&shans->generation,
+                                             __ATOMIC_ACQUIRE);
+}
+
+
+bool recorder_chans_configure(recorder_chans_p chans,
+                              const char *message)
+// ----------------------------------------------------------------------------
+//   Send a configuration message over the shared memory buffer
+// ----------------------------------------------------------------------------
+{
+    recorder_shans_p shans = chans->map_addr;
+    recorder_ring_p  cmds  = &shans->commands;
+    size_t           len   = strlen(message);
+    size_t           avail = recorder_ring_writable(cmds);
+    if (avail < len)
+    {
+        record(recorder_warning,
+               "Insufficient space in command buffer, %u < %u", avail, len);
+        return false;
+    }
+    recorder_ring_write(cmds, message, len, NULL, NULL, NULL);
+    recorder_doorbell_ring(&shans->doorbell, true);
+    return true;
+}
+
+
+recorder_chan_p recorder_chan_find(recorder_chans_p  chans,
+                                   const char       *pattern,
+                                   recorder_chan_p   after)
+// ----------------------------------------------------------------------------
+//   Find a recorder_chan with the given name in the recorder_chan list
+// ----------------------------------------------------------------------------
+{
+    pattern_t re;
+    int             status = pattern_comp(&re, pattern);
+    recorder_chan_p first  = after ? after->next : chans->head;
+    recorder_chan_p chan   = NULL;;
+
+    if (status == 0)
+    {
+        for (chan = first; chan; chan = chan->next)
+        {
+            const char *name = recorder_chan_name(chan);
+            if (pattern_match(&re, name))
+                break;
+        }
+    }
+    pattern_free(&re);
+    return chan;
+}
+
+
+const char *recorder_chan_name(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the name for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return (const char *) shan + shan->name;
+}
+
+
+const char *recorder_chan_description(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the description for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return (const char *) shan + shan->description;
+}
+
+
+const char *recorder_chan_unit(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the measurement unit for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return (const char *) shan + shan->unit;
+}
+
+
+recorder_data recorder_chan_min(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the min value specified for the given channel
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return shan->min;
+}
+
+
+recorder_data recorder_chan_max(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the max value specified for the given channel
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return shan->max;
+}
+
+
+recorder_type recorder_chan_type(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the element type for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return shan->type;
+}
+
+
+size_t recorder_chan_size(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the ring size for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return recorder_shan_ring(shan)->size;
+}
+
+
+size_t recorder_chan_item_size(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return the ring item size for a given recorder_chan
+// ----------------------------------------------------------------------------
+{
+    recorder_shan_p shan = recorder_shared(chan);
+    return shan->ring.item_size;
+}
+
+
+size_t recorder_chan_readable(recorder_chan_p chan, ringidx_t *reader)
+// ----------------------------------------------------------------------------
+//   Return number of readable elements in ring
+// ----------------------------------------------------------------------------
+{
+    if (!recorder_chans_valid(chan->chans))
+        return 0;
+    recorder_shan_p shan = recorder_shared(chan);
+    return recorder_ring_readable(recorder_shan_ring(shan),
+                                  recorder_shan_reader(shan, reader));
+}
+
+
+static size_t recorder_shcols_read(recorder_shcols_p cols, unsigned column,
+                                   recorder_data *times, recorder_data *values,
+                                   size_t stride, size_t count,
+                                   ringidx_t *reader_ptr)
+// ----------------------------------------------------------------------------
+//   Read rows from shared columns, storing every 'stride' output item
+// ----------------------------------------------------------------------------
+//   This follows the same catch-up logic as recorder_ring_read. The reader
+//   is required, since the ring is shared by all channels of the columns.
+{
+    recorder_ring_p ring  = &cols->ring;
+    const size_t    size  = ring->size;
+    recorder_data  *tcol  = (recorder_data *) (ring + 1);
+    recorder_data  *vcol  = (recorder_data *) ((char *) cols + cols->values);
+    ringidx_t       reader, writer, commit, first_reader, to_copy, idx, n;
+
+    vcol += column * size;
+
+    do
+    {
+        reader = *reader_ptr;
+        commit = ring->commit;
+        writer = ring->writer;
+
+        // Check if write may have overwritten beyond our read point
+        if (writer - reader >= size)
+        {
+            ringidx_t skip = writer - size + 1 - reader;
+            recorder_ring_add_fetch(ring->overflow, skip);
+            recorder_ring_add_fetch(*reader_ptr, skip);
+            reader += skip;
+        }
+
+        // Writers may still be filling rows after the commit point
+        to_copy = (intptr_t) (commit - reader) > 0 ? commit - reader : 0;
+        if (to_copy > count)
+            to_copy = count;
+
+        first_reader = reader;
+        idx = reader & (size - 1);
+        for (n = 0; n < to_copy; n++)
+        {
+            times[n * stride] = tcol[idx];
+            values[n * stride] = vcol[idx];
+            if (++idx == size)
+                idx = 0;
+        }
+    } while (!recorder_ring_compare_exchange(*reader_ptr,
+                                             first_reader,
+                                             first_reader + to_copy));
+
+    return to_copy;
+}
+
+
+size_t recorder_chan_read(recorder_chan_p chan,
+                          recorder_data *ptr, size_t count,
+                          ringidx_t *reader)
+// ----------------------------------------------------------------------------
+//   Read data from the ring
+// ----------------------------------------------------------------------------
+{
+    if (!recorder_chans_valid(chan->chans))
+        return 0;
+    recorder_shan_p shan = recorder_shared(chan);
+    recorder_shcols_p cols = recorder_shan_columns(shan);
+    if (cols)
+        return recorder_shcols_read(cols, shan->column,
+                                    ptr, ptr + 1, 2, count,
+                                    recorder_shan_reader(shan, reader));
+    return recorder_ring_read(&shan->ring, ptr, count, reader, NULL, NULL);
+}
+
+
+size_t recorder_chan_read_columns(recorder_chan_p chan,
+                                  recorder_data *times,
+                                  recorder_data *values,
+                                  size_t count,
+                                  ringidx_t *reader)
+// ----------------------------------------------------------------------------
+//   Read time stamps and values from the ring in separate arrays
+// ----------------------------------------------------------------------------
+{
+    if (!recorder_chans_valid(chan->chans))
+        return 0;
+    recorder_shan_p shan = recorder_shared(chan);
+    recorder_shcols_p cols = recorder_shan_columns(shan);
+    if (cols)
+        return recorder_shcols_read(cols, shan->column,
+                                    times, values, 1, count,
+                                    recorder_shan_reader(shan, reader));
+
+    // Interleaved channel: split the data directly from shared memory
+    recorder_ring_span spans[2];
+    ringidx_t          first;
+    size_t             done = 0;
+    size_t             read = recorder_ring_acquire(&shan->ring, count, reader,
+                                                    NULL, NULL, spans, &first);
+    unsigned           s;
+    for (s = 0; s < 2; s++)
+    {
+        const recorder_data *data = spans[s].data;
+        size_t i;
+        for (i = 0; i < spans[s].count; i++)
+        {
+            times[done] = data[2 * i];
+            values[done] = data[2 * i + 1];
+            done++;
+        }
+    }
+
+    // Drop the oldest items if writers overwrote them while we copied
+    size_t valid = recorder_ring_release(&shan->ring, reader, first, read);
+    if (valid < read)
+    {
+        memmove(times, times + read - valid, valid * sizeof(recorder_data));
+        memmove(values, values + read - valid, valid * sizeof(recorder_data));
+    }
+    return valid;
+}
+
+
+ringidx_t recorder_chan_reader(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Return current reader index for recorder_chan
+// ----------------------------------------------------------------------------
+{
+    if (!recorder_chans_valid(chan->chans))
+        return 0;
+    recorder_shan_p shan = recorder_shared(chan);
+    return *recorder_shan_reader(shan, NULL);
+}
+
+
+static recorder_type recorder_type_from_format(const char *format,
+                                               unsigned index)
+// ----------------------------------------------------------------------------
+//   Analyze format string to figure out the type of export
+// ----------------------------------------------------------------------------
+{
+    const recorder_format_info *info = recorder_format_described(format);
+    char           c;
+    bool           in_format    = false;
+    recorder_type  result       = RECORDER_NONE;
+    unsigned       start_index  = index;
+    const char    *start_format = recorder_format_text(format);
+
+    // Use the description computed by the compiler if there is one
+    if (info && index < info->args && index < 16)
+    {
+        unsigned bit = 1U << index;
+        result = (info->other       & bit) ? RECORDER_INVALID
+               : (info->real        & bit) ? RECORDER_REAL
+               : (info->signed_args & bit) ? RECORDER_SIGNED
+               :                             RECORDER_UNSIGNED;
+        record(recorder, "Export type at index %u in %s is %u",
+               start_index, start_format, result);
+        return result;
+    }
+
+    format = start_format;
+    for (c = *format++; c; c = *format++)
+    {
+        if (c == '%')
+        {
+            in_format = !in_format;
+            continue;
+        }
+        if (!in_format)
+            continue;
+        switch (c)
+        {
+        case 'f': case 'F':  // Floating point formatting
+        case 'g': case 'G':
+        case 'e': case 'E':
+        case 'a': case 'A':
+            result = RECORDER_REAL;
+            break;
+
+        case 'b':           // Integer formatting
+        case 'd': case 'D':
+        case 'i':
+            result = RECORDER_SIGNED;
+            break;
+
+        case 'c': case 'C':
+        case 's': case 'S':
+        case 'o': case 'O':
+        case 'u': case 'U':
+        case 'x':
+        case 'X':
+        case 'p':
+            result = RECORDER_UNSIGNED;
+            break;
+
+            // GCC: case '0' ... '9', not supported on IAR
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+        case '.':
+        case '+':
+        case '-':
+        case 'l': case 'L':
+        case 'h':
+        case 'j':
+        case 't':
+        case 'z':
+        case 'q':
+        case 'v':
+            break;
+        case 'n':           // Expect two args
+        case '*':
+        default:
+            result = RECORDER_INVALID;
+            break;
+        }
+
+        if (result != RECORDER_NONE)
+        {
+            if (!index)
+            {
+                record(recorder, "Export type at index %u in %s is %u",
+                       start_index, start_format, result);
+                return result;
+            }
+            index--;
+            result = RECORDER_NONE;
+            in_format = false;
+        }
+    }
+
+    record(recorder_warning,
+           "Unknown format directive at index %u in %s",
+           start_index, start_format);
+    return RECORDER_INVALID;
+}
+
+
+
+// ============================================================================
+//
+//    Capturing recorder_chans to a file, and replaying them
+//
+// ============================================================================
+//  A capture file uses the same chunk headers as binary dumps. It starts
+//  with a header chunk, followed by:
+//  - Channel chunks describing each captured channel, the chunk id being
+//    the channel number in the capture,
+//  - Data chunks holding up to RECORDER_CAPTURE_SAMPLES samples for one
+//    channel. Time stamps are stored as a delta of deltas, integer values as
+//    a delta to the previous value, real values as a XOR with the previous
+//    value, all as variable-length integers. Regular events with slowly
+//    changing values take a few bytes per sample instead of sixteen.
+//  - Index chunks listing channel and data chunks, written every
+//    RECORDER_CAPTURE_INDEXED entries and when the capture ends. The id of
+//    each index chunk is the offset of the previous one, 0 for the first.
+//  - A trailer chunk giving the offset of the last index chunk, written
+//    when the capture ends. A capture that was interrupted can still be
+//    replayed: the index is then rebuilt by scanning the chunk headers.
+
+enum
+{
+    RECORDER_CAPTURE_MAGIC      = 0x50414352,   // "RCAP"
+    RECORDER_CAPTURE_VERSION    = RECORDER_VERSION(1,1,0),
+    RECORDER_CAPTURE_CHANNEL    = 'C',
+    RECORDER_CAPTURE_DATA       = 'D',
+    RECORDER_CAPTURE_INDEX      = 'I',
+    RECORDER_CAPTURE_TRAILER    = 'T',
+
+    RECORDER_CAPTURE_SAMPLES    = 4096, // Samples in a data chunk
+    RECORDER_CAPTURE_INDEXED    = 4096, // Entries in an index chunk
+    RECORDER_CAPTURE_READ       = 512,  // Samples read from a channel at once
+    RECORDER_CAPTURE_VARINT     = 10,   // Largest variable-length integer
+    RECORDER_CAPTURE_REPLAY     = 1024  // Samples replayed in one step
+};
+
+
+typedef struct recorder_capture_header
+// ----------------------------------------------------------------------------
+//   Data for the header chunk at the beginning of a capture
+// ----------------------------------------------------------------------------
+{
+    uint32_t    version;                // Version of the capture format
+    uint32_t    samples;                // Maximum samples in a data chunk
+    uint64_t    hz;                     // RECORDER_HZ for the time stamps
+} recorder_capture_header;
+
+
+typedef struct recorder_capture_info
+// ----------------------------------------------------------------------------
+//   Data for a channel chunk, followed by name, description and unit
+// ----------------------------------------------------------------------------
+{
+    uint32_t    type;                   // Type when the capture started
+    uint32_t    reserved;
+    recorder_data min;                  // Minimum value for the channel
+    recorder_data max;                  // Maximum value for the channel
+} recorder_capture_info;
+
+
+typedef struct recorder_capture_block
+// ----------------------------------------------------------------------------
+//   Data for a data chunk, followed by the encoded samples
+// ----------------------------------------------------------------------------
+{
+    uint32_t    count;                  // Number of samples
+    uint32_t    type;                   // Type of the values
+    uint64_t    lost;                   // Samples lost before this chunk
+    uint64_t    first_time;             // Time stamp of first sample
+    uint64_t    last_time;              // Time stamp of last sample
+} recorder_capture_block;
+
+
+typedef struct recorder_capture_entry
+// ----------------------------------------------------------------------------
+//   An entry in the index of a capture
+// ----------------------------------------------------------------------------
+{
+    uint64_t    offset;                 // Offset of the chunk in the file
+    uint32_t    kind;                   // RECORDER_CAPTURE_CHANNEL or DATA
+    uint32_t    channel;                // Channel number in the capture
+    uint64_t    count;                  // Number of samples in data chunks
+    uint64_t    first_time;             // Time stamp of first sample
+    uint64_t    last_time;              // Time stamp of last sample
+} recorder_capture_entry;
+
+
+typedef struct recorder_capture_stream
+// ----------------------------------------------------------------------------
+//   State for one channel being captured
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p     chan;           // Channel being read
+    ringidx_t           reader;         // Our reader index in the channel
+    uint64_t            samples;        // Samples captured so far
+    uint64_t            lost;           // Samples lost since last chunk
+    recorder_type       type;           // Type of the current chunk
+    uint32_t            count;          // Samples in the current chunk
+    uint64_t            first_time;     // Time stamp of first sample
+    uint64_t            last_time;      // Time stamp of previous sample
+    uint64_t            last_delta;     // Previous time stamp delta
+    uint64_t            last_value;     // Previous value
+    size_t              used;           // Bytes used in buffer
+    uint8_t            *buffer;         // Encoded samples
+} recorder_capture_stream;
+
+
+struct recorder_capture
+// ----------------------------------------------------------------------------
+//   State while capturing channels to a file
+// ----------------------------------------------------------------------------
+{
+    int                         fd;
+    recorder_chans_p            chans;
+    char                       *pattern;
+    uint64_t                    offset;
+    uint64_t                    lost;
+    unsigned                    count;
+    recorder_capture_stream    *streams;
+    size_t                      indexed;
+    size_t                      index_room;
+    recorder_capture_entry     *index;
+    uint64_t                    last_index; // Offset of last index chunk
+    recorder_data               times[RECORDER_CAPTURE_READ];
+    recorder_data               values[RECORDER_CAPTURE_READ];
+};
+
+
+static inline uint8_t *recorder_varint_put(uint8_t *ptr, uint64_t value)
+// ----------------------------------------------------------------------------
+//   Write a variable-length integer, 7 bits per byte
+// ----------------------------------------------------------------------------
+{
+    while (value >= 0x80)
+    {
+        *ptr++ = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    *ptr++ = (uint8_t) value;
+    return ptr;
+}
+
+
+static inline const uint8_t *recorder_varint_get(const uint8_t *ptr,
+                                                 const uint8_t *end,
+                                                 uint64_t *value)
+// ----------------------------------------------------------------------------
+//   Read a variable-length integer, return NULL if it is truncated
+// ----------------------------------------------------------------------------
+{
+    uint64_t result = 0;
+    unsigned shift;
+    for (shift = 0; ptr < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *ptr++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+
+static inline uint64_t recorder_zigzag(uint64_t value)
+// ----------------------------------------------------------------------------
+//   Map small negative differences to small unsigned values
+// ----------------------------------------------------------------------------
+{
+    return (value << 1) ^ (uint64_t) ((int64_t) value >> 63);
+}
+
+
+static inline uint64_t recorder_unzigzag(uint64_t value)
+// ----------------------------------------------------------------------------
+//   Reverse of recorder_zigzag
+// ----------------------------------------------------------------------------
+{
+    return (value >> 1) ^ (uint64_t) -(int64_t) (value & 1);
+}
+
+
+static void recorder_capture_index_write(recorder_capture_p capture);
+static void recorder_capture_write(recorder_capture_p capture,
+                                   uint32_t kind, uint64_t id,
+                                   const void *data, size_t size,
+                                   const void *extra, size_t extra_size)
+// ----------------------------------------------------------------------------
+//   Write a chunk with up to two pieces of data, and index it if needed
+// ----------------------------------------------------------------------------
+{
+    recorder_binary_chunk chunk = { kind, (uint32_t) (size + extra_size), id };
+
+    if (kind == RECORDER_CAPTURE_CHANNEL || kind == RECORDER_CAPTURE_DATA)
+    {
+        if (capture->indexed >= capture->index_room)
+        {
+            capture->index_room = capture->index_room * 2 + 64;
+            capture->index = realloc(capture->index,
+                                     capture->index_room *
+                                     sizeof(recorder_capture_entry));
+        }
+        recorder_capture_entry *entry = &capture->index[capture->indexed++];
+        memset(entry, 0, sizeof(*entry));
+        entry->offset = capture->offset;
+        entry->kind = kind;
+        entry->channel = (uint32_t) id;
+        if (kind == RECORDER_CAPTURE_DATA)
+        {
+            const recorder_capture_block *block = data;
+            entry->count = block->count;
+            entry->first_time = block->first_time;
+            entry->last_time = block->last_time;
+        }
+    }
+
+    if (!recorder_write_all(capture->fd, &chunk, sizeof(chunk)) ||
+        !recorder_write_all(capture->fd, data, size) ||
+        (extra_size &&
+         !recorder_write_all(capture->fd, extra, extra_size)))
+        record(recorder_error, "Error writing capture: %s", strerror(errno));
+    capture->offset += sizeof(chunk) + size + extra_size;
+
+    // Write the index in pieces, so that its chunks remain small
+    if (capture->indexed >= RECORDER_CAPTURE_INDEXED)
+        recorder_capture_index_write(capture);
+}
+
+
+static void recorder_capture_index_write(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Write the entries indexed since the last index chunk
+// ----------------------------------------------------------------------------
+{
+    uint64_t offset = capture->offset;
+    size_t   size   = capture->indexed * sizeof(recorder_capture_entry);
+    capture->indexed = 0;
+    recorder_capture_write(capture, RECORDER_CAPTURE_INDEX,
+                           capture->last_index, capture->index, size,
+                           NULL, 0);
+    capture->last_index = offset;
+}
+
+
+static void recorder_capture_block_write(recorder_capture_p capture,
+                                         unsigned channel)
+// ----------------------------------------------------------------------------
+//   Write the pending samples of a channel as a data chunk
+// ----------------------------------------------------------------------------
+{
+    recorder_capture_stream *s = &capture->streams[channel];
+    if (!s->count)
+        return;
+
+    recorder_capture_block block =
+    {
+        s->count, s->type, s->lost, s->first_time, s->last_time
+    };
+    recorder_capture_write(capture, RECORDER_CAPTURE_DATA, channel,
+                           &block, sizeof(block), s->buffer, s->used);
+    s->count = 0;
+    s->used = 0;
+    s->lost = 0;
+}
+
+
+static void recorder_capture_scan(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Add the channels matching the pattern that are not captured yet
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p chan = NULL;
+    unsigned        s;
+
+    while ((chan = recorder_chan_find(capture->chans, capture->pattern, chan)))
+    {
+        for (s = 0; s < capture->count; s++)
+            if (capture->streams[s].chan == chan)
+                break;
+        if (s < capture->count)
+            continue;
+
+        capture->streams = realloc(capture->streams,
+                                   (s + 1) * sizeof(recorder_capture_stream));
+        capture->count = s + 1;
+        recorder_capture_stream *stream = &capture->streams[s];
+        memset(stream, 0, sizeof(*stream));
+        stream->chan = chan;
+        stream->type = recorder_chan_type(chan);
+        stream->buffer = malloc(RECORDER_CAPTURE_SAMPLES * 2 *
+                                RECORDER_CAPTURE_VARINT);
+
+        const char *name  = recorder_chan_name(chan);
+        const char *descr = recorder_chan_description(chan);
+        const char *unit  = recorder_chan_unit(chan);
+        size_t name_len   = strlen(name) + 1;
+        size_t descr_len  = strlen(descr) + 1;
+        size_t unit_len   = strlen(unit) + 1;
+        char  *text       = malloc(name_len + descr_len + unit_len);
+        memcpy(text, name, name_len);
+        memcpy(text + name_len, descr, descr_len);
+        memcpy(text + name_len + descr_len, unit, unit_len);
+
+        recorder_capture_info info;
+        memset(&info, 0, sizeof(info));
+        info.type = stream->type;
+        info.min = recorder_chan_min(chan);
+        info.max = recorder_chan_max(chan);
+        recorder_capture_write(capture, RECORDER_CAPTURE_CHANNEL, s,
+                               &info, sizeof(info),
+                               text, name_len + descr_len + unit_len);
+        free(text);
+        record(recorder, "Capturing channel %u %+s", s, name);
+    }
+}
+
+
+recorder_capture_p recorder_capture_new(recorder_chans_p chans,
+                                        const char *pattern,
+                                        int fd)
+// ----------------------------------------------------------------------------
+//   Start capturing the channels matching 'pattern' to the given file
+// ----------------------------------------------------------------------------
+{
+    recorder_capture_p capture = calloc(1, sizeof(struct recorder_capture));
+    off_t              offset  = lseek(fd, 0, SEEK_CUR);
+
+    capture->fd = fd;
+    capture->chans = chans;
+    capture->pattern = strdup(pattern ? pattern : ".*");
+    capture->offset = offset > 0 ? (uint64_t) offset : 0;
+
+    recorder_capture_header header =
+    {
+        RECORDER_CAPTURE_VERSION, RECORDER_CAPTURE_SAMPLES, RECORDER_HZ
+    };
+    recorder_capture_write(capture, RECORDER_CAPTURE_MAGIC, 0,
+                           &header, sizeof(header), NULL, 0);
+    recorder_capture_scan(capture);
+    return capture;
+}
+
+
+static void recorder_capture_encode(recorder_capture_p capture,
+                                    unsigned channel, size_t count)
+// ----------------------------------------------------------------------------
+//   Encode samples that were just read from a channel
+// ----------------------------------------------------------------------------
+{
+    recorder_capture_stream *s    = &capture->streams[channel];
+    recorder_type            type = recorder_chan_type(s->chan);
+    size_t                   i;
+
+    // The type of exported channels is only known after the first write
+    if (type != s->type)
+        recorder_capture_block_write(capture, channel);
+    s->type = type;
+
+    for (i = 0; i < count; i++)
+    {
+        if (s->count == RECORDER_CAPTURE_SAMPLES)
+            recorder_capture_block_write(capture, channel);
+
+        uint64_t time  = capture->times[i].unsigned_value;
+        uint64_t value = capture->values[i].unsigned_value;
+        if (!s->count)
+        {
+            s->first_time = time;
+            s->last_time = time;
+            s->last_delta = 0;
+            s->last_value = 0;
+        }
+
+        uint64_t delta = time - s->last_time;
+        uint8_t *ptr   = s->buffer + s->used;
+        ptr = recorder_varint_put(ptr, recorder_zigzag(delta - s->last_delta));
+        ptr = recorder_varint_put(ptr, type == RECORDER_REAL
+                                  ? value ^ s->last_value
+                                  : recorder_zigzag(value - s->last_value));
+        s->used = ptr - s->buffer;
+        s->last_delta = delta;
+        s->last_time = time;
+        s->last_value = value;
+        s->count++;
+    }
+    s->samples += count;
+}
+
+
+size_t recorder_capture_poll(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Read all available samples from captured channels, return their number
+// ----------------------------------------------------------------------------
+{
+    size_t   total = 0;
+    unsigned c;
+
+    for (c = 0; c < capture->count; c++)
+    {
+        recorder_capture_stream *s = &capture->streams[c];
+        size_t                   count;
+        do
+        {
+            ringidx_t before = s->reader;
+            count = recorder_chan_read_columns(s->chan,
+                                               capture->times,
+                                               capture->values,
+                                               RECORDER_CAPTURE_READ,
+                                               &s->reader);
+
+            // Samples overwritten before the first read are not lost
+            uint64_t lost = s->reader - before - count;
+            if (lost && s->samples)
+            {
+                s->lost += lost;
+                capture->lost += lost;
+            }
+            if (count)
+                recorder_capture_encode(capture, c, count);
+            total += count;
+        } while (count == RECORDER_CAPTURE_READ);
+    }
+    return total;
+}
+
+
+void recorder_capture_flush(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Write pending samples, and start capturing channels created meanwhile
+// ----------------------------------------------------------------------------
+{
+    unsigned c;
+    for (c = 0; c < capture->count; c++)
+        recorder_capture_block_write(capture, c);
+    recorder_capture_scan(capture);
+}
+
+
+uint64_t recorder_capture_lost(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Return the number of samples that were overwritten before being read
+// ----------------------------------------------------------------------------
+{
+    return capture->lost;
+}
+
+
+void recorder_capture_delete(recorder_capture_p capture)
+// ----------------------------------------------------------------------------
+//   Write pending samples and the index, then release the capture
+// ----------------------------------------------------------------------------
+{
+    unsigned c;
+    for (c = 0; c < capture->count; c++)
+        recorder_capture_block_write(capture, c);
+
+    recorder_capture_index_write(capture);
+    recorder_capture_write(capture, RECORDER_CAPTURE_TRAILER, 0,
+                           &capture->last_index, sizeof(capture->last_index),
+                           NULL, 0);
+
+    for (c = 0; c < capture->count; c++)
+        free(capture->streams[c].buffer);
+    free(capture->streams);
+    free(capture->index);
+    free(capture->pattern);
+    free(capture);
+}
+
+
+typedef struct recorder_replay_stream
+// ----------------------------------------------------------------------------
+//   State for one channel being replayed
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p     chan;           // Channel written to
+    size_t              next;           // Next index entry to look at
+    uint32_t            remaining;      // Samples left in current chunk
+    recorder_type       type;           // Type of the current chunk
+    uint64_t            time;           // Time stamp of the next sample
+    uint64_t            delta;          // Time stamp delta
+    uint64_t            value;          // Value of the next sample
+    bool                ready;          // Next sample was decoded
+    const uint8_t      *ptr;            // Next encoded sample
+    const uint8_t      *end;            // End of encoded samples
+    uint8_t            *buffer;         // Current chunk
+    size_t              room;           // Size of buffer
+} recorder_replay_stream;
+
+
+struct recorder_replay
+// ----------------------------------------------------------------------------
+//   State while replaying a capture into channels
+// ----------------------------------------------------------------------------
+{
+    int                         fd;
+    double                      scale;  // From capture ticks to RECORDER_HZ
+    uintptr_t                   start;  // recorder_tick() at first sample
+    uint64_t                    first;  // Time stamp of first sample
+    unsigned                    count;
+    recorder_replay_stream     *streams;
+    size_t                      indexed;
+    recorder_capture_entry     *index;
+};
+
+
+static bool recorder_replay_read(int fd, uint64_t offset,
+                                 void *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Read data at a given offset in the capture
+// ----------------------------------------------------------------------------
+{
+    if (lseek(fd, (off_t) offset, SEEK_SET) < 0)
+        return false;
+    return recorder_read_all(fd, data, size);
+}
+
+
+static bool recorder_replay_load_index(recorder_replay_p replay)
+// ----------------------------------------------------------------------------
+//   Load the index from the end of the capture, or rebuild it
+// ----------------------------------------------------------------------------
+{
+    int                   fd = replay->fd;
+    recorder_binary_chunk chunk;
+    uint64_t              offset;
+    off_t                 end = lseek(fd, 0, SEEK_END);
+
+    // Use the index if the capture was complete
+    if (end > (off_t) (sizeof(chunk) + sizeof(offset)) &&
+        recorder_replay_read(fd, end - sizeof(chunk) - sizeof(offset),
+                             &chunk, sizeof(chunk)) &&
+        chunk.kind == RECORDER_CAPTURE_TRAILER &&
+        chunk.size == sizeof(offset) &&
+        recorder_read_all(fd, &offset, sizeof(offset)))
+    {
+        // Count the entries in the chain of index chunks, last one first
+        uint64_t last = offset;
+        size_t   total = 0;
+        bool     valid = true;
+        while (valid && offset)
+        {
+            valid = recorder_replay_read(fd, offset, &chunk, sizeof(chunk)) &&
+                chunk.kind == RECORDER_CAPTURE_INDEX &&
+                chunk.id < offset;
+            total += chunk.size / sizeof(recorder_capture_entry);
+            offset = chunk.id;
+        }
+
+        // Read them back to front, so that entries remain in file order
+        replay->index = valid && total
+            ? malloc(total * sizeof(recorder_capture_entry))
+            : NULL;
+        replay->indexed = total;
+        for (offset = last; replay->index && offset; offset = chunk.id)
+        {
+            size_t count;
+            if (!recorder_replay_read(fd, offset, &chunk, sizeof(chunk)) ||
+                (count = chunk.size / sizeof(recorder_capture_entry)) > total ||
+                !recorder_read_all(fd, replay->index + total - count,
+                                   count * sizeof(recorder_capture_entry)))
+                break;
+            total -= count;
+        }
+        if (replay->index && !offset && !total)
+            return true;
+        free(replay->index);
+        replay->index = NULL;
+        replay->indexed = 0;
+    }
+
+    // Otherwise, scan the chunk headers
+    size_t room = 0;
+    offset = 0;
+    while (recorder_replay_read(fd, offset, &chunk, sizeof(chunk)))
+    {
+        if (chunk.kind == RECORDER_CAPTURE_CHANNEL ||
+            chunk.kind == RECORDER_CAPTURE_DATA)
+        {
+            recorder_capture_block block;
+            memset(&block, 0, sizeof(block));
+            if (chunk.kind == RECORDER_CAPTURE_DATA &&
+                !recorder_read_all(fd, &block, sizeof(block)))
+                break;
+            if (offset + sizeof(chunk) + chunk.size > (uint64_t) end)
+                break;
+            if (replay->indexed >= room)
+            {
+                room = room * 2 + 64;
+                replay->index = realloc(replay->index,
+                                        room * sizeof(recorder_capture_entry));
+            }
+            recorder_capture_entry *entry = &replay->index[replay->indexed++];
+            entry->offset = offset;
+            entry->kind = chunk.kind;
+            entry->channel = (uint32_t) chunk.id;
+            entry->count = block.count;
+            entry->first_time = block.first_time;
+            entry->last_time = block.last_time;
+        }
+        offset += sizeof(chunk) + chunk.size;
+    }
+    if (replay->indexed)
+        record(recorder_warning,
+               "Capture has no index, rebuilt one with %zu chunks",
+               replay->indexed);
+    return replay->indexed > 0;
+}
+
+
+static bool recorder_replay_chunk(recorder_replay_p replay, unsigned channel)
+// ----------------------------------------------------------------------------
+//   Load the next data chunk for a channel, return false at end of capture
+// ----------------------------------------------------------------------------
+{
+    recorder_replay_stream *s = &replay->streams[channel];
+
+    while (s->next < replay->indexed)
+    {
+        recorder_capture_entry *entry = &replay->index[s->next++];
+        if (entry->kind != RECORDER_CAPTURE_DATA ||
+            entry->channel != channel)
+            continue;
+
+        recorder_binary_chunk  chunk;
+        recorder_capture_block block;
+        if (!recorder_replay_read(replay->fd, entry->offset,
+                                  &chunk, sizeof(chunk)) ||
+            chunk.kind != RECORDER_CAPTURE_DATA ||
+            chunk.size < sizeof(block) ||
+            !recorder_read_all(replay->fd, &block, sizeof(block)))
+        {
+            record(recorder_error, "Invalid data chunk at offset %lu",
+                   (unsigned long) entry->offset);
+            continue;
+        }
+
+        size_t size = chunk.size - sizeof(block);
+        if (size > s->room)
+        {
+            s->room = size;
+            s->buffer = realloc(s->buffer, size);
+        }
+        if (!recorder_read_all(replay->fd, s->buffer, size))
+        {
+            record(recorder_error, "Truncated data chunk at offset %lu",
+                   (unsigned long) entry->offset);
+            continue;
+        }
+
+        // The type of the channel is set the same way as for exports
+        if (s->chan && block.type != RECORDER_NONE)
+            recorder_shared(s->chan)->type = (recorder_type) block.type;
+        s->type = (recorder_type) block.type;
+        s->remaining = block.count;
+        s->time = block.first_time;
+        s->delta = 0;
+        s->value = 0;
+        s->ptr = s->buffer;
+        s->end = s->buffer + size;
+        return true;
+    }
+    return false;
+}
+
+
+static bool recorder_replay_decode(recorder_replay_p replay, unsigned channel)
+// ----------------------------------------------------------------------------
+//   Decode the next sample for a channel, return false at end of capture
+// ----------------------------------------------------------------------------
+{
+    recorder_replay_stream *s = &replay->streams[channel];
+    uint64_t                dod, value;
+
+    while (!s->remaining)
+        if (!recorder_replay_chunk(replay, channel))
+            return false;
+
+    // The first sample of a chunk holds its first time stamp and value
+    const uint8_t *ptr = recorder_varint_get(s->ptr, s->end, &dod);
+    if (ptr)
+        ptr = recorder_varint_get(ptr, s->end, &value);
+    if (!ptr)
+    {
+        record(recorder_error, "Corrupt samples in capture channel %u",
+               channel);
+        s->remaining = 0;
+        return recorder_replay_decode(replay, channel);
+    }
+
+    s->delta += recorder_unzigzag(dod);
+    s->time += s->delta;
+    s->value = s->type == RECORDER_REAL
+        ? s->value ^ value
+        : s->value + recorder_unzigzag(value);
+    s->ptr = ptr;
+    s->remaining--;
+    s->ready = true;
+    return true;
+}
+
+
+recorder_replay_p recorder_replay_new(int fd, recorder_chans_p chans)
+// ----------------------------------------------------------------------------
+//   Open a capture and create the channels it describes in 'chans'
+// ----------------------------------------------------------------------------
+{
+    recorder_binary_chunk   chunk;
+    recorder_capture_header header;
+
+    if (!recorder_replay_read(fd, 0, &chunk, sizeof(chunk)) ||
+        chunk.kind != RECORDER_CAPTURE_MAGIC ||
+        chunk.size < sizeof(header) ||
+        !recorder_read_all(fd, &header, sizeof(header)))
+    {
+        record(recorder_error, "File is not a recorder capture");
+        return NULL;
+    }
+    if (header.version >> 16 != RECORDER_CAPTURE_VERSION >> 16)
+    {
+        record(recorder_error, "Unsupported capture version %x",
+               header.version);
+        return NULL;
+    }
+
+    recorder_replay_p replay = calloc(1, sizeof(struct recorder_replay));
+    replay->fd = fd;
+    replay->scale = header.hz ? (double) RECORDER_HZ / header.hz : 1.0;
+    if (!recorder_replay_load_index(replay))
+    {
+        record(recorder_error, "Capture contains no channel");
+        recorder_replay_delete(replay);
+        return NULL;
+    }
+
+    // Create channels in the order they were captured
+    size_t i;
+    for (i = 0; i < replay->indexed; i++)
+    {
+        recorder_capture_entry *entry = &replay->index[i];
+        if (entry->kind != RECORDER_CAPTURE_CHANNEL)
+            continue;
+
+        recorder_capture_info info;
+        char                 *text = NULL;
+        if (recorder_replay_read(fd, entry->offset, &chunk, sizeof(chunk)) &&
+            chunk.size > sizeof(info) &&
+            recorder_read_all(fd, &info, sizeof(info)))
+        {
+            size_t size = chunk.size - sizeof(info);
+            text = malloc(size + 3);
+            if (!recorder_read_all(fd, text, size))
+                size = 0;
+            text[size] = text[size+1] = text[size+2] = 0;
+        }
+        if (!text)
+        {
+            record(recorder_error, "Invalid channel chunk at offset %lu",
+                   (unsigned long) entry->offset);
+            continue;
+        }
+
+        unsigned channel = entry->channel;
+        if (channel >= replay->count)
+        {
+            replay->streams = realloc(replay->streams,
+                                      (channel + 1) *
+                                      sizeof(recorder_replay_stream));
+            memset(replay->streams + replay->count, 0,
+                   (channel + 1 - replay->count) *
+                   sizeof(recorder_replay_stream));
+            replay->count = channel + 1;
+        }
+
+        const char *name  = text;
+        const char *descr = name + strlen(name) + 1;
+        const char *unit  = descr + strlen(descr) + 1;
+        recorder_replay_stream *s = &replay->streams[channel];
+        s->chan = recorder_chan_new(chans, (recorder_type) info.type,
+                                    RECORDER_TWEAK(recorder_export_size),
+                                    name, descr, unit, info.min, info.max);
+        s->next = i + 1;
+        free(text);
+    }
+
+    // Find the first sample to replay
+    unsigned c;
+    replay->first = UINT64_MAX;
+    for (c = 0; c < replay->count; c++)
+        if (replay->streams[c].chan &&
+            recorder_replay_decode(replay, c) &&
+            replay->streams[c].time < replay->first)
+            replay->first = replay->streams[c].time;
+    return replay;
+}
+
+
+bool recorder_replay_step(recorder_replay_p replay, double speed)
+// ----------------------------------------------------------------------------
+//   Replay the samples that are due, return false at end of capture
+// ----------------------------------------------------------------------------
+//   Samples from all channels are merged by time stamp, and paced using
+//   the wall clock, 'speed' times faster than captured. A speed of 0 or
+//   less replays samples as fast as possible.
+{
+    uintptr_t now = recorder_tick();
+    unsigned  replayed;
+
+    if (!replay->start)
+        replay->start = now;
+
+    for (replayed = 0; replayed < RECORDER_CAPTURE_REPLAY; replayed++)
+    {
+        recorder_replay_stream *next = NULL;
+        unsigned                c;
+        for (c = 0; c < replay->count; c++)
+        {
+            recorder_replay_stream *s = &replay->streams[c];
+            if (s->ready && (!next || s->time < next->time))
+                next = s;
+        }
+        if (!next)
+            return false;
+
+        if (speed > 0)
+        {
+            double    elapsed = (next->time - replay->first) * replay->scale;
+            uintptr_t due     = replay->start + (uintptr_t) (elapsed / speed);
+            if ((intptr_t) (due - now) > 0)
+            {
+                // Wait for the next sample, but not too long
+                uintptr_t wait = (due - now) * 1000000 / RECORDER_HZ;
+                if (wait > 10000)
+                    wait = 10000;
+                if (!replayed && wait)
+                {
+                    struct timespec tm;
+                    tm.tv_sec  = 0;
+                    tm.tv_nsec = wait * 1000;
+                    nanosleep(&tm, NULL);
+                }
+                return true;
+            }
+        }
+
+        // Write the way exports do, overwriting what readers did not take
+        recorder_shan_p shan   = recorder_shared(next->chan);
+        recorder_ring_p ring   = &shan->ring;
+        ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
+        recorder_data  *data   = (recorder_data *) (ring + 1);
+        data += 2 * (writer & (ring->size - 1));
+        data[0].unsigned_value = replay->scale == 1.0
+            ? next->time
+            : (uint64_t) (next->time * replay->scale);
+        data[1].unsigned_value = next->value;
+        recorder_ring_fetch_add(ring->commit, 1);
+
+        next->ready = false;
+        recorder_replay_decode(replay, next - replay->streams);
+    }
+    return true;
+}
+
+
+void recorder_replay_delete(recorder_replay_p replay)
+// ----------------------------------------------------------------------------
+//   Release the replay state, the channels remain in their recorder_chans
+// ----------------------------------------------------------------------------
+{
+    unsigned c;
+    for (c = 0; c < replay->count; c++)
+        free(replay->streams[c].buffer);
+    free(replay->streams);
+    free(replay->index);
+    free(replay);
+}
+
+
+// ============================================================================
+//
+//    Aggregating recorder_chans from several processes
+//
+// ============================================================================
+//  Each source process is read by its own thread, so that one slow or
+//  stopped process does not delay the others. Samples are copied into
+//  channels of the output recorder_chans, named "label/channel", with time
+//  stamps aligned on the tick clock of the aggregating process, and
+//  optionally downsampled to one sample per 'period'. The output channels
+//  are written the way exports are, so a slow viewer never blocks readers.
+//  Commands sent to the output channels, e.g. by the scope, are forwarded to
+//  all source processes, and sent again to processes that restart.
+
+typedef struct recorder_aggregate_output
+// ----------------------------------------------------------------------------
+//   An output channel, kept when its source process is reopened
+// ----------------------------------------------------------------------------
+//   Sources are reopened when they restart or delete channels, and then
+//   read their channels from the start again. Samples before 'next_time'
+//   were already copied or downsampled away, and are skipped.
+{
+    struct recorder_aggregate_output *next;
+    char                       *name;
+    recorder_chan_p             chan;
+    uintptr_t                   next_time; // Earliest time for next sample
+} recorder_aggregate_output;
+
+
+typedef struct recorder_aggregate_stream
+// ----------------------------------------------------------------------------
+//   A channel from a source process being copied to an output channel
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p             input;  // Channel in the source process
+    recorder_aggregate_output  *output; // Merged channel, NULL until typed
+    ringidx_t                   reader; // Our reader index in the input
+    uint64_t                    samples;// Samples read so far
+} recorder_aggregate_stream;
+
+
+typedef struct recorder_aggregate_source
+// ----------------------------------------------------------------------------
+//   A source process, identified by its RECORDER_SHARE file
+// ----------------------------------------------------------------------------
+{
+    recorder_aggregate_p        aggregate;
+    char                       *file;
+    char                       *label;
+    recorder_chans_p            chans;  // NULL while the process is stopped
+    uint32_t                    serial; // Serial the commands were sent to
+    bool                        configured; // Commands were sent once
+    off_t                       head;   // First shared channel we know about
+    intptr_t                    offset; // Ticks added to align time stamps
+    unsigned                    count;
+    recorder_aggregate_stream  *streams;
+    uint64_t                    lost;
+    pthread_t                   thread;
+    recorder_data               times[RECORDER_CAPTURE_READ];
+    recorder_data               values[RECORDER_CAPTURE_READ];
+} recorder_aggregate_source;
+
+
+struct recorder_aggregate
+// ----------------------------------------------------------------------------
+//   State while aggregating channels from several processes
+// ----------------------------------------------------------------------------
+//   The lock protects the output recorder_chans, the lists of sources and
+//   outputs, and the 'chans' of sources while they are being replaced
+{
+    recorder_chans_p            output;
+    char                       *pattern;
+    uintptr_t                   period;
+    unsigned                    running;
+    pthread_mutex_t             lock;
+    pthread_t                   forwarder;
+    unsigned                    count;
+    recorder_aggregate_source **sources;
+    recorder_aggregate_output  *outputs;
+    unsigned                    commands;
+    char                      **command;   // Sent to all sources when opened
+};
+
+
+static bool recorder_aggregate_open(recorder_aggregate_source *source)
+// ----------------------------------------------------------------------------
+//   (Re)open the channels of a source process, compute clock alignment
+// ----------------------------------------------------------------------------
+{
+    recorder_aggregate_p aggregate = source->aggregate;
+    recorder_chans_p     chans     = NULL;
+    if (access(source->file, R_OK) == 0)
+        chans = recorder_chans_open(source->file);
+
+    pthread_mutex_lock(&aggregate->lock);
+    if (source->chans)
+        recorder_chans_close(source->chans);
+    source->chans = chans;
+    source->count = 0;
+    if (chans)
+    {
+        recorder_shans_p in  = chans->map_addr;
+        recorder_shans_p out = aggregate->output->map_addr;
+        source->head = in->head;
+        if (in->clock == out->clock && in->clock != RECORDER_TICK_OTHER)
+            source->offset = (intptr_t) (in->origin - out->origin);
+        else
+            source->offset = (intptr_t) (in->epoch - out->epoch);
+        record(recorder, "Aggregating %+s as %+s, time offset %ld",
+               source->file, source->label, (long) source->offset);
+
+        // Configure processes when they start, but not when they only
+        // deleted channels, since commands may be what deleted them
+        if (!source->configured || source->serial != chans->serial)
+        {
+            unsigned c;
+            for (c = 0; c < aggregate->commands; c++)
+                recorder_chans_configure(chans, aggregate->command[c]);
+            source->configured = true;
+            source->serial = chans->serial;
+        }
+    }
+    pthread_mutex_unlock(&aggregate->lock);
+    return chans != NULL;
+}
+
+
+static void recorder_aggregate_scan(recorder_aggregate_source *source)
+// ----------------------------------------------------------------------------
+//   Add channels created in the source since it was opened, then match them
+// ----------------------------------------------------------------------------
+//   New channels are linked at the head of the shared list, so we only need
+//   to walk it until we reach the first channel we already know about.
+{
+    recorder_chans_p chans = source->chans;
+    recorder_shans_p shans = chans->map_addr;
+    off_t            head  = __atomic_load_n(&shans->head, __ATOMIC_ACQUIRE);
+    off_t            off;
+
+    for (off = head; off && off != source->head; )
+    {
+        recorder_shan_p shan = (recorder_shan_p) ((char *) shans + off);
+        recorder_chan_p chan = malloc(sizeof(recorder_chan_t));
+        chan->chans = chans;
+        chan->offset = off;
+        chan->next = chans->head;
+        chans->head = chan;
+        off = shan->next;
+    }
+    source->head = head;
+
+    recorder_chan_p chan = NULL;
+    unsigned        s;
+    while ((chan = recorder_chan_find(chans, source->aggregate->pattern, chan)))
+    {
+        for (s = 0; s < source->count; s++)
+            if (source->streams[s].input == chan)
+                break;
+        if (s < source->count)
+            continue;
+
+        source->streams = realloc(source->streams,
+                                  (s + 1) * sizeof(recorder_aggregate_stream));
+        source->count = s + 1;
+        recorder_aggregate_stream *stream = &source->streams[s];
+        memset(stream, 0, sizeof(*stream));
+        stream->input = chan;
+    }
+}
+
+
+static recorder_aggregate_output *
+recorder_aggregate_output_chan(recorder_aggregate_source *source,
+                               recorder_chan_p input)
+// ----------------------------------------------------------------------------
+//   Find or create the output channel for an input channel
+// ----------------------------------------------------------------------------
+//   This is done once the type of the input is known, since exported
+//   channels are only typed when the first record is written into them
+{
+    recorder_aggregate_p       aggregate = source->aggregate;
+    const char                *name      = recorder_chan_name(input);
+    size_t                     len = strlen(source->label) + strlen(name) + 2;
+    char                      *full      = malloc(len);
+    recorder_aggregate_output *output;
+
+    snprintf(full, len, "%s/%s", source->label, name);
+    pthread_mutex_lock(&aggregate->lock);
+    for (output = aggregate->outputs; output; output = output->next)
+        if (strcmp(output->name, full) == 0)
+            break;
+    if (!output)
+    {
+        recorder_chan_p chan =
+            recorder_chan_new(aggregate->output, recorder_chan_type(input),
+                              RECORDER_TWEAK(recorder_export_size), full,
+                              recorder_chan_description(input),
+                              recorder_chan_unit(input),
+                              recorder_chan_min(input),
+                              recorder_chan_max(input));
+        if (chan)
+        {
+            output = calloc(1, sizeof(recorder_aggregate_output));
+            output->next = aggregate->outputs;
+            output->name = full;
+            output->chan = chan;
+            aggregate->outputs = output;
+            full = NULL;
+        }
+    }
+    pthread_mutex_unlock(&aggregate->lock);
+    free(full);
+    return output;
+}
+
+
+static size_t recorder_aggregate_copy(recorder_aggregate_source *source,
+                                      recorder_aggregate_stream *stream)
+// ----------------------------------------------------------------------------
+//   Copy the available samples of one input channel, return number read
+// ----------------------------------------------------------------------------
+{
+    uintptr_t period = source->aggregate->period;
+    size_t    total  = 0;
+    size_t    count, i;
+
+    do
+    {
+        ringidx_t before = stream->reader;
+        count = recorder_chan_read_columns(stream->input,
+                                           source->times, source->values,
+                                           RECORDER_CAPTURE_READ,
+                                           &stream->reader);
+
+        // Samples overwritten before the first read are not lost
+        uint64_t lost = stream->reader - before - count;
+        if (lost && stream->samples)
+            source->lost += lost;
+        stream->samples += count;
+        total += count;
+
+        if (count && !stream->output)
+            if (recorder_chan_type(stream->input) != RECORDER_NONE)
+                stream->output = recorder_aggregate_output_chan(source,
+                                                                stream->input);
+        if (!stream->output)
+            continue;
+
+        // Write the way exports do, overwriting what readers did not take
+        recorder_aggregate_output *output = stream->output;
+        recorder_shan_p shan = recorder_shared(output->chan);
+        recorder_ring_p ring = &shan->ring;
+        recorder_data  *base = (recorder_data *) (ring + 1);
+        for (i = 0; i < count; i++)
+        {
+            // Skip samples recorded before the aggregator started, or
+            // copied already before the source was reopened
+            intptr_t time = (intptr_t) source->times[i].unsigned_value
+                + source->offset;
+            if (time < 0 || (uintptr_t) time < output->next_time)
+                continue;
+            output->next_time = (uintptr_t) time + (period ? period : 1);
+
+            ringidx_t      writer = recorder_ring_fetch_add(ring->writer, 1);
+            recorder_data *data   = base + 2 * (writer & (ring->size - 1));
+            data[0].unsigned_value = (uintptr_t) time;
+            data[1] = source->values[i];
+            recorder_ring_fetch_add(ring->commit, 1);
+        }
+    } while (count == RECORDER_CAPTURE_READ);
+    return total;
+}
+
+
+static void *recorder_aggregate_thread(void *arg)
+// ----------------------------------------------------------------------------
+//   Read the channels of one source process until the aggregate is deleted
+// ----------------------------------------------------------------------------
+{
+    recorder_aggregate_source *source    = arg;
+    recorder_aggregate_p       aggregate = source->aggregate;
+    uintptr_t                  scanned   = recorder_tick();
+
+    while (recorder_ring_fetch_add(aggregate->running, 0))
+    {
+        uintptr_t now  = recorder_tick();
+        size_t    read = 0;
+        unsigned  s;
+
+        // Reopen processes that restarted or deleted channels every second
+        if (!source->chans || !recorder_chans_valid(source->chans))
+        {
+            if (source->chans || now - scanned >= RECORDER_HZ)
+            {
+                if (recorder_aggregate_open(source))
+                    recorder_aggregate_scan(source);
+                scanned = now;
+            }
+        }
+        else if (now - scanned >= RECORDER_HZ)
+        {
+            recorder_aggregate_scan(source);
+            scanned = now;
+        }
+
+        for (s = 0; s < source->count; s++)
+            read += recorder_aggregate_copy(source, &source->streams[s]);
+        if (!read)
+        {
+            unsigned        ms = RECORDER_TWEAK(recorder_aggregate_sleep);
+            struct timespec tm;
+            tm.tv_sec  = ms / 1000;
+            tm.tv_nsec = ms % 1000 * 1000000;
+            nanosleep(&tm, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+static void *recorder_aggregate_forward(void *arg)
+// ----------------------------------------------------------------------------
+//   Forward commands sent to the output channels to all source processes
+// ----------------------------------------------------------------------------
+{
+    recorder_aggregate_p aggregate = arg;
+    recorder_shans_p     shans     = aggregate->output->map_addr;
+    char                 buffer[RECORDER_CMD_LEN];
+
+    while (recorder_ring_fetch_add(aggregate->running, 0))
+    {
+        uint32_t seen = __atomic_load_n(&shans->doorbell, __ATOMIC_ACQUIRE);
+        size_t cmdlen = recorder_ring_readable(&shans->commands, NULL);
+        if (cmdlen)
+        {
+            recorder_ring_read(&shans->commands,buffer,cmdlen,NULL,NULL,NULL);
+            buffer[cmdlen] = 0;
+            recorder_aggregate_configure(aggregate, buffer);
+        }
+        else
+        {
+            recorder_doorbell_wait(&shans->doorbell, seen,
+                                   RECORDER_TWEAK(recorder_configuration_sleep),
+                                   true);
+        }
+    }
+    return NULL;
+}
+
+
+recorder_aggregate_p recorder_aggregate_new(recorder_chans_p output,
+                                            const char *pattern,
+                                            uintptr_t period)
+// ----------------------------------------------------------------------------
+//   Start aggregating channels matching 'pattern' into 'output'
+// ----------------------------------------------------------------------------
+//   'period' is the minimum time between samples of an output channel, in
+//   units of RECORDER_HZ, or 0 to copy all samples
+{
+    recorder_aggregate_p aggregate = calloc(1, sizeof(*aggregate));
+    aggregate->output = output;
+    aggregate->pattern = strdup(pattern ? pattern : ".*");
+    aggregate->period = period;
+    aggregate->running = 1;
+    pthread_mutex_init(&aggregate->lock, NULL);
+    if (pthread_create(&aggregate->forwarder, NULL,
+                       recorder_aggregate_forward, aggregate) != 0)
+    {
+        record(recorder_error, "Unable to start forwarding commands: %s",
+               strerror(errno));
+        aggregate->forwarder = pthread_self();
+    }
+    return aggregate;
+}
+
+
+bool recorder_aggregate_add(recorder_aggregate_p aggregate,
+                            const char *file,
+                            const char *label)
+// ----------------------------------------------------------------------------
+//   Add a source process, return false if its channels cannot be read yet
+// ----------------------------------------------------------------------------
+//   Sources that are not running are retried every second. The label is
+//   used to prefix the name of its channels, and defaults to the file name.
+//   A label that is already used gets a "-2", "-3", ... suffix, so that
+//   two sources never write into the same output channels.
+{
+    recorder_aggregate_source *source = calloc(1, sizeof(*source));
+    const char *base  = strrchr(file, '/');
+    const char *name  = label ? label : base ? base + 1 : file;
+    size_t      len   = strlen(name) + 16;
+    unsigned    index = 1;
+    bool        used  = true;
+    unsigned    s;
+
+    source->aggregate = aggregate;
+    source->file = strdup(file);
+    source->label = malloc(len);
+    snprintf(source->label, len, "%s", name);
+
+    pthread_mutex_lock(&aggregate->lock);
+    while (used)
+    {
+        used = false;
+        for (s = 0; s < aggregate->count && !used; s++)
+            used = strcmp(aggregate->sources[s]->label, source->label) == 0;
+        if (used)
+            snprintf(source->label, len, "%s-%u", name, ++index);
+    }
+    if (index > 1)
+        record(recorder_warning, "Label %+s already used, using %+s for %+s",
+               name, source->label, file);
+    aggregate->sources = realloc(aggregate->sources,
+                                 (aggregate->count + 1) * sizeof(source));
+    aggregate->sources[aggregate->count++] = source;
+    pthread_mutex_unlock(&aggregate->lock);
+
+    bool opened = recorder_aggregate_open(source);
+    if (opened)
+        recorder_aggregate_scan(source);
+
+    if (pthread_create(&source->thread, NULL,
+                       recorder_aggregate_thread, source) != 0)
+    {
+        record(recorder_error, "Unable to start reading %+s: %s",
+               file, strerror(errno));
+        source->thread = pthread_self();
+    }
+    return opened;
+}
+
+
+unsigned recorder_aggregate_configure(recorder_aggregate_p aggregate,
+                                      const char *message)
+// ----------------------------------------------------------------------------
+//   Send a configuration message to all running source processes
+// ----------------------------------------------------------------------------
+//   The message is also sent to processes when they start or restart later.
+//   Return the number of processes that received it now.
+{
+    unsigned sent = 0;
+    unsigned s, c;
+    record(recorder, "Forwarding command %+s", message);
+    pthread_mutex_lock(&aggregate->lock);
+    for (c = 0; c < aggregate->commands; c++)
+        if (strcmp(aggregate->command[c], message) == 0)
+            break;
+    if (c == aggregate->commands)
+    {
+        aggregate->command = realloc(aggregate->command,
+                                     (c + 1) * sizeof(char *));
+        aggregate->command[c] = strdup(message);
+        aggregate->commands = c + 1;
+    }
+    for (s = 0; s < aggregate->count; s++)
+    {
+        recorder_chans_p chans = aggregate->sources[s]->chans;
+        if (chans && recorder_chans_valid(chans) &&
+            recorder_chans_configure(chans, message))
+            sent++;
+    }
+    pthread_mutex_unlock(&aggregate->lock);
+    return sent;
+}
+
+
+uint64_t recorder_aggregate_lost(recorder_aggregate_p aggregate)
+// ----------------------------------------------------------------------------
+//   Return the number of samples overwritten before being read
+// ----------------------------------------------------------------------------
+{
+    uint64_t lost = 0;
+    unsigned s;
+    pthread_mutex_lock(&aggregate->lock);
+    for (s = 0; s < aggregate->count; s++)
+        lost += aggregate->sources[s]->lost;
+    pthread_mutex_unlock(&aggregate->lock);
+    return lost;
+}
+
+
+void recorder_aggregate_delete(recorder_aggregate_p aggregate)
+// ----------------------------------------------------------------------------
+//   Stop all threads and release the sources, output channels remain
+// ----------------------------------------------------------------------------
+{
+    pthread_t self = pthread_self();
+    unsigned  s;
+
+    recorder_ring_fetch_add(aggregate->running, -1);
+    recorder_shans_p shans = aggregate->output->map_addr;
+    recorder_doorbell_ring(&shans->doorbell, true);
+    if (!pthread_equal(aggregate->forwarder, self))
+        pthread_join(aggregate->forwarder, NULL);
+
+    for (s = 0; s < aggregate->count; s++)
+    {
+        recorder_aggregate_source *source = aggregate->sources[s];
+        if (!pthread_equal(source->thread, self))
+            pthread_join(source->thread, NULL);
+        if (source->chans)
+            recorder_chans_close(source->chans);
+        free(source->streams);
+        free(source->label);
+        free(source->file);
+        free(source);
+    }
+    recorder_aggregate_output *output, *next;
+    for (output = aggregate->outputs; output; output = next)
+    {
+        next = output->next;
+        free(output->name);
+        free(output);
+    }
+    for (s = 0; s < aggregate->commands; s++)
+        free(aggregate->command[s]);
+    free(aggregate->command);
+    free(aggregate->sources);
+    free(aggregate->pattern);
+    pthread_mutex_destroy(&aggregate->lock);
+    free(aggregate);
+}
+
+
+
+// ============================================================================
+//
+//   Doorbells to wake up waiting background threads
+//
+// ============================================================================
+
+// When waiting for events, wake up at least this often in case a wake up
+// was lost, e.g. on a weakly ordered CPU, or on an unmapped shared doorbell
+static const unsigned recorder_doorbell_timeout = 1000; // ms
+
+
+static inline bool recorder_doorbell_enabled(void)
+// ----------------------------------------------------------------------------
+//   Check if background threads wait for doorbells instead of polling
+// ----------------------------------------------------------------------------
+{
+#if HAVE_LINUX_FUTEX_H
+    return RECORDER_TWEAK(recorder_dump_events) != 0;
+#else // !HAVE_LINUX_FUTEX_H
+    return false;
+#endif // HAVE_LINUX_FUTEX_H
+}
+
+
+static void recorder_doorbell_ring(uint32_t *doorbell, bool shared)
+// ----------------------------------------------------------------------------
+//   Signal a doorbell, waking up all threads waiting on it
+// ----------------------------------------------------------------------------
+{
+    recorder_ring_fetch_add(*doorbell, 1);
+#if HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, doorbell,
+            shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+#else // !HAVE_LINUX_FUTEX_H
+    (void) shared;
+#endif // HAVE_LINUX_FUTEX_H
+}
+
+
+static void recorder_doorbell_wait(uint32_t *doorbell, uint32_t seen,
+                                   unsigned sleep_ms, bool shared)
+// ----------------------------------------------------------------------------
+//   Wait until the doorbell changes from 'seen', or sleep if we can't wait
+// ----------------------------------------------------------------------------
+{
+    struct timespec tm;
+#if HAVE_LINUX_FUTEX_H
+    if (recorder_doorbell_enabled())
+    {
+        tm.tv_sec  = recorder_doorbell_timeout / 1000;
+        tm.tv_nsec = recorder_doorbell_timeout % 1000 * 1000000;
+        syscall(SYS_futex, doorbell,
+                shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, seen,
+                &tm, NULL, 0);
+        return;
+    }
+#else // !HAVE_LINUX_FUTEX_H
+    (void) doorbell;
+    (void) seen;
+    (void) shared;
+#endif // HAVE_LINUX_FUTEX_H
+    tm.tv_sec  = sleep_ms / 1000;
+    tm.tv_nsec = sleep_ms % 1000 * 1000000;
+    nanosleep(&tm, NULL);
+}
+
+
+
+// ============================================================================
+//
+//   Background dump
+//
+// ============================================================================
+
+static bool     background_dump_running  = false;
+static uint32_t background_dump_doorbell = 0;
+
+
+static void recorder_dump_wakeup(void)
+// ----------------------------------------------------------------------------
+//   Wake up the background dump thread, only once while it is waiting
+// ----------------------------------------------------------------------------
+{
+    unsigned waiting = 1;
+    if (recorder_ring_compare_exchange(recorder_dump_waiting, waiting, 0))
+        recorder_doorbell_ring(&background_dump_doorbell, false);
+}
+
+
+static void *background_dump(void *pattern)
+// ----------------------------------------------------------------------------
+//    Dump the recorder (background thread)
+// ----------------------------------------------------------------------------
+//    When there is nothing left to dump, the thread announces that it is
+//    waiting, checks one last time, and waits for the doorbell. Writers
+//    only ring it when a ring goes from empty to non-empty. Wakeups are
+//    at least recorder_dump_batch us apart, so that busy recorders are
+//    dumped in batches, while idle ones are dumped with low latency.
+{
+    const char *what = pattern;
+    uintptr_t   last_wakeup = 0;
+    while (background_dump_running)
+    {
+        unsigned dumped = recorder_sort(what, recorder_format,
+                                        recorder_show, recorder_output);
+        if (dumped)
+            continue;
+
+        bool     events = recorder_doorbell_enabled();
+        uint32_t seen = background_dump_doorbell;
+        if (events)
+        {
+            __atomic_store_n(&recorder_dump_waiting, 1, __ATOMIC_SEQ_CST);
+            dumped = recorder_sort(what, recorder_format,
+                                   recorder_show, recorder_output);
+        }
+        if (dumped || !background_dump_running)
+        {
+            recorder_dump_waiting = 0;
+            continue;
+        }
+        recorder_doorbell_wait(&background_dump_doorbell, seen,
+                               RECORDER_TWEAK(recorder_dump_sleep), false);
+        recorder_dump_waiting = 0;
+        if (!events)
+            continue;
+
+        // Batch records if we were woken up too recently
+        uintptr_t now = recorder_tick();
+        uintptr_t batch = RECORDER_TWEAK(recorder_dump_batch)
+            * RECORDER_HZ / 1000000;
+        if (now - last_wakeup < batch)
+        {
+            uintptr_t wait = (batch - (now - last_wakeup))
+                * 1000000 / RECORDER_HZ;
+            struct timespec tm;
+            tm.tv_sec  = wait / 1000000;
+            tm.tv_nsec = wait % 1000000 * 1000;
+            nanosleep(&tm, NULL);
+        }
+        last_wakeup = recorder_tick();
+    }
+    return pattern;
+}
+
+
+void recorder_background_dump(const char *what)
+// ----------------------------------------------------------------------------
+//   Dump the selected recorders, waiting for records if nothing to dump
+// ----------------------------------------------------------------------------
+{
+    pthread_t tid;
+    background_dump_running = true;
+    if (strcmp(what, "all") == 0)
+        what = ".*";
+    pthread_create(&tid, NULL, background_dump, (void *) what);
+    record(recorder, "Started background dump thread for %s, thread %p",
+           what, (void *) tid);
+}
+
+
+void recorder_background_dump_stop(void)
+// ----------------------------------------------------------------------------
+//   Stop the background dump task
+// ----------------------------------------------------------------------------
+{
+    background_dump_running = false;
+    recorder_doorbell_ring(&background_dump_doorbell, false);
+}
+
+
+
+// ============================================================================
+//
+//    Signal handling
+//
+// ============================================================================
+
+#if HAVE_SIGACTION
+
+typedef struct sigaction        sig_fn;
+#define SIGNAL_DEFAULT          {}
+#define SIGNAL_INTERFACE        int sig, siginfo_t *info, void *ucontext
+#define SIGNAL_CALL             sig, info, ucontext
+
+#else // !HAVE_SIGACTION
+
+/* For MinGW, there is no struct sigaction */
+typedef void (*sig_fn)(int);
+
+#define SIGNAL_DEFAULT          NULL
+#define SIGNAL_INTERFACE        int sig
+#define SIGNAL_CALL             sig
+
+static inline void sigaction(int sig, sig_fn *handler, sig_fn *save)
+// ----------------------------------------------------------------------------
+//   Quick and dirty replacement for sigaction to avoid too many #ifdefs below
+// ----------------------------------------------------------------------------
+{
+    sig_fn old = signal(sig, handler ? *handler : SIG_DFL);
+    if (save)
+        *save = old;
+}
+
+#endif // HAVE_SIGACTION
+
+static sig_fn old_handler[NSIG] = { };
+
+
+static void signal_handler(SIGNAL_INTERFACE)
+// ----------------------------------------------------------------------------
+//    Dump the recorder when receiving a signal
+// ----------------------------------------------------------------------------
+{
+    // Only use async-signal-safe functions from here on: strsignal(),
+    // snprintf() or exit() may allocate memory or take locks
+    record(recorder_signals, "Received signal %d, %+s\n",
+            sig,
+            recorder_dumping ? "already dumping, exiting" : "dumping recorder");
+    if (recorder_dumping)
+        _exit('R');
+    recorder_crashing = 1;
+
+#if HAVE_SIGACTION
+    record(recorder_signals,
+           "Received signal %d si_addr=%p, ucontext %p, dumping recorder",
+           sig, info->si_addr, ucontext);
+
+#else // No sigaction
+    record(recorder_signals, "Received signal %d, dumping recorder", sig);
+#endif // HAVE_SIGACTION
+
+    // Restore previous handler in case we crash during the dump
+    sig_fn action = SIGNAL_DEFAULT;
+    sigaction(sig, &old_handler[sig], &action);
+
+    // Perform the dump. If we get a signal within, we'll exit('R') right away
+    recorder_dump();
+
+    // If there is another hanlder installed, invoke it
+#if HAVE_SIGACTION
+    if (old_handler[sig].sa_flags & SA_SIGINFO)
+    {
+        if (old_handler[sig].sa_sigaction)
+        {
+            record(recorder_signals, "Passing signal %d to action %p\n",
+                   sig, old_handler[sig].sa_sigaction);
+            old_handler[sig].sa_sigaction(sig, info, ucontext);
+        }
+    }
+    else
+    {
+        if (old_handler[sig].sa_handler)
+        {
+            record(recorder_signals, "Passing signal %d to handler %p\n",
+                   sig, old_handler[sig].sa_handler);
+            old_handler[sig].sa_handler(sig);
+        }
+    }
+#else // !HAVE_SIGACTION
+    if (old_handler[sig])
+    {
+        record(recorder_signals, "Passing signal %d to previous %p\n",
+               sig, old_handler[sig]);
+        old_handler[sig](sig);
+    }
+#endif // HAVE_SIGACTION
+
+    // Exit through atexit() handlers, which remove shared memory files
+    uintptr_t mask = (uintptr_t) 1 << sig;
+    if (RECORDER_TWEAK(recorder_signals_exiting) & mask)
+        exit('r');
+    recorder_crashing = 0;
+
+    // Restore the previous action
+    if (RECORDER_TWEAK(recorder_signals_repeating) & mask)
+        sigaction(sig, &action, NULL);
+}
+
+
+#if HAVE_SYS_MMAN_H
+static void recorder_allocate_alt_stack(void)
+// ----------------------------------------------------------------------------
+//    Allocate an alternate stack for the crash handler
+// ----------------------------------------------------------------------------
+{
+    // Setup alt stack for recorder_dump
+    if (!recorder_alt_stack)
+    {
+        size_t size = RECORDER_TWEAK(recorder_alt_stack_size);
+        if (size)
+        {
+            size_t page = getpagesize();
+            recorder_alt_stack = mmap(NULL, size + 2 * page,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANON,
+                                      -1, 0);
+            record(recorder, "Set alt stack to %p size %llu",
+                   recorder_alt_stack, size);
+            if (recorder_alt_stack)
+            {
+                mprotect(recorder_alt_stack, page, PROT_NONE);
+                mprotect(recorder_alt_stack + page + size, page, PROT_NONE);
+
+                stack_t sigstk;
+                sigstk.ss_size = size;
+                sigstk.ss_flags = 0;
+                sigstk.ss_sp = recorder_alt_stack + page;
+                int rc = sigaltstack(&sigstk, NULL);
+                if (rc < 0)
+                    record(recorder_error, "Alt stack %p size %u result %d",
+                           recorder_alt_stack, size, rc);
+            }
+        }
+    }
+
+}
+#endif // HAVE_SYS_MMAN_H
+
+
+void recorder_dump_on_signal(int sig)
+// ----------------------------------------------------------------------------
+//    C interface for Recorder::DumpOnSignal
+// ----------------------------------------------------------------------------
+{
+    if (sig < 0 || sig >= NSIG)
+        return;
+
+#if HAVE_SYS_MMAN_H
+    // Alocate alternative stack if necessary
+    if (!recorder_alt_stack)
+        recorder_allocate_alt_stack();
+#endif // HAVE_SYS_MMAN_H
+
+    // Format once, so that library calls such as memcpy are bound before
+    // we need them on the small alternate stack in the signal handler
+    char warmup[32];
+    recorder_safe_format(warmup, sizeof(warmup), "%s %g", NULL, 0, 0, 1.5);
+
+    // Already set?
+    sig_fn action = SIGNAL_DEFAULT;
+    sigaction(sig, NULL, &action);
+#if HAVE_SIGACTION
+    if ((action.sa_flags & SA_SIGINFO) != 0 &&
+        action.sa_sigaction == signal_handler)
+    {
+        record(recorder_signals, "No change for %s (%d) flag 0x%X address %p\n",
+               strsignal(sig), sig, action.sa_flags, action.sa_sigaction);
+        return;
+    }
+    old_handler[sig] = action;
+
+    action.sa_sigaction = signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(sig, &action, NULL);
+
+#else // HAVE_SIGACTION
+    if (action != signal_handler)
+        old_handler[sig] = action;
+
+    signal(sig, signal_handler);
+#endif // HAVE_SIGACTION
+
+#if HAVE_SIGACTION
+    record(recorder_signals,
+           "Recorder dump handler %p for signal %d, old flags=0x%X action=%p",
+           signal_handler, sig,
+           old_handler[sig].sa_flags, old_handler[sig].sa_sigaction);
+#else
+    record(recorder_signals,
+           "Recorder dump handler %p for signal %d, old %p",
+           signal_handler, sig, old_handler[sig]);
+#endif // HAVE_SIGACTION
+}
+
+
+void recorder_dump_on_common_signals(unsigned add, unsigned remove)
+// ----------------------------------------------------------------------------
+//    Easy interface to dump on the most common signals
+// ----------------------------------------------------------------------------
+{
+    // Normally, this is called after constructors have run, so this is
+    // a good time to check environment settings
+    recorder_trace_set(getenv("RECORDER_TRACES"));
+    recorder_trace_set(getenv("RECORDER_TWEAKS"));
+
+    const char *dump_pattern = getenv("RECORDER_DUMP");
+    if (dump_pattern)
+        recorder_background_dump(dump_pattern);
+
+    unsigned sig;
+    unsigned signals = (add | RECORDER_TWEAK(recorder_signals_mask)) & ~remove;
+
+    record(recorder_signals,
+           "Activating dump for signal mask 0x%X", signals);
+    for (sig = 0; signals; sig++)
+    {
+        unsigned mask = 1U << sig;
+        if (signals & mask)
+            recorder_dump_on_signal(sig);
+        signals &= ~mask;
+    }
+}
+
+
+
+// ============================================================================
+//
+//    Support functions
+//
+// ============================================================================
+
+#ifndef recorder_tick
+//  Time stamps are in units of 1/RECORDER_HZ second since the first tick.
+//  The clock is selected using the RECORDER_CLOCK environment variable
+//  when the first tick is taken:
+//  - "gettimeofday": system time, microsecond resolution
+//  - "monotonic": clock_gettime(CLOCK_MONOTONIC_RAW), default if available
+//  - "cycles": CPU cycle counter, calibrated at startup, where reliable
+
+typedef uint64_t (*recorder_clock_fn)(void);
+
+static recorder_clock_fn recorder_clock        = NULL;
+static uint64_t          recorder_clock_origin = 0;
+
+
+static uint64_t recorder_clock_gettimeofday(void)
+// ----------------------------------------------------------------------------
+//   Time from gettimeofday(), in units of RECORDER_HZ
+// ----------------------------------------------------------------------------
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (uint64_t) t.tv_sec * RECORDER_HZ
+        +  (uint64_t) t.tv_usec * RECORDER_HZ / 1000000;
+}
+
+
+#ifdef CLOCK_MONOTONIC
+#ifdef CLOCK_MONOTONIC_RAW
+#define RECORDER_CLOCK_MONOTONIC        CLOCK_MONOTONIC_RAW
+#else // !CLOCK_MONOTONIC_RAW
+#define RECORDER_CLOCK_MONOTONIC        CLOCK_MONOTONIC
+#endif // CLOCK_MONOTONIC_RAW
+
+static uint64_t recorder_clock_monotonic(void)
+// ----------------------------------------------------------------------------
+//   Time from the monotonic clock, in units of RECORDER_HZ
+// ----------------------------------------------------------------------------
+{
+    struct timespec t;
+    clock_gettime(RECORDER_CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * RECORDER_HZ
+        +  (uint64_t) t.tv_nsec * RECORDER_HZ / 1000000000;
+}
+#define recorder_clock_default          recorder_clock_monotonic
+#else // !CLOCK_MONOTONIC
+#define recorder_clock_default          recorder_clock_gettimeofday
+#endif // CLOCK_MONOTONIC
+
+
+#if     defined(__GNUC__) && defined(__SIZEOF_INT128__)        \
+    && (defined(__x86_64__) || defined(__aarch64__))
+#define RECORDER_CLOCK_CYCLES           1
+
+// Cycle count at start, and RECORDER_HZ / frequency as 32.32 fixed point
+static uint64_t recorder_cycles_origin = 0;
+static uint64_t recorder_cycles_scale  = 0;
+
+
+static inline uint64_t recorder_cycles(void)
+// ----------------------------------------------------------------------------
+//   Read the CPU cycle counter
+// ----------------------------------------------------------------------------
+{
+#if defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t) hi << 32 | lo;
+#else // __aarch64__
+    uint64_t cycles;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#endif // __x86_64__
+}
+
+
+static uint64_t recorder_clock_cycles(void)
+// ----------------------------------------------------------------------------
+//   Time from the cycle counter, in units of RECORDER_HZ
+// ----------------------------------------------------------------------------
+{
+    uint64_t cycles = recorder_cycles() - recorder_cycles_origin;
+    return (unsigned __int128) cycles * recorder_cycles_scale >> 32;
+}
+
+
+static bool recorder_cycles_calibrate(void)
+// ----------------------------------------------------------------------------
+//   Compute the frequency of the cycle counter, return false if unreliable
+// ----------------------------------------------------------------------------
+{
+    uint64_t frequency;
+
+#if defined(__x86_64__)
+    // Only use the TSC if it is invariant (CPUID 0x80000007, EDX bit 8)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & 0x100))
+        return false;
+
+    // Measure how many cycles elapse during 10ms
+    struct timespec tm = { 0, 10000000 };
+    uint64_t t0 = recorder_clock_default();
+    uint64_t c0 = recorder_cycles();
+    nanosleep(&tm, NULL);
+    uint64_t t1 = recorder_clock_default();
+    uint64_t c1 = recorder_cycles();
+    if (t1 <= t0)
+        return false;
+    frequency = (c1 - c0) * RECORDER_HZ / (t1 - t0);
+#else // __aarch64__
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+#endif // __x86_64__
+
+    if (!frequency)
+        return false;
+    recorder_cycles_scale = ((unsigned __int128) RECORDER_HZ << 32) / frequency;
+    recorder_cycles_origin = recorder_cycles();
+    return true;
+}
+#endif // Cycle counter
+
+
+static void recorder_clock_init(void)
+// ----------------------------------------------------------------------------
+//   Select the clock and record the origin of time stamps
+// ----------------------------------------------------------------------------
+//   This cannot call record(), since that would call recorder_tick()
+{
+    static unsigned state = 0;          // 1: Initializing, 2: Initialized
+    unsigned        uninitialized = 0;
+    if (!recorder_ring_compare_exchange(state, uninitialized, 1))
+    {
+        // Another thread is selecting the clock, wait until it's done
+        while (recorder_ring_fetch_add(state, 0) != 2)
+            sched_yield();
+        return;
+    }
+
+    const char       *name  = getenv("RECORDER_CLOCK");
+    recorder_clock_fn clock = recorder_clock_default;
+    bool              bad   = false;
+    if (name)
+    {
+        if (strcmp(name, "gettimeofday") == 0)
+            clock = recorder_clock_gettimeofday;
+#ifdef RECORDER_CLOCK_CYCLES
+        else if (strcmp(name, "cycles") == 0)
+            if (recorder_cycles_calibrate())
+                clock = recorder_clock_cycles;
+            else
+                bad = true;
+#endif // RECORDER_CLOCK_CYCLES
+        else if (strcmp(name, "monotonic") != 0)
+            bad = true;
+    }
+
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    recorder_time_at_start = (uintptr_t)
+        ((uint64_t) (t.tv_sec % 86400) * RECORDER_HZ
+         + (uint64_t) t.tv_usec * RECORDER_HZ / 1000000);
+    recorder_clock_origin = clock();
+    recorder_clock_fn none = NULL;
+    recorder_ring_compare_exchange(recorder_clock, none, clock);
+    recorder_ring_fetch_add(state, 1);
+
+    if (bad)
+        record(recorder_warning, "Clock '%+s' unavailable, using default",
+               name);
+}
+
+
+uintptr_t recorder_tick(void)
+// ----------------------------------------------------------------------------
+//   Return the "ticks" as stored in the recorder
+// ----------------------------------------------------------------------------
+{
+    recorder_clock_fn clock = recorder_clock;
+    if (!clock)
+    {
+        recorder_clock_init();
+        clock = recorder_clock;
+    }
+    return clock() - recorder_clock_origin;
+}
+
+
+static uint64_t recorder_tick_reference(uint64_t *origin, uint32_t *clock)
+// ----------------------------------------------------------------------------
+//   Return the system time at tick 0, as well as the tick clock and origin
+// ----------------------------------------------------------------------------
+//   Processes using the same clock can align their time stamps exactly
+//   using the origin, others have to rely on the system time
+{
+    uintptr_t tick = recorder_tick();
+    uint64_t  now  = recorder_clock_gettimeofday();
+
+    *origin = recorder_clock_origin;
+    *clock  = RECORDER_TICK_OTHER;
+    if (recorder_clock == recorder_clock_gettimeofday)
+        *clock = RECORDER_TICK_GETTIMEOFDAY;
+#ifdef CLOCK_MONOTONIC
+    else if (recorder_clock == recorder_clock_monotonic)
+        *clock = RECORDER_TICK_MONOTONIC;
+#endif // CLOCK_MONOTONIC
+    return now - tick;
+}
+
+#else // recorder_tick
+
+static uint64_t recorder_tick_reference(uint64_t *origin, uint32_t *clock)
+// ----------------------------------------------------------------------------
+//   With an application-defined tick, only rely on the system time
+// ----------------------------------------------------------------------------
+{
+    uintptr_t      tick = recorder_tick();
+    struct timeval t;
+    gettimeofday(&t, NULL);
+
+    *origin = 0;
+    *clock  = RECORDER_TICK_OTHER;
+    return (uint64_t) t.tv_sec * RECORDER_HZ
+        +  (uint64_t) t.tv_usec * RECORDER_HZ / 1000000 - tick;
+}
+#endif // recorder_tick
+
+
+// ============================================================================
+//
+//    Index of recorder names and cache of compiled patterns
+//
+// ============================================================================
+//   recorder_trace_set is called repeatedly, e.g. by the background
+//   configuration thread. Compiled patterns are kept for the next calls,
+//   and names are hashed at activation, so that setting a trace by name
+//   does not test the pattern against every recorder and tweak.
+
+enum
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return (const char *) shan + shan->name;
-}
+    RECORDER_INDEX_SIZE         = 1024, // Hash slots for recorders and tweaks
+    RECORDER_INDEX_PROBES       = 64,   // Max slots tested for a hash
+    RECORDER_PATTERNS           = 16,   // Compiled patterns kept in the cache
+    RECORDER_PATTERN_TEXT       = 64    // Longest pattern kept in the cache
+};
 
+static recorder_info  *recorder_index[RECORDER_INDEX_SIZE];
+static recorder_tweak *recorder_tweak_index[RECORDER_INDEX_SIZE];
 
-const char *recorder_chan_description(recorder_chan_p chan)
+// Set if some name could not be put in the index
+static bool recorder_index_incomplete = false;
+
+typedef struct recorder_pattern
 // ----------------------------------------------------------------------------
-//   Return the description for a given recorder_chan
+//   A compiled pattern in the cache
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return (const char *) shan + shan->description;
-}
+    bool        valid;
+    char        text[RECORDER_PATTERN_TEXT];
+    pattern_t   re;
+} recorder_pattern;
 
+static recorder_pattern recorder_patterns[RECORDER_PATTERNS];
+static unsigned         recorder_patterns_busy = 0;
+static unsigned         recorder_patterns_next = 0;
 
-const char *recorder_chan_unit(recorder_chan_p chan)
+
+typedef struct recorder_match
 // ----------------------------------------------------------------------------
-//   Return the measurement unit for a given recorder_chan
+//   State for iterating over the recorders or tweaks matching a pattern
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return (const char *) shan + shan->unit;
-}
+    pattern_t  *re;
+    const char *text;           // Text of the pattern
+    const char *name;           // Name to look up in the index, or NULL
+    size_t      prefix;         // Length of literal prefix of the pattern
+    unsigned    hash;           // Hash of name
+    unsigned    probe;          // Index slot of the last match
+} recorder_match;
 
 
-recorder_data recorder_chan_min(recorder_chan_p chan)
+static unsigned recorder_name_hash(const char *name)
 // ----------------------------------------------------------------------------
-//   Return the min value specified for the given channel
+//   Case-insensitive hash of a name, since patterns ignore case
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->min;
+    unsigned hash = 2166136261U;
+    while (*name)
+        hash = (hash ^ (unsigned) tolower((unsigned char) *name++)) * 16777619U;
+    return hash;
 }
 
 
-recorder_data recorder_chan_max(recorder_chan_p chan)
+static bool recorder_name_is(const char *name, const char *text, size_t len)
 // ----------------------------------------------------------------------------
-//   Return the max value specified for the given channel
+//   Check if the first len characters of name match text ignoring case
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->max;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (tolower((unsigned char) name[i]) != tolower((unsigned char) text[i]))
+            return false;
+        if (!name[i])
+            break;
+    }
+    return true;
 }
 
 
-recorder_type recorder_chan_type(recorder_chan_p chan)
+static void recorder_index_insert(recorder_info *rec)
 // ----------------------------------------------------------------------------
-//   Return the element type for a given recorder_chan
+//   Lock-free insertion of a recorder in the index
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->type;
+    unsigned hash = recorder_name_hash(rec->name);
+    unsigned probe;
+
+    for (probe = 0; probe < RECORDER_INDEX_PROBES; probe++)
+    {
+        recorder_info **slot =
+            &recorder_index[(hash + probe) % RECORDER_INDEX_SIZE];
+        recorder_info  *none = NULL;
+        if (recorder_ring_compare_exchange(*slot, none, rec))
+            return;
+    }
+    recorder_index_incomplete = true;
 }
 
 
-size_t recorder_chan_size(recorder_chan_p chan)
+static void recorder_tweak_index_insert(recorder_tweak *tweak)
 // ----------------------------------------------------------------------------
-//   Return the ring size for a given recorder_chan
+//   Lock-free insertion of a tweak in the index
 // ----------------------------------------------------------------------------
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->ring.size;
+    unsigned hash = recorder_name_hash(tweak->name);
+    unsigned probe;
+
+    for (probe = 0; probe < RECORDER_INDEX_PROBES; probe++)
+    {
+        recorder_tweak **slot =
+            &recorder_tweak_index[(hash + probe) % RECORDER_INDEX_SIZE];
+        recorder_tweak  *none = NULL;
+        if (recorder_ring_compare_exchange(*slot, none, tweak))
+            return;
+    }
+    recorder_index_incomplete = true;
 }
 
 
-size_t recorder_chan_item_size(recorder_chan_p chan)
+static pattern_t *recorder_pattern_get(const char *text,
+                                       pattern_t *local,
+                                       int *status)
 // ----------------------------------------------------------------------------
-//   Return the ring item size for a given recorder_chan
+//   Return a compiled pattern from the cache, or compile it in local
 // ----------------------------------------------------------------------------
+//   If another thread uses the cache, or the pattern is too long, the
+//   pattern is compiled in local. It must be released in all cases.
 {
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->ring.item_size;
+    unsigned idle = 0;
+    unsigned p;
+
+    *status = 0;
+    if (strlen(text) < RECORDER_PATTERN_TEXT &&
+        recorder_ring_compare_exchange(recorder_patterns_busy, idle, 1))
+    {
+        recorder_pattern *pattern;
+        for (p = 0; p < RECORDER_PATTERNS; p++)
+        {
+            pattern = &recorder_patterns[p];
+            if (pattern->valid && strcmp(pattern->text, text) == 0)
+                return &pattern->re;
+        }
+
+        pattern = &recorder_patterns[recorder_patterns_next++ %
+                                     RECORDER_PATTERNS];
+        if (pattern->valid)
+            pattern_free(&pattern->re);
+        strcpy(pattern->text, text);
+        *status = pattern_comp(&pattern->re, pattern->text);
+        pattern->valid = *status == 0;
+        return &pattern->re;
+    }
+
+    *status = pattern_comp(local, text);
+    return local;
 }
 
 
-size_t recorder_chan_readable(recorder_chan_p chan, ringidx_t *reader)
+static void recorder_pattern_release(pattern_t *re, pattern_t *local)
 // ----------------------------------------------------------------------------
-//   Return number of readable elements in ring
+//   Release a pattern returned by recorder_pattern_get
 // ----------------------------------------------------------------------------
 {
-    if (!recorder_chans_valid(chan->chans))
-        return 0;
-    recorder_shan_p shan = recorder_shared(chan);
-    return recorder_ring_readable(&shan->ring, reader);
+    unsigned p;
+
+    if (re == local)
+    {
+        pattern_free(local);
+        return;
+    }
+    for (p = 0; p < RECORDER_PATTERNS; p++)
+        if (re == &recorder_patterns[p].re && !recorder_patterns[p].valid)
+            pattern_free(re);
+    __atomic_store_n(&recorder_patterns_busy, 0, __ATOMIC_RELEASE);
 }
 
 
-size_t recorder_chan_read(recorder_chan_p chan,
-                          recorder_data *ptr, size_t count,
-                          ringidx_t *reader)
+static void recorder_match_init(recorder_match *m,
+                                pattern_t *re, const char *text)
 // ----------------------------------------------------------------------------
-//   Read data from the ring
+//   Find how the names matching a pattern can be found quickly
 // ----------------------------------------------------------------------------
+//   A pattern made only of letters, digits and '_' matches one name, which
+//   is looked up in the index. Otherwise, only names that begin with the
+//   literal part of the pattern are tested against the pattern.
 {
-    if (!recorder_chans_valid(chan->chans))
-        return 0;
-    recorder_shan_p shan = recorder_shared(chan);
-    return recorder_ring_read(&shan->ring, ptr, count, reader, NULL, NULL);
+    size_t len = 0;
+
+    m->re = re;
+    m->text = text;
+    m->name = NULL;
+    m->prefix = 0;
+    m->hash = 0;
+    m->probe = 0;
+
+#if HAVE_REGEX_H
+    while (isalnum((unsigned char) text[len]) || text[len] == '_')
+        len++;
+    if (text[len] == 0 && len > 0 && !recorder_index_incomplete)
+    {
+        m->name = text;
+        m->hash = recorder_name_hash(text);
+    }
+    else if (strchr(text, '|') == NULL)
+    {
+        // In "ab*" or "ab?", the prefix is "a"
+        if (len && text[len] && strchr("*?{", text[len]))
+            len--;
+        m->prefix = len;
+    }
+#endif // HAVE_REGEX_H
 }
 
 
-ringidx_t recorder_chan_reader(recorder_chan_p chan)
+static inline bool recorder_match_name(recorder_match *m, const char *name)
 // ----------------------------------------------------------------------------
-//   Return current reader index for recorder_chan
+//   Check if a name matches the pattern
 // ----------------------------------------------------------------------------
 {
-    if (!recorder_chans_valid(chan->chans))
-        return 0;
-    recorder_shan_p shan = recorder_shared(chan);
-    return shan->ring.reader;
+    return recorder_name_is(name, m->text, m->prefix) &&
+        pattern_match(m->re, name);
 }
 
 
-static recorder_type recorder_type_from_format(const char *format,
-                                               unsigned index)
+static recorder_info *recorder_match_recorder(recorder_match *m,
+                                              recorder_info *rec)
 // ----------------------------------------------------------------------------
-//   Analyze format string to figure out the type of export
+//   Return the next recorder after rec (first if NULL) matching the pattern
 // ----------------------------------------------------------------------------
 {
-    char           c;
-    bool           in_format    = false;
-    recorder_type  result       = RECORDER_NONE;
-    unsigned       start_index  = index;
-    const char    *start_format = format;
-
-    for (c = *format++; c; c = *format++)
+    if (m->name)
     {
-        if (c == '%')
+        size_t   len   = strlen(m->name) + 1;
+        unsigned probe = rec ? m->probe + 1 : 0;
+        for (; probe < RECORDER_INDEX_PROBES; probe++)
         {
-            in_format = !in_format;
-            continue;
+            rec = __atomic_load_n(&recorder_index[(m->hash + probe) %
+                                                  RECORDER_INDEX_SIZE],
+                                  __ATOMIC_ACQUIRE);
+            if (!rec)
+                break;
+            if (recorder_name_is(rec->name, m->name, len))
+            {
+                m->probe = probe;
+                return rec;
+            }
         }
-        if (!in_format)
-            continue;
-        switch (c)
-        {
-        case 'f': case 'F':  // Floating point formatting
-        case 'g': case 'G':
-        case 'e': case 'E':
-        case 'a': case 'A':
-            result = RECORDER_REAL;
-            break;
-
-        case 'b':           // Integer formatting
-        case 'd': case 'D':
-        case 'i':
-            result = RECORDER_SIGNED;
-            break;
+        return NULL;
+    }
 
-        case 'c': case 'C':
-        case 's': case 'S':
-        case 'o': case 'O':
-        case 'u': case 'U':
-        case 'x':
-        case 'X':
-        case 'p':
-            result = RECORDER_UNSIGNED;
-            break;
+    for (rec = rec ? rec->next : recorder_first(); rec; rec = rec->next)
+        if (recorder_match_name(m, rec->name))
+            return rec;
+    return NULL;
+}
 
-            // GCC: case '0' ... '9', not supported on IAR
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-        case '.':
-        case '+':
-        case '-':
-        case 'l': case 'L':
-        case 'h':
-        case 'j':
-        case 't':
-        case 'z':
-        case 'q':
-        case 'v':
-            break;
-        case 'n':           // Expect two args
-        case '*':
-        default:
-            result = RECORDER_INVALID;
-            break;
-        }
 
-        if (result != RECORDER_NONE)
+static recorder_tweak *recorder_match_tweak(recorder_match *m,
+                                            recorder_tweak *tweak)
+// ----------------------------------------------------------------------------
+//   Return the next tweak after tweak (first if NULL) matching the pattern
+// ----------------------------------------------------------------------------
+{
+    if (m->name)
+    {
+        size_t   len   = strlen(m->name) + 1;
+        unsigned probe = tweak ? m->probe + 1 : 0;
+        for (; probe < RECORDER_INDEX_PROBES; probe++)
         {
-            if (!index)
+            tweak = __atomic_load_n(&recorder_tweak_index[(m->hash + probe) %
+                                                          RECORDER_INDEX_SIZE],
+                                    __ATOMIC_ACQUIRE);
+            if (!tweak)
+                break;
+            if (recorder_name_is(tweak->name, m->name, len))
             {
-                record(recorder, "Export type at index %u in %s is %u",
-                       start_index, start_format, result);
-                return result;
+                m->probe = probe;
+                return tweak;
             }
-            index--;
-            result = RECORDER_NONE;
-            in_format = false;
         }
+        return NULL;
     }
 
-    record(recorder_warning,
-           "Unknown format directive at index %u in %s",
-           start_index, start_format);
-    return RECORDER_INVALID;
+    for (tweak = tweak ? tweak->next : tweaks; tweak; tweak = tweak->next)
+        if (recorder_match_name(m, tweak->name))
+            return tweak;
+    return NULL;
 }
 
 
 
-// ============================================================================
-//
-//   Background dump
-//
-// ============================================================================
+void recorder_activate (recorder_info *recorder)
+// ----------------------------------------------------------------------------
+//   Activate the given recorder by putting it in linked list
+// ----------------------------------------------------------------------------
+{
+    static recorder_info *last = NULL;
+    if (recorder->next || recorder == last)
+    {
+        record(recorder_error, "Re-activating %+s (%p)",
+               recorder->name, recorder);
+        return;
+    }
+    record(recorder, "Activating '%+s' (%p)", recorder->name, recorder);
+    recorder_index_insert(recorder);
 
-static bool background_dump_running = false;
+    // Lock-free insertion. Note that compare_exchange updates head if it fails
+    recorder_info  *head = recorders;
+    do { recorder->next = head; }
+    while (!recorder_ring_compare_exchange(recorders, head, recorder));
+    if (!head)
+        last = recorder;
+}
 
 
-static void *background_dump(void *pattern)
+void recorder_shards_activate(recorder_info *recorder,
+                              recorder_shards *shards,
+                              size_t size)
 // ----------------------------------------------------------------------------
-//    Dump the recorder (background thread)
+//   Initialize the additional rings for a recorder, then start using them
 // ----------------------------------------------------------------------------
 {
-    const char *what = pattern;
-    while (background_dump_running)
+    unsigned s;
+
+    if (recorder->shards)
     {
-        unsigned dumped = recorder_sort(what, recorder_format,
-                                        recorder_show, recorder_output);
-        if (dumped == 0)
+        record(recorder_error, "Re-activating shards for %+s (%p)",
+               recorder->name, recorder);
+        return;
+    }
+    record(recorder, "Activating %u shards for '%+s' (%p)",
+           shards->count, recorder->name, recorder);
+
+    // On NUMA systems, place ring N on node N % nodes, ring 0 being static
+    unsigned nodes = recorder_numa_init();
+    if (nodes > 1 && !shards->placed)
+    {
+        recorder_ring_t **placed = malloc(shards->count * sizeof(*placed));
+        if (placed)
         {
-            struct timespec tm;
-            tm.tv_sec  = 0;
-            tm.tv_nsec = 1000000 * RECORDER_TWEAK(recorder_dump_sleep);
-            nanosleep(&tm, NULL);
+            for (s = 0; s < shards->count; s++)
+            {
+                unsigned node = (s + 1) % nodes;
+                void *ring = recorder_alloc(shards->stride, node);
+                if (!ring)
+                {
+                    record(recorder_warning,
+                           "Unable to place shard %u of %+s on node %u",
+                           s + 1, recorder->name, node);
+                    ring = (char *) shards->first + s * shards->stride;
+                }
+                placed[s] = ring;
+            }
+            shards->placed = placed;
         }
     }
-    return pattern;
+
+    for (s = 0; s < shards->count; s++)
+    {
+        void *ring = shards->placed
+            ? (void *) shards->placed[s]
+            : (void *) ((char *) shards->first + s * shards->stride);
+        recorder_ring_init_sequenced(ring, size, sizeof(recorder_entry));
+    }
+    recorder->shards = shards;
 }
 
 
-void recorder_background_dump(const char *what)
+void recorder_tweak_activate (recorder_tweak *tweak)
 // ----------------------------------------------------------------------------
-//   Dump the selected recorders, sleeping sleep_ms if nothing to dump
+//   Activate the given recorder by putting it in linked list
 // ----------------------------------------------------------------------------
 {
-    pthread_t tid;
-    background_dump_running = true;
-    if (strcmp(what, "all") == 0)
-        what = ".*";
-    pthread_create(&tid, NULL, background_dump, (void *) what);
-    record(recorder, "Started background dump thread for %s, thread %p",
-           what, (void *) tid);
+    static recorder_tweak *last = NULL;
+    if (tweak->next || tweak == last)
+    {
+        record(recorder_error, "Re-activating tweak %+s (%p)",
+               tweak->name, tweak);
+        return;
+    }
+    record(recorder, "Activating tweak '%+s' (%p)", tweak->name, tweak);
+    recorder_tweak_index_insert(tweak);
+
+    // Lock-free insertion. Note that compare_exchange updates head if it fails
+    recorder_tweak  *head = tweaks;
+    do { tweak->next = head; }
+    while (!recorder_ring_compare_exchange(tweaks, head, tweak));
+    if (!head)
+        last = tweak;
 }
 
 
-void recorder_background_dump_stop(void)
+void recorder_sections_register(recorder_section *section)
 // ----------------------------------------------------------------------------
-//   Stop the background dump task
+//   Register the sections of a module, to activate them on first use
 // ----------------------------------------------------------------------------
+//   Each source file of a module registers the same sections, one after the
+//   other since they are registered by constructors of the same module.
+//   Only the first registration of a module is kept. Modules are compared
+//   using both sections, since a module may have no recorders or no tweaks.
 {
-    background_dump_running = false;
-}
-
-
-
-// ============================================================================
-//
-//    Signal handling
-//
-// ============================================================================
-
-#if HAVE_SIGACTION
-
-typedef struct sigaction        sig_fn;
-#define SIGNAL_DEFAULT          {}
-#define SIGNAL_INTERFACE        int sig, siginfo_t *info, void *ucontext
-#define SIGNAL_CALL             sig, info, ucontext
-
-#else // !HAVE_SIGACTION
+    static recorder_info * const  *last_infos  = NULL;
+    static recorder_tweak * const *last_tweaks = NULL;
+    if (section->infos == section->infos_end &&
+        section->tweaks == section->tweaks_end)
+        return;
+    if (section->infos == last_infos && section->tweaks == last_tweaks)
+        return;
+    last_infos = section->infos;
+    last_tweaks = section->tweaks;
 
-/* For MinGW, there is no struct sigaction */
-typedef void (*sig_fn)(int);
+    recorder_section *head = recorder_sections;
+    do { section->next = head; }
+    while (!recorder_ring_compare_exchange(recorder_sections, head, section));
+}
 
-#define SIGNAL_DEFAULT          NULL
-#define SIGNAL_INTERFACE        int sig
-#define SIGNAL_CALL             sig
 
-static inline void sigaction(int sig, sig_fn *handler, sig_fn *save)
+static void recorder_sections_activate(void)
 // ----------------------------------------------------------------------------
-//   Quick and dirty replacement for sigaction to avoid too many #ifdefs below
+//   Activate the recorders and tweaks in the sections registered so far
 // ----------------------------------------------------------------------------
 {
-    sig_fn old = signal(sig, handler ? *handler : SIG_DFL);
-    if (save)
-        *save = old;
+    // Take the registered sections, so that each is only activated once
+    recorder_ring_fetch_add(recorder_sections_activating, 1);
+    recorder_section *section = recorder_sections;
+    while (section &&
+           !recorder_ring_compare_exchange(recorder_sections, section, NULL))
+        continue;
+
+    for (; section; section = section->next)
+    {
+        recorder_info * const  *info;
+        recorder_tweak * const *tweak;
+        for (tweak = section->tweaks; tweak < section->tweaks_end; tweak++)
+            if (*tweak)
+                recorder_tweak_activate(*tweak);
+        for (info = section->infos; info < section->infos_end; info++)
+            if (*info)
+                recorder_activate(*info);
+    }
+
+    // Wait for other threads activating sections they took before us
+    recorder_ring_fetch_add(recorder_sections_activating, -1);
+    while (recorder_sections_activating && !recorder_crashing)
+        sched_yield();
 }
 
-#endif // HAVE_SIGACTION
 
-static sig_fn old_handler[NSIG] = { };
 
 
-static void signal_handler(SIGNAL_INTERFACE)
+// ============================================================================
+//
+//    Asynchronous traces
+//
+// ============================================================================
+//  When recorder_trace_async is set, the recording thread only publishes the
+//  position of traced entries in a queue. A background thread formats them.
+
+typedef struct recorder_trace_request
 // ----------------------------------------------------------------------------
-//    Dump the recorder when receiving a signal
+//   A traced entry waiting to be formatted
 // ----------------------------------------------------------------------------
 {
-    record(recorder_signals, "Received signal %s, %+s\n",
-            strsignal(sig),
-            recorder_dumping ? "already dumping, exiting" : "dumping recorder");
-    if (recorder_dumping)
-        exit('R');
+    recorder_info      *rec;
+    recorder_ring_p     ring;
+    ringidx_t           index;          // Index of the entry in the ring
+} recorder_trace_request;
 
-#if HAVE_SIGACTION
-    record(recorder_signals,
-           "Received signal %+s (%d) si_addr=%p, ucontext %p, dumping recorder",
-           strsignal(sig), sig, info->si_addr, ucontext);
 
-#else // No sigaction
-    record(recorder_signals, "Received signal %d, dumping recorder", sig);
-#endif // HAVE_SIGACTION
+/// Queue of traced entries, read by the trace thread
+static struct
+{
+    recorder_ring_t             ring;
+    recorder_trace_request      data[RECORDER_TRACE_QUEUE_SIZE];
+} recorder_trace_queue;
 
-    // Restore previous handler in case we crash during the dump
-    sig_fn action = SIGNAL_DEFAULT;
-    sigaction(sig, &old_handler[sig], &action);
+static unsigned  recorder_trace_started  = 0;
+static unsigned  recorder_trace_waiting  = 0;
+static uint32_t  recorder_trace_doorbell = 0;
+static uintptr_t recorder_trace_drops    = 0;
 
-    // Perform the dump. If we get a signal within, we'll exit('R') right away
-    recorder_dump();
 
-    // If there is another hanlder installed, invoke it
-#if HAVE_SIGACTION
-    if (old_handler[sig].sa_flags & SA_SIGINFO)
-    {
-        if (old_handler[sig].sa_sigaction)
-        {
-            record(recorder_signals, "Passing signal %s (%d) to action %p\n",
-                   strsignal(sig), sig, old_handler[sig].sa_sigaction);
-            old_handler[sig].sa_sigaction(sig, info, ucontext);
-        }
-    }
-    else
-    {
-        if (old_handler[sig].sa_handler)
-        {
-            record(recorder_signals, "Passing signal %s (%d) to handler %p\n",
-                   strsignal(sig), sig, old_handler[sig].sa_handler);
-            old_handler[sig].sa_handler(sig);
-        }
-    }
-#else // !HAVE_SIGACTION
-    if (old_handler[sig])
-    {
-        record(recorder_signals, "Passing signal %s (%d) to previous %p\n",
-               strsignal(sig), sig, old_handler[sig]);
-        old_handler[sig](sig);
-    }
-#endif // HAVE_SIGACTION
+static bool recorder_trace_full(recorder_ring_p ring,
+                                ringidx_t from, ringidx_t to)
+// ----------------------------------------------------------------------------
+//   When the trace queue is full, drop the entry and count it
+// ----------------------------------------------------------------------------
+{
+    (void) ring;
+    recorder_ring_fetch_add(recorder_trace_drops, to - from);
+    return false;
+}
 
-    uintptr_t mask = (uintptr_t) 1 << sig;
-    if (RECORDER_TWEAK(recorder_signals_exiting) & mask)
-        exit('r');
 
-    // Restore the previous action
-    if (RECORDER_TWEAK(recorder_signals_repeating) & mask)
-        sigaction(sig, &action, NULL);
+static bool recorder_trace_commit(recorder_ring_p ring,
+                                  ringidx_t from, ringidx_t to)
+// ----------------------------------------------------------------------------
+//   Wait for other writers to commit before us, requests are copied quickly
+// ----------------------------------------------------------------------------
+{
+    (void) ring;
+    (void) from;
+    (void) to;
+    sched_yield();
+    return true;
 }
 
 
-#if HAVE_SYS_MMAN_H
-static void recorder_allocate_alt_stack(void)
+static void recorder_trace_dump(recorder_info *rec,
+                                recorder_ring_p ring,
+                                recorder_entry *entry)
 // ----------------------------------------------------------------------------
-//    Allocate an alternate stack for the crash handler
+//   Format a traced entry, measuring the time it takes while publishing stats
 // ----------------------------------------------------------------------------
 {
-    // Setup alt stack for recorder_dump
-    if (!recorder_alt_stack)
+    if (!recorder_stats_interval)
     {
-        size_t size = RECORDER_TWEAK(recorder_alt_stack_size);
-        if (size)
-        {
-            size_t page = getpagesize();
-            recorder_alt_stack = mmap(NULL, size + 2 * page,
-                                      PROT_READ | PROT_WRITE,
-                                      MAP_PRIVATE | MAP_ANON,
-                                      -1, 0);
-            record(recorder, "Set alt stack to %p size %llu",
-                   recorder_alt_stack, size);
-            if (recorder_alt_stack)
-            {
-                mprotect(recorder_alt_stack, page, PROT_NONE);
-                mprotect(recorder_alt_stack + page + size, page, PROT_NONE);
-
-                stack_t sigstk;
-                sigstk.ss_size = size;
-                sigstk.ss_flags = 0;
-                sigstk.ss_sp = recorder_alt_stack + page;
-                int rc = sigaltstack(&sigstk, NULL);
-                if (rc < 0)
-                    record(recorder_error, "Alt stack %p size %u result %d",
-                           recorder_alt_stack, size, rc);
-            }
-        }
+        recorder_dump_entry(rec, ring, entry,
+                            recorder_format, recorder_show, recorder_output);
+        return;
     }
 
+    uintptr_t start = recorder_tick();
+    recorder_dump_entry(rec, ring, entry,
+                        recorder_format, recorder_show, recorder_output);
+    recorder_ring_fetch_add(rec->stats.traced, 1);
+    recorder_ring_fetch_add(rec->stats.trace_ticks, recorder_tick() - start);
 }
-#endif // HAVE_SYS_MMAN_H
 
 
-void recorder_dump_on_signal(int sig)
+static bool recorder_trace_format(recorder_trace_request *request)
 // ----------------------------------------------------------------------------
-//    C interface for Recorder::DumpOnSignal
+//   Format a traced entry, unless it was overwritten in the meantime
 // ----------------------------------------------------------------------------
 {
-    if (sig < 0 || sig >= NSIG)
-        return;
-
-#if HAVE_SYS_MMAN_H
-    // Alocate alternative stack if necessary
-    if (!recorder_alt_stack)
-        recorder_allocate_alt_stack();
-#endif // HAVE_SYS_MMAN_H
+    // Copy the entry and its continuations, since writers may overwrite it
+    struct
+    {
+        recorder_ring_t ring;
+        recorder_entry  data[RECORDER_RECORD_SLOTS];
+    } copy;
+    recorder_ring_p  ring  = request->ring;
+    recorder_entry  *base  = (recorder_entry *) (ring + 1);
+    size_t           size  = ring->size;
+    ringidx_t        index = request->index;
+    unsigned         count = size < array_size(copy.data)
+                           ? size : array_size(copy.data);
+    unsigned         i;
+
+    for (i = 0; i < count; i++)
+        copy.data[i] = base[(index + i) & (size - 1)];
+    for (i = count; i < array_size(copy.data); i++)
+        copy.data[i].format = "";
+    copy.ring.size = array_size(copy.data);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (ring->writer - index > size)
+        return false;
 
-    // Already set?
-    sig_fn action = SIGNAL_DEFAULT;
-    sigaction(sig, NULL, &action);
-#if HAVE_SIGACTION
-    if ((action.sa_flags & SA_SIGINFO) != 0 &&
-        action.sa_sigaction == signal_handler)
+    // Keep the largest delay between recording and formatting
+    if (recorder_stats_interval)
     {
-        record(recorder_signals, "No change for %s (%d) flag 0x%X address %p\n",
-               strsignal(sig), sig, action.sa_flags, action.sa_sigaction);
-        return;
+        uintptr_t lag = recorder_tick() - copy.data[0].timestamp;
+        uintptr_t max = recorder_stats_trace_lag;
+        while (lag > max &&
+               !recorder_ring_compare_exchange(recorder_stats_trace_lag,
+                                               max, lag))
+            continue;
     }
-    old_handler[sig] = action;
-
-    action.sa_sigaction = signal_handler;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
-    sigaction(sig, &action, NULL);
-
-#else // HAVE_SIGACTION
-    if (action != signal_handler)
-        old_handler[sig] = action;
-
-    signal(sig, signal_handler);
-#endif // HAVE_SIGACTION
 
-#if HAVE_SIGACTION
-    record(recorder_signals,
-           "Recorder dump handler %p for signal %d, old flags=0x%X action=%p",
-           signal_handler, sig,
-           old_handler[sig].sa_flags, old_handler[sig].sa_sigaction);
-#else
-    record(recorder_signals,
-           "Recorder dump handler %p for signal %d, old %p",
-           signal_handler, sig, old_handler[sig]);
-#endif // HAVE_SIGACTION
+    // Treat unsafe strings as pointers, they may no longer be valid
+    recorder_trace_deferred = true;
+    recorder_trace_dump(request->rec, &copy.ring, copy.data);
+    recorder_trace_deferred = false;
+    return true;
 }
 
 
-void recorder_dump_on_common_signals(unsigned add, unsigned remove)
+static unsigned recorder_trace_flush(void)
 // ----------------------------------------------------------------------------
-//    Easy interface to dump on the most common signals
+//   Format all queued trace entries, return the number formatted
 // ----------------------------------------------------------------------------
 {
-    // Normally, this is called after constructors have run, so this is
-    // a good time to check environment settings
-    recorder_trace_set(getenv("RECORDER_TRACES"));
-    recorder_trace_set(getenv("RECORDER_TWEAKS"));
-
-    const char *dump_pattern = getenv("RECORDER_DUMP");
-    if (dump_pattern)
-        recorder_background_dump(dump_pattern);
-
-    unsigned sig;
-    unsigned signals = (add | RECORDER_TWEAK(recorder_signals_mask)) & ~remove;
-
-    record(recorder_signals,
-           "Activating dump for signal mask 0x%X", signals);
-    for (sig = 0; signals; sig++)
+    recorder_trace_request request;
+    unsigned               formatted = 0;
+    recorder_batch_begin();
+    while (recorder_ring_read(&recorder_trace_queue.ring, &request, 1,
+                              NULL, NULL, NULL))
     {
-        unsigned mask = 1U << sig;
-        if (signals & mask)
-            recorder_dump_on_signal(sig);
-        signals &= ~mask;
+        if (recorder_trace_format(&request))
+            formatted++;
+        else
+            recorder_ring_fetch_add(recorder_trace_drops, 1);
     }
+    recorder_batch_end();
+    return formatted;
 }
 
 
+static bool recorder_trace_report(void)
+// ----------------------------------------------------------------------------
+//   Report entries that were dropped because the trace thread fell behind
+// ----------------------------------------------------------------------------
+{
+    static uintptr_t reported = 0;
+    uintptr_t        drops    = recorder_trace_drops;
+    if (drops == reported)
+        return false;
+    record(recorder_warning, "Dropped %lu trace entries (%lu total)",
+           (unsigned long) (drops - reported), (unsigned long) drops);
+    reported = drops;
+    return true;
+}
 
-// ============================================================================
-//
-//    Support functions
-//
-// ============================================================================
 
-#ifndef recorder_tick
-uintptr_t recorder_tick(void)
+static void recorder_trace_atexit(void)
 // ----------------------------------------------------------------------------
-//   Return the "ticks" as stored in the recorder
+//   Format the remaining traces when exiting
 // ----------------------------------------------------------------------------
 {
-    static uintptr_t initialTick = 0;
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    uintptr_t tick = t.tv_sec * RECORDER_HZ + t.tv_usec / (1000000/RECORDER_HZ);
-    if (!initialTick)
+    recorder_trace_flush();
+    if (recorder_trace_report())
+        recorder_trace_flush();
+}
+
+
+static void *recorder_trace_thread(void *arg)
+// ----------------------------------------------------------------------------
+//   Background thread formatting asynchronous traces
+// ----------------------------------------------------------------------------
+{
+    for (;;)
     {
-        initialTick = tick;
-        recorder_time_at_start = tick % ((uintptr_t) 86400 * RECORDER_HZ);
-    }
+        if (recorder_trace_flush() || recorder_trace_report())
+            continue;
 
-    return tick - initialTick;
+        uint32_t seen = recorder_trace_doorbell;
+        __atomic_store_n(&recorder_trace_waiting, 1, __ATOMIC_SEQ_CST);
+        if (!recorder_ring_readable(&recorder_trace_queue.ring, NULL))
+            recorder_doorbell_wait(&recorder_trace_doorbell, seen,
+                                   RECORDER_TWEAK(recorder_dump_sleep), false);
+        recorder_trace_waiting = 0;
+    }
+    return arg;
 }
-#endif // recorder_tick
 
 
-void recorder_activate (recorder_info *recorder)
+static void recorder_trace_start(void)
 // ----------------------------------------------------------------------------
-//   Activate the given recorder by putting it in linked list
+//   Start the trace thread the first time an asynchronous trace is emitted
 // ----------------------------------------------------------------------------
 {
-    if (recorder->next)
+    unsigned stopped = 0;
+    if (recorder_ring_compare_exchange(recorder_trace_started, stopped, 1))
     {
-        record(recorder_error, "Re-activating %+s (%p)",
-               recorder->name, recorder);
-        return;
+        pthread_t tid;
+        recorder_ring_init(&recorder_trace_queue.ring,
+                           RECORDER_TRACE_QUEUE_SIZE,
+                           sizeof(recorder_trace_request));
+        atexit(recorder_trace_atexit);
+        pthread_create(&tid, NULL, recorder_trace_thread, NULL);
+        recorder_trace_started = 2;
     }
-    record(recorder, "Activating '%+s' (%p)", recorder->name, recorder);
-
-    // Lock-free insertion. Note that compare_exchange updates head if it fails
-    recorder_info  *head = recorders;
-    do { recorder->next = head; }
-    while (!recorder_ring_compare_exchange(recorders, head, recorder));
+    while (recorder_trace_started != 2)
+        sched_yield();
 }
 
 
-void recorder_tweak_activate (recorder_tweak *tweak)
+static void recorder_trace_defer(recorder_info *rec, recorder_ring_p ring,
+                                 recorder_entry *entry)
 // ----------------------------------------------------------------------------
-//   Activate the given recorder by putting it in linked list
+//   Publish a traced entry for the trace thread to format it
 // ----------------------------------------------------------------------------
 {
-    if (tweak->next)
+    if (recorder_trace_started != 2)
+        recorder_trace_start();
+
+    // Reconstruct the full ring index from the entry position
+    recorder_entry *base   = (recorder_entry *) (ring + 1);
+    size_t          size   = ring->size;
+    ringidx_t       writer = ring->writer;
+    ringidx_t       index  = writer - 1 - ((writer - 1 - (entry - base)) & (size - 1));
+
+    recorder_trace_request request = { rec, ring, index };
+    recorder_ring_write(&recorder_trace_queue.ring, &request, 1,
+                        recorder_trace_full, recorder_trace_commit, NULL);
+
+    // Wake up the trace thread if it is waiting for entries
+    if (recorder_trace_waiting)
     {
-        record(recorder_error, "Re-activating tweak %+s (%p)",
-               tweak->name, tweak);
-        return;
+        unsigned waiting = 1;
+        if (recorder_ring_compare_exchange(recorder_trace_waiting, waiting, 0))
+            recorder_doorbell_ring(&recorder_trace_doorbell, false);
     }
-    record(recorder, "Activating tweak '%+s' (%p)", tweak->name, tweak);
-
-    // Lock-free insertion. Note that compare_exchange updates head if it fails
-    recorder_tweak  *head = tweaks;
-    do { tweak->next = head; }
-    while (!recorder_ring_compare_exchange(tweaks, head, tweak));
 }
 
 
 
-
 // ============================================================================
 //
 //    Recorder sharing
@@ -2274,54 +7806,120 @@ void recorder_trace_entry(recorder_info *info, recorder_entry *entry)
 // ----------------------------------------------------------------------------
 //   Show a recorder entry when a trace is enabled
 // ----------------------------------------------------------------------------
+{
+    unsigned r, rings = recorder_ring_count(info);
+
+    // Find which ring the entry belongs to
+    for (r = 0; r < rings; r++)
+    {
+        recorder_ring_p ring = recorder_shard_ring(info, r);
+        recorder_entry *base = (recorder_entry *) (ring + 1);
+        if (entry >= base && entry < base + ring->size)
+        {
+            recorder_trace_ring_entry(info, ring, entry);
+            return;
+        }
+    }
+    record(recorder_error, "Entry %p not in recorder %+s", entry, info->name);
+}
+
+
+static void recorder_export_type(recorder_shan_p shan,
+                                 const char *format, unsigned index)
+// ----------------------------------------------------------------------------
+//   Find the type of an exported channel the first time data is exported
+// ----------------------------------------------------------------------------
+//   This is done only once per channel, so that exporting data only costs
+//   the reservation and commit in the channel ring
+{
+    recorder_type none = RECORDER_NONE;
+    if (!recorder_ring_compare_exchange(shan->type, none, RECORDER_INVALID))
+        return;
+    shan->type = recorder_type_from_format(format, index);
+    record(recorder, "Channel #%u '%+s' type %u %+s",
+           index,
+           (const char *) shan + shan->name,
+           shan->type,
+           shan->type < array_size(recorder_type_name)
+           ? recorder_type_name[shan->type]
+           : "UNGOOD");
+}
+
+
+static void recorder_trace_ring_entry(recorder_info *info,
+                                      recorder_ring_p recRing,
+                                      recorder_entry *entry)
+// ----------------------------------------------------------------------------
+//   Show an entry from the given recorder ring when a trace is enabled
+// ----------------------------------------------------------------------------
 {
     unsigned i;
 
     // Dump entry if it's not just exported to shared memory
     if (info->trace != RECORDER_CHAN_MAGIC)
-        recorder_dump_entry(info, entry,
-                            recorder_format, recorder_show, recorder_output);
+    {
+        if (RECORDER_TWEAK(recorder_trace_async) && !recorder_crashing)
+            recorder_trace_defer(info, recRing, entry);
+        else
+            recorder_trace_dump(info, recRing, entry);
+    }
+
+    // Export channels to shared memory
+    recorder_record record;
+    if (!info->exported[0])
+        return;
+    recorder_record_init(&record, recRing, entry);
+
+    // Column channels share a single row reservation and time stamp
+    recorder_chan_p   first = info->exported[0];
+    recorder_shcols_p cols  = NULL;
+    if (first)
+        cols = recorder_shan_columns(recorder_shared(first));
+    if (cols)
+    {
+        recorder_ring_p ring   = &cols->ring;
+        const size_t    size   = ring->size;
+        ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
+        ringidx_t       row    = writer & (size - 1);
+        recorder_data  *data   = (recorder_data *) (ring + 1);
+        recorder_data  *values = (recorder_data *) ((char*)cols + cols->values);
+
+        data[row].unsigned_value = entry->timestamp;
+        for (i = 0; i < cols->count; i++)
+        {
+            recorder_chan_p exported = info->exported[i];
+            if (!exported)
+                continue;
+
+            recorder_shan_p shan = recorder_shared(exported);
+            if (shan->type == RECORDER_NONE)
+                recorder_export_type(shan, entry->format, i);
+
+            values[i * size + row].unsigned_value =
+                recorder_record_value(&record, i);
+        }
+        recorder_ring_fetch_add(ring->commit, 1);
+        return;
+    }
 
-    // Export channels to shared memory
     for (i = 0; i < array_size(info->exported); i++)
     {
         recorder_chan_p exported = info->exported[i];
-        if (exported)
-        {
-            recorder_shan_p  shan   = recorder_shared(exported);
-            recorder_ring_p  ring   = &shan->ring;
-            ringidx_t        writer = recorder_ring_fetch_add(ring->writer, 1);
-            recorder_data   *data   = (recorder_data *) (ring + 1);
-            size_t           size   = ring->size;
-            recorder_type    none   = RECORDER_NONE;
-
-            record(recorder, "Channel #%u '%+s' type %u %+s",
-                   i,
-                   (const char *) shan + shan->name,
-                   shan->type,
-                   shan->type < array_size(recorder_type_name)
-                   ? recorder_type_name[shan->type]
-                   : "UNGOOD");
-
-            if (recorder_ring_compare_exchange(shan->type, none,
-                                               RECORDER_INVALID))
-                shan->type = recorder_type_from_format(entry->format, i);
-
-            recorder_ring_p recRing = &info->ring;
-            recorder_entry *base = (recorder_entry *) (recRing + 1);
-            ringidx_t idx = entry - base;
-            const unsigned  max = array_size(entry->args);
-            recorder_entry *source = &base[(idx + i/max) % ring->size];
-            unsigned sourceIdx = i % max;
-
-            data += 2 * (writer % size);
-            data[0].unsigned_value = entry->timestamp;
-            data[1].unsigned_value = source->args[sourceIdx];
-            record(recorder, "  source %p offset %u idx %u value %llu",
-                   source, source - base, sourceIdx, data[1].unsigned_value);
+        if (!exported)
+            continue;
 
-            recorder_ring_fetch_add(ring->commit, 1);
-        }
+        recorder_shan_p shan = recorder_shared(exported);
+        if (shan->type == RECORDER_NONE)
+            recorder_export_type(shan, entry->format, i);
+
+        recorder_ring_p ring   = &shan->ring;
+        ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
+        recorder_data  *data   = (recorder_data *) (ring + 1);
+
+        data += 2 * (writer & (ring->size - 1));
+        data[0].unsigned_value = entry->timestamp;
+        data[1].unsigned_value = recorder_record_value(&record, i);
+        recorder_ring_fetch_add(ring->commit, 1);
     }
 }
 
@@ -2338,12 +7936,36 @@ const char *recorder_export_file(void)
 }
 
 
+static unsigned recorder_stats_stop(void)
+// ----------------------------------------------------------------------------
+//   Stop the statistics thread and wait for it, return the previous interval
+// ----------------------------------------------------------------------------
+//   This must be done before deleting the channels it writes into
+{
+    unsigned interval = recorder_stats_interval;
+    if (interval)
+        recorder_stats_publish(0);
+    while (recorder_ring_fetch_add(recorder_stats_started, 0))
+        sched_yield();
+    return interval;
+}
+
+
+// Held while the configuration thread reads commands from the shared
+// memory, so that the channels being shared are not deleted meanwhile
+static pthread_mutex_t recorder_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 static void recorder_atexit_cleanup(void)
 // ----------------------------------------------------------------------------
 //   Cleanup when exiting the program
 // ----------------------------------------------------------------------------
 {
+    recorder_stats_stop();
+    pthread_mutex_lock(&recorder_share_lock);
     recorder_chans_delete(chans);
+    chans = NULL;
+    pthread_mutex_unlock(&recorder_share_lock);
 }
 
 
@@ -2353,23 +7975,34 @@ static void *background_configuration_check(void *ignored)
 // ----------------------------------------------------------------------------
 {
     char buffer[RECORDER_CMD_LEN];
-    while (chans)
+    for (;;)
     {
+        pthread_mutex_lock(&recorder_share_lock);
+        if (!chans)
+        {
+            pthread_mutex_unlock(&recorder_share_lock);
+            break;
+        }
         recorder_shans *shans = chans->map_addr;
+        uint32_t seen = __atomic_load_n(&shans->doorbell, __ATOMIC_ACQUIRE);
         size_t cmdlen = recorder_ring_readable(&shans->commands, NULL);
+        if (cmdlen)
+            recorder_ring_read(&shans->commands,buffer,cmdlen,NULL,NULL,NULL);
+        pthread_mutex_unlock(&recorder_share_lock);
+
+        // Commands may share again, which deletes the channels
         if (cmdlen)
         {
             record(recorder, "Got shared-memory command len %zu", cmdlen);
-            recorder_ring_read(&shans->commands,buffer,cmdlen,NULL,NULL,NULL);
             buffer[cmdlen] = 0;
             recorder_trace_set(buffer);
         }
         else
         {
-            struct timespec tm;
-            tm.tv_sec  = 0;
-            tm.tv_nsec = 1000000 * RECORDER_TWEAK(recorder_configuration_sleep);
-            nanosleep(&tm, NULL);
+            // Deleting the channels rings the doorbell before unmapping it
+            recorder_doorbell_wait(&shans->doorbell, seen,
+                                   RECORDER_TWEAK(recorder_configuration_sleep),
+                                   true);
         }
     }
     return ignored ? NULL : NULL;
@@ -2381,10 +8014,19 @@ static void recorder_share(const char *path)
 //   Share to the given name
 // ----------------------------------------------------------------------------
 {
-    bool had_chans = chans != NULL;
+    bool     had_chans = chans != NULL;
+    unsigned stats     = 0;
+    pthread_mutex_lock(&recorder_share_lock);
     if (chans)
+    {
+        // Restart statistics in the new channels once the old ones are gone
+        stats = recorder_stats_stop();
         recorder_chans_delete(chans);
+    }
     chans = recorder_chans_new(path);
+    pthread_mutex_unlock(&recorder_share_lock);
+    if (stats && chans)
+        recorder_stats_publish(stats);
     if (!had_chans && chans)
     {
         pthread_t tid;
@@ -2407,9 +8049,34 @@ static void recorder_export(recorder_info *rec, const char *value, bool multi)
             return;
     }
 
-    char *names = strdup(value);
-    char *next  = names;
-    int   t;
+    char   *names  = strdup(value);
+    char   *next   = names;
+    size_t  size   = RECORDER_TWEAK(recorder_export_size);
+    size_t  cols   = 0;
+    int     t;
+
+    pthread_mutex_lock(&recorder_chans_lock);
+
+    // Column export: all channels share a newly allocated set of columns
+    if (RECORDER_TWEAK(recorder_export_columns) && size)
+    {
+        unsigned count = 1;
+        for (next = names; (next = strchr(next, ',')); next++)
+            count++;
+        if (count > array_size(rec->exported))
+            count = array_size(rec->exported);
+        for (t = 0; t < (int) array_size(rec->exported); t++)
+        {
+            if (rec->exported[t])
+            {
+                recorder_chan_remove(rec->exported[t]);
+                rec->exported[t] = NULL;
+            }
+        }
+        cols = recorder_shcols_new(chans, count, size);
+        next = names;
+    }
+
     for (t = 0; next && t < (int) array_size(rec->exported); t++)
     {
         char *name = next;
@@ -2421,7 +8088,6 @@ static void recorder_export(recorder_info *rec, const char *value, bool multi)
         }
 
         recorder_chan_p chan = rec->exported[t];
-        size_t size = RECORDER_TWEAK(recorder_export_size);
         recorder_data min, max;
         min.signed_value = 0;
         max.signed_value = 0;
@@ -2435,12 +8101,25 @@ static void recorder_export(recorder_info *rec, const char *value, bool multi)
 
         record(recorder, "Exporting channel %+s for index %u in %+s\n",
                name, t, rec->name);
-        if (!chan || strcmp(recorder_chan_name(chan), name) != 0)
+        if (cols)
+        {
+            chan = recorder_chan_create(chans, RECORDER_NONE, 0, chan_name,
+                                        rec->description, "", min, max);
+            if (chan)
+            {
+                recorder_shan_p shan = recorder_shared(chan);
+                shan->columns = (off_t) cols - chan->offset;
+                shan->column = t;
+                recorder_shcols_p shcols = recorder_shan_columns(shan);
+                shcols->users++;
+            }
+        }
+        else if (!chan || strcmp(recorder_chan_name(chan), name) != 0)
         {
             if (chan)
-                recorder_chan_delete(chan);
-            chan = recorder_chan_new(chans, RECORDER_NONE, size,
-                                     chan_name, rec->description, "", min, max);
+                recorder_chan_remove(chan);
+            chan = recorder_chan_create(chans, RECORDER_NONE, size, chan_name,
+                                        rec->description, "", min, max);
         }
         rec->exported[t] = chan;
         if (multi)
@@ -2449,6 +8128,7 @@ static void recorder_export(recorder_info *rec, const char *value, bool multi)
         if (rec->trace == 0)
             rec->trace = RECORDER_CHAN_MAGIC;
     }
+    pthread_mutex_unlock(&recorder_chans_lock);
 
     free(names);
 }
@@ -2468,6 +8148,8 @@ int recorder_trace_set(const char *param_spec)
     // Facilitate usage such as: recorder_trace_set(getenv("RECORDER_TRACES"))
     if (!param_spec)
         return 0;
+    if (recorder_sections || recorder_sections_activating)
+        recorder_sections_activate();
 
     record(recorder_traces, "Setting traces to %s", param_spec);
 
@@ -2482,6 +8164,9 @@ int recorder_trace_set(const char *param_spec)
         char       *alloc     = NULL;
         char       *end       = NULL;
         bool        numerical = true;
+        bool        sampled   = false;
+        bool        rated     = false;
+        uint32_t    every     = 0;
         size_t      len       = 0;
 
         // Split foo:bar:baz so that we consider only foo in this loop
@@ -2548,6 +8233,24 @@ int recorder_trace_set(const char *param_spec)
             if (numerical)
             {
                 value = (intptr_t) strtol(value_ptr, &end, 0);
+                if (*end == '/' && value >= 0)
+                {
+                    // Sampling, e.g. "net=1/64", or rate, e.g. "net=100/s"
+                    sampled = true;
+                    if (strcmp(end, "/s") == 0)
+                    {
+                        rated = true;
+                        end += 2;
+                    }
+                    else if (isdigit(end[1]))
+                    {
+                        every = (uint32_t) strtoul(end + 1, &end, 0);
+                    }
+                    else
+                    {
+                        end++;
+                    }
+                }
                 if (*end != 0)
                 {
                     rc = RECORDER_TRACE_INVALID_VALUE;
@@ -2569,59 +8272,78 @@ int recorder_trace_set(const char *param_spec)
             if (strcmp(param, "all") == 0)
                 param = (char *) ".*";
 
-            pattern_t re;
-            int status = pattern_comp(&re, param);
+            pattern_t       local;
+            int             status;
+            pattern_t      *re = recorder_pattern_get(param, &local, &status);
+            recorder_match  m;
             if (status == 0)
             {
-                if (numerical)
+                recorder_match_init(&m, re, param);
+                if (sampled)
                 {
-                    // Numerical value: set the corresponding trace
-                    for (rec = recorders; rec; rec = rec->next)
+                    // Sampling: only applies to recorders
+                    for (rec = recorder_match_recorder(&m, NULL);
+                         rec;
+                         rec = recorder_match_recorder(&m, rec))
                     {
-                        bool re_result = pattern_match(&re, rec->name);
-                        record(recorder_traces, "Numerical testing %+s = %+s",
-                               rec->name, re_result ? "YES" : "NO");
-                        if (re_result)
+                        recorder_sampling *sampling = &rec->sampling;
+                        if (rated)
                         {
-                            record(recorder_traces,
-                                   "Set %+s from %ld to %ld",
-                                   rec->name, rec->trace, value);
-                            rec->trace = value;
-                            matches++;
+                            sampling->rate = (uint32_t) value;
                         }
-                    }
-                    for (tweak = tweaks; tweak; tweak = tweak->next)
-                    {
-                        bool re_result = pattern_match(&re, tweak->name);
-                        if (re_result)
+                        else
                         {
-                            record(recorder_traces,
-                                   "Set tweak %+s from %ld to %ld",
-                                   tweak->name, tweak->trace, value);
-                            tweak->trace = value;
-                            matches++;
+                            sampling->keep = (uint32_t) value;
+                            sampling->every = value < every ? every : 0;
                         }
+                        recorder_ring_fetch_add(sampling->generation, 1);
+                        record(recorder_traces,
+                               "Sample %+s keeping %u in %u, %u per second",
+                               rec->name, sampling->keep, sampling->every,
+                               sampling->rate);
+                        matches++;
+                    }
+                }
+                else if (numerical)
+                {
+                    // Numerical value: set the corresponding trace
+                    for (rec = recorder_match_recorder(&m, NULL);
+                         rec;
+                         rec = recorder_match_recorder(&m, rec))
+                    {
+                        record(recorder_traces,
+                               "Set %+s from %ld to %ld",
+                               rec->name, rec->trace, value);
+                        rec->trace = value;
+                        matches++;
+                    }
+                    for (tweak = recorder_match_tweak(&m, NULL);
+                         tweak;
+                         tweak = recorder_match_tweak(&m, tweak))
+                    {
+                        record(recorder_traces,
+                               "Set tweak %+s from %ld to %ld",
+                               tweak->name, tweak->trace, value);
+                        tweak->trace = value;
+                        matches++;
                     }
                 }
                 else
                 {
                     // Non-numerical: Activate corresponding exports
-                    for (rec = recorders; rec; rec = rec->next)
-                        if (pattern_match(&re, rec->name))
-                            matches++;
-
-                    for (rec = recorders; rec; rec = rec->next)
+                    for (rec = recorder_match_recorder(&m, NULL);
+                         rec;
+                         rec = recorder_match_recorder(&m, rec))
+                        matches++;
+
+                    for (rec = recorder_match_recorder(&m, NULL);
+                         rec;
+                         rec = recorder_match_recorder(&m, rec))
                     {
-                        bool re_result = pattern_match(&re, rec->name);
-                        record(recorder_traces, "Textual testing %+s = %+s",
-                               rec->name, re_result ? "YES" : "NO");
-                        if (re_result)
-                        {
-                            record(recorder_traces,
-                                   "Share %+s under name %s",
-                                   rec->name, value_ptr);
-                            recorder_export(rec, value_ptr, matches > 1);
-                        }
+                        record(recorder_traces,
+                               "Share %+s under name %s",
+                               rec->name, value_ptr);
+                        recorder_export(rec, value_ptr, matches > 1);
                     }
                 }
             }
@@ -2630,12 +8352,12 @@ int recorder_trace_set(const char *param_spec)
                 rc = RECORDER_TRACE_INVALID_NAME;
 #if HAVE_REGEX_H
                 static char     error[128];
-                regerror(status, &re, error, sizeof(error));
+                regerror(status, re, error, sizeof(error));
                 record(recorder_traces, "regcomp returned %d: %s",
                        status, error);
 #endif // HAVE_REGEX_H
             }
-            pattern_free(&re);
+            recorder_pattern_release(re, &local);
         }
         else
         {
@@ -2653,7 +8375,7 @@ int recorder_trace_set(const char *param_spec)
         else if (strcmp(param, "help") == 0 || strcmp(param, "list") == 0)
         {
             fprintf(stderr, "List of available recorders:\n");
-            for (rec = recorders; rec; rec = rec->next)
+            for (rec = recorder_first(); rec; rec = rec->next)
                 if (rec->trace <= 1)
                     fprintf(stderr, "%20s%s: %s\n",
                            rec->name, rec->trace ? "*" : " ",
@@ -2681,38 +8403,87 @@ int recorder_trace_set(const char *param_spec)
         {
             recorder_dump();
         }
+        else if (strcmp(param, "stats") == 0)
+        {
+            unsigned interval = RECORDER_TWEAK(recorder_stats_period);
+            if (value_ptr)
+                interval = strtoul(value_ptr, NULL, 0);
+            recorder_stats_publish(interval);
+        }
+        else if (strcmp(param, "dump_binary") == 0)
+        {
+            int fd = value_ptr
+                ? open(value_ptr, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                : -1;
+            if (fd >= 0)
+            {
+                recorder_dump_binary(fd);
+                close(fd);
+            }
+            else
+            {
+                record(recorder_warning,
+                       "dump_binary expects a file name");
+            }
+        }
+        else if (strcmp(param, "output_binary") == 0)
+        {
+            // Without a file name, return to text output
+            int fd = -1;
+            if (value_ptr)
+            {
+                fd = open(value_ptr, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0)
+                    record(recorder_warning,
+                           "Unable to open binary output %s", value_ptr);
+            }
+            if (!value_ptr || fd >= 0)
+            {
+                if (recorder_binary_output >= 0)
+                    close(recorder_binary_output);
+                recorder_binary_output = fd;
+            }
+        }
         else if (strcmp(param, "traces") == 0)
         {
-            for (rec = recorders; rec; rec = rec->next)
+            for (rec = recorder_first(); rec; rec = rec->next)
                 fprintf(stderr, "Recorder %s trace %"PRIdPTR" (0x%"PRIXPTR")\n",
                         rec->name, rec->trace, rec->trace);
         }
         else if (strcmp(param, "output") == 0 ||
-                 strcmp(param, "output_append") == 0)
+                 strcmp(param, "output_append") == 0 ||
+                 strcmp(param, "output_buffered") == 0)
         {
-            if (recorder_show != recorder_print)
+            // Without a file name, output_buffered buffers current output
+            bool buffered = strcmp(param, "output_buffered") == 0;
+            bool append   = strcmp(param, "output_append") == 0;
+            if (recorder_show != recorder_print &&
+                recorder_show != recorder_print_buffered)
             {
                 record(recorder_warning,
                        "Not changing output for unknown recorder_show");
             }
-            else if (value_ptr == NULL)
+            else if (value_ptr == NULL && !buffered)
             {
                 record(recorder_warning,
                        "output / output_append expect a file name");
             }
             else
             {
-                const char *mode = param[sizeof("output")-1] == '_' ? "a" : "w";
-                FILE *f = fopen(value_ptr, mode);
+                FILE *f = value_ptr ? fopen(value_ptr, append ? "a" : "w") : NULL;
                 if (f != NULL)
                 {
 #if HAVE_SETLINEBUF
                     setlinebuf(f);
 #endif // HAVE_SETLINEBUF
-                    f = recorder_configure_output(f);
-                    if (f)
-                        fclose(f);
+                    FILE *previous = recorder_configure_output(f);
+                    if (previous)
+                        fclose(previous);
                 }
+                if (f != NULL || !value_ptr)
+                    recorder_configure_show(buffered
+                                            ? recorder_print_buffered
+                                            : recorder_print);
             }
         }
         else
@@ -2726,3 +8497,456 @@ int recorder_trace_set(const char *param_spec)
 
     return rc;
 }
+
+
+
+// ============================================================================
+//
+//    Publishing recorder statistics
+//
+// ============================================================================
+//  A background thread periodically samples the ring indexes of each recorder,
+//  which costs nothing on the recording path, and publishes rates as export
+//  channels named "recorder.stats.<name>.<counter>". Channels are only
+//  created for recorders that have been written to, and can be read by any
+//  recorder_chans client, e.g. recorder_scope 'recorder\.stats\..*'.
+
+typedef struct recorder_stats_chans
+// ----------------------------------------------------------------------------
+//   Channels publishing the statistics of a recorder, with the last sample
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p     rate;           // Records written per second
+    recorder_chan_p     overflow;       // Records lost per second
+    recorder_chan_p     trace;          // Average trace formatting time (ns)
+    ringidx_t           writes;         // Records written at last sample
+    uintptr_t           overflows;      // Records lost at last sample
+    uintptr_t           traced;         // Traces formatted at last sample
+    uintptr_t           trace_ticks;    // Ticks formatting at last sample
+} recorder_stats_chans;
+
+
+/// Global statistics, not associated to a specific recorder
+static struct
+{
+    recorder_chans_p    chans;          // Channels the stats were created in
+    recorder_chan_p     dump;           // Average dump duration (us)
+    recorder_chan_p     lag;            // Largest asynchronous trace lag (us)
+    recorder_chan_p     drops;          // Traces dropped per second
+    uintptr_t           dumps;
+    uintptr_t           dump_ticks;
+    uintptr_t           trace_drops;
+    uintptr_t           time;           // Time of last sample
+} recorder_stats_global;
+
+static uint32_t recorder_stats_doorbell = 0;
+
+
+static recorder_chan_p recorder_stats_chan(const char *name,
+                                           const char *counter,
+                                           const char *description,
+                                           const char *unit)
+// ----------------------------------------------------------------------------
+//   Create a channel for a statistics counter
+// ----------------------------------------------------------------------------
+{
+    char chan_name[256];
+    recorder_data min, max;
+    min.unsigned_value = 0;
+    max.unsigned_value = 0;
+    if (name)
+        snprintf(chan_name, sizeof(chan_name),
+                 "recorder.stats.%s.%s", name, counter);
+    else
+        snprintf(chan_name, sizeof(chan_name), "recorder.stats.%s", counter);
+    return recorder_chan_new(chans, RECORDER_UNSIGNED,
+                             RECORDER_TWEAK(recorder_export_size),
+                             chan_name, description, unit, min, max);
+}
+
+
+static void recorder_stats_write(recorder_chan_p chan,
+                                 uintptr_t time, uintptr_t value)
+// ----------------------------------------------------------------------------
+//   Write a sample like exported records do, overwriting unread samples
+// ----------------------------------------------------------------------------
+{
+    if (!chan)
+        return;
+
+    recorder_shan_p shan   = recorder_shared(chan);
+    recorder_ring_p ring   = &shan->ring;
+    ringidx_t       writer = recorder_ring_fetch_add(ring->writer, 1);
+    recorder_data  *data   = (recorder_data *) (ring + 1);
+
+    data += 2 * (writer & (ring->size - 1));
+    data[0].unsigned_value = time;
+    data[1].unsigned_value = value;
+    recorder_ring_fetch_add(ring->commit, 1);
+}
+
+
+static inline uintptr_t recorder_stats_per_second(uintptr_t count,
+                                                  uintptr_t ticks)
+// ----------------------------------------------------------------------------
+//   Convert a count over some ticks into a count per second
+// ----------------------------------------------------------------------------
+{
+    return ticks ? (uintptr_t) ((double) count * RECORDER_HZ / ticks) : 0;
+}
+
+
+static void recorder_stats_reset(void)
+// ----------------------------------------------------------------------------
+//   Forget published channels, e.g. after recorder_share replaced 'chans'
+// ----------------------------------------------------------------------------
+//   The channels were deleted with the previous recorder_chans
+{
+    recorder_info *rec;
+    for (rec = recorder_first(); rec; rec = rec->next)
+    {
+        free(rec->stats.published);
+        rec->stats.published = NULL;
+    }
+    recorder_stats_global.chans = chans;
+    recorder_stats_global.dump = recorder_stats_chan(
+        NULL, "dump", "Average duration of recorder dumps", "us");
+    recorder_stats_global.lag = recorder_stats_chan(
+        NULL, "lag", "Largest delay before formatting async traces", "us");
+    recorder_stats_global.drops = recorder_stats_chan(
+        NULL, "drops", "Asynchronous traces dropped", "/s");
+    recorder_stats_global.dumps = recorder_stats_dumps;
+    recorder_stats_global.dump_ticks = recorder_stats_dump_ticks;
+    recorder_stats_global.trace_drops = recorder_trace_drops;
+}
+
+
+static void recorder_stats_sample(recorder_info *rec, uintptr_t now,
+                                  uintptr_t ticks)
+// ----------------------------------------------------------------------------
+//   Sample the counters of a recorder, create its channels on first write
+// ----------------------------------------------------------------------------
+{
+    recorder_stats_chans *published = rec->stats.published;
+    unsigned              r, rings  = recorder_ring_count(rec);
+    ringidx_t             writes    = 0;
+    uintptr_t             overflows = 0;
+
+    for (r = 0; r < rings; r++)
+    {
+        recorder_ring_p ring = recorder_shard_ring(rec, r);
+        writes += ring->writer;
+        overflows += ring->overflow;
+    }
+    if (!published)
+    {
+        if (!writes)
+            return;
+        published = calloc(1, sizeof(recorder_stats_chans));
+        if (!published)
+            return;
+        published->rate = recorder_stats_chan(
+            rec->name, "rate", "Records written", "/s");
+        published->overflow = recorder_stats_chan(
+            rec->name, "overflow", "Records lost before being read", "/s");
+        published->trace = recorder_stats_chan(
+            rec->name, "trace", "Average time formatting traces", "ns");
+        rec->stats.published = published;
+        ticks = 0;
+    }
+
+    uintptr_t traced      = rec->stats.traced;
+    uintptr_t trace_ticks = rec->stats.trace_ticks;
+    if (ticks)
+    {
+        uintptr_t formatted = traced - published->traced;
+        recorder_stats_write(published->rate, now,
+                             recorder_stats_per_second(
+                                 writes - published->writes, ticks));
+        recorder_stats_write(published->overflow, now,
+                             recorder_stats_per_second(
+                                 overflows - published->overflows, ticks));
+        if (formatted)
+            recorder_stats_write(published->trace, now,
+                                 (uintptr_t)
+                                 ((double) (trace_ticks -
+                                            published->trace_ticks)
+                                  * 1e9 / RECORDER_HZ / formatted));
+    }
+    published->writes = writes;
+    published->overflows = overflows;
+    published->traced = traced;
+    published->trace_ticks = trace_ticks;
+}
+
+
+static void recorder_stats_global_sample(uintptr_t now, uintptr_t ticks)
+// ----------------------------------------------------------------------------
+//   Sample the counters that are not specific to a recorder
+// ----------------------------------------------------------------------------
+{
+    uintptr_t dumps      = recorder_stats_dumps;
+    uintptr_t dump_ticks = recorder_stats_dump_ticks;
+    uintptr_t drops      = recorder_trace_drops;
+    uintptr_t lag        = recorder_stats_trace_lag;
+
+    while (!recorder_ring_compare_exchange(recorder_stats_trace_lag, lag, 0))
+        continue;
+    if (dumps != recorder_stats_global.dumps)
+        recorder_stats_write(recorder_stats_global.dump, now,
+                             (uintptr_t)
+                             ((double) (dump_ticks -
+                                        recorder_stats_global.dump_ticks)
+                              * 1e6 / RECORDER_HZ
+                              / (dumps - recorder_stats_global.dumps)));
+    if (lag)
+        recorder_stats_write(recorder_stats_global.lag, now,
+                             (uintptr_t) ((double) lag * 1e6 / RECORDER_HZ));
+    recorder_stats_write(recorder_stats_global.drops, now,
+                         recorder_stats_per_second(
+                             drops - recorder_stats_global.trace_drops, ticks));
+    recorder_stats_global.dumps = dumps;
+    recorder_stats_global.dump_ticks = dump_ticks;
+    recorder_stats_global.trace_drops = drops;
+}
+
+
+static void recorder_stats_sleep(unsigned sleep_ms)
+// ----------------------------------------------------------------------------
+//   Sleep for the given interval, or until recorder_stats_publish is called
+// ----------------------------------------------------------------------------
+{
+    struct timespec tm;
+    tm.tv_sec  = sleep_ms / 1000;
+    tm.tv_nsec = sleep_ms % 1000 * 1000000;
+#if HAVE_LINUX_FUTEX_H
+    uint32_t seen = recorder_stats_doorbell;
+    if (recorder_stats_interval == sleep_ms)
+        syscall(SYS_futex, &recorder_stats_doorbell, FUTEX_WAIT_PRIVATE, seen,
+                &tm, NULL, 0);
+#else // !HAVE_LINUX_FUTEX_H
+    nanosleep(&tm, NULL);
+#endif // HAVE_LINUX_FUTEX_H
+}
+
+
+static void *recorder_stats_thread(void *arg)
+// ----------------------------------------------------------------------------
+//   Background thread publishing statistics until the interval becomes 0
+// ----------------------------------------------------------------------------
+{
+    for (;;)
+    {
+        unsigned interval = recorder_stats_interval;
+        if (!interval)
+        {
+            // Stop, unless recorder_stats_publish restarted us meanwhile
+            unsigned stopped = 0;
+            __atomic_store_n(&recorder_stats_started, 0, __ATOMIC_SEQ_CST);
+            if (!recorder_stats_interval ||
+                !recorder_ring_compare_exchange(recorder_stats_started,
+                                                stopped, 1))
+                break;
+            continue;
+        }
+
+        if (recorder_stats_global.chans != chans)
+            recorder_stats_reset();
+        if (chans)
+        {
+            uintptr_t      now   = recorder_tick();
+            uintptr_t      ticks = now - recorder_stats_global.time;
+            recorder_info *rec;
+
+            if (!recorder_stats_global.time)
+                ticks = 0;
+            for (rec = recorder_first(); rec; rec = rec->next)
+                recorder_stats_sample(rec, now, ticks);
+            if (ticks)
+                recorder_stats_global_sample(now, ticks);
+            recorder_stats_global.time = now;
+        }
+
+        recorder_stats_sleep(interval);
+    }
+    return arg;
+}
+
+
+void recorder_stats_publish(unsigned interval_ms)
+// ----------------------------------------------------------------------------
+//   Start or stop publishing recorder statistics as export channels
+// ----------------------------------------------------------------------------
+{
+    record(recorder, "Publishing statistics every %u ms", interval_ms);
+    if (interval_ms && !chans)
+    {
+        recorder_share(recorder_export_file());
+        if (!chans)
+            return;
+    }
+
+    recorder_stats_interval = interval_ms;
+    recorder_doorbell_ring(&recorder_stats_doorbell, false);
+    unsigned stopped = 0;
+    if (interval_ms &&
+        recorder_ring_compare_exchange(recorder_stats_started, stopped, 1))
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, recorder_stats_thread, NULL) != 0)
+        {
+            record(recorder_error, "Unable to start statistics thread");
+            recorder_stats_started = 0;
+            return;
+        }
+        pthread_detach(tid);
+    }
+}
+
+
+
+// ============================================================================
+//
+//    Timing histograms
+//
+// ============================================================================
+//  Each thread counts durations for a RECORD_TIMING_HISTOGRAM site in its
+//  own histogram, so that measuring does not touch shared cache lines.
+//  The first thread that finds the print interval elapsed merges them.
+//  Histograms of exited threads are released by a thread-specific key, and
+//  reused with the counts they hold, so that no count is lost.
+
+static pthread_key_t  recorder_timing_key;
+static pthread_once_t recorder_timing_once = PTHREAD_ONCE_INIT;
+
+
+static void recorder_timing_thread_exit(void *owned)
+// ----------------------------------------------------------------------------
+//   Release the histograms of a thread that exits
+// ----------------------------------------------------------------------------
+{
+    recorder_timing_histogram *histogram = owned;
+    while (histogram)
+    {
+        recorder_timing_histogram *next = histogram->owned;
+        histogram->owned = NULL;
+        __atomic_store_n(&histogram->busy, 0, __ATOMIC_RELEASE);
+        histogram = next;
+    }
+}
+
+
+static void recorder_timing_key_create(void)
+// ----------------------------------------------------------------------------
+//   Create the key releasing histograms at thread exit
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&recorder_timing_key, recorder_timing_thread_exit);
+}
+
+
+recorder_timing_histogram *recorder_timing_histogram_new(recorder_timing *timing)
+// ----------------------------------------------------------------------------
+//   Find or allocate the histogram for the current thread
+// ----------------------------------------------------------------------------
+{
+    recorder_timing_histogram *histogram;
+    uintptr_t                  idle;
+
+    pthread_once(&recorder_timing_once, recorder_timing_key_create);
+
+    // Reuse the histogram of a thread that exited if there is one
+    for (histogram = timing->threads; histogram; histogram = histogram->next)
+    {
+        idle = 0;
+        if (__atomic_load_n(&histogram->busy, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&histogram->busy, &idle, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!histogram)
+    {
+        histogram = calloc(1, sizeof(*histogram));
+        if (!histogram)
+            return NULL;
+        histogram->busy = 1;
+
+        recorder_timing_histogram *next = timing->threads;
+        do
+            histogram->next = next;
+        while (!recorder_ring_compare_exchange(timing->threads,
+                                               next, histogram));
+    }
+
+    histogram->owned = pthread_getspecific(recorder_timing_key);
+    pthread_setspecific(recorder_timing_key, histogram);
+    return histogram;
+}
+
+
+static inline double recorder_timing_us(unsigned bucket)
+// ----------------------------------------------------------------------------
+//   Return the largest duration counted in a bucket, in microseconds
+// ----------------------------------------------------------------------------
+{
+    uintptr_t value = bucket;
+    if (bucket >= RECORDER_TIMING_SUB)
+    {
+        unsigned shift = bucket / RECORDER_TIMING_SUB - 1;
+        uintptr_t low = RECORDER_TIMING_SUB + bucket % RECORDER_TIMING_SUB;
+        value = (low << shift) + ((uintptr_t) 1 << shift) - 1;
+    }
+    return value * (1e6 / RECORDER_HZ);
+}
+
+
+bool recorder_timing_merge(recorder_timing *timing,
+                           uintptr_t now, uintptr_t interval,
+                           recorder_timing_result *result)
+// ----------------------------------------------------------------------------
+//   Merge the durations counted since last merge, return true if any
+// ----------------------------------------------------------------------------
+{
+    uintptr_t known = timing->last_merge;
+    if (now - known < interval ||
+        !recorder_ring_compare_exchange(timing->last_merge, known, now))
+        return false;
+
+    uintptr_t                  merged[RECORDER_TIMING_BUCKETS] = { 0 };
+    uintptr_t                  total = 0;
+    recorder_timing_histogram *histogram;
+    unsigned                   b;
+
+    for (histogram = timing->threads; histogram; histogram = histogram->next)
+    {
+        for (b = 0; b < RECORDER_TIMING_BUCKETS; b++)
+        {
+            uint32_t counted = histogram->counts[b];
+            uint32_t delta = counted - histogram->seen[b];
+            histogram->seen[b] = counted;
+            merged[b] += delta;
+            total += delta;
+        }
+    }
+    if (!total)
+        return false;
+
+    uintptr_t p50   = (total + 1) / 2;
+    uintptr_t p99   = total - total / 100;
+    uintptr_t count = 0;
+    result->p50 = result->p99 = 0;
+    for (b = 0; b < RECORDER_TIMING_BUCKETS; b++)
+    {
+        if (!merged[b])
+            continue;
+        if (count < p50 && count + merged[b] >= p50)
+            result->p50 = recorder_timing_us(b);
+        if (count < p99 && count + merged[b] >= p99)
+            result->p99 = recorder_timing_us(b);
+        count += merged[b];
+        result->max = recorder_timing_us(b);
+    }
+    result->rate = (double) total * RECORDER_HZ / (now - known);
+    return true;
+}
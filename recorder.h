@@ -115,11 +115,34 @@ extern recorder_format_fn recorder_configure_format(recorder_format_fn format);
 extern recorder_type_fn   recorder_configure_type(uint8_t id,
                                                   recorder_type_fn type);
 
+// Allocate memory for sharded recorder rings, placed on the given NUMA node
+typedef void *(*recorder_alloc_fn)(size_t size, unsigned node);
+extern recorder_alloc_fn  recorder_configure_alloc(recorder_alloc_fn alloc);
+
+// Output function writing lines in batches during dumps, for pipes or sockets
+extern unsigned           recorder_print_buffered(const char *text, size_t len,
+                                                  void *output);
+
 // Sort recorder entries with specific format and output functions
 extern unsigned recorder_sort(const char *what,
                               recorder_format_fn format,
                               recorder_show_fn show, void *show_arg);
 
+// Copy recorder entries matching 'what' now, to dump them later
+typedef struct recorder_snapshot *recorder_snapshot_p;
+extern recorder_snapshot_p recorder_snapshot(const char *what);
+extern unsigned recorder_snapshot_dump(recorder_snapshot_p snapshot);
+extern unsigned recorder_snapshot_sort(recorder_snapshot_p snapshot,
+                                       recorder_format_fn format,
+                                       recorder_show_fn show, void *show_arg);
+extern void     recorder_snapshot_delete(recorder_snapshot_p snapshot);
+
+// Dump all recorder entries in binary form to file descriptor 'fd'
+extern unsigned recorder_dump_binary(int fd);
+
+// Show entries from a binary dump read from 'fd', as recorder_dump() would
+extern unsigned recorder_decode_binary(int fd);
+
 // Return the current indent for the recorder
 extern unsigned recorder_indent(void);
 
@@ -127,6 +150,9 @@ extern unsigned recorder_indent(void);
 extern void recorder_background_dump(const char *what);
 extern void recorder_background_dump_stop(void);
 
+// Publish statistics about recorders as channels every 'interval_ms' (0=stop)
+extern void recorder_stats_publish(unsigned interval_ms);
+
 
 
 // ============================================================================
@@ -153,6 +179,27 @@ typedef struct recorder_entry
 } recorder_entry;
 
 
+typedef struct recorder_format_info
+/// ---------------------------------------------------------------------------
+///   Description of the arguments of a format, computed at compile time
+///----------------------------------------------------------------------------
+///  In C++, the RECORD macros place this description immediately before
+///  the format text, which then begins with RECORDER_FORMAT_DESCRIBED.
+///  Each mask has one bit per argument, and arguments that are in none of
+///  the masks are unsigned integers, characters or pointers.
+{
+    uint16_t    args;           ///< Number of arguments used by the format
+    uint16_t    real;           ///< Floating-point arguments
+    uint16_t    signed_args;    ///< Signed integer arguments
+    uint16_t    strings;        ///< String arguments (%s)
+    uint16_t    safe;           ///< Safe string arguments (%+s)
+    uint16_t    other;          ///< Field widths, custom or invalid formats
+} recorder_format_info;
+
+/// First character of a format text preceded by a recorder_format_info
+#define RECORDER_FORMAT_DESCRIBED       '\037'
+
+
 /// A global counter indicating the order of entries across recorders.
 /// this is incremented atomically for each record() call.
 /// It must be exposed because all XYZ_record() implementations need to
@@ -160,6 +207,49 @@ typedef struct recorder_entry
 extern uintptr_t recorder_order;
 
 
+typedef struct recorder_shards
+///----------------------------------------------------------------------------
+///   Additional rings for a recorder defined with RECORDER_SHARDED
+///----------------------------------------------------------------------------
+//    Each ring is immediately followed by its recorder_entry data.
+//    Rings are 'stride' bytes apart, starting at 'first', unless they
+//    were allocated on NUMA nodes, in which case they are listed in 'placed'
+{
+    unsigned                count;      ///< Number of additional rings
+    size_t                  stride;     ///< Distance between rings in bytes
+    recorder_ring_t *       first;      ///< First additional ring
+    recorder_ring_t **      placed;     ///< Rings placed on NUMA nodes, or NULL
+} recorder_shards;
+
+
+typedef struct recorder_sampling
+///----------------------------------------------------------------------------
+///   Sampling and rate limiting of the records for a recorder
+///----------------------------------------------------------------------------
+//    Set with recorder_trace_set, e.g. "net=1/64" or "net=10000/s"
+{
+    uint32_t                keep;       ///< Records kept out of 'every'
+    uint32_t                every;      ///< Sampling period, 0 if unused
+    uint32_t                rate;       ///< Records kept per second, 0 = all
+    uint32_t                generation; ///< Changed when settings change
+    uintptr_t               dropped;    ///< Records dropped by sampling
+    uintptr_t               reported;   ///< Dropped records shown in dumps
+} recorder_sampling;
+
+
+typedef struct recorder_stats
+///----------------------------------------------------------------------------
+///   Statistics about a recorder, published by recorder_stats_publish
+///----------------------------------------------------------------------------
+//    Only updated on the tracing path while statistics are being published.
+//    Writes and overflows are read from the ring indexes instead.
+{
+    uintptr_t               traced;     ///< Entries formatted as traces
+    uintptr_t               trace_ticks;///< Ticks spent formatting traces
+    struct recorder_stats_chans *published; ///< Channels, NULL until active
+} recorder_stats;
+
+
 typedef struct recorder_info
 ///----------------------------------------------------------------------------
 ///   A linked list of the activated recorders
@@ -171,6 +261,9 @@ typedef struct recorder_info
     const char *            description;///< Description of what is recorded
     struct recorder_info *  next;       ///< Pointer to next in list
     struct recorder_chan *  exported[12];///< Shared-memory ring export
+    recorder_shards *       shards;     ///< Per-thread rings, NULL if unused
+    recorder_sampling       sampling;   ///< Sampling of the records
+    recorder_stats          stats;      ///< Statistics about the recorder
     recorder_ring_t         ring;       ///< Pointer to ring for this recorder
     recorder_entry          data[0];    ///< Data for this recorder
 } recorder_info;
@@ -269,9 +362,27 @@ extern ringidx_t recorder_append_fast3(recorder_info *rec,
 /// Activate a recorder (during construction time)
 extern void recorder_activate(recorder_info *recorder);
 
+/// Activate the additional rings of a sharded recorder
+extern void recorder_shards_activate(recorder_info *recorder,
+                                     recorder_shards *shards,
+                                     size_t size);
+
 /// Activate a tweak
 extern void recorder_tweak_activate(recorder_tweak *tweak);
 
+/// Range of the linker sections holding the recorders and tweaks of a module
+typedef struct recorder_section
+{
+    recorder_info * const *     infos;      ///< First recorder in section
+    recorder_info * const *     infos_end;  ///< End of recorders
+    recorder_tweak * const *    tweaks;     ///< First tweak in section
+    recorder_tweak * const *    tweaks_end; ///< End of tweaks
+    struct recorder_section *   next;       ///< Next registered section
+} recorder_section;
+
+/// Register the sections of a module, activated on first use of the recorders
+extern void recorder_sections_register(recorder_section *section);
+
 /// Show one recorder entry when a trace is enabled
 extern void recorder_trace_entry(recorder_info *info, recorder_entry *entry);
 
@@ -289,6 +400,16 @@ enum { RECORDER_TRACE_OK,
 //
 // ============================================================================
 
+// On ELF platforms, put pointers to recorders and tweaks in linker sections
+#if defined(__GNUC__) && defined(__ELF__) && !defined(RECORDER_NO_SECTIONS)
+#define RECORDER_SECTIONS               1
+#define RECORDER_SECTION(Section)       __attribute__((section(#Section), used))
+#else
+#define RECORDER_SECTIONS               0
+#define RECORDER_SECTION(Section)
+#endif
+
+
 #define RECORDER_DECLARE(Name)                                          \
 /* ----------------------------------------------------------------*/   \
 /*  Declare a recorder with the given name (for use in headers)    */   \
@@ -326,28 +447,70 @@ enum { RECORDER_TRACE_OK,
 struct recorder_info_for_##Name                                         \
 {                                                                       \
     recorder_info       info;                                           \
-    recorder_entry      data[Size];                                     \
+    recorder_entry      data[RECORDER_RING_SIZE(Size)];                 \
+    ringidx_t           sequence[RECORDER_RING_SIZE(Size)];             \
 }                                                                       \
 recorder_info_for_##Name =                                              \
 {                                                                       \
     {                                                                   \
         0, #Name, Info, NULL,                                           \
         { NULL, NULL, NULL, NULL },                                     \
-        { Size, sizeof(recorder_entry), 0, 0, 0, 0 },                   \
+        NULL,                                                           \
+        { 0, 0, 0, 0, 0, 0 },                                           \
+        { 0, 0, NULL },                                                 \
+        {                                                               \
+            RECORDER_RING_SIZE(Size), sizeof(recorder_entry),           \
+            RECORDER_RING_SEQUENCED, {}, 0, 0, {}, 0, 0, {}             \
+        },                                                              \
         {}                                                              \
     },                                                                  \
+    {},                                                                 \
     {}                                                                  \
 };                                                                      \
-recorder_info * const recorder_info_ptr_for_##Name =                    \
+recorder_info * const recorder_info_ptr_for_##Name                      \
+RECORDER_SECTION(recorder_infos) =                                      \
     &recorder_info_for_##Name.info;                                     \
                                                                         \
+RECORDER_ACTIVATION(recorder_activate, Name)                            \
+                                                                        \
+/* Purposefully generate compile error if macro not followed by ; */    \
+extern void recorder_activate(recorder_info *recorder)
+
+
+#define RECORDER_SHARDED(Name, Size, Info)                              \
+/*!----------------------------------------------------------------*/   \
+/*! Define a recorder with one ring of Size elements per shard     */   \
+/*!----------------------------------------------------------------*/   \
+/*! Each thread records in one of RECORDER_SHARDS rings, which          \
+ *! avoids contention on the ring indexes when many threads use the     \
+ *! same recorder. The rings are merged by 'order' when dumping. */     \
+                                                                        \
+RECORDER_DEFINE(Name, Size, Info);                                      \
+                                                                        \
+/* The additional rings, initialized at construction time */            \
+static struct recorder_shards_for_##Name                                \
+{                                                                       \
+    recorder_shards     shards;                                         \
+    struct                                                              \
+    {                                                                   \
+        recorder_ring_t ring;                                           \
+        recorder_entry  data[RECORDER_RING_SIZE(Size)];                 \
+        ringidx_t       sequence[RECORDER_RING_SIZE(Size)];             \
+    }                   rings[RECORDER_SHARDS - 1];                     \
+} recorder_shards_for_##Name;                                           \
+                                                                        \
 RECORDER_CONSTRUCTOR                                                    \
-static void recorder_activate_##Name(void)                              \
+static void recorder_shards_activate_##Name(void)                       \
 /* ----------------------------------------------------------------*/   \
-/*  Activate recorder before entering main()                       */   \
+/*  Activate the additional rings before entering main()           */   \
 /* ----------------------------------------------------------------*/   \
 {                                                                       \
-    recorder_activate(RECORDER_INFO(Name));                             \
+    recorder_shards *shards = &recorder_shards_for_##Name.shards;       \
+    shards->count = RECORDER_SHARDS - 1;                                \
+    shards->stride = sizeof(recorder_shards_for_##Name.rings[0]);       \
+    shards->first = &recorder_shards_for_##Name.rings[0].ring;          \
+    recorder_shards_activate(RECORDER_INFO(Name), shards,               \
+                             RECORDER_RING_SIZE(Size));                 \
 }                                                                       \
                                                                         \
 /* Purposefully generate compile error if macro not followed by ; */    \
@@ -355,6 +518,22 @@ extern void recorder_activate(recorder_info *recorder)
 
 
 
+#if RECORDER_SECTIONS
+// Recorders and tweaks are found in linker sections, no constructor needed
+#define RECORDER_ACTIVATION(Activate, Name)
+#else // !RECORDER_SECTIONS
+#define RECORDER_ACTIVATION(Activate, Name)                             \
+RECORDER_CONSTRUCTOR                                                    \
+static void Activate##_##Name(void)                                     \
+/* ----------------------------------------------------------------*/   \
+/*  Activate recorder or tweak before entering main()              */   \
+/* ----------------------------------------------------------------*/   \
+{                                                                       \
+    Activate(RECORDER_INFO(Name));                                      \
+}
+#endif // RECORDER_SECTIONS
+
+
 #define RECORDER_TWEAK_DEFINE(Name, Value, Info)                        \
 struct recorder_tweak_for_##Name                                        \
 {                                                                       \
@@ -364,17 +543,11 @@ recorder_info_for_##Name =                                              \
 {                                                                       \
     { Value, #Name, Info, NULL }                                        \
 };                                                                      \
-recorder_tweak * const recorder_info_ptr_for_##Name =                   \
+recorder_tweak * const recorder_info_ptr_for_##Name                     \
+RECORDER_SECTION(recorder_tweaks) =                                     \
     &recorder_info_for_##Name.info;                                     \
                                                                         \
-RECORDER_CONSTRUCTOR                                                    \
-static void recorder_tweak_activate_##Name(void)                        \
-/* ----------------------------------------------------------------*/   \
-/*  Activate a tweak before entering main()                        */   \
-/* ----------------------------------------------------------------*/   \
-{                                                                       \
-    recorder_tweak_activate(&recorder_info_for_##Name.info);            \
-}
+RECORDER_ACTIVATION(recorder_tweak_activate, Name)
 
 
 
@@ -388,6 +561,43 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORDER_TRACE(Name)    (RECORDER_INFO(Name)->trace)
 #define RECORDER_TWEAK(Name)    RECORDER_TRACE(Name)
 #define RECORDER_ENABLED(Name)  (RECORDER_TRACE(Name) != -1)
+#define RECORDER_COMPILED(Name) (!RECORDER_COMPILED_OUT(Name))
+
+// Record statements for recorder 'foo' compile to nothing when building with
+// -DRECORDER_DISABLE_foo, and for all recorders with -DRECORDER_DISABLE_ALL.
+// This is tested by the preprocessor, giving 1 if the flag is defined as
+// 1 or as nothing, and 0 otherwise.
+#define RECORDER_COMPILED_OUT(Name)                                     \
+    RECORDER_OR(RECORDER_IS_SET(RECORDER_DISABLE_ALL),                  \
+                RECORDER_IS_SET(RECORDER_DISABLE_##Name))
+#define RECORDER_IS_SET(Flag)           RECORDER_IS_SET_(Flag)
+#define RECORDER_IS_SET_(Value)         RECORDER_IS_SET__(RECORDER_SET_##Value)
+#define RECORDER_IS_SET__(Maybe)        RECORDER_IS_SET___(Maybe 1, 0, 0)
+#define RECORDER_IS_SET___(Ignored, Value, ...) Value
+#define RECORDER_SET_                   0,
+#define RECORDER_SET_1                  0,
+#define RECORDER_OR(A, B)               RECORDER_OR_(A, B)
+#define RECORDER_OR_(A, B)              RECORDER_OR_##A##B
+#define RECORDER_OR_00                  0
+#define RECORDER_OR_01                  1
+#define RECORDER_OR_10                  1
+#define RECORDER_OR_11                  1
+#define RECORDER_CHOOSE(Out, IfOut, IfIn)       RECORDER_CHOOSE_(Out, IfOut, IfIn)
+#define RECORDER_CHOOSE_(Out, IfOut, IfIn)      RECORDER_CHOOSE_##Out(IfOut, IfIn)
+#define RECORDER_CHOOSE_0(IfOut, IfIn)          IfIn
+#define RECORDER_CHOOSE_1(IfOut, IfIn)          IfOut
+
+// A record statement compiled out still checks its arguments, as dead code
+#ifdef __GNUC__
+#define RECORD_COMPILED_OUT(Name, ...)                                  \
+    (__extension__ ({                                                   \
+        if (0)                                                          \
+            RECORD_ALWAYS(Name, __VA_ARGS__);                           \
+        (ringidx_t) -1;                                                 \
+    }))
+#else // !__GNUC__
+#define RECORD_COMPILED_OUT(Name, ...)  ((ringidx_t) -1)
+#endif // __GNUC__
 
 
 
@@ -400,6 +610,9 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define record(Name, ...)       RECORD_MACRO(Name, __VA_ARGS__)
 #define RECORD(Name, ...)       RECORD_MACRO(Name, __VA_ARGS__)
 #define RECORD_MACRO(Name, ...)                                         \
+    RECORDER_CHOOSE(RECORDER_COMPILED_OUT(Name),                        \
+                    RECORD_COMPILED_OUT, RECORD_COMPILED)(Name, __VA_ARGS__)
+#define RECORD_COMPILED(Name, ...)                                      \
     (RECORDER_ENABLED(Name)                                             \
      ? RECORD_ALWAYS(Name, __VA_ARGS__)                                 \
      : (ringidx_t) -1)
@@ -415,34 +628,30 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_0(Name, Format)                          \
     recorder_append(RECORDER_INFO(Name),                \
                     RECORDER_SOURCE_FUNCTION,           \
-                    RECORDER_SOURCE_LOCATION            \
-                    Format, 0, 0, 0, 0)
+                    RECORDER_FORMAT(Format, ()),        \
+                    0, 0, 0, 0)
 #define RECORD_1(Name, Format, a)                       \
     recorder_append(RECORDER_INFO(Name),                \
                     RECORDER_SOURCE_FUNCTION,           \
-                    RECORDER_SOURCE_LOCATION            \
-                    Format,                             \
+                    RECORDER_FORMAT(Format, (a)),       \
                     RECORDER_ARG(a), 0, 0, 0)
 #define RECORD_2(Name, Format, a,b)                     \
     recorder_append(RECORDER_INFO(Name),                \
                     RECORDER_SOURCE_FUNCTION,           \
-                    RECORDER_SOURCE_LOCATION            \
-                    Format,                             \
+                    RECORDER_FORMAT(Format, (a,b)),     \
                     RECORDER_ARG(a),                    \
                     RECORDER_ARG(b), 0, 0)
 #define RECORD_3(Name, Format, a,b,c)                   \
     recorder_append(RECORDER_INFO(Name),                \
                     RECORDER_SOURCE_FUNCTION,           \
-                    RECORDER_SOURCE_LOCATION            \
-                    Format,                             \
+                    RECORDER_FORMAT(Format, (a,b,c)),   \
                     RECORDER_ARG(a),                    \
                     RECORDER_ARG(b),                    \
                     RECORDER_ARG(c), 0)
 #define RECORD_4(Name, Format, a,b,c,d)                 \
     recorder_append(RECORDER_INFO(Name),                \
                     RECORDER_SOURCE_FUNCTION,           \
-                    RECORDER_SOURCE_LOCATION            \
-                    Format,                             \
+                    RECORDER_FORMAT(Format, (a,b,c,d)), \
                     RECORDER_ARG(a),                    \
                     RECORDER_ARG(b),                    \
                     RECORDER_ARG(c),                    \
@@ -450,8 +659,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_5(Name, Format, a,b,c,d,e)               \
     recorder_append2(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e)),                  \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -460,8 +669,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_6(Name, Format, a,b,c,d,e,f)             \
     recorder_append2(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f)),                \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -471,8 +680,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_7(Name, Format, a,b,c,d,e,f,g)           \
     recorder_append2(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g)),              \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -483,8 +692,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_8(Name, Format, a,b,c,d,e,f,g,h)         \
     recorder_append2(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g,h)),            \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -496,8 +705,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_9(Name, Format, a,b,c,d,e,f,g,h,i)       \
     recorder_append3(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g,h,i)),          \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -510,8 +719,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_10(Name, Format, a,b,c,d,e,f,g,h,i,j)    \
     recorder_append3(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g,h,i,j)),        \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -525,8 +734,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_11(Name, Format, a,b,c,d,e,f,g,h,i,j,k)  \
     recorder_append3(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g,h,i,j,k)),      \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -541,8 +750,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_12(Name,Format,a,b,c,d,e,f,g,h,i,j,k,l)  \
     recorder_append3(RECORDER_INFO(Name),               \
                      RECORDER_SOURCE_FUNCTION,          \
-                     RECORDER_SOURCE_LOCATION           \
-                     Format,                            \
+                     RECORDER_FORMAT(Format,            \
+                         (a,b,c,d,e,f,g,h,i,j,k,l)),    \
                      RECORDER_ARG(a),                   \
                      RECORDER_ARG(b),                   \
                      RECORDER_ARG(c),                   \
@@ -559,7 +768,11 @@ static void recorder_tweak_activate_##Name(void)                        \
 
 // Faster version that does not record time, about 2x faster on x86
 #define record_fast(Name, ...)     RECORD_FAST(Name, __VA_ARGS__)
-#define RECORD_FAST(Name, ...)                  \
+#define RECORD_FAST(Name, ...)                                          \
+    RECORDER_CHOOSE(RECORDER_COMPILED_OUT(Name),                        \
+                    RECORD_COMPILED_OUT, RECORD_FAST_COMPILED)          \
+    (Name, __VA_ARGS__)
+#define RECORD_FAST_COMPILED(Name, ...)                                 \
     (RECORDER_ENABLED(Name)                                             \
      ? RECORD_FAST_ALWAYS(Name, __VA_ARGS__)                            \
      : (ringidx_t) -1)
@@ -568,34 +781,30 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_0(Name, Format)                             \
     recorder_append_fast(RECORDER_INFO(Name),                   \
                          RECORDER_SOURCE_FUNCTION,              \
-                         RECORDER_SOURCE_LOCATION               \
-                         Format, 0, 0, 0, 0)
+                         RECORDER_FORMAT(Format, ()),           \
+                         0, 0, 0, 0)
 #define RECORD_FAST_1(Name, Format, a)                          \
     recorder_append_fast(RECORDER_INFO(Name),                   \
                          RECORDER_SOURCE_FUNCTION,              \
-                         RECORDER_SOURCE_LOCATION               \
-                         Format,                                \
+                         RECORDER_FORMAT(Format, (a)),          \
                          RECORDER_ARG(a), 0, 0, 0)
 #define RECORD_FAST_2(Name, Format, a,b)                        \
     recorder_append_fast(RECORDER_INFO(Name),                   \
                          RECORDER_SOURCE_FUNCTION,              \
-                         RECORDER_SOURCE_LOCATION               \
-                         Format,                                \
+                         RECORDER_FORMAT(Format, (a,b)),        \
                          RECORDER_ARG(a),                       \
                          RECORDER_ARG(b), 0, 0)
 #define RECORD_FAST_3(Name, Format, a,b,c)                      \
     recorder_append_fast(RECORDER_INFO(Name),                   \
                          RECORDER_SOURCE_FUNCTION,              \
-                         RECORDER_SOURCE_LOCATION               \
-                         Format,                                \
+                         RECORDER_FORMAT(Format, (a,b,c)),      \
                          RECORDER_ARG(a),                       \
                          RECORDER_ARG(b),                       \
                          RECORDER_ARG(c), 0)
 #define RECORD_FAST_4(Name, Format, a,b,c,d)                    \
     recorder_append_fast(RECORDER_INFO(Name),                   \
                          RECORDER_SOURCE_FUNCTION,              \
-                             RECORDER_SOURCE_LOCATION           \
-                         Format,                                \
+                         RECORDER_FORMAT(Format, (a,b,c,d)),    \
                          RECORDER_ARG(a),                       \
                          RECORDER_ARG(b),                       \
                          RECORDER_ARG(c),                       \
@@ -603,8 +812,7 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_5(Name, Format, a,b,c,d,e)                  \
     recorder_append_fast2(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                              RECORDER_SOURCE_LOCATION          \
-                          Format,                               \
+                          RECORDER_FORMAT(Format, (a,b,c,d,e)), \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -613,8 +821,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_6(Name, Format, a,b,c,d,e,f)                \
     recorder_append_fast2(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f)),                   \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -624,8 +832,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_7(Name, Format, a,b,c,d,e,f,g)              \
     recorder_append_fast2(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g)),                 \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -636,8 +844,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_8(Name, Format, a,b,c,d,e,f,g,h)            \
     recorder_append_fast2(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g,h)),               \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -649,8 +857,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_9(Name, Format, a,b,c,d,e,f,g,h,i)          \
     recorder_append_fast3(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g,h,i)),             \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -663,8 +871,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_10(Name, Format, a,b,c,d,e,f,g,h,i,j)       \
     recorder_append_fast3(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g,h,i,j)),           \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -678,8 +886,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_11(Name, Format, a,b,c,d,e,f,g,h,i,j,k)     \
     recorder_append_fast3(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g,h,i,j,k)),         \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -694,8 +902,8 @@ static void recorder_tweak_activate_##Name(void)                        \
 #define RECORD_FAST_12(Name, Format, a,b,c,d,e,f,g,h,i,j,k,l)   \
     recorder_append_fast3(RECORDER_INFO(Name),                  \
                           RECORDER_SOURCE_FUNCTION,             \
-                          RECORDER_SOURCE_LOCATION              \
-                          Format,                               \
+                          RECORDER_FORMAT(Format,               \
+                              (a,b,c,d,e,f,g,h,i,j,k,l)),       \
                           RECORDER_ARG(a),                      \
                           RECORDER_ARG(b),                      \
                           RECORDER_ARG(c),                      \
@@ -710,6 +918,15 @@ static void recorder_tweak_activate_##Name(void)                        \
                           RECORDER_ARG(l))
 #define RECORD_FAST_X(Name, Format, ...)   RECORD_TOO_MANY_ARGS(printf(Format, __VA_ARGS__))
 
+// Format with source location, described at compile time in C++14
+#if defined(__cplusplus) && __cplusplus >= 201402L && !defined(RECORDER_NO_FORMAT_INFO)
+#define RECORDER_FORMAT(Format, Args)                                   \
+    RECORDER_DESCRIBE(RECORDER_SOURCE_LOCATION Format,                  \
+                      Args)
+#else // No compile-time format analysis
+#define RECORDER_FORMAT(Format, Args)   RECORDER_SOURCE_LOCATION Format
+#endif // C++14
+
 // Some ugly macro drudgery to make things easy to use. Adjust type.
 #ifdef __cplusplus
 #define RECORDER_ARG(arg)       _recorder_arg(arg)
@@ -792,13 +1009,15 @@ do {                                                            \
     if (_interval >= _print_interval &&                                 \
         recorder_ring_compare_exchange(_last_second,_known,_end_time))  \
     {                                                                   \
+        uintptr_t _iterations = _iterations_last_second;                \
         record(Recorder,                                                \
                Operation " %.2f " Name "/s, total %lu, "                \
-               "%.2f loops/s, avg duration %.2f us, ",                  \
+               "%.2f loops/s, avg duration %.3f us, ",                  \
                _total_last_second * _scale,                             \
                _total,                                                  \
-               _iterations_last_second * _scale,                        \
-               _duration_last_second * _scale);                         \
+               _iterations * _scale,                                    \
+               _duration_last_second * (1e6 / RECORDER_HZ)              \
+               / (_iterations + !_iterations));                         \
         _total_last_second = 0;                                         \
         _duration_last_second = 0;                                      \
         _iterations_last_second = 0;                                    \
@@ -806,6 +1025,109 @@ do {                                                            \
 } while (0)
 
 
+// Timing histograms: durations are counted in per-thread log-linear buckets,
+// each power of two being split in RECORDER_TIMING_SUB buckets, so that
+// percentiles are accurate within 1/RECORDER_TIMING_SUB (6%)
+#define RECORDER_TIMING_SUB_BITS        4
+#define RECORDER_TIMING_SUB             (1 << RECORDER_TIMING_SUB_BITS)
+#define RECORDER_TIMING_BUCKETS                                         \
+    ((8 * sizeof(uintptr_t) - RECORDER_TIMING_SUB_BITS + 1)             \
+     * RECORDER_TIMING_SUB)
+
+typedef struct recorder_timing_histogram
+///----------------------------------------------------------------------------
+///   Durations measured by one thread for a RECORD_TIMING_HISTOGRAM site
+///----------------------------------------------------------------------------
+//    Only the owning thread writes 'counts', without atomics. The thread
+//    merging histograms keeps the counts it already reported in 'seen'.
+//    When the owning thread exits, the histogram is reused by another one.
+{
+    struct recorder_timing_histogram *next; ///< Next thread for same site
+    struct recorder_timing_histogram *owned;///< Next owned by same thread
+    uintptr_t   busy;                       ///< Owned by a running thread
+    uint32_t    counts[RECORDER_TIMING_BUCKETS]; ///< Durations per bucket
+    uint32_t    seen[RECORDER_TIMING_BUCKETS];   ///< Counts already merged
+} recorder_timing_histogram;
+
+
+typedef struct recorder_timing
+///----------------------------------------------------------------------------
+///   A RECORD_TIMING_HISTOGRAM site, with the histograms of all threads
+///----------------------------------------------------------------------------
+{
+    recorder_timing_histogram * threads;    ///< Histograms for each thread
+    uintptr_t                   last_merge; ///< Time of the last merge
+} recorder_timing;
+
+
+typedef struct recorder_timing_result
+///----------------------------------------------------------------------------
+///   Merged histograms for a print interval
+///----------------------------------------------------------------------------
+{
+    double                      rate;       ///< Operations per second
+    double                      p50;        ///< Median duration (us)
+    double                      p99;        ///< 99th percentile duration (us)
+    double                      max;        ///< Largest duration (us)
+} recorder_timing_result;
+
+
+extern recorder_timing_histogram *
+recorder_timing_histogram_new(recorder_timing *timing);
+extern bool recorder_timing_merge(recorder_timing *timing,
+                                  uintptr_t now, uintptr_t interval,
+                                  recorder_timing_result *result);
+
+
+static inline unsigned recorder_timing_bucket(uintptr_t duration)
+// ----------------------------------------------------------------------------
+//   Return the histogram bucket for a given duration
+// ----------------------------------------------------------------------------
+{
+    if (duration < RECORDER_TIMING_SUB)
+        return (unsigned) duration;
+#ifdef __GNUC__
+    unsigned msb = 8 * sizeof(unsigned long long) - 1
+        - __builtin_clzll((unsigned long long) duration);
+#else // !__GNUC__
+    unsigned msb = 0;
+    while (duration >> (msb + 1))
+        msb++;
+#endif // __GNUC__
+    unsigned shift = msb - RECORDER_TIMING_SUB_BITS;
+    return (shift + 1) * RECORDER_TIMING_SUB
+        + (unsigned) ((duration >> shift) & (RECORDER_TIMING_SUB - 1));
+}
+
+
+#define RECORD_TIMING_HISTOGRAM_BEGIN(Recorder)                         \
+do {                                                                    \
+    static recorder_timing _timing = { NULL, 0 };                       \
+    static RECORDER_THREAD_LOCAL recorder_timing_histogram *_histogram; \
+    uintptr_t _start_time = recorder_tick()
+
+#define RECORD_TIMING_HISTOGRAM_END(Recorder, Operation)                \
+    uintptr_t _end_time = recorder_tick();                              \
+    if (!_histogram)                                                    \
+        _histogram = recorder_timing_histogram_new(&_timing);           \
+    if (_histogram)                                                     \
+        _histogram->counts[recorder_timing_bucket(_end_time -           \
+                                                  _start_time)]++;      \
+    intptr_t _trace = RECORDER_INFO(Recorder)->trace;                   \
+    uintptr_t _print_interval =                                         \
+        ((_trace == RECORDER_CHAN_MAGIC || _trace <= 0 ? 100 : _trace)  \
+         * (RECORDER_HZ / 1000));                                       \
+    recorder_timing_result _result;                                     \
+    if (_end_time - _timing.last_merge >= _print_interval &&            \
+        recorder_timing_merge(&_timing, _end_time, _print_interval,     \
+                              &_result))                                \
+        record(Recorder,                                                \
+               Operation " %.2f/s, p50 %.3f us, p99 %.3f us, "          \
+               "max %.3f us",                                           \
+               _result.rate, _result.p50, _result.p99, _result.max);    \
+} while (0)
+
+
 // ============================================================================
 //
 //    Data export from recorders
@@ -847,7 +1169,7 @@ typedef struct recorder_chan  *recorder_chan_p;
 #define RECORDER_CHAN_MAGIC           (0xC0DABABE ^ RECORDER_64BIT)
 
 // The recorder channel version (update only when channel format changes)
-#define RECORDER_CHAN_VERSION         RECORDER_VERSION(1,2,0)
+#define RECORDER_CHAN_VERSION         RECORDER_VERSION(1,8,0)
 #define RECORDER_EXPORT_SIZE          2048
 
 extern const char *recorder_export_file(void);
@@ -872,6 +1194,8 @@ extern recorder_chan_p  recorder_chan_new(recorder_chans_p chans,
                                           recorder_data    min,
                                           recorder_data    max);
 extern void             recorder_chan_delete(recorder_chan_p chan);
+extern size_t           recorder_chan_write(recorder_chan_p chan,
+                                            const void *ptr, size_t count);
 
 
 
@@ -903,6 +1227,59 @@ extern size_t           recorder_chan_readable(recorder_chan_p chan,
 extern size_t           recorder_chan_read(recorder_chan_p chan,
                                            recorder_data *ptr, size_t count,
                                            ringidx_t *readerID);
+extern size_t           recorder_chan_read_columns(recorder_chan_p chan,
+                                                   recorder_data *times,
+                                                   recorder_data *values,
+                                                   size_t count,
+                                                   ringidx_t *readerID);
+
+
+
+// ============================================================================
+//
+//    Capturing recorder_chans to a file and replaying them
+//
+// ============================================================================
+
+typedef struct recorder_capture *recorder_capture_p;
+typedef struct recorder_replay  *recorder_replay_p;
+
+// Capture channels matching a pattern, reading them with their own readers
+extern recorder_capture_p recorder_capture_new(recorder_chans_p chans,
+                                               const char *pattern,
+                                               int fd);
+extern size_t           recorder_capture_poll(recorder_capture_p capture);
+extern void             recorder_capture_flush(recorder_capture_p capture);
+extern uint64_t         recorder_capture_lost(recorder_capture_p capture);
+extern void             recorder_capture_delete(recorder_capture_p capture);
+
+// Replay a capture into channels created in a local recorder_chans
+extern recorder_replay_p recorder_replay_new(int fd, recorder_chans_p chans);
+extern bool             recorder_replay_step(recorder_replay_p replay,
+                                             double speed);
+extern void             recorder_replay_delete(recorder_replay_p replay);
+
+
+
+// ============================================================================
+//
+//    Aggregating recorder_chans from several processes
+//
+// ============================================================================
+
+typedef struct recorder_aggregate *recorder_aggregate_p;
+
+// Merge channels from other processes into channels of a local recorder_chans
+extern recorder_aggregate_p recorder_aggregate_new(recorder_chans_p output,
+                                                   const char *pattern,
+                                                   uintptr_t period);
+extern bool             recorder_aggregate_add(recorder_aggregate_p aggregate,
+                                               const char *file,
+                                               const char *label);
+extern unsigned         recorder_aggregate_configure(recorder_aggregate_p ag,
+                                                     const char *message);
+extern uint64_t         recorder_aggregate_lost(recorder_aggregate_p aggregate);
+extern void             recorder_aggregate_delete(recorder_aggregate_p ag);
 
 
 
@@ -919,10 +1296,17 @@ extern size_t           recorder_chan_read(recorder_chan_p chan,
 
 #ifdef __GNUC__
 #define RECORDER_CONSTRUCTOR            __attribute__((constructor))
+#define RECORDER_THREAD_LOCAL           __thread
 #else
 #define RECORDER_CONSTRUCTOR
+#define RECORDER_THREAD_LOCAL
 #endif
 
+#ifndef RECORDER_SHARDS
+// Number of rings in a recorder defined using RECORDER_SHARDED
+#define RECORDER_SHARDS                 8
+#endif // RECORDER_SHARDS
+
 
 // ============================================================================
 //
@@ -936,13 +1320,42 @@ extern uintptr_t recorder_tick(void);
 #endif
 
 #ifndef RECORDER_HZ
-#if RECORDER_64BIT
-#define RECORDER_HZ     1000000
+#if RECORDER_64BIT // Nanosecond time stamps
+#define RECORDER_HZ     1000000000
 #else // Small time stamp, do not generate huge values
 #define RECORDER_HZ     1000
 #endif // INTPTR_MAX
 #endif // RECORDER_HZ
 
+#if RECORDER_SECTIONS
+// The linker defines the bounds of each section in each module (program or
+// shared library). Each source file registers them for its module, and
+// registering a module more than once is cheap.
+extern recorder_info * const  __start_recorder_infos[]
+    __attribute__((weak, visibility("hidden")));
+extern recorder_info * const  __stop_recorder_infos[]
+    __attribute__((weak, visibility("hidden")));
+extern recorder_tweak * const __start_recorder_tweaks[]
+    __attribute__((weak, visibility("hidden")));
+extern recorder_tweak * const __stop_recorder_tweaks[]
+    __attribute__((weak, visibility("hidden")));
+
+RECORDER_CONSTRUCTOR
+static void recorder_sections_register_module(void)
+// ----------------------------------------------------------------------------
+//   Register the recorders and tweaks of this module before entering main()
+// ----------------------------------------------------------------------------
+{
+    static recorder_section section =
+    {
+        __start_recorder_infos, __stop_recorder_infos,
+        __start_recorder_tweaks, __stop_recorder_tweaks,
+        NULL
+    };
+    recorder_sections_register(&section);
+}
+#endif // RECORDER_SECTIONS
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -1059,4 +1472,223 @@ static inline uintptr_t _recorder_double(double d)
 }
 
 
+
+
+// ============================================================================
+//
+//    Utility: Analyze format strings at compile time in C++
+//
+// ============================================================================
+//
+//   The RECORD macros turn the format into a static recorder_described,
+//   so that its recorder_format_info is computed by the compiler. This also
+//   checks that the arguments match the format, e.g. that a double is not
+//   passed to %d. Programs where recorder_configure_type overrides standard
+//   formats such as %E can define RECORDER_FORMAT_CHECKS to 0.
+
+#if defined(__cplusplus) && __cplusplus >= 201402L && !defined(RECORDER_NO_FORMAT_INFO)
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+#ifndef RECORDER_FORMAT_CHECKS
+#define RECORDER_FORMAT_CHECKS  1
+#endif // RECORDER_FORMAT_CHECKS
+
+#define RECORDER_DESCRIBE(Format, Args)                                 \
+    ([]() -> const char *                                               \
+    {                                                                   \
+        typedef decltype(recorder_format_types Args) types;             \
+        typedef recorder_format_checker<types> check;                   \
+        static constexpr recorder_described<sizeof(Format)>             \
+            recorder_format(Format);                                    \
+        static_assert(!RECORDER_FORMAT_CHECKS ||                        \
+                      check::count(recorder_format.info),               \
+                      "Number of record arguments does not match format"); \
+        static_assert(!RECORDER_FORMAT_CHECKS ||                        \
+                      check::types(recorder_format.info),               \
+                      "Type of record argument does not match format"); \
+        return recorder_format.text;                                    \
+    } ())
+
+
+
+template <size_t N>
+struct recorder_described
+// ----------------------------------------------------------------------------
+//   A format text preceded by its description
+// ----------------------------------------------------------------------------
+//   This follows the same rules as recorder_dump_entry to count arguments
+{
+    recorder_format_info info;
+    char                 text[N + 1];
+
+    constexpr recorder_described(const char (&format)[N]): info(), text()
+    {
+        unsigned arg = 0;
+        size_t   i   = 0;
+
+        text[0] = RECORDER_FORMAT_DESCRIBED;
+        for (i = 0; i < N; i++)
+            text[i + 1] = format[i];
+
+        for (i = 0; i < N && format[i]; i++)
+        {
+            if (format[i] != '%')
+                continue;
+
+            bool safe = false;
+            bool done = false;
+            while (!done && ++i < N)
+            {
+                uint16_t bit = arg < 16 ? (uint16_t) (1U << arg) : 0;
+                switch(format[i])
+                {
+                case 'f': case 'F': case 'g': case 'G':
+                case 'e': case 'E': case 'a': case 'A':
+                    info.real |= bit;
+                    arg++;
+                    done = true;
+                    break;
+                case 'b': case 'd': case 'D': case 'i':
+                    info.signed_args |= bit;
+                    arg++;
+                    done = true;
+                    break;
+                case 's': case 'S':
+                    if (safe)
+                        info.safe |= bit;
+                    else
+                        info.strings |= bit;
+                    arg++;
+                    done = true;
+                    break;
+                case 'c': case 'C': case 'o': case 'O':
+                case 'u': case 'U': case 'x': case 'X': case 'p':
+                    arg++;
+                    done = true;
+                    break;
+                case '%':
+                    done = true;
+                    break;
+                case '0': case '1': case '2': case '3': case '4':
+                case '5': case '6': case '7': case '8': case '9':
+                case '.': case '-': case 'l': case 'L': case 'h':
+                case 'j': case 't': case 'z': case 'q': case 'v':
+#ifdef _WIN32
+                case 'I':
+#endif // _WIN32
+                    break;
+                case '+':
+                    safe = true;
+                    break;
+                case 'n':
+                case '*':
+                    info.other |= bit;
+                    arg++;
+                    break;
+                case 0:
+                    i--;
+                    done = true;
+                    break;
+                default:
+                    // Custom format configured with recorder_configure_type
+                    info.other |= bit;
+                    arg++;
+                    done = true;
+                    break;
+                }
+            }
+        }
+        info.args = (uint16_t) arg;
+    }
+};
+
+
+template <class ...Args>
+struct recorder_format_args
+// ----------------------------------------------------------------------------
+//   The types of the arguments passed to a RECORD statement
+// ----------------------------------------------------------------------------
+{
+};
+
+
+template <class ...Args>
+recorder_format_args<Args...> recorder_format_types(const Args &...);
+// ----------------------------------------------------------------------------
+//   Only used in decltype, so that arguments are not evaluated twice
+// ----------------------------------------------------------------------------
+
+
+enum recorder_arg_kind
+// ----------------------------------------------------------------------------
+//   Kinds of arguments that the recorder formats differently
+// ----------------------------------------------------------------------------
+{
+    RECORDER_ARG_OTHER,
+    RECORDER_ARG_INTEGER,
+    RECORDER_ARG_REAL,
+    RECORDER_ARG_POINTER
+};
+
+
+template <class Arg>
+constexpr recorder_arg_kind recorder_kind()
+// ----------------------------------------------------------------------------
+//   Return the kind for a given argument type
+// ----------------------------------------------------------------------------
+{
+    typedef typename std::decay<Arg>::type T;
+    return std::is_floating_point<T>::value
+        ? RECORDER_ARG_REAL
+        : std::is_integral<T>::value || std::is_enum<T>::value
+        ? RECORDER_ARG_INTEGER
+        : std::is_pointer<T>::value ||
+          std::is_same<T, std::nullptr_t>::value ||
+          std::is_same<T, std::string>::value
+        ? RECORDER_ARG_POINTER
+        : RECORDER_ARG_OTHER;
+}
+
+
+template <class Types>
+struct recorder_format_checker;
+
+template <class ...Args>
+struct recorder_format_checker< recorder_format_args<Args...> >
+// ----------------------------------------------------------------------------
+//   Check that the arguments of a RECORD statement match its format
+// ----------------------------------------------------------------------------
+{
+    static constexpr bool count(const recorder_format_info &info)
+    {
+        return info.args == sizeof...(Args);
+    }
+
+    static constexpr bool types(const recorder_format_info &info)
+    {
+        const recorder_arg_kind kinds[] =
+        {
+            recorder_kind<Args>()..., RECORDER_ARG_OTHER
+        };
+        for (unsigned a = 0; a < sizeof...(Args) && a < 16; a++)
+        {
+            unsigned bit = 1U << a;
+            recorder_arg_kind kind = kinds[a];
+            if (kind == RECORDER_ARG_OTHER || (info.other & bit))
+                continue;
+            if ((kind == RECORDER_ARG_REAL) != ((info.real & bit) != 0))
+                return false;
+            if (((info.strings | info.safe) & bit) &&
+                kind != RECORDER_ARG_POINTER)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif // C++14
+
+
 #endif // RECORDER_H
@@ -0,0 +1,615 @@
+// *****************************************************************************
+// recorder_bench.c                                             Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Micro-benchmarks for the flight recorder
+//
+//     This measures the latency of record statements for various numbers
+//     of threads and configurations, the throughput of recorder_sort and
+//     of recorder_ring. Results are printed one per line, as
+//     'benchmark metric value unit', and can be compared to a baseline
+//     file written by an earlier run to detect regressions.
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder_ring.h"
+#include "recorder.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+
+RECORDER(BenchRecord,           32, "Benchmark for record");
+RECORDER(BenchFast,             32, "Benchmark for RECORD_FAST");
+RECORDER_SHARDED(BenchSharded,  32, "Benchmark for sharded recorders");
+RECORDER(BenchTraced,           32, "Benchmark for traced records");
+RECORDER(BenchExported,         32, "Benchmark for exported records");
+RECORDER(BenchBackground,     1024, "Benchmark with a background dump");
+
+#define BENCH_SORT_RECORDERS(X)                                         \
+    X(00) X(01) X(02) X(03) X(04) X(05) X(06) X(07)                     \
+    X(08) X(09) X(10) X(11) X(12) X(13) X(14) X(15)                     \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23)                     \
+    X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+#define BENCH_SORT_DEFINE(N)                                            \
+    RECORDER(BenchSort##N, 256, "Benchmark for recorder_sort");
+BENCH_SORT_RECORDERS(BENCH_SORT_DEFINE)
+
+RECORDER_TWEAK_DEFINE(bench_duration, 200, "Duration of each benchmark (ms)");
+RECORDER_TWEAK_DEFINE(bench_batch, 16, "Records timed together");
+RECORDER_TWEAK_DEFINE(bench_tolerance, 10, "Regression tolerance (percent)");
+
+enum { BENCH_SAMPLES = 1 << 16 };       // Latency samples kept per thread
+
+
+
+// ============================================================================
+//
+//    Measuring the latency of record statements
+//
+// ============================================================================
+
+typedef struct bench_thread
+// ----------------------------------------------------------------------------
+//   State for a thread running a latency benchmark
+// ----------------------------------------------------------------------------
+{
+    pthread_t   tid;
+    unsigned    index;
+    uintptr_t   records;
+    uintptr_t   samples;
+    uint32_t   *sample;                 // Record latency in 1/16 ns
+} bench_thread;
+
+static volatile bool bench_running = false;
+static volatile bool bench_started = false;
+static FILE *        bench_results = NULL;
+
+
+static void bench_result(const char *key, const char *metric,
+                         double value, const char *unit)
+// ----------------------------------------------------------------------------
+//   Show a result, and keep a copy in the results file if there is one
+// ----------------------------------------------------------------------------
+{
+    printf("%s %s %.1f %s\n", key, metric, value, unit);
+    fflush(stdout);
+    if (bench_results)
+        fprintf(bench_results, "%s %s %.1f %s\n", key, metric, value, unit);
+}
+
+
+#define BENCH_THREAD(Name, Statement)                                   \
+/* ------------------------------------------------------------------*/ \
+/*  Run a statement in batches, and keep the time taken by each one  */ \
+/* ------------------------------------------------------------------*/ \
+static void *bench_##Name(void *arg)                                    \
+{                                                                       \
+    bench_thread *t     = arg;                                          \
+    unsigned      tid   = t->index;                                     \
+    uintptr_t     batch = RECORDER_TWEAK(bench_batch);                  \
+    uintptr_t     i     = 0;                                            \
+    uintptr_t     b;                                                    \
+                                                                        \
+    while (!bench_started)                                              \
+        sched_yield();                                                  \
+    while (bench_running)                                               \
+    {                                                                   \
+        uintptr_t start = recorder_tick();                              \
+        for (b = 0; b < batch; b++, i++)                                \
+            Statement;                                                  \
+        uintptr_t duration = recorder_tick() - start;                   \
+        double ns = 1e9 / RECORDER_HZ * duration / batch;               \
+        t->sample[t->samples++ % BENCH_SAMPLES] =                       \
+            ns * 16 < UINT32_MAX ? (uint32_t) (ns * 16) : UINT32_MAX;   \
+    }                                                                   \
+    t->records = i;                                                     \
+    return NULL;                                                        \
+}
+
+BENCH_THREAD(record,
+             record(BenchRecord, "Thread %u record %u", tid, i))
+BENCH_THREAD(fast,
+             RECORD_FAST(BenchFast, "Thread %u record %u", tid, i))
+BENCH_THREAD(sharded,
+             record(BenchSharded, "Thread %u record %u", tid, i))
+BENCH_THREAD(traced,
+             record(BenchTraced, "Thread %u record %u", tid, i))
+BENCH_THREAD(exported,
+             record(BenchExported, "Thread %u record %u", tid, i))
+BENCH_THREAD(background,
+             record(BenchBackground, "Thread %u record %u", tid, i))
+
+
+static int bench_compare(const void *a, const void *b)
+// ----------------------------------------------------------------------------
+//   Compare two latency samples
+// ----------------------------------------------------------------------------
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void bench_sleep(unsigned ms)
+// ----------------------------------------------------------------------------
+//   Sleep for the given number of milliseconds
+// ----------------------------------------------------------------------------
+{
+    struct timespec tm;
+    tm.tv_sec  = ms / 1000;
+    tm.tv_nsec = ms % 1000 * 1000000;
+    while (nanosleep(&tm, &tm) != 0)
+        ;
+}
+
+
+static void bench_latency(const char *name, void *(*body)(void *),
+                          unsigned threads)
+// ----------------------------------------------------------------------------
+//   Run a latency benchmark with the given number of threads
+// ----------------------------------------------------------------------------
+{
+    bench_thread *t = calloc(threads, sizeof(bench_thread));
+    unsigned      i;
+
+    bench_running = true;
+    bench_started = false;
+    for (i = 0; i < threads; i++)
+    {
+        t[i].index = i;
+        t[i].sample = malloc(BENCH_SAMPLES * sizeof(uint32_t));
+        pthread_create(&t[i].tid, NULL, body, &t[i]);
+    }
+
+    uintptr_t start = recorder_tick();
+    bench_started = true;
+    bench_sleep(RECORDER_TWEAK(bench_duration));
+    bench_running = false;
+    for (i = 0; i < threads; i++)
+        pthread_join(t[i].tid, NULL);
+    double duration = (double) (recorder_tick() - start) / RECORDER_HZ;
+
+    // Merge the samples of all threads
+    uintptr_t records = 0;
+    size_t    count = 0;
+    uint32_t *all = malloc(threads * BENCH_SAMPLES * sizeof(uint32_t));
+    for (i = 0; i < threads; i++)
+    {
+        size_t kept = t[i].samples < BENCH_SAMPLES
+            ? t[i].samples
+            : BENCH_SAMPLES;
+        memcpy(all + count, t[i].sample, kept * sizeof(uint32_t));
+        count += kept;
+        records += t[i].records;
+        free(t[i].sample);
+    }
+    qsort(all, count, sizeof(uint32_t), bench_compare);
+
+    static const struct { const char *name; double ratio; } percentiles[] =
+    {
+        { "p50", 0.5 }, { "p99", 0.99 }, { "p99.9", 0.999 }
+    };
+    char key[64];
+    snprintf(key, sizeof(key), "record.%s.t%u", name, threads);
+    for (i = 0; i < 3; i++)
+    {
+        size_t index = count ? (size_t) (percentiles[i].ratio * (count-1)) : 0;
+        double ns = count ? all[index] / 16.0 : 0.0;
+        bench_result(key, percentiles[i].name, ns, "ns");
+    }
+    bench_result(key, "rate", records / duration, "/s");
+    free(all);
+    free(t);
+}
+
+
+
+// ============================================================================
+//
+//    Throughput of recorder_sort
+//
+// ============================================================================
+
+static unsigned bench_show(const char *text, size_t len, void *output)
+// ----------------------------------------------------------------------------
+//   Discard the formatted entries
+// ----------------------------------------------------------------------------
+{
+    (void) text;
+    (void) output;
+    return (unsigned) len;
+}
+
+
+static void bench_sort_fill(unsigned count)
+// ----------------------------------------------------------------------------
+//   Fill the first 'count' sort recorders
+// ----------------------------------------------------------------------------
+{
+    unsigned i;
+#define BENCH_SORT_FILL(N)                                              \
+    if (1##N - 100 < count)                                             \
+        for (i = 0; i < 256; i++)                                       \
+            record(BenchSort##N, "Recorder %u entry %u", 1##N - 100, i);
+    BENCH_SORT_RECORDERS(BENCH_SORT_FILL)
+#undef BENCH_SORT_FILL
+}
+
+
+static void bench_sort(unsigned count)
+// ----------------------------------------------------------------------------
+//   Measure how many entries per second recorder_sort shows
+// ----------------------------------------------------------------------------
+{
+    char      pattern[32];
+    uintptr_t entries = 0;
+    uintptr_t elapsed = 0;
+    uintptr_t limit   = RECORDER_TWEAK(bench_duration) * RECORDER_HZ / 1000;
+
+    // Use the default format, so that the cost of formatting is included
+    recorder_format_fn format = recorder_configure_format(NULL);
+    recorder_configure_format(format);
+
+    snprintf(pattern, sizeof(pattern), "BenchSort([0-2][0-9]|3[01])");
+    if (count <= 10)
+        snprintf(pattern, sizeof(pattern), "BenchSort0[0-%u]", count - 1);
+    else if (count <= 20)
+        snprintf(pattern, sizeof(pattern), "BenchSort(0[0-9]|1[0-%u])",
+                 count - 11);
+
+    while (elapsed < limit)
+    {
+        bench_sort_fill(count);
+        uintptr_t start = recorder_tick();
+        entries += recorder_sort(pattern, format, bench_show, NULL);
+        elapsed += recorder_tick() - start;
+    }
+    char key[32];
+    snprintf(key, sizeof(key), "sort.r%u", count);
+    bench_result(key, "rate", entries * (double) RECORDER_HZ / elapsed, "/s");
+}
+
+
+
+// ============================================================================
+//
+//    Throughput of recorder_ring with multiple producers and consumers
+//
+// ============================================================================
+
+static recorder_ring_p bench_ring     = NULL;
+static uintptr_t       bench_consumed = 0;
+
+
+static void *bench_producer(void *arg)
+// ----------------------------------------------------------------------------
+//   Write items in the ring until stopped
+// ----------------------------------------------------------------------------
+{
+    uintptr_t item = (uintptr_t) arg;
+    while (!bench_started)
+        sched_yield();
+    while (bench_running)
+        if (recorder_ring_write(bench_ring, &item, 1, NULL, NULL, NULL))
+            item++;
+    return NULL;
+}
+
+
+static void *bench_consumer(void *arg)
+// ----------------------------------------------------------------------------
+//   Read items from the ring until stopped
+// ----------------------------------------------------------------------------
+{
+    uintptr_t items[64];
+    uintptr_t count = 0;
+    while (!bench_started)
+        sched_yield();
+    while (bench_running)
+        count += recorder_ring_read(bench_ring, items, 64, NULL, NULL, NULL);
+    recorder_ring_fetch_add(bench_consumed, count);
+    return arg;
+}
+
+
+static void bench_ring_mpmc(unsigned pairs)
+// ----------------------------------------------------------------------------
+//   Measure items going through a ring with 'pairs' producers and consumers
+// ----------------------------------------------------------------------------
+{
+    pthread_t *tid = calloc(2 * pairs, sizeof(pthread_t));
+    unsigned   i;
+
+    bench_ring = recorder_ring_new(1024, sizeof(uintptr_t));
+    bench_consumed = 0;
+    bench_running = true;
+    bench_started = false;
+    for (i = 0; i < pairs; i++)
+    {
+        pthread_create(&tid[2*i], NULL, bench_producer, NULL);
+        pthread_create(&tid[2*i+1], NULL, bench_consumer, NULL);
+    }
+
+    uintptr_t start = recorder_tick();
+    bench_started = true;
+    bench_sleep(RECORDER_TWEAK(bench_duration));
+    bench_running = false;
+    for (i = 0; i < 2 * pairs; i++)
+        pthread_join(tid[i], NULL);
+    double duration = (double) (recorder_tick() - start) / RECORDER_HZ;
+
+    char key[32];
+    snprintf(key, sizeof(key), "ring.p%uc%u", pairs, pairs);
+    bench_result(key, "rate", bench_consumed / duration, "/s");
+    recorder_ring_delete(bench_ring);
+    free(tid);
+}
+
+
+
+// ============================================================================
+//
+//    Comparing with a baseline
+//
+// ============================================================================
+
+static unsigned bench_compare_baseline(const char *baseline,
+                                       const char *current)
+// ----------------------------------------------------------------------------
+//   Report results that are worse than the baseline, return their number
+// ----------------------------------------------------------------------------
+//   Latencies ('ns') are worse when higher, rates ('/s') when lower
+{
+    FILE *base = fopen(baseline, "r");
+    FILE *cur  = fopen(current, "r");
+    char  line[256], key[128], metric[32], unit[16];
+    char  ckey[128], cmetric[32], cunit[16];
+    double value, cvalue;
+    unsigned regressions = 0;
+
+    if (!base || !cur)
+    {
+        fprintf(stderr, "Unable to open baseline %s\n", baseline);
+        if (base)
+            fclose(base);
+        if (cur)
+            fclose(cur);
+        return 1;
+    }
+
+    double tolerance = RECORDER_TWEAK(bench_tolerance) / 100.0;
+    while (fgets(line, sizeof(line), base))
+    {
+        if (line[0] == '#' ||
+            sscanf(line, "%127s %31s %lf %15s", key, metric,
+                   &value, unit) != 4)
+            continue;
+
+        rewind(cur);
+        while (fgets(line, sizeof(line), cur))
+        {
+            if (line[0] == '#' ||
+                sscanf(line, "%127s %31s %lf %15s", ckey, cmetric,
+                       &cvalue, cunit) != 4 ||
+                strcmp(key, ckey) != 0 || strcmp(metric, cmetric) != 0)
+                continue;
+
+            bool latency = strcmp(unit, "ns") == 0;
+            double change = value > 0.0 ? (cvalue - value) / value : 0.0;
+            if (latency ? change > tolerance : change < -tolerance)
+            {
+                fprintf(stderr, "REGRESSION %s %s %.1f -> %.1f %s (%+.1f%%)\n",
+                        key, metric, value, cvalue, unit, 100.0 * change);
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(base);
+    fclose(cur);
+    return regressions;
+}
+
+
+
+// ============================================================================
+//
+//    Main entry point
+//
+// ============================================================================
+
+static void bench_usage(const char *program)
+// ----------------------------------------------------------------------------
+//   Show the command-line options
+// ----------------------------------------------------------------------------
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-o file] [-c baseline] [benchmark...]\n"
+            "  -t threads:  Maximum number of threads (default: CPUs)\n"
+            "  -o file:     Also write results to file, e.g. for a baseline\n"
+            "  -c baseline: Report results worse than in baseline file\n"
+            "  benchmark:   record, fast, sharded, traced, exported,\n"
+            "               background, sort or ring (default: all)\n"
+            "Tweaks bench_duration (ms), bench_batch and\n"
+            "bench_tolerance (%%) can be set with RECORDER_TWEAKS\n",
+            program);
+}
+
+
+static bool bench_selected(int argc, char **argv, int first, const char *name)
+// ----------------------------------------------------------------------------
+//   Check if a benchmark was selected on the command line
+// ----------------------------------------------------------------------------
+{
+    int a;
+    if (first >= argc)
+        return true;
+    for (a = first; a < argc; a++)
+        if (strcmp(argv[a], name) == 0)
+            return true;
+    return false;
+}
+
+
+int main(int argc, char **argv)
+{
+    long        cpus     = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned    max      = cpus > 0 ? (unsigned) cpus : 1;
+    const char *output   = NULL;
+    const char *baseline = NULL;
+    char        results[64] = "";
+    int         a;
+
+    recorder_trace_set(getenv("RECORDER_TRACES"));
+    recorder_trace_set(getenv("RECORDER_TWEAKS"));
+
+    for (a = 1; a < argc && argv[a][0] == '-'; a++)
+    {
+        if (strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+            max = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+            output = argv[++a];
+        else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc)
+            baseline = argv[++a];
+        else
+        {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max < 1)
+        max = 1;
+
+    // Keep a copy of the results to compare them with the baseline
+    if (baseline && !output)
+    {
+        snprintf(results, sizeof(results),
+                 "/tmp/recorder_bench_%d", (int) getpid());
+        output = results;
+    }
+    if (output && !(bench_results = fopen(output, "w")))
+    {
+        fprintf(stderr, "Unable to write %s\n", output);
+        return 1;
+    }
+
+    char header[128];
+    snprintf(header, sizeof(header),
+             "# recorder_bench %u.%u.%u, %u threads max, "
+             "%ums per benchmark, batches of %u\n",
+             RECORDER_VERSION_MAJOR(RECORDER_CURRENT_VERSION),
+             RECORDER_VERSION_MINOR(RECORDER_CURRENT_VERSION),
+             RECORDER_VERSION_PATCH(RECORDER_CURRENT_VERSION),
+             max,
+             (unsigned) RECORDER_TWEAK(bench_duration),
+             (unsigned) RECORDER_TWEAK(bench_batch));
+    fputs(header, stdout);
+    if (bench_results)
+        fputs(header, bench_results);
+
+    static const struct
+    {
+        const char *name;
+        void *(*body)(void *);
+        const char *setup;
+        const char *cleanup;
+    } latency[] =
+    {
+        { "record",     bench_record,     NULL, NULL },
+        { "fast",       bench_fast,       NULL, NULL },
+        { "sharded",    bench_sharded,    NULL, NULL },
+        { "traced",     bench_traced,     "BenchTraced", "BenchTraced=0" },
+        { "exported",   bench_exported,   "BenchExported=thread,record",
+                                          "BenchExported=0" },
+        { "background", bench_background, NULL, NULL },
+    };
+    unsigned l, threads;
+
+    // The exports and traces must not disturb the results
+    char share[64];
+    snprintf(share, sizeof(share), "/tmp/recorder_bench_share_%d",
+             (int) getpid());
+    setenv("RECORDER_SHARE", share, 1);
+    FILE *null = fopen("/dev/null", "w");
+    void *saved = recorder_configure_output(null);
+
+    for (l = 0; l < sizeof(latency) / sizeof(latency[0]); l++)
+    {
+        if (!bench_selected(argc, argv, a, latency[l].name))
+            continue;
+        if (latency[l].setup)
+            recorder_trace_set(latency[l].setup);
+        if (latency[l].body == bench_background)
+            recorder_background_dump("BenchBackground");
+        threads = 1;
+        for (;;)
+        {
+            bench_latency(latency[l].name, latency[l].body, threads);
+            if (threads >= max)
+                break;
+            threads = threads * 2 > max ? max : threads * 2;
+        }
+        if (latency[l].body == bench_background)
+            recorder_background_dump_stop();
+        if (latency[l].cleanup)
+            recorder_trace_set(latency[l].cleanup);
+    }
+
+    if (bench_selected(argc, argv, a, "sort"))
+    {
+        static const unsigned counts[] = { 1, 4, 16, 32 };
+        unsigned c;
+        for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+            bench_sort(counts[c]);
+    }
+
+    if (bench_selected(argc, argv, a, "ring"))
+        for (threads = 1; 2 * threads <= max || threads == 1; threads *= 2)
+            bench_ring_mpmc(threads);
+
+    recorder_configure_output(saved);
+    fclose(null);
+    unlink(share);
+    if (bench_results)
+        fclose(bench_results);
+
+    if (!baseline)
+        return 0;
+
+    unsigned regressions = bench_compare_baseline(baseline, output);
+    if (results[0])
+        unlink(results);
+    fprintf(stderr, "%u regression%s compared to %s\n",
+            regressions, regressions == 1 ? "" : "s", baseline);
+    return regressions ? 2 : 0;
+}
@@ -44,11 +44,15 @@ typedef intptr_t ringdiff_t;
 recorder_ring_p recorder_ring_init(recorder_ring_p ring,
                                    size_t size, size_t item_size)
 // ----------------------------------------------------------------------------
-//   Initialize a ring
+//   Initialize a ring, rounding size down to a power of 2 to fit in memory
 // ----------------------------------------------------------------------------
 {
-    ring->size = size;
+    size_t rounded = recorder_ring_round_size(size);
+    if (rounded > size)
+        rounded >>= 1;
+    ring->size = rounded;
     ring->item_size = item_size;
+    ring->flags = 0;
     ring->reader = 0;
     ring->writer = 0;
     ring->commit = 0;
@@ -59,15 +63,45 @@ recorder_ring_p recorder_ring_init(recorder_ring_p ring,
 
 recorder_ring_p recorder_ring_new(size_t size, size_t item_size)
 // ----------------------------------------------------------------------------
-//   Create a new ring with the given name
+//   Create a new ring, rounding size up to a power of 2
 // ----------------------------------------------------------------------------
 {
+    size = recorder_ring_round_size(size);
     recorder_ring_p ring = malloc(sizeof(recorder_ring_t) + size * item_size);
     recorder_ring_init(ring, size, item_size);
     return ring;
 }
 
 
+recorder_ring_p recorder_ring_init_sequenced(recorder_ring_p ring,
+                                             size_t size, size_t item_size)
+// ----------------------------------------------------------------------------
+//   Initialize a ring where writers publish elements with sequence numbers
+// ----------------------------------------------------------------------------
+//   The memory must have room for 'size' sequence numbers after the data
+{
+    recorder_ring_init(ring, size, item_size);
+    ring->flags = RECORDER_RING_SEQUENCED;
+    memset(recorder_ring_sequence(ring), 0, ring->size * sizeof(ringidx_t));
+    return ring;
+}
+
+
+recorder_ring_p recorder_ring_new_sequenced(size_t size, size_t item_size)
+// ----------------------------------------------------------------------------
+//   Create a new sequenced ring, rounding size up to a power of 2
+// ----------------------------------------------------------------------------
+{
+    size = recorder_ring_round_size(size);
+    size_t data = size * item_size;
+    data = (data + sizeof(ringidx_t) - 1) & ~(sizeof(ringidx_t) - 1);
+    recorder_ring_p ring = malloc(sizeof(recorder_ring_t) + data +
+                                  size * sizeof(ringidx_t));
+    recorder_ring_init_sequenced(ring, size, item_size);
+    return ring;
+}
+
+
 void recorder_ring_delete(recorder_ring_p ring)
 // ----------------------------------------------------------------------------
 //   Delete the given ring from the list
@@ -129,7 +163,7 @@ void *recorder_ring_peek(recorder_ring_p ring)
         reader = recorder_ring_add_fetch(ring->reader, skip);
         written = commit - reader;
     }
-    return written ? data + reader % size * item_size : NULL;
+    return written ? data + (reader & (size - 1)) * item_size : NULL;
 }
 
 
@@ -192,7 +226,7 @@ ringidx_t recorder_ring_read(recorder_ring_p         ring,
         while (to_copy)
         {
             // Compute how much we can copy in one memcpy
-            idx        = reader % size;
+            idx        = reader & (size - 1);
             to_end     = size - idx;
             this_round = to_copy < to_end ? to_copy : to_end;
             byte_count = this_round * item_size;
@@ -207,80 +241,268 @@ ringidx_t recorder_ring_read(recorder_ring_p         ring,
                                              first_reader, next_reader));
 
     // Return number of items effectively read
-    return count - to_copy;
+    return next_reader - first_reader;
 }
 
 
-ringidx_t recorder_ring_write(recorder_ring_p         ring,
-                              const void             *source,
-                              size_t                  count,
-                              recorder_ring_block_fn  write_block,
-                              recorder_ring_block_fn  commit_block,
-                              ringidx_t              *writer_ptr)
+size_t recorder_ring_acquire(recorder_ring_p         ring,
+                             size_t                  count,
+                             ringidx_t              *reader_ptr,
+                             recorder_ring_block_fn  read_block,
+                             recorder_ring_block_fn  read_overflow,
+                             recorder_ring_span      spans[2],
+                             ringidx_t              *first_ptr)
 // ----------------------------------------------------------------------------
-//   Write 'count' elements from 'ptr' into 'rb', return entry idx
+//   Return up to 'count' readable elements in place, in at most two spans
 // ----------------------------------------------------------------------------
+//   The elements are not copied, and the reader does not move until
+//   recorder_ring_release is called. Writers may overwrite the elements
+//   meanwhile, and recorder_ring_release tells how many remained valid.
+{
+    const size_t  size      = ring->size;
+    const size_t  item_size = ring->item_size;
+    char         *data      = (char *) (ring + 1);
+    ringidx_t     reader, writer, commit, available, to_read, idx, to_end;
+
+    if (!reader_ptr)
+        reader_ptr = &ring->reader;
+
+    reader = *reader_ptr;
+    commit = ring->commit;
+    writer = ring->writer;
+    available = commit - reader;
+    to_read = count;
+
+    // Check if we want to read more than available
+    if (to_read > available)
+        if (!read_block || !read_block(ring, reader, reader + to_read))
+            to_read = available;
+
+    // Check if write may have overwritten beyond our read point
+    if (writer - reader >= size)
+    {
+        // If so, catch up
+        ringidx_t first_valid = writer - size + 1;
+        if (!read_overflow || !read_overflow(ring, reader, first_valid))
+        {
+            ringidx_t skip = first_valid - reader;
+            recorder_ring_add_fetch(ring->overflow, skip);
+            reader = recorder_ring_add_fetch(*reader_ptr, skip);
+            available = commit - reader;
+            if ((ringdiff_t) available < 0)
+                available = 0;
+            if (to_read > available)
+                to_read = available;
+        }
+    }
+
+    // Split at the end of the data array
+    idx = reader & (size - 1);
+    to_end = size - idx;
+    spans[0].data = data + idx * item_size;
+    spans[0].count = to_read < to_end ? to_read : to_end;
+    spans[1].data = data;
+    spans[1].count = to_read - spans[0].count;
+
+    *first_ptr = reader;
+    return to_read;
+}
+
+
+size_t recorder_ring_release(recorder_ring_p  ring,
+                             ringidx_t       *reader_ptr,
+                             ringidx_t        first,
+                             size_t           count)
+// ----------------------------------------------------------------------------
+//   Move the reader after elements returned by recorder_ring_acquire
+// ----------------------------------------------------------------------------
+//   Return the number of elements at the end of what was acquired that
+//   were not overwritten by writers, or 0 if another reader moved first.
+{
+    const size_t size = ring->size;
+
+    if (!reader_ptr)
+        reader_ptr = &ring->reader;
+
+    // The caller read the elements before, keep them ahead of the writer
+    recorder_ring_acquire_fence();
+    ringidx_t writer = ring->writer;
+    if (!recorder_ring_compare_exchange(*reader_ptr, first, first + count))
+        return 0;
+
+    // A writer that reserved index w may have overwritten w - size
+    ringidx_t first_valid = writer - size + 1;
+    if (writer - first >= size)
+    {
+        ringidx_t lost = first_valid - first;
+        recorder_ring_add_fetch(ring->overflow, lost < count ? lost : count);
+        return lost < count ? count - lost : 0;
+    }
+    return count;
+}
+
+
+size_t recorder_ring_reserve(recorder_ring_p         ring,
+                             size_t                  count,
+                             recorder_ring_block_fn  write_block,
+                             ringidx_t              *writer_ptr,
+                             recorder_ring_span      spans[2])
+// ----------------------------------------------------------------------------
+//   Reserve up to 'count' elements for writing, in at most two spans
+// ----------------------------------------------------------------------------
+//   The elements must then be written in place, and recorder_ring_commit
+//   called with the writer index and the count returned by this function
 {
     const size_t size      = ring->size;
     const size_t item_size = ring->item_size;
-    const char * ptr       = source;
     char *       data      = (char *) (ring + 1);
-    size_t       to_copy   = count;
-    ringidx_t    reader, writer, idx, available, to_end, first_writer;
-    size_t       this_round, byte_count;
-
+    size_t       to_write  = count;
+    ringidx_t    reader, writer, idx, available, to_end;
 
-    // First commit to writing a given amount of contiguous data
     do
     {
         reader = ring->reader;
         writer = ring->writer;
         available = size + reader - writer;
-        to_copy = count;
+        to_write = count;
 
-        // Check if we want to copy more than can be written
-        if (to_copy > available)
-            if (write_block && !write_block(ring, writer, writer + to_copy))
-                to_copy = available;
+        // Check if we want to write more than there is room for
+        if (to_write > available)
+            if (write_block && !write_block(ring, writer, writer + to_write))
+                to_write = available;
 
     } while (!recorder_ring_compare_exchange(ring->writer,
-                                             writer, writer + to_copy));
+                                             writer, writer + to_write));
+
+    // Split at the end of the data array
+    idx = writer & (size - 1);
+    to_end = size - idx;
+    spans[0].data = data + idx * item_size;
+    spans[0].count = to_write < to_end ? to_write : to_end;
+    spans[1].data = data;
+    spans[1].count = to_write - spans[0].count;
+
+    *writer_ptr = writer;
+    return to_write;
+}
 
-    // Record first writer, to see if we will be the one committing
-    first_writer = writer;
-    if (writer_ptr)
-        *writer_ptr = writer;
 
-    // Then copy data in contiguous memcpy chunks (normally at most two)
-    while (to_copy)
+void recorder_ring_commit(recorder_ring_p         ring,
+                          ringidx_t               writer,
+                          size_t                  count,
+                          recorder_ring_block_fn  commit_block)
+// ----------------------------------------------------------------------------
+//   Make elements reserved with recorder_ring_reserve readable
+// ----------------------------------------------------------------------------
+//   Commits happen in order. If an earlier write is not committed yet,
+//   this spins, unless commit_block returns false, in which case the commit
+//   index simply moves forward by 'count'. Sequenced rings never wait.
+{
+    if (ring->flags & RECORDER_RING_SEQUENCED)
     {
-        // Compute how much we can copy in one memcpy
-        idx        = writer % size;
-        to_end     = size - idx;
-        this_round = to_copy < to_end ? to_copy : to_end;
-        byte_count = this_round * item_size;
-
-        // Copy data from buffer into destination
-        memcpy(data + idx * item_size, ptr, byte_count);
-        ptr += byte_count;
-        to_copy -= this_round;
-        writer += this_round;
+        recorder_ring_publish(ring, writer, count);
+        return;
     }
 
-    // Commit buffer change, but only if commit is first_writer.
-    // Otherwise, some other write is still copying its data, we must spin.
-    ringidx_t expected = first_writer;
-    while (!recorder_ring_compare_exchange(ring->commit, expected, writer))
+    ringidx_t expected = writer;
+    while (!recorder_ring_compare_exchange(ring->commit,
+                                           expected, writer + count))
     {
-        if (!commit_block || !commit_block(ring, ring->commit, first_writer))
+        if (!commit_block || !commit_block(ring, ring->commit, writer))
         {
             // Skip forward
-            recorder_ring_fetch_add(ring->commit, writer - first_writer);
+            recorder_ring_fetch_add(ring->commit, count);
             break;
         }
-        expected = first_writer;
+        expected = writer;
+    }
+}
+
+
+ringidx_t recorder_ring_publish(recorder_ring_p ring,
+                                ringidx_t       writer,
+                                size_t          count)
+// ----------------------------------------------------------------------------
+//   Mark elements of a sequenced ring as written, then advance the commit
+// ----------------------------------------------------------------------------
+//   The commit moves past all consecutive elements that were written,
+//   including those of writers that have not advanced it yet, as well as
+//   slots that a writer one lap ahead already reused after an overflow.
+//   Return the commit seen before moving it, like a fetch_add would.
+{
+    const size_t size     = ring->size;
+    ringidx_t   *sequence = recorder_ring_sequence(ring);
+    ringidx_t    index, seq, commit, next, before;
+
+    for (index = writer; index != writer + count; index++)
+    {
+        // Never move a sequence back if a later lap already wrote the slot
+        // Sequentially consistent, so that either we see the sequence of
+        // a concurrent writer, or it sees ours and moves the commit for us
+        ringidx_t *slot = &sequence[index & (size - 1)];
+        seq = *slot;
+        while ((ringdiff_t) (index + 1 - seq) > 0)
+            if (__atomic_compare_exchange_n(slot, &seq, index + 1, 0,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_RELAXED))
+                break;
+    }
+
+    commit = __atomic_load_n(&ring->commit, __ATOMIC_SEQ_CST);
+    before = commit;
+    for (;;)
+    {
+        next = commit;
+        for (;;)
+        {
+            seq = __atomic_load_n(&sequence[next & (size - 1)],
+                                  __ATOMIC_SEQ_CST);
+            if ((ringdiff_t) (seq - (next + 1)) < 0)
+                break;
+            next++;
+        }
+        if (next == commit)
+            break;
+        if (recorder_ring_compare_exchange(ring->commit, commit, next))
+            commit = next;
     }
+    return before;
+}
+
+
+ringidx_t recorder_ring_write(recorder_ring_p         ring,
+                              const void             *source,
+                              size_t                  count,
+                              recorder_ring_block_fn  write_block,
+                              recorder_ring_block_fn  commit_block,
+                              ringidx_t              *writer_ptr)
+// ----------------------------------------------------------------------------
+//   Write 'count' elements from 'ptr' into 'rb', return entry idx
+// ----------------------------------------------------------------------------
+{
+    const size_t       item_size = ring->item_size;
+    const char        *ptr       = source;
+    recorder_ring_span spans[2];
+    ringidx_t          writer;
+    unsigned           s;
+
+    // First commit to writing a given amount of contiguous data
+    size_t written = recorder_ring_reserve(ring, count, write_block,
+                                           &writer, spans);
+    if (writer_ptr)
+        *writer_ptr = writer;
+
+    // Then copy data in contiguous memcpy chunks
+    for (s = 0; s < 2; s++)
+    {
+        size_t byte_count = spans[s].count * item_size;
+        memcpy(spans[s].data, ptr, byte_count);
+        ptr += byte_count;
+    }
+
+    // Commit buffer change once previous writes are committed
+    recorder_ring_commit(ring, writer, written, commit_block);
 
     // Return number of items effectively written
-    return count - to_copy;
+    return written;
 }
@@ -44,7 +44,7 @@
  *
  * How this works:
  *   Each buffer is represented by
- *   - an array A of N items (for performance, N should be a power of 2),
+ *   - an array A of N items, where N is a power of 2,
  *   - a reader index R,
  *   - a writer index W
  *   - a commit index C
@@ -59,21 +59,47 @@
  *   1a. Set R to W-N+1
  *   2b. Increase O to record the overflow
  *   2. There is readable data iff R < C. If so:
- *   2a. Read A[R % N] (possibly blocking)
+ *   2a. Read A[R & (N-1)] (possibly blocking)
  *   2b. Atomically increase R
  *
  *   Writing E entries in the buffer consists in the following steps:
  *   1. Atomically increase W, fetching the old W (fetch_and_add)
- *   2. Copy the entries in A[oldW % N] (possibly blocking)
+ *   2. Copy the entries in A[oldW & (N-1)] (possibly blocking)
  *   3. Wait until C == oldW, and Atomically set C to W (possibly blocking)
  *
  * Step 2 can block if the reader has not caught up yet.
  * Step 3 can block if another writer has still not updated C
  *
+ * Zero-copy access:
+ *   Writers can reserve elements with recorder_ring_reserve, write them in
+ *   place, then call recorder_ring_commit, which are steps 1, 2 and 3 above.
+ *   Readers can access elements in place with recorder_ring_acquire, which
+ *   does steps 1 and 2 without copying, then call recorder_ring_release.
+ *   In both cases, the elements are given as at most two contiguous spans,
+ *   since they may wrap around the end of the array.
+ *
+ * Sequenced rings:
+ *   In step 3 above, a writer that is descheduled before updating C holds
+ *   back all the writers that follow it. A ring initialized with
+ *   recorder_ring_init_sequenced instead has an array S of N sequence
+ *   numbers after A. Writers store I+1 in S[I & (N-1)] once A[I] is written,
+ *   then move C forward past all consecutive slots that are written, so that
+ *   no writer ever waits for another. C only covers fully written entries,
+ *   and readers are unchanged.
+ *
  * Important notes:
- *   The code as written is safe for use with C++ objects. Do not attempt
- *   to replace data copies with memcpy(), as it would most likely not
- *   improve speed (because of the "modulo" to perform) and would break C++.
+ *   Since N is a power of 2, indexes are reduced with a mask instead of a
+ *   modulo. Sizes given as constants are rounded up by RECORDER_RING_SIZE,
+ *   sizes given at run time are rounded up by recorder_ring_new, or down by
+ *   recorder_ring_init, which must fit in the memory it is given.
+ *
+ *   The reader and writer indexes live in separate cache lines, so that
+ *   readers and writers on different CPUs do not keep stealing the same
+ *   line from one another. The padding uses explicit sizes, so that the
+ *   layout of rings in shared memory does not depend on the compiler.
+ *
+ *   Data is copied with memcpy(), in at most two chunks. The elements must
+ *   therefore be trivially copyable, e.g. POD types in C++.
  *
  *   In theory, if you use the buffer long enough, all indexes will ultimately
  *   wrap around. This is why all comparisons are done with something like
@@ -120,6 +146,9 @@ extern "C" {
     __atomic_compare_exchange_n(&Value, &Expected, New,                 \
                                 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
 
+#define recorder_ring_acquire_fence()                           \
+    __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
 #define RECORDER_RING_MAYBE_UNUSED   __attribute__((unused))
 
 #else // ! __GNUC__
@@ -128,6 +157,7 @@ extern "C" {
 #define recorder_ring_fetch_add(Value, Offset)   (Value += Offset)
 #define recorder_ring_add_fetch(Value, Offset)   ((Value += Offset), Value)
 #define recorder_ring_compare_exchange(Val, Exp, New) ((Val = New), true)
+#define recorder_ring_acquire_fence()
 
 #define RECORDER_RING_MAYBE_UNUSED
 
@@ -143,19 +173,70 @@ extern "C" {
 
 typedef uintptr_t ringidx_t;
 
+// Size of a cache line, used to keep reader and writer indexes apart
+#define RECORDER_CACHE_LINE     64
+
+// Round a constant ring size up to a power of 2 (0 remains 0)
+#define RECORDER_RING_SIZE(N)   (RECORDER_RING_FILL_32((size_t) (N) - 1) + 1)
+#define RECORDER_RING_FILL_1(X)  ((X) | (X) >> 1)
+#define RECORDER_RING_FILL_2(X)  (RECORDER_RING_FILL_1(X)  | RECORDER_RING_FILL_1(X)  >> 2)
+#define RECORDER_RING_FILL_4(X)  (RECORDER_RING_FILL_2(X)  | RECORDER_RING_FILL_2(X)  >> 4)
+#define RECORDER_RING_FILL_8(X)  (RECORDER_RING_FILL_4(X)  | RECORDER_RING_FILL_4(X)  >> 8)
+#define RECORDER_RING_FILL_16(X) (RECORDER_RING_FILL_8(X)  | RECORDER_RING_FILL_8(X)  >> 16)
+#define RECORDER_RING_FILL_32(X) (RECORDER_RING_FILL_16(X) | RECORDER_RING_FILL_16(X) >> 16 >> 16)
+
 typedef struct recorder_ring
 // ----------------------------------------------------------------------------
 //   Header for ring buffers
 // ----------------------------------------------------------------------------
 {
-    size_t      size;           // Number of elements in data array
+    size_t      size;           // Number of elements in data array (2^N)
     size_t      item_size;      // Size of the elements
-    ringidx_t   reader;         // Reader index
+    size_t      flags;          // RECORDER_RING_SEQUENCED
+    char        size_pad[RECORDER_CACHE_LINE - 3 * sizeof(size_t)];
     ringidx_t   writer;         // Writer index
     ringidx_t   commit;         // Last commited write
+    char        writer_pad[RECORDER_CACHE_LINE - 2 * sizeof(ringidx_t)];
+    ringidx_t   reader;         // Reader index
     ringidx_t   overflow;       // Overflowed writes
+    char        reader_pad[RECORDER_CACHE_LINE - 2 * sizeof(ringidx_t)];
 } recorder_ring_t, *recorder_ring_p;
 
+// Flags for rings
+#define RECORDER_RING_SEQUENCED 1      // Sequence numbers follow the data
+
+static inline RECORDER_RING_MAYBE_UNUSED
+size_t recorder_ring_round_size(size_t size)
+// ----------------------------------------------------------------------------
+//   Round a ring size up to the next power of 2
+// ----------------------------------------------------------------------------
+{
+    size_t result = 1;
+    while (result && result < size)
+        result <<= 1;
+    return size ? result : 0;
+}
+
+static inline RECORDER_RING_MAYBE_UNUSED
+ringidx_t *recorder_ring_sequence(recorder_ring_p ring)
+// ----------------------------------------------------------------------------
+//   Return the sequence numbers that follow the data in a sequenced ring
+// ----------------------------------------------------------------------------
+{
+    size_t bytes = ring->size * ring->item_size;
+    bytes = (bytes + sizeof(ringidx_t) - 1) & ~(sizeof(ringidx_t) - 1);
+    return (ringidx_t *) ((char *) (ring + 1) + bytes);
+}
+
+typedef struct recorder_ring_span
+// ----------------------------------------------------------------------------
+//   Contiguous elements in a ring, for zero-copy reads and writes
+// ----------------------------------------------------------------------------
+{
+    void *      data;           // First element
+    size_t      count;          // Number of elements
+} recorder_ring_span;
+
 /* Deal with blocking situations on given ring
    - Return true if situation is handled and operation can proceed
    - Return false will abort read or write operation.
@@ -169,6 +250,11 @@ typedef bool (*recorder_ring_block_fn)(recorder_ring_p,
 extern recorder_ring_p  recorder_ring_init(recorder_ring_p ring,
                                            size_t size, size_t item_size);
 extern recorder_ring_p  recorder_ring_new(size_t size, size_t item_size);
+extern recorder_ring_p  recorder_ring_init_sequenced(recorder_ring_p ring,
+                                                     size_t size,
+                                                     size_t item_size);
+extern recorder_ring_p  recorder_ring_new_sequenced(size_t size,
+                                                    size_t item_size);
 extern void             recorder_ring_delete(recorder_ring_p ring);
 extern size_t           recorder_ring_readable(recorder_ring_p ring, ringidx_t *reader);
 extern size_t           recorder_ring_writable(recorder_ring_p ring);
@@ -183,6 +269,26 @@ extern ringidx_t        recorder_ring_write(recorder_ring_p ring,
                                             recorder_ring_block_fn write_block,
                                             recorder_ring_block_fn commit_block,
                                             ringidx_t *writer);
+extern size_t           recorder_ring_acquire(recorder_ring_p ring,
+                                              size_t count,
+                                              ringidx_t *reader,
+                                              recorder_ring_block_fn read_block,
+                                              recorder_ring_block_fn read_overflow,
+                                              recorder_ring_span spans[2],
+                                              ringidx_t *first);
+extern size_t           recorder_ring_release(recorder_ring_p ring,
+                                              ringidx_t *reader,
+                                              ringidx_t first, size_t count);
+extern size_t           recorder_ring_reserve(recorder_ring_p ring,
+                                              size_t count,
+                                              recorder_ring_block_fn write_block,
+                                              ringidx_t *writer,
+                                              recorder_ring_span spans[2]);
+extern void             recorder_ring_commit(recorder_ring_p ring,
+                                             ringidx_t writer, size_t count,
+                                             recorder_ring_block_fn commit_block);
+extern ringidx_t        recorder_ring_publish(recorder_ring_p ring,
+                                              ringidx_t writer, size_t count);
 
 
 
@@ -245,9 +351,45 @@ extern ringidx_t        recorder_ring_write(recorder_ring_p ring,
     }                                                                   \
                                                                         \
     static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Ring##_acquire(Ring *rb,                                     \
+                          size_t count,                                 \
+                          ringidx_t *reader,                            \
+                          recorder_ring_span spans[2],                  \
+                          ringidx_t *first)                             \
+    {                                                                   \
+        return recorder_ring_acquire(&rb->ring, count, reader,          \
+                                     NULL, NULL, spans, first);         \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Ring##_release(Ring *rb,                                     \
+                          ringidx_t *reader,                            \
+                          ringidx_t first,                              \
+                          size_t count)                                 \
+    {                                                                   \
+        return recorder_ring_release(&rb->ring, reader, first, count);  \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Ring##_reserve(Ring *rb,                                     \
+                          size_t count,                                 \
+                          ringidx_t *writer,                            \
+                          recorder_ring_span spans[2])                  \
+    {                                                                   \
+        return recorder_ring_reserve(&rb->ring, count, NULL,            \
+                                     writer, spans);                    \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    void Ring##_commit(Ring *rb, ringidx_t writer, size_t count)        \
+    {                                                                   \
+        recorder_ring_commit(&rb->ring, writer, count, NULL);           \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
     ringidx_t Ring##_readable(Ring *rb)                                 \
     {                                                                   \
-        return recorder_ring_readable(&rb->ring);                       \
+        return recorder_ring_readable(&rb->ring, NULL);                 \
     }                                                                   \
                                                                         \
     static inline RECORDER_RING_MAYBE_UNUSED                            \
@@ -273,7 +415,7 @@ extern ringidx_t        recorder_ring_write(recorder_ring_p ring,
     extern struct Name##_ring                                           \
     {                                                                   \
         recorder_ring_t ring;                                           \
-        Type            data[Size];                                     \
+        Type            data[RECORDER_RING_SIZE(Size)];                 \
     } Name;                                                             \
                                                                         \
     static inline RECORDER_RING_MAYBE_UNUSED                            \
@@ -309,6 +451,39 @@ extern ringidx_t        recorder_ring_write(recorder_ring_p ring,
     }                                                                   \
                                                                         \
     static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Name##_acquire(size_t count,                                 \
+                          ringidx_t *reader,                            \
+                          recorder_ring_span spans[2],                  \
+                          ringidx_t *first)                             \
+    {                                                                   \
+        return recorder_ring_acquire(&Name.ring, count, reader,         \
+                                     NULL, NULL, spans, first);         \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Name##_release(ringidx_t *reader,                            \
+                          ringidx_t first,                              \
+                          size_t count)                                 \
+    {                                                                   \
+        return recorder_ring_release(&Name.ring, reader, first, count); \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    size_t Name##_reserve(size_t count,                                 \
+                          ringidx_t *writer,                            \
+                          recorder_ring_span spans[2])                  \
+    {                                                                   \
+        return recorder_ring_reserve(&Name.ring, count, NULL,           \
+                                     writer, spans);                    \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
+    void Name##_commit(ringidx_t writer, size_t count)                  \
+    {                                                                   \
+        recorder_ring_commit(&Name.ring, writer, count, NULL);          \
+    }                                                                   \
+                                                                        \
+    static inline RECORDER_RING_MAYBE_UNUSED                            \
     size_t Name##_block_read(Type *ptr,                                 \
                              size_t count,                              \
                              ringidx_t *reader,                         \
@@ -338,7 +513,10 @@ extern ringidx_t        recorder_ring_write(recorder_ring_p ring,
                                                                         \
     struct Name##_ring Name =                                           \
     {                                                                   \
-        { Size, sizeof(Type), 0, 0, 0, 0 }                              \
+        {                                                               \
+            RECORDER_RING_SIZE(Size), sizeof(Type), 0, { 0 },           \
+            0, 0, { 0 }, 0, 0, { 0 }                                    \
+        }                                                               \
     };
 
 
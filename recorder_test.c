@@ -47,6 +47,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <inttypes.h>
 
 
@@ -58,6 +59,20 @@ RECORDER(Special,        64, "Special operations to the recorder");
 RECORDER(SpeedTest,      32, "Recorder speed test");
 RECORDER(SpeedInfo,      32, "Recorder information during speed test");
 RECORDER(FastSpeedTest,  32, "Fast recorder speed test");
+RECORDER_SHARDED(ShardedSpeedTest, 32, "Sharded recorder speed test");
+RECORDER(ScalableOrder,  16, "Entries ordered from time stamps");
+RECORDER(ScalableAfter,  16, "Entries ordered after scalable order mode");
+RECORDER(Binary,         16, "Entries written to a binary dump");
+RECORDER(AsyncTrace,     16, "Entries traced from a background thread");
+RECORDER(InlineString,   16, "Entries with a copy of a string argument");
+RECORDER(Buffered,       16, "Entries dumped with buffered output");
+RECORDER(Sampled,        64, "Entries kept by sampling");
+RECORDER(Snapshot,       16, "Entries copied in a snapshot");
+RECORDER(Counted,        16, "Entries counted in published statistics");
+RECORDER(Columns,        16, "Entries exported in shared columns");
+RECORDER(Timed,          16, "Percentiles from timing histograms");
+RECORDER(CompiledOut,    16, "Entries compiled out of the build");
+#define RECORDER_DISABLE_CompiledOut 1
 
 
 
@@ -152,6 +167,847 @@ void *recorder_fast_thread(void *thread)
     return NULL;
 }
 
+void *recorder_sharded_thread(void *thread)
+{
+    uintptr_t i = 0;
+    unsigned tid = (unsigned) (uintptr_t) thread;
+    while (!threads_to_stop)
+    {
+        i++;
+        record(ShardedSpeedTest, "[thread %u] Sharded recording %u mod %u",
+               tid, i, i % 300);
+    }
+    recorder_ring_fetch_add(recorder_count, i);
+    recorder_ring_fetch_add(threads_to_stop, -1);
+    return NULL;
+}
+
+void count_entry(recorder_show_fn show, void *output,
+                 const char *label, const char *location,
+                 uintptr_t order, uintptr_t timestamp,
+                 const char *message)
+{
+    unsigned *counted = output;
+    (*counted)++;
+}
+
+const char *counted_text = "";
+
+void count_matching(recorder_show_fn show, void *output,
+                    const char *label, const char *location,
+                    uintptr_t order, uintptr_t timestamp,
+                    const char *message)
+{
+    unsigned *counted = output;
+    if (strstr(message, counted_text))
+        (*counted)++;
+}
+
+void check_scalable_order(recorder_show_fn show, void *output,
+                          const char *label, const char *location,
+                          uintptr_t order, uintptr_t timestamp,
+                          const char *message)
+{
+    unsigned *expected = output;
+    const char *number = strchr(message, '#');
+    unsigned index = number ? atoi(number + 1) : ~0U;
+    if (index != *expected)
+        FAIL("Scalable order entry %u shown at position %u",
+             index, *expected);
+    (*expected)++;
+}
+
+unsigned async_traced = 0;
+
+void check_async_trace(recorder_show_fn show, void *output,
+                       const char *label, const char *location,
+                       uintptr_t order, uintptr_t timestamp,
+                       const char *message)
+{
+    const char *number = strchr(message, '#');
+    unsigned index = number ? atoi(number + 1) : ~0U;
+    if (strcmp(label, "AsyncTrace") != 0)
+        return;
+    if (index != async_traced)
+        FAIL("Async trace entry %u shown at position %u",
+             index, async_traced);
+    recorder_ring_fetch_add(async_traced, 1);
+}
+
+char decoded[1024];
+
+unsigned show_decoded(const char *text, size_t len, void *output)
+{
+    size_t used = strlen(decoded);
+    if (used + len + 2 < sizeof(decoded))
+    {
+        memcpy(decoded + used, text, len);
+        strcpy(decoded + used + len, "\n");
+    }
+    return len;
+}
+
+void binary_dump_test(void)
+{
+    const char *expected[] =
+    {
+        "Binary: Text 'hello' number 42 real 3.25",
+        "Binary: Long 1 2 3 4 5.5 'six' 7 8.5 9",
+    };
+    unsigned e;
+
+    char text[] = "hello";
+    record(Binary, "Text '%+s' number %d real %.2f", text, 42, 3.25);
+    record(Binary, "Long %d %u %ld %lu %.1f '%+s' %d %.1f %x",
+           1, 2u, 3l, 4lu, 5.5, "six", 7, 8.5, 9);
+
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+    unsigned written = recorder_dump_binary(fd);
+    lseek(fd, 0, SEEK_SET);
+
+    recorder_show_fn show = recorder_configure_show(show_decoded);
+    unsigned read = recorder_decode_binary(fd);
+    recorder_configure_show(show);
+    fclose(file);
+
+    INFO("Binary dump wrote %u entries, decoded %u", written, read);
+    if (read == 0 || read > written)
+        FAIL("Unexpected number of decoded entries %u for %u written",
+             read, written);
+    for (e = 0; e < sizeof(expected) / sizeof(expected[0]); e++)
+        if (!strstr(decoded, expected[e]))
+            FAIL("Binary dump did not contain '%s'", expected[e]);
+
+    // A chunk with an impossible size must be rejected, not read
+    struct { uint32_t kind, size; uint64_t id; } chunk = { 'S', ~0U, 0 };
+    char garbage[4000] = { 0 };
+    file = tmpfile();
+    fd = fileno(file);
+    if (write(fd, &chunk, sizeof(chunk)) != sizeof(chunk) ||
+        write(fd, garbage, sizeof(garbage)) != sizeof(garbage))
+        FAIL("Unable to write invalid binary dump");
+    lseek(fd, 0, SEEK_SET);
+    read = recorder_decode_binary(fd);
+    fclose(file);
+    if (read)
+        FAIL("Decoded %u entries from an invalid binary dump", read);
+
+    // Decoding dumps does not fill the cache of formats for this process
+    unsigned uncached = 0;
+    for (e = 0; e < 200; e++)
+    {
+        record(Binary, "Cached %u", e);
+        file = tmpfile();
+        fd = fileno(file);
+        recorder_dump_binary(fd);
+        lseek(fd, 0, SEEK_SET);
+        recorder_configure_show(show_decoded);
+        recorder_decode_binary(fd);
+        lseek(fd, 0, SEEK_SET);
+        recorder_decode_binary(fd);
+        recorder_configure_show(show);
+        fclose(file);
+        record(Binary, "Cached again %u", e);
+        recorder_sort("Binary", count_entry, NULL, &read);
+    }
+    counted_text = "Format cache full";
+    recorder_sort("recorder_warning", count_matching, NULL, &uncached);
+    if (uncached)
+        FAIL("Formats were no longer cached after decoding dumps");
+}
+
+char inline_shown[256];
+
+void show_inline_string(recorder_show_fn show, void *output,
+                        const char *label, const char *location,
+                        uintptr_t order, uintptr_t timestamp,
+                        const char *message)
+{
+    size_t used = strlen(inline_shown);
+    snprintf(inline_shown + used, sizeof(inline_shown) - used, "%s\n", message);
+}
+
+void inline_string_test(void)
+{
+    recorder_ring_p ring = &RECORDER_INFO(InlineString)->ring;
+    char text[] = "before";
+    ringidx_t writer = ring->writer;
+
+    record(InlineString, "Args %d %d %d %d %d %d %d %d %d %d",
+           1, 2, 3, 4, 5, 6, 7, 8, 9, 10);
+    if (ring->writer - writer != 2)
+        FAIL("Record with 10 args used %u entries",
+             (unsigned) (ring->writer - writer));
+
+    writer = ring->writer;
+    recorder_trace_set("recorder_inline_strings=16");
+    record(InlineString, "Text '%s' %d", text, 2);
+    recorder_trace_set("recorder_inline_strings=0");
+    strcpy(text, "after");
+    if (ring->writer - writer != 2)
+        FAIL("Record with an inline string used %u entries",
+             (unsigned) (ring->writer - writer));
+
+    recorder_sort("InlineString", show_inline_string, NULL, NULL);
+    if (!strstr(inline_shown, "Args 1 2 3 4 5 6 7 8 9 10"))
+        FAIL("Long record shown as '%.200s'", inline_shown);
+    if (!strstr(inline_shown, "Text 'before' 2"))
+        FAIL("Inline string shown as '%.200s'", inline_shown);
+}
+
+void buffered_output_test(void)
+{
+    char buffer[4096];
+    int  fds[2];
+    int  i;
+
+    if (pipe(fds) != 0)
+    {
+        FAIL("Unable to create pipe for buffered output");
+        return;
+    }
+    for (i = 0; i < 8; i++)
+        record(Buffered, "Line %d", i);
+
+    void *output = recorder_configure_output((void *) (intptr_t) fds[1]);
+    recorder_show_fn show = recorder_configure_show(recorder_print_buffered);
+    unsigned dumped = recorder_dump_for("Buffered");
+    recorder_configure_show(show);
+    recorder_configure_output(output);
+    close(fds[1]);
+
+    ssize_t size = read(fds[0], buffer, sizeof(buffer) - 1);
+    close(fds[0]);
+    buffer[size > 0 ? size : 0] = 0;
+
+    unsigned lines = 0;
+    char *line;
+    for (line = buffer; (line = strchr(line, '\n')); line++)
+        lines++;
+    INFO("Buffered output dumped %u entries, read %u lines", dumped, lines);
+    if (dumped != 8 || lines != dumped)
+        FAIL("Buffered output wrote %u lines for %u entries", lines, dumped);
+    if (!strstr(buffer, "Buffered: Line 7\n"))
+    {
+        size_t length = strlen(buffer);
+        FAIL("Buffered output did not contain last line: '%.160s'",
+             buffer + (length > 160 ? length - 160 : 0));
+    }
+}
+
+void trace_set_test(void)
+{
+    unsigned pass;
+
+    // Repeat to use compiled patterns from the cache
+    for (pass = 0; pass < 2; pass++)
+    {
+        recorder_trace_set("bufFERED=3:sleep_time=5");
+        if (RECORDER_TRACE(Buffered) != 3 || RECORDER_TWEAK(sleep_time) != 5 ||
+            RECORDER_TWEAK(sleep_time_delta) != 0)
+            FAIL("Setting by name gave Buffered=%ld sleep_time=%ld delta=%ld",
+                 (long) RECORDER_TRACE(Buffered),
+                 (long) RECORDER_TWEAK(sleep_time),
+                 (long) RECORDER_TWEAK(sleep_time_delta));
+
+        recorder_trace_set("Buff.*=4:sleep_t(ime)?.*=0");
+        if (RECORDER_TRACE(Buffered) != 4 || RECORDER_TWEAK(sleep_time) != 0)
+            FAIL("Setting by pattern gave Buffered=%ld sleep_time=%ld",
+                 (long) RECORDER_TRACE(Buffered),
+                 (long) RECORDER_TWEAK(sleep_time));
+        recorder_trace_set("Buffered=0");
+    }
+}
+
+unsigned sampled_kept = 0;
+char     sampled_report[256];
+
+void check_sampled(recorder_show_fn show, void *output,
+                   const char *label, const char *location,
+                   uintptr_t order, uintptr_t timestamp,
+                   const char *message)
+{
+    if (strstr(message, "Dropped"))
+        snprintf(sampled_report, sizeof(sampled_report), "%s", message);
+    else
+        sampled_kept++;
+}
+
+void sampling_test(void)
+{
+    int i;
+
+    recorder_trace_set("Sampled=1/4");
+    for (i = 0; i < 32; i++)
+        record(Sampled, "Sampled %d", i);
+    sampled_kept = 0;
+    recorder_sort("Sampled", check_sampled, NULL, NULL);
+    if (sampled_kept != 8 || !strstr(sampled_report, "Dropped 24 records"))
+        FAIL("Sampling 1/4 kept %u records, reported '%.160s'",
+             sampled_kept, sampled_report);
+
+    recorder_trace_set("Sampled=1/1:Sampled=5/s");
+    for (i = 0; i < 32; i++)
+        record(Sampled, "Rate limited %d", i);
+    sampled_kept = 0;
+    recorder_sort("Sampled", check_sampled, NULL, NULL);
+    if (sampled_kept != 5 || !strstr(sampled_report, "Dropped 27 records"))
+        FAIL("Rate 5/s kept %u records, reported '%.160s'",
+             sampled_kept, sampled_report);
+
+    // A slow writer that stays under the rate keeps all its records
+    recorder_trace_set("Sampled=10/s");
+    for (i = 0; i < 12; i++)
+    {
+        record(Sampled, "Slow %d", i);
+        dawdle(120, 0);
+    }
+    sampled_kept = 0;
+    sampled_report[0] = 0;
+    recorder_sort("Sampled", check_sampled, NULL, NULL);
+    if (sampled_kept != 12 || strstr(sampled_report, "Dropped"))
+        FAIL("Rate 10/s kept %u slow records, reported '%s'",
+             sampled_kept, sampled_report);
+    recorder_trace_set("Sampled=0/s");
+}
+
+unsigned snapshot_shown = 0;
+unsigned snapshot_after = 0;
+int      snapshot_first = -1;
+
+void check_snapshot(recorder_show_fn show, void *output,
+                    const char *label, const char *location,
+                    uintptr_t order, uintptr_t timestamp,
+                    const char *message)
+{
+    const char *before = strstr(message, "Before ");
+    if (before && snapshot_first < 0)
+        snapshot_first = atoi(before + 7);
+    if (strstr(message, "After"))
+        snapshot_after++;
+    snapshot_shown++;
+}
+
+void snapshot_test(void)
+{
+    unsigned pass;
+    int      i;
+
+    for (i = 0; i < 20; i++)
+        record(Snapshot, "Before %d", i);
+    recorder_snapshot_p snapshot = recorder_snapshot("Snapshot");
+    for (i = 0; i < 5; i++)
+        record(Snapshot, "After %d", i);
+
+    // A snapshot can be dumped more than once
+    for (pass = 0; pass < 2; pass++)
+    {
+        snapshot_shown = snapshot_after = 0;
+        snapshot_first = -1;
+        recorder_snapshot_sort(snapshot, check_snapshot, NULL, NULL);
+        if (snapshot_shown != 15 || snapshot_after || snapshot_first != 5)
+            FAIL("Snapshot showed %u entries, %u after, first %d",
+                 snapshot_shown, snapshot_after, snapshot_first);
+    }
+    recorder_snapshot_delete(snapshot);
+}
+
+void capture_test(void)
+{
+    char source[64], target[64];
+    snprintf(source, sizeof(source), "/tmp/recorder_capture_%d", (int) getpid());
+    snprintf(target, sizeof(target), "/tmp/recorder_replay_%d", (int) getpid());
+
+    recorder_data    zero = { 0 };
+    recorder_chans_p chans = recorder_chans_new(source);
+    recorder_chan_p  ints = recorder_chan_new(chans, RECORDER_SIGNED, 1024,
+                                              "ints", "Integers", "", zero, zero);
+    recorder_chan_p  reals = recorder_chan_new(chans, RECORDER_REAL, 1024,
+                                               "reals", "Reals", "s", zero, zero);
+    recorder_chans_p remote = recorder_chans_open(source);
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+    recorder_capture_p capture = recorder_capture_new(remote, ".*", fd);
+
+    // Write samples with irregular time stamps, polling in between
+    unsigned       samples = 0;
+    int            i;
+    recorder_data  data[2];
+    for (i = 0; i < 1000; i++)
+    {
+        data[0].unsigned_value = 1000 + 10 * i + (i % 3);
+        data[1].signed_value = i % 7 - 3;
+        recorder_chan_write(ints, data, 1);
+        data[0].unsigned_value = 1005 + 10 * i;
+        data[1].real_value = i * 0.5;
+        recorder_chan_write(reals, data, 1);
+        if (i % 16 == 15)
+            samples += recorder_capture_poll(capture);
+    }
+    samples += recorder_capture_poll(capture);
+    if (samples != 2000 || recorder_capture_lost(capture))
+        FAIL("Captured %u samples, lost %lu", samples,
+             (unsigned long) recorder_capture_lost(capture));
+    recorder_capture_delete(capture);
+    recorder_chans_close(remote);
+    recorder_chans_delete(chans);
+    unlink(source);
+
+    // Replay everything as fast as possible, and check the last samples
+    lseek(fd, 0, SEEK_SET);
+    chans = recorder_chans_new(target);
+    recorder_replay_p replay = recorder_replay_new(fd, chans);
+    remote = recorder_chans_open(target);
+    if (!replay)
+    {
+        FAIL("Unable to replay capture");
+    }
+    else
+    {
+        while (recorder_replay_step(replay, 0))
+            ;
+        recorder_replay_delete(replay);
+
+        ints = recorder_chan_find(remote, "ints", NULL);
+        reals = recorder_chan_find(remote, "reals", NULL);
+        ringidx_t reader = 1000 - 4;
+        if (!ints || !reals ||
+            recorder_chan_type(reals) != RECORDER_REAL ||
+            strcmp(recorder_chan_unit(reals), "s") != 0)
+            FAIL("Replayed channels were not recreated correctly");
+        else if (recorder_chan_read(ints, data, 1, &reader) != 1 ||
+                 data[0].unsigned_value != 1000 + 10 * 996 + 0 ||
+                 data[1].signed_value != 996 % 7 - 3)
+            FAIL("Replayed integer sample %lu %ld",
+                 (unsigned long) data[0].unsigned_value,
+                 (long) data[1].signed_value);
+        else if ((reader = 1000 - 1,
+                  recorder_chan_read(reals, data, 1, &reader) != 1) ||
+                 data[0].unsigned_value != 1005 + 10 * 999 ||
+                 data[1].real_value != 999 * 0.5)
+            FAIL("Replayed real sample %lu %f",
+                 (unsigned long) data[0].unsigned_value,
+                 data[1].real_value);
+    }
+    recorder_chans_close(remote);
+    recorder_chans_delete(chans);
+    unlink(target);
+    fclose(file);
+}
+
+void capture_index_test(void)
+{
+    char source[64], target[64];
+    snprintf(source, sizeof(source), "/tmp/recorder_capidx_%d", (int) getpid());
+    snprintf(target, sizeof(target), "/tmp/recorder_repidx_%d", (int) getpid());
+
+    // One data chunk per sample, so that the index is written in pieces
+    recorder_data    zero = { 0 };
+    recorder_chans_p chans = recorder_chans_new(source);
+    recorder_chan_p  ints = recorder_chan_new(chans, RECORDER_SIGNED, 16,
+                                              "ints", "Integers", "", zero, zero);
+    recorder_chans_p remote = recorder_chans_open(source);
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+    recorder_capture_p capture = recorder_capture_new(remote, ".*", fd);
+    recorder_data data[2];
+    unsigned      i, rebuilt = 0;
+    for (i = 0; i < 10000; i++)
+    {
+        data[0].unsigned_value = 1000 + i;
+        data[1].signed_value = i;
+        recorder_chan_write(ints, data, 1);
+        recorder_capture_poll(capture);
+        recorder_capture_flush(capture);
+    }
+    recorder_capture_delete(capture);
+    recorder_chans_close(remote);
+    recorder_chans_delete(chans);
+    unlink(source);
+
+    // Replay must find data chunks from all index chunks, in order
+    recorder_sort("recorder_warning", count_entry, NULL, &i);
+    lseek(fd, 0, SEEK_SET);
+    recorder_trace_set("recorder_export_size=16384");
+    chans = recorder_chans_new(target);
+    recorder_replay_p replay = recorder_replay_new(fd, chans);
+    remote = recorder_chans_open(target);
+    recorder_trace_set("recorder_export_size=2048");
+    unsigned replayed = 0;
+    ringidx_t reader = 0;
+    if (replay)
+    {
+        while (recorder_replay_step(replay, 0))
+            ;
+        recorder_replay_delete(replay);
+        ints = recorder_chan_find(remote, "ints", NULL);
+        while (ints && recorder_chan_read(ints, data, 1, &reader) == 1)
+            if (data[1].signed_value == (intptr_t) replayed)
+                replayed++;
+    }
+    counted_text = "rebuilt";
+    recorder_sort("recorder_warning", count_matching, NULL, &rebuilt);
+    if (replayed != 10000 || rebuilt)
+        FAIL("Replayed %u samples in order from an index in pieces%s",
+             replayed, rebuilt ? ", rebuilt" : "");
+
+    recorder_chans_close(remote);
+    recorder_chans_delete(chans);
+    unlink(target);
+    fclose(file);
+}
+
+void chans_reuse_test(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/recorder_reuse_%d", (int) getpid());
+
+    recorder_data    zero = { 0 };
+    recorder_data    data[2];
+    recorder_chans_p chans = recorder_chans_new(path);
+    recorder_chan_p  kept = recorder_chan_new(chans, RECORDER_SIGNED, 16,
+                                              "kept", "Kept", "", zero, zero);
+    recorder_chans_p remote = recorder_chans_open(path);
+
+    // Growing the file must not invalidate readers
+    recorder_chan_p  chan[64];
+    int              i;
+    for (i = 0; i < 64; i++)
+        chan[i] = recorder_chan_new(chans, RECORDER_SIGNED, 1024,
+                                    "temp", "Temporary", "", zero, zero);
+    data[0].unsigned_value = 1;
+    data[1].signed_value = 42;
+    recorder_chan_write(kept, data, 1);
+    recorder_chan_p seen = recorder_chan_find(remote, "kept", NULL);
+    ringidx_t reader = 0;
+    if (!recorder_chans_valid(remote) || !seen ||
+        recorder_chan_read(seen, data, 1, &reader) != 1 ||
+        data[1].signed_value != 42)
+        FAIL("Reader did not survive growth of the exports file");
+
+    // Deleting channels invalidates readers, then their memory is reused
+    for (i = 0; i < 64; i++)
+        recorder_chan_delete(chan[i]);
+    if (recorder_chans_valid(remote))
+        FAIL("Reader still valid after channels were deleted");
+    struct stat before, after;
+    stat(path, &before);
+    for (i = 0; i < 1000; i++)
+        recorder_chan_delete(recorder_chan_new(chans, RECORDER_SIGNED, 1024,
+                                               "temp", "Again", "",
+                                               zero, zero));
+    stat(path, &after);
+    INFO("Exports file %ld bytes, %ld after re-creating 1000 channels",
+         (long) before.st_size, (long) after.st_size);
+    if (after.st_size != before.st_size)
+        FAIL("Exports file grew from %ld to %ld bytes",
+             (long) before.st_size, (long) after.st_size);
+
+    recorder_chans_close(remote);
+    recorder_chans_delete(chans);
+    unlink(path);
+}
+
+void columns_test(void)
+{
+    char path[64], share[80];
+    snprintf(path, sizeof(path), "/tmp/recorder_cols_%d", (int) getpid());
+    snprintf(share, sizeof(share), "share=%s", path);
+    recorder_trace_set(share);
+    recorder_trace_set("recorder_export_columns=1");
+    recorder_trace_set("Columns=first,second");
+
+    int i;
+    for (i = 0; i < 3; i++)
+        record(Columns, "Row %d %d", i, 2 * i);
+
+    // Channels sharing columns each read all rows with their own reader
+    recorder_data    data[2 * 8];
+    recorder_chans_p chans = recorder_chans_open(path);
+    recorder_chan_p  first = recorder_chan_find(chans, "first", NULL);
+    recorder_chan_p  second = recorder_chan_find(chans, "second", NULL);
+    size_t           firsts = first ? recorder_chan_read(first, data, 8, NULL) : 0;
+    size_t           seconds = second ? recorder_chan_read(second, data, 8, NULL) : 0;
+    if (firsts != 3 || seconds != 3 || data[2*2+1].signed_value != 4)
+        FAIL("Shared columns read %u and %u rows",
+             (unsigned) firsts, (unsigned) seconds);
+
+    recorder_trace_set("Columns=0:recorder_export_columns=0");
+    recorder_chans_close(chans);
+    unlink(path);
+}
+
+void stats_test(void)
+{
+    char path[64], share[80];
+    snprintf(path, sizeof(path), "/tmp/recorder_stats_%d", (int) getpid());
+    snprintf(share, sizeof(share), "share=%s:stats=5", path);
+
+    int i, j;
+    recorder_trace_set(share);
+    for (i = 0; i < 10; i++)
+    {
+        for (j = 0; j < 100; j++)
+            record(Counted, "Counted %d.%d", i, j);
+        dawdle(5, 0);
+    }
+
+    recorder_chans_p chans = recorder_chans_open(path);
+    recorder_chan_p  rate = recorder_chan_find(chans,
+                                               "recorder.stats.Counted.rate",
+                                               NULL);
+    recorder_data    data[2];
+    ringidx_t        reader = 0;
+    uintptr_t        max = 0;
+    while (rate && recorder_chan_read(rate, data, 1, &reader) == 1)
+        if (max < data[1].unsigned_value)
+            max = data[1].unsigned_value;
+    INFO("Published rate for Counted up to %lu records/s", (unsigned long) max);
+    if (!rate || !max)
+        FAIL("No rate published for the Counted recorder");
+    recorder_chans_close(chans);
+
+    // Sharing to another file moves the statistics there
+    char moved[64];
+    snprintf(moved, sizeof(moved), "/tmp/recorder_stats2_%d", (int) getpid());
+    snprintf(share, sizeof(share), "share=%s", moved);
+    recorder_trace_set(share);
+    for (i = 0; i < 10; i++)
+    {
+        record(Counted, "Counted again %d", i);
+        dawdle(5, 0);
+    }
+    chans = recorder_chans_open(moved);
+    if (!chans ||
+        !recorder_chan_find(chans, "recorder.stats.Counted.rate", NULL))
+        FAIL("Statistics were not published after sharing to %s", moved);
+
+    recorder_trace_set("stats=0");
+    if (chans)
+        recorder_chans_close(chans);
+    unlink(moved);
+    unlink(path);
+}
+
+size_t aggregated(recorder_chans_p chans, const char *name,
+                  recorder_data *data, size_t count)
+{
+    // Wait for the aggregation threads to copy samples, then read them
+    recorder_chan_p chan = NULL;
+    ringidx_t       reader = 0;
+    size_t          read = 0;
+    int             tries;
+    for (tries = 0; tries < 100 && read < count; tries++)
+    {
+        dawdle(10, 0);
+        if (!chan)
+            chan = recorder_chan_find(chans, name, NULL);
+        if (chan)
+            read += recorder_chan_read(chan, data + 2 * read, count - read,
+                                       &reader);
+    }
+    return read;
+}
+
+void aggregate_test(void)
+{
+    char source[64], target[64], sampled[64];
+    snprintf(source, sizeof(source), "/tmp/recorder_agsrc_%d", (int) getpid());
+    snprintf(target, sizeof(target), "/tmp/recorder_agout_%d", (int) getpid());
+    snprintf(sampled, sizeof(sampled), "/tmp/recorder_agdn_%d", (int) getpid());
+
+    recorder_data    zero = { 0 };
+    recorder_chans_p chans = recorder_chans_new(source);
+    recorder_chan_p  ints = recorder_chan_new(chans, RECORDER_SIGNED, 1024,
+                                              "ints", "Integers", "", zero, zero);
+    recorder_chans_p output = recorder_chans_new(target);
+    recorder_chans_p down = recorder_chans_new(sampled);
+    recorder_aggregate_p all = recorder_aggregate_new(output, ".*", 0);
+    recorder_aggregate_p few = recorder_aggregate_new(down, "ints", 10);
+    if (!recorder_aggregate_add(all, source, "worker") ||
+        !recorder_aggregate_add(few, source, NULL) ||
+        !recorder_aggregate_add(few, source, NULL))
+        FAIL("Unable to aggregate channels from %s", source);
+
+    // Time stamps from the same process do not need any adjustment
+    uintptr_t     start = recorder_tick();
+    recorder_data data[2 * 102];
+    int           i;
+    for (i = 0; i < 100; i++)
+    {
+        data[0].unsigned_value = start + i;
+        data[1].signed_value = i;
+        recorder_chan_write(ints, data, 1);
+    }
+    size_t copied = aggregated(output, "worker/ints", data, 100);
+    if (copied != 100 ||
+        data[2*99].unsigned_value != start + 99 ||
+        data[2*99+1].signed_value != 99)
+        FAIL("Aggregated %u samples, last %lu %ld", (unsigned) copied,
+             (unsigned long) data[2*99].unsigned_value,
+             (long) data[2*99+1].signed_value);
+
+    // Deleting a channel makes the aggregator reopen the source, and read
+    // the retained samples again, which must not be copied twice
+    recorder_chan_p gone = recorder_chan_new(chans, RECORDER_SIGNED, 16,
+                                             "gone", "Deleted", "", zero, zero);
+    recorder_chan_delete(gone);
+    data[0].unsigned_value = start + 100;
+    data[1].signed_value = 100;
+    recorder_chan_write(ints, data, 1);
+    copied = aggregated(output, "worker/ints", data, 100 + 2);
+    if (copied != 101 || data[2*100].unsigned_value != start + 100)
+        FAIL("Aggregated %u samples after reopening", (unsigned) copied);
+
+    const char *base = strrchr(source, '/') + 1;
+    char        name[80];
+    snprintf(name, sizeof(name), "%s/ints", base);
+    copied = aggregated(down, name, data, 100);
+    if (copied != 11 || data[2*10+1].signed_value != 100)
+        FAIL("Downsampled to %u samples", (unsigned) copied);
+
+    // The same label used twice is made unique
+    snprintf(name, sizeof(name), "%s-2/ints", base);
+    copied = aggregated(down, name, data, 100);
+    if (copied != 11)
+        FAIL("Duplicate label got %u samples", (unsigned) copied);
+
+    // Configurations are sent to processes added after configuring, which
+    // here is this process, through its own configuration thread
+    char self[64], share[80];
+    snprintf(self, sizeof(self), "/tmp/recorder_agself_%d", (int) getpid());
+    snprintf(share, sizeof(share), "share=%s", self);
+    recorder_trace_set(share);
+    recorder_aggregate_configure(all, "sleep_time_delta=3");
+    recorder_aggregate_add(all, self, "self");
+    for (i = 0; i < 100 && RECORDER_TWEAK(sleep_time_delta) != 3; i++)
+        dawdle(10, 0);
+    if (RECORDER_TWEAK(sleep_time_delta) != 3)
+        FAIL("Configuration was not sent to a process added later");
+    recorder_trace_set("sleep_time_delta=0");
+
+    if (recorder_aggregate_configure(all, "aggregated_command") != 2)
+        FAIL("Command was not forwarded to the aggregated processes");
+    if (recorder_aggregate_lost(all))
+        FAIL("Aggregation lost %lu samples",
+             (unsigned long) recorder_aggregate_lost(all));
+
+    recorder_aggregate_delete(few);
+    recorder_aggregate_delete(all);
+    recorder_chans_delete(down);
+    recorder_chans_delete(output);
+    recorder_chans_delete(chans);
+    unlink(self);
+    unlink(sampled);
+    unlink(target);
+    unlink(source);
+}
+
+unsigned timed_shown = 0;
+double   timed_p50, timed_p99, timed_max;
+
+void check_timed(recorder_show_fn show, void *output,
+                 const char *label, const char *location,
+                 uintptr_t order, uintptr_t timestamp,
+                 const char *message)
+{
+    const char *text = strstr(message, "Timed loop");
+    double rate;
+    if (text &&
+        sscanf(text, "Timed loop %lf/s, p50 %lf us, p99 %lf us, max %lf us",
+               &rate, &timed_p50, &timed_p99, &timed_max) == 4)
+        timed_shown++;
+}
+
+void *timing_histogram_thread(void *arg)
+{
+    uintptr_t end = recorder_tick() + RECORDER_HZ / 4;
+    unsigned  i = 0;
+    while (recorder_tick() < end)
+    {
+        RECORD_TIMING_HISTOGRAM_BEGIN(Timed);
+        dawdle(i++ % 100 == 0 ? 2 : 0, 0);
+        RECORD_TIMING_HISTOGRAM_END(Timed, "Timed loop");
+    }
+    return arg;
+}
+
+unsigned timing_threads_seen = 0;
+void *timing_reuse_thread(void *arg)
+{
+    RECORD_TIMING_HISTOGRAM_BEGIN(Timed);
+    recorder_timing_histogram *h;
+    for (timing_threads_seen = 0, h = _timing.threads; h; h = h->next)
+        timing_threads_seen++;
+    RECORD_TIMING_HISTOGRAM_END(Timed, "Timed reuse");
+    return arg;
+}
+
+void timing_histogram_test(void)
+{
+    pthread_t tid[2];
+    int       t;
+    for (t = 0; t < 2; t++)
+        pthread_create(&tid[t], NULL, timing_histogram_thread, NULL);
+    for (t = 0; t < 2; t++)
+        pthread_join(tid[t], NULL);
+
+    // Threads running one after the other share the same histogram
+    for (t = 0; t < 4; t++)
+    {
+        pthread_create(&tid[0], NULL, timing_reuse_thread, NULL);
+        pthread_join(tid[0], NULL);
+    }
+    if (timing_threads_seen != 1)
+        FAIL("Exited threads left %u timing histograms", timing_threads_seen);
+
+    recorder_sort("Timed", check_timed, NULL, NULL);
+    INFO("Timing histogram shown %u times, last p50 %.3f p99 %.3f max %.3f us",
+         timed_shown, timed_p50, timed_p99, timed_max);
+    if (!timed_shown || timed_p50 > timed_p99 || timed_p99 > timed_max ||
+        timed_max < 2000)
+        FAIL("Timing histogram shown %u times, p50 %f, p99 %f, max %f",
+             timed_shown, timed_p50, timed_p99, timed_max);
+}
+
+void compiled_out_test(void)
+{
+    unsigned dumped = 0;
+    int      evaluated = 0;
+    record(CompiledOut, "Compiled out %d", evaluated++);
+    RECORD_FAST(CompiledOut, "Compiled out fast %d", evaluated++);
+    recorder_sort("CompiledOut", count_entry, NULL, &dumped);
+    if (RECORDER_COMPILED(CompiledOut) || !RECORDER_COMPILED(Timed) ||
+        evaluated || dumped)
+        FAIL("Compiled out recorder evaluated %d, dumped %u entries",
+             evaluated, dumped);
+}
+
+#if RECORDER_SECTIONS
+// Plugins defining tweaks but no recorders, as if loaded with dlopen
+recorder_tweak  plugin_tweak_a = { 1, "plugin_tweak_a", "Plugin A", NULL };
+recorder_tweak  plugin_tweak_b = { 1, "plugin_tweak_b", "Plugin B", NULL };
+recorder_tweak *const plugin_tweaks_a[] = { &plugin_tweak_a };
+recorder_tweak *const plugin_tweaks_b[] = { &plugin_tweak_b };
+
+void tweak_only_module_test(void)
+{
+    static recorder_section plugin_a =
+        { NULL, NULL, plugin_tweaks_a, plugin_tweaks_a + 1, NULL };
+    static recorder_section plugin_b =
+        { NULL, NULL, plugin_tweaks_b, plugin_tweaks_b + 1, NULL };
+    recorder_sections_register(&plugin_a);
+    recorder_sections_register(&plugin_b);
+    recorder_trace_set("plugin_tweak_a=5:plugin_tweak_b=6");
+    if (plugin_tweak_a.trace != 5 || plugin_tweak_b.trace != 6)
+        FAIL("Tweaks of modules without recorders set to %ld and %ld",
+             (long) plugin_tweak_a.trace, (long) plugin_tweak_b.trace);
+}
+#else // !RECORDER_SECTIONS
+void tweak_only_module_test(void) {}
+#endif // RECORDER_SECTIONS
+
 typedef struct example { int x; int y; int z; } example_t;
 
 size_t show_struct(intptr_t trace,
@@ -164,6 +1020,13 @@ size_t show_struct(intptr_t trace,
     return s;
 }
 
+static const char *speed_test_name[] = { "normal", "fast", "sharded" };
+static const char *speed_test_Name[] = { "Normal", "Fast", "Sharded" };
+static void *(*speed_test_thread[])(void *) =
+{
+    recorder_thread, recorder_fast_thread, recorder_sharded_thread
+};
+
 void flight_recorder_test(int argc, char **argv)
 {
     int i, j;
@@ -178,27 +1041,27 @@ void flight_recorder_test(int argc, char **argv)
         FAIL("Testing an unexpected version of the recorder, "
              "update RECORDER_CURRENT_VERSION");
 
-    for (i = 0; i < 2; i++)
+    for (i = 0; i < 3; i++)
     {
         recorder_count = 0;
 
         INFO("Launching %u %s recorder thread%s",
-             count, i ? "fast" : "normal", count>1?"s":"");
+             count, speed_test_name[i], count>1?"s":"");
         record(MAIN, "Starting %s speed test for %us with %u threads",
-               i ? "fast" : "normal", howLong, count);
+               speed_test_name[i], howLong, count);
 
         pthread_t tid;
         for (j = 0; j < count; j++)
             pthread_create(&tid, NULL,
-                           i ? recorder_fast_thread : recorder_thread,
+                           speed_test_thread[i],
                            (void *) (intptr_t) j);
 
         INFO("%s recorder testing in progress, please wait about %ds",
-             i ? "Fast" : "Normal", howLong);
+             speed_test_Name[i], howLong);
         unsigned sleepTime = howLong;
         do { sleepTime =  sleep(sleepTime); } while (sleepTime);
         INFO("%s recorder testing completed, stopping threads",
-             i ? "Fast" : "Normal");
+             speed_test_Name[i]);
         threads_to_stop = count;
 
         while(threads_to_stop)
@@ -208,7 +1071,7 @@ void flight_recorder_test(int argc, char **argv)
             dawdle(1, 0);
         }
         INFO("%s test: all threads have stopped, %"PRIuPTR" iterations",
-             i ? "Fast" : "Normal", recorder_count);
+             speed_test_Name[i], recorder_count);
 
         recorder_count += (recorder_count == 0);
         printf("Recorder test analysis (%s):\n"
@@ -216,20 +1079,55 @@ void flight_recorder_test(int argc, char **argv)
                "  Iterations / ms       = %8"PRIuPTR"\n"
                "  Duration per record   = %8uns\n"
                "  Number of threads     = %8u\n",
-               i ? "Fast version" : "Normal version",
+               speed_test_Name[i],
                recorder_count,
                recorder_count / (howLong * 1000),
                (unsigned) (howLong * 1000000000ULL / recorder_count),
                count);
 
         INFO("Recorder test complete (%s), %u threads.",
-             i ? "Fast version" : "Normal version", count);
+             speed_test_Name[i], count);
         INFO("  Iterations      = %10"PRIuPTR, recorder_count);
         INFO("  Iterations / ms = %10"PRIuPTR, recorder_count / (howLong * 1000));
         INFO("  Record cost     = %10uns",
              (unsigned) (howLong * 1000000000ULL / recorder_count));
     }
 
+    // Check that sharded entries from all threads can be dumped
+    unsigned counted = 0;
+    unsigned sharded = recorder_sort("ShardedSpeedTest",
+                                     count_entry, NULL, &counted);
+    INFO("Sharded recorder dumped %u entries", sharded);
+    if (sharded != counted ||
+        sharded > 32 * RECORDER_SHARDS || (count > 1 && sharded <= 32))
+        FAIL("Unexpected number of sharded entries %u for %u threads",
+             sharded, count);
+
+    // Check that entries in scalable order mode are dumped in order
+    unsigned scalable = 0;
+    recorder_trace_set("recorder_scalable_order=1");
+    for (j = 0; j < 10; j++)
+        record(ScalableOrder, "Entry #%u", j);
+    recorder_trace_set("recorder_scalable_order=0");
+    for (j = 10; j < 15; j++)
+        record(ScalableAfter, "Entry #%u", j);
+    if (recorder_sort("Scalable(Order|After)",
+                      check_scalable_order, NULL, &scalable) != 15)
+        FAIL("Unexpected number of scalable order entries %u", scalable);
+
+    // Check that asynchronous traces are all shown, in order
+    recorder_format_fn format = recorder_configure_format(check_async_trace);
+    recorder_trace_set("AsyncTrace:recorder_trace_async=1");
+    for (j = 0; j < 10; j++)
+        record(AsyncTrace, "Entry #%u", j);
+    for (j = 0; j < 1000 && async_traced < 10; j++)
+        dawdle(1, 0);
+    recorder_trace_set("AsyncTrace=0:recorder_trace_async=0");
+    recorder_configure_format(format);
+    INFO("Async traces shown %u entries", async_traced);
+    if (async_traced != 10)
+        FAIL("Unexpected number of async traces %u", async_traced);
+
     record(Special, "Sizeof int=%u intptr_t=%u float=%u double=%u",
            sizeof(int), sizeof(intptr_t), sizeof(float), sizeof(double));
 
@@ -256,6 +1154,21 @@ void flight_recorder_test(int argc, char **argv)
 
     recorder_dump_for("Special");
     recorder_dump();
+    binary_dump_test();
+    inline_string_test();
+    buffered_output_test();
+    trace_set_test();
+    sampling_test();
+    snapshot_test();
+    capture_test();
+    capture_index_test();
+    chans_reuse_test();
+    columns_test();
+    stats_test();
+    aggregate_test();
+    timing_histogram_test();
+    compiled_out_test();
+    tweak_only_module_test();
 
     if (getenv("KEEP_RUNNING"))
     {
@@ -460,6 +460,111 @@ RECORDER_RING_DECLARE(speed_test, recorder_entry, 512);
 RECORDER_RING_DEFINE(speed_test, recorder_entry, 512);
 
 
+RECORDER_RING_DECLARE(span_test, unsigned, 16);
+RECORDER_RING_DEFINE(span_test, unsigned, 16);
+RECORDER_RING_DECLARE(rounded_test, unsigned, 12);
+RECORDER_RING_DEFINE(rounded_test, unsigned, 12);
+
+
+void ring_size_test(void)
+// ----------------------------------------------------------------------------
+//   Check that ring sizes are powers of 2 and indexes on separate lines
+// ----------------------------------------------------------------------------
+{
+    struct
+    {
+        recorder_ring_t ring;
+        unsigned        data[24];
+    } fixed;
+    recorder_ring_p ring = recorder_ring_new(100, sizeof(unsigned));
+
+    if (rounded_test.ring.size != 16 ||
+        sizeof(rounded_test.data) != 16 * sizeof(unsigned))
+        FAIL("Constant ring of 12 has size %zu", rounded_test.ring.size);
+    if (ring->size != 128)
+        FAIL("Ring of 100 allocated with size %zu", ring->size);
+    recorder_ring_delete(ring);
+    recorder_ring_init(&fixed.ring, 24, sizeof(unsigned));
+    if (fixed.ring.size != 16)
+        FAIL("Ring of 24 initialized with size %zu", fixed.ring.size);
+    if (RECORDER_RING_SIZE(0) != 0 || RECORDER_RING_SIZE(1) != 1 ||
+        RECORDER_RING_SIZE(1025) != 2048)
+        FAIL("Incorrect constant ring size rounding");
+    if ((char *) &fixed.ring.reader - (char *) &fixed.ring.writer
+        < RECORDER_CACHE_LINE)
+        FAIL("Reader and writer indexes share a cache line");
+    record(MAIN, "Ring size test %+s", failed ? "failed" : "passed");
+}
+
+
+void sequenced_test(void)
+// ----------------------------------------------------------------------------
+//   Check that sequenced rings only make fully written elements readable
+// ----------------------------------------------------------------------------
+{
+    recorder_ring_p    ring = recorder_ring_new_sequenced(8, sizeof(unsigned));
+    recorder_ring_span spans[2];
+    ringidx_t          first, second, reader = 0;
+    unsigned           data[8];
+    unsigned           round;
+
+    for (round = 0; round < 4; round++)
+    {
+        // Commit the second write before the first one, without waiting
+        recorder_ring_reserve(ring, 3, NULL, &first, spans);
+        recorder_ring_reserve(ring, 2, NULL, &second, spans);
+        recorder_ring_commit(ring, second, 2, NULL);
+        if (recorder_ring_readable(ring, &reader) != 0)
+            FAIL("Round %u: second write readable before first one", round);
+        recorder_ring_commit(ring, first, 3, NULL);
+        if (recorder_ring_readable(ring, &reader) != 5)
+            FAIL("Round %u: %zu readable after both writes, expected 5",
+                 round, recorder_ring_readable(ring, &reader));
+        recorder_ring_read(ring, data, 5, &reader, NULL, NULL);
+        ring->reader = reader;
+    }
+    recorder_ring_delete(ring);
+    record(MAIN, "Sequenced ring test %+s", failed ? "failed" : "passed");
+}
+
+
+void zero_copy_test(void)
+// ----------------------------------------------------------------------------
+//   Check that reserve / acquire return spans split at the end of the ring
+// ----------------------------------------------------------------------------
+{
+    recorder_ring_span spans[2];
+    ringidx_t          writer, reader = 0, first;
+    unsigned           round, n, s, value = 0, expected = 0;
+
+    for (round = 0; round < 8; round++)
+    {
+        size_t count = span_test_reserve(11, &writer, spans);
+        if (count != 11 || spans[0].count + spans[1].count != count)
+            FAIL("Reserved %zu items in spans of %zu and %zu",
+                 count, spans[0].count, spans[1].count);
+        for (s = 0; s < 2; s++)
+            for (n = 0; n < spans[s].count; n++)
+                ((unsigned *) spans[s].data)[n] = value++;
+        span_test_commit(writer, count);
+
+        count = span_test_acquire(16, &reader, spans, &first);
+        if (count != 11 || first != writer)
+            FAIL("Acquired %zu items at %lu, wrote at %lu",
+                 count, (unsigned long) first, (unsigned long) writer);
+        for (s = 0; s < 2; s++)
+            for (n = 0; n < spans[s].count; n++)
+                if (((unsigned *) spans[s].data)[n] != expected++)
+                    FAIL("Span %u item %u is %u", s, n,
+                         ((unsigned *) spans[s].data)[n]);
+        if (span_test_release(&reader, first, count) != count)
+            FAIL("Items overwritten while reading without writers");
+        span_test.ring.reader = reader;
+    }
+    record(MAIN, "Zero-copy test %+s", failed ? "failed" : "passed");
+}
+
+
 static inline ringidx_t special_ring_write(recorder_ring_p ring,
                                            recorder_entry *source)
 // ----------------------------------------------------------------------------
@@ -469,7 +574,7 @@ static inline ringidx_t special_ring_write(recorder_ring_p ring,
     const size_t     size   = 512;
     recorder_entry * data   = (recorder_entry *) (ring + 1);
     ringidx_t        writer = recorder_ring_fetch_add(ring->writer, 1);
-    data[writer % size] = *source;
+    data[writer & (size - 1)] = *source;
     return writer;
 }
 
@@ -561,6 +666,9 @@ int main(int argc, char **argv)
     recorder_trace_set(".*_(warning|error)");
     recorder_dump_on_common_signals(0, 0);
     ringbuffer_test(argc, argv);
+    zero_copy_test();
+    ring_size_test();
+    sequenced_test();
     if (failed)
         recorder_dump();        // Try to figure out what failed
     compare_performance_of_common_operations(100000);
@@ -0,0 +1,305 @@
+// *****************************************************************************
+// recorder_reader.cpp                                          Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Thread reading the exported channels shown by all views
+//
+//
+//
+//
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder_reader.h"
+
+#include <stdio.h>
+
+
+RecorderReader::RecorderReader(const char *filename, recorder_chans_p &chans)
+// ----------------------------------------------------------------------------
+//   Create the reader, which starts reading when start() is called
+// ----------------------------------------------------------------------------
+    : filename(filename), chans(chans), current(0), done(0)
+{}
+
+
+RecorderReader::~RecorderReader()
+// ----------------------------------------------------------------------------
+//   Stop the thread and delete remaining subscriptions
+// ----------------------------------------------------------------------------
+{
+    stop();
+    for (auto &channel : channels)
+        for (auto subscription : channel.subscriptions)
+            delete subscription;
+    for (auto subscription : detached)
+        delete subscription;
+}
+
+
+RecorderReader::Subscription *RecorderReader::subscribe(recorder_chan_p chan)
+// ----------------------------------------------------------------------------
+//   Get the points of a channel, reading it once for all its subscribers
+// ----------------------------------------------------------------------------
+{
+    Subscription *subscription = new Subscription;
+    QMutexLocker lock(&mutex);
+    for (auto &channel : channels)
+    {
+        if (channel.chan == chan)
+        {
+            channel.subscriptions.append(subscription);
+            return subscription;
+        }
+    }
+    Channel channel = { chan, 0, { subscription } };
+    channels.append(channel);
+    return subscription;
+}
+
+
+void RecorderReader::unsubscribe(Subscription *subscription)
+// ----------------------------------------------------------------------------
+//   Stop reading for a subscription, and for its channel if it was the last
+// ----------------------------------------------------------------------------
+{
+    QMutexLocker lock(&mutex);
+    if (!detached.removeOne(subscription))
+    {
+        for (int c = 0; c < channels.size(); c++)
+        {
+            Channel &channel = channels[c];
+            if (channel.subscriptions.removeOne(subscription))
+            {
+                if (channel.subscriptions.isEmpty())
+                    channels.remove(c);
+                break;
+            }
+        }
+    }
+    delete subscription;
+}
+
+
+bool RecorderReader::take(Subscription *subscription,
+                          Points &points, size_t capacity)
+// ----------------------------------------------------------------------------
+//   Take the pending points, return true if some were dropped before
+// ----------------------------------------------------------------------------
+//   The buffers are swapped, so that neither side allocates in steady state
+{
+    QMutexLocker lock(&mutex);
+    bool skipped = subscription->skipped;
+    points.resize(0);
+    points.swap(subscription->pending);
+    subscription->capacity = capacity;
+    subscription->skipped = false;
+    return skipped;
+}
+
+
+void RecorderReader::reopen()
+// ----------------------------------------------------------------------------
+//   Reopen the channels if they became invalid, detaching all subscriptions
+// ----------------------------------------------------------------------------
+//   Views notice that the generation changed and subscribe again.
+//   Until they unsubscribe, their old subscriptions stay valid but get
+//   no more points, since the channels they were reading are gone.
+{
+    QMutexLocker lock(&mutex);
+    if (recorder_chans_valid(chans))
+        return;
+
+    fprintf(stderr, "Recorder channels became invalid, re-initializing\n");
+    recorder_chans_close(chans);
+    chans = recorder_chans_open(filename);
+    for (auto &channel : channels)
+    {
+        for (auto subscription : channel.subscriptions)
+        {
+            subscription->pending.resize(0);
+            detached.append(subscription);
+        }
+    }
+    channels.clear();
+    current++;
+}
+
+
+void RecorderReader::stop()
+// ----------------------------------------------------------------------------
+//   Stop the reader thread and wait for it to exit
+// ----------------------------------------------------------------------------
+{
+    done.storeRelease(1);
+    wait();
+}
+
+
+void RecorderReader::run()
+// ----------------------------------------------------------------------------
+//   Read all channels, and wait a bit when there was nothing to read
+// ----------------------------------------------------------------------------
+{
+    while (!done.loadAcquire())
+    {
+        size_t count = 0;
+        for (int c = 0; ; c++)
+        {
+            QMutexLocker lock(&mutex);
+            if (c >= channels.size() || !chans || !recorder_chans_valid(chans))
+                break;
+            count += read(channels[c]);
+        }
+        if (!count)
+            msleep(interval);
+    }
+}
+
+
+size_t RecorderReader::read(Channel &channel)
+// ----------------------------------------------------------------------------
+//   Read a channel and append its points to all its subscriptions
+// ----------------------------------------------------------------------------
+{
+    recorder_chan_p chan = channel.chan;
+    ringidx_t &ridx = channel.reader;
+    size_t readable = recorder_chan_readable(chan, &ridx);
+    if (!readable)
+        return 0;
+
+    // Points older than what subscribers keep would be dropped right away
+    size_t capacity = 0;
+    for (auto subscription : channel.subscriptions)
+        if (capacity < subscription->capacity)
+            capacity = subscription->capacity;
+    bool skipped = false;
+    if (readable > capacity)
+    {
+        ridx += readable - capacity;
+        readable = capacity;
+        skipped = true;
+    }
+
+    times.resize(readable);
+    values.resize(readable);
+    points.resize(readable);
+
+    recorder_data *tbuf = times.data();
+    recorder_data *vbuf = values.data();
+    QPointF *pbuf = points.data();
+    size_t count = recorder_chan_read_columns(chan, tbuf, vbuf,
+                                              readable, &ridx);
+
+    Q_ASSERT(count <= readable);
+    double scale = 1.0 / RECORDER_HZ;
+    switch(recorder_chan_type(chan))
+    {
+    case RECORDER_NONE:
+        Q_ASSERT(!"Recorder channel has invalid type NONE");
+        break;
+    case RECORDER_INVALID:
+        // Recorder format is invalid, put some fake data
+        for (size_t p = 0; p < count; p++)
+            pbuf[p] = QPointF(p, p % 32);
+        break;
+    case RECORDER_SIGNED:
+        for (size_t p = 0; p < count; p++)
+            pbuf[p] = QPointF(tbuf[p].unsigned_value * scale,
+                              vbuf[p].signed_value);
+        break;
+    case RECORDER_UNSIGNED:
+        for (size_t p = 0; p < count; p++)
+            pbuf[p] = QPointF(tbuf[p].unsigned_value * scale,
+                              vbuf[p].unsigned_value);
+        break;
+    case RECORDER_REAL:
+        for (size_t p = 0; p < count; p++)
+            pbuf[p] = QPointF(tbuf[p].unsigned_value * scale,
+                              vbuf[p].real_value);
+        break;
+    }
+
+    // Keep only the latest points if the view does not take them in time
+    points.resize(count);
+    for (auto subscription : channel.subscriptions)
+    {
+        Points &pending = subscription->pending;
+        pending += points;
+        size_t size = pending.size();
+        if (size > subscription->capacity)
+        {
+            pending.remove(0, size - subscription->capacity);
+            subscription->skipped = true;
+        }
+        if (skipped)
+            subscription->skipped = true;
+    }
+    return count;
+}
+
+
+unsigned RecorderReader::interval        = 2;
+size_t   RecorderReader::defaultCapacity = 4096;
+
+
+RecorderReplay::RecorderReplay(recorder_replay_p replay, double speed)
+// ----------------------------------------------------------------------------
+//   Create the replay thread, which starts when start() is called
+// ----------------------------------------------------------------------------
+    : replay(replay), speed(speed), done(0)
+{}
+
+
+RecorderReplay::~RecorderReplay()
+// ----------------------------------------------------------------------------
+//   Stop the thread and release the replay
+// ----------------------------------------------------------------------------
+{
+    stop();
+    recorder_replay_delete(replay);
+}
+
+
+void RecorderReplay::stop()
+// ----------------------------------------------------------------------------
+//   Stop replaying and wait for the thread to exit
+// ----------------------------------------------------------------------------
+{
+    done.storeRelease(1);
+    wait();
+}
+
+
+void RecorderReplay::run()
+// ----------------------------------------------------------------------------
+//   Replay samples until the end of the capture
+// ----------------------------------------------------------------------------
+{
+    while (!done.loadAcquire() && recorder_replay_step(replay, speed))
+        ;
+}
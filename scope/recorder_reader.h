@@ -0,0 +1,128 @@
+#ifndef RECORDER_READER_H
+#define RECORDER_READER_H
+// *****************************************************************************
+// recorder_reader.h                                            Recorder project
+// *****************************************************************************
+//
+// File description:
+//
+//     Thread reading the exported channels shown by all views
+//
+//
+//
+//
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2017-2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of Recorder
+//
+// Recorder is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Recorder is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Recorder, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "recorder.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QPointF>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+
+class RecorderReader : public QThread
+// ----------------------------------------------------------------------------
+//   Read channels for all views, so that the GUI thread only draws them
+// ----------------------------------------------------------------------------
+{
+public:
+    typedef QVector<QPointF> Points;
+
+    struct Subscription
+    // ------------------------------------------------------------------------
+    //   Points read from a channel for one series, until a view takes them
+    // ------------------------------------------------------------------------
+    //   A subscription is only deleted by unsubscribe(), even after reopen()
+    {
+        Subscription(): capacity(defaultCapacity), skipped(false) {}
+        size_t          capacity;       // Maximum number of pending points
+        Points          pending;        // Points not taken by the view yet
+        bool            skipped;        // Points dropped since last taken
+    };
+
+public:
+    explicit RecorderReader(const char *filename, recorder_chans_p &chans);
+    ~RecorderReader();
+
+    Subscription *      subscribe(recorder_chan_p chan);
+    void                unsubscribe(Subscription *subscription);
+    bool                take(Subscription *subscription,
+                             Points &points, size_t capacity);
+    void                reopen();
+    void                stop();
+    unsigned            generation()    { return current; }
+
+public:
+    static unsigned     interval;
+    static size_t       defaultCapacity;
+
+protected:
+    void                run() override;
+
+private:
+    struct Channel
+    {
+        recorder_chan_p         chan;
+        ringidx_t               reader;
+        QVector<Subscription *> subscriptions;
+    };
+    size_t              read(Channel &channel);
+
+    const char *        filename;
+    recorder_chans_p &  chans;
+    QMutex              mutex;
+    QVector<Channel>    channels;
+    QVector<Subscription *> detached;   // Channels were closed by reopen()
+    QVector<recorder_data> times;
+    QVector<recorder_data> values;
+    Points              points;
+    unsigned            current;
+    QAtomicInt          done;
+};
+
+
+class RecorderReplay : public QThread
+// ----------------------------------------------------------------------------
+//   Replay a capture into local channels that the reader then reads
+// ----------------------------------------------------------------------------
+{
+public:
+    explicit RecorderReplay(recorder_replay_p replay, double speed);
+    ~RecorderReplay();
+
+    void                stop();
+
+protected:
+    void                run() override;
+
+private:
+    recorder_replay_p   replay;
+    double              speed;
+    QAtomicInt          done;
+};
+
+#endif // RECORDER_READER_H
@@ -37,12 +37,17 @@
 
 #include "recorder_view.h"
 #include "recorder_slider.h"
+#include "recorder_reader.h"
 #include "recorder.h"
 
 #include <QtWidgets/QApplication>
 #include <QtWidgets/QMainWindow>
 #include <QtWidgets/QVBoxLayout>
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 
 static void usage(const char *progname)
 // ----------------------------------------------------------------------------
@@ -64,6 +69,10 @@ static void usage(const char *progname)
            "    -r ratio        : Set averaging ratio in percent\n"
            "    -b basename     : Set basename for saving data\n"
            "    -g WxH@XxY      : Set window geometry to W x H pixels\n"
+           "    -o              : Toggle OpenGL rendering\n"
+           "    -i ms           : Set interval between channel reads\n"
+           "    -p capture      : Replay a file written by recorder_capture\n"
+           "    -x speed        : Set replay speed (0 = as fast as possible)\n"
            "\n"
            "  Configuration syntax for -c matches RECORDER_TRACES syntax\n"
            "  Slider syntax is slider[=value[:min:max]]\n"
@@ -88,6 +97,46 @@ int main(int argc, char *argv[])
 {
     recorder_trace_set(".*_warning|.*_error");
     const char *path = recorder_export_file();
+
+    // Options for replaying a capture must be known before opening channels
+    const char *capture = NULL;
+    double speed = 1.0;
+    for (int a = 1; a + 1 < argc; a++)
+    {
+        if (strcmp(argv[a], "-p") == 0)
+            capture = argv[++a];
+        else if (strcmp(argv[a], "-x") == 0)
+            speed = strtod(argv[++a], NULL);
+    }
+
+    // A replay writes the captured samples into local channels
+    char replayPath[64];
+    recorder_chans_p replayChans = NULL;
+    RecorderReplay *replay = NULL;
+    int captureFD = -1;
+    if (capture)
+    {
+        captureFD = open(capture, O_RDONLY);
+        if (captureFD < 0)
+        {
+            fprintf(stderr, "Unable to open capture '%s'\n", capture);
+            return 1;
+        }
+        snprintf(replayPath, sizeof(replayPath),
+                 "/tmp/recorder_replay_%d", (int) getpid());
+        path = replayPath;
+        replayChans = recorder_chans_new(path);
+        recorder_replay_p replayed = replayChans
+            ? recorder_replay_new(captureFD, replayChans)
+            : NULL;
+        if (!replayed)
+        {
+            fprintf(stderr, "Unable to replay capture '%s'\n", capture);
+            return 1;
+        }
+        replay = new RecorderReplay(replayed, speed);
+    }
+
     recorder_chans_p chans = recorder_chans_open(path);
     if (!chans)
     {
@@ -95,6 +144,9 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // A single thread reads the channels for all views
+    RecorderReader reader(path, chans);
+
     QApplication a(argc, argv);
     QMainWindow window;
     QWidget *widget = new QWidget;
@@ -126,6 +178,19 @@ int main(int argc, char *argv[])
         {
             RecorderView::showAverage = !RecorderView::showAverage;
         }
+        else if (arg == "-o")
+        {
+            RecorderView::useOpenGL = !RecorderView::useOpenGL;
+        }
+        else if (arg == "-i" && a+1 < argc)
+        {
+            RecorderReader::interval = strtoul(argv[++a], NULL, 10);
+        }
+        else if ((arg == "-p" || arg == "-x") && a+1 < argc)
+        {
+            // Already processed above
+            a++;
+        }
         else if (arg == "-c" && a+1 < argc)
         {
             if (!recorder_chans_configure(chans, argv[++a]))
@@ -177,7 +242,8 @@ int main(int argc, char *argv[])
         }
         else
         {
-            RecorderView *view = new RecorderView(path, chans, argv[a]);
+            RecorderView *view = new RecorderView(path, chans, reader,
+                                                  argv[a]);
             layout->addWidget(view);
             views++;
         }
@@ -185,7 +251,8 @@ int main(int argc, char *argv[])
 
     if (views == 0 && configurations == 0)
     {
-        RecorderView *recorderView = new RecorderView(path, chans, ".*");
+        RecorderView *recorderView = new RecorderView(path, chans, reader,
+                                                      ".*");
         layout->addWidget(recorderView);
     }
 
@@ -200,9 +267,20 @@ int main(int argc, char *argv[])
         if (posx > 0 && posy > 0)
             window.move(posx, posy);
         window.show();
+        reader.start();
+        if (replay)
+            replay->start();
         result = a.exec();
     }
 
+    delete replay;
+    reader.stop();
     recorder_chans_close(chans);
+    if (replayChans)
+    {
+        recorder_chans_delete(replayChans);
+        unlink(replayPath);
+        close(captureFD);
+    }
     return result;
 }
@@ -42,6 +42,7 @@ INCLUDEPATH += ..
 HEADERS += recorder_view.h
 
 SOURCES += recorder_view.cpp    \
+           recorder_reader.cpp  \
            recorder_scope.cpp   \
            recorder_slider.cpp
 
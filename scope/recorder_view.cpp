@@ -38,7 +38,6 @@
 #include "recorder_view.h"
 
 #include <QtCore/QtMath>
-#include <QMutex>
 #include <QRegularExpression>
 #include <QFileInfo>
 #include <QGraphicsLayout>
@@ -50,6 +49,7 @@ static const double timeScale = 1.0 / timeUnit;
 
 RecorderView::RecorderView(const char *filename,
                            recorder_chans_p &chans,
+                           RecorderReader &reader,
                            const char *pattern,
                            QWidget *parent)
 // ----------------------------------------------------------------------------
@@ -57,6 +57,7 @@ RecorderView::RecorderView(const char *filename,
 // ----------------------------------------------------------------------------
     : QChartView(parent),
       filename(filename), pattern(pattern), chans(chans),
+      reader(reader), generation(reader.generation()),
       sourceChanged(false),
       viewHasNormal(showNormal),
       viewHasTiming(showTiming),
@@ -101,6 +102,8 @@ RecorderView::~RecorderView()
 // ----------------------------------------------------------------------------
 {
     dataUpdater.stop();
+    for (auto subscription : subscriptions)
+        reader.unsubscribe(subscription);
     delete xAxis;
     delete yAxis;
     delete tAxis;
@@ -115,7 +118,6 @@ void RecorderView::setup()
 {
     unsigned i = 0;
     recorder_chan_p chan = NULL;
-    bool hasGL = getenv ("RECORDER_NOGL") == NULL;
     const char *colors[] = {
         "yellow", "red", "lightgreen", "orange",
         "cyan", "lightgray", "pink", "lightyellow",
@@ -159,15 +161,15 @@ void RecorderView::setup()
 
             chart->addSeries(series);
             seriesList.append(series);
-            data.append(Points());
+            data.append(History());
             chanList.append(chan);
-            readerIndex.append(0);
+            subscriptions.append(reader.subscribe(chan));
             seriesType.append(type);
 
             QPen pen(QBrush(QColor(colors[colorIndex])), 2.0);
             pen.setCosmetic(true);
             series->setPen(pen);
-            series->setUseOpenGL(hasGL);
+            series->setUseOpenGL(useOpenGL);
             series->attachAxis(xAxis);
             series->attachAxis(type == TIMING ? tAxis : yAxis);
 
@@ -198,22 +200,18 @@ void RecorderView::updateSetup()
 // ----------------------------------------------------------------------------
 {
     // Update chans only once (it's a pointer shared across all views)
-    static QMutex chansUpdateMutex;
-    chansUpdateMutex.lock();
-    if (!recorder_chans_valid(chans))
-    {
-        fprintf(stderr, "Recorder channels became invalid, re-initializing\n");
-        recorder_chans_close(chans);
-        chans = recorder_chans_open(filename);
-    }
-    chansUpdateMutex.unlock();
+    // If another view did it, the reader only detached our subscriptions
+    for (auto subscription : subscriptions)
+        reader.unsubscribe(subscription);
+    reader.reopen();
+    generation = reader.generation();
 
     // Update the view with the new channels
     chart->removeAllSeries();
     data.clear();
     seriesList.clear();
     chanList.clear();
-    readerIndex.clear();
+    subscriptions.clear();
     seriesType.clear();
     setup();
 }
@@ -238,6 +236,8 @@ void RecorderView::updateSeries()
             return;
         }
     }
+    if (generation != reader.generation())
+        sourceChanged = true;
     if (sourceChanged)
     {
         updateSetup();
@@ -245,10 +245,11 @@ void RecorderView::updateSeries()
     }
 
     size_t numSeries = seriesList.size();
+    size_t columns = this->width() > 0 ? this->width() : 1;
     size_t width =
           maxWidth > 0    ? maxWidth
-        : maxDuration > 0 ? this->width() * 10
-        : this->width();
+        : maxDuration > 0 ? columns * 10
+        : columns;
     double minX = -1.0, maxX = 1.0;
     double minY = -1.0, maxY = 1.0;
     double maxT = timeUnit;
@@ -257,97 +258,34 @@ void RecorderView::updateSeries()
 
     for (size_t s = 0; s < numSeries; s++)
     {
-        recorder_chan_p chan = chanList[s];
-        ringidx_t &ridx = readerIndex[s];
-        size_t readable = recorder_chan_readable(chan, &ridx);
         QLineSeries *series = seriesList[s];
-        Points &dataPoints = data[s];
+        History &history = data[s];
         series_et type = seriesType[s];
 
-        if (readable)
-        {
-            size_t dataLen = dataPoints.size();
-            if (dataLen > width)
-            {
-                dataPoints.remove(0, dataLen - width);
-                dataLen = width;
-            }
-            if (readable > width)
-                readable = width;
-
-            QVector<recorder_data> recorderDataRead(2 * readable);
-            Points pointsRead(readable);
-
-            recorder_data *rbuf = recorderDataRead.data();
-            QPointF *pbuf = pointsRead.data();
-            size_t count = recorder_chan_read(chan, rbuf, readable, &ridx);
-
-            Q_ASSERT(count <= readable);
-            double scale = 1.0 / RECORDER_HZ;
-            if (count)
-            {
-                switch(recorder_chan_type(chan))
-                {
-                case RECORDER_NONE:
-                    Q_ASSERT(!"Recorder channel has invalid type NONE");
-                    break;
-                case RECORDER_INVALID:
-                    // Recorder format is invalid, put some fake data
-                    for (size_t p = 0; p < count; p++)
-                        pbuf[p] = QPointF(p, p % 32);
-                    break;
-                case RECORDER_SIGNED:
-                    for (size_t p = 0; p < count; p++)
-                        pbuf[p] = QPointF(rbuf[2*p].unsigned_value * scale,
-                                          rbuf[2*p+1].signed_value);
-                    break;
-                case RECORDER_UNSIGNED:
-                    for (size_t p = 0; p < count; p++)
-                        pbuf[p] = QPointF(rbuf[2*p].unsigned_value * scale,
-                                          rbuf[2*p+1].unsigned_value);
-                    break;
-                case RECORDER_REAL:
-                    for (size_t p = 0; p < count; p++)
-                        pbuf[p] = QPointF(rbuf[2 * p].unsigned_value * scale,
-                                          rbuf[2 * p + 1].real_value);
-                    break;
-                }
-
-                size_t newLen = count + dataLen;
-                size_t toRemove = newLen > width ? newLen - width : 0;
-                if (toRemove)
-                    dataPoints.remove(0, toRemove);
-                if (count != readable)
-                    pointsRead.resize(count);
-                dataPoints.append(pointsRead);
+        // The reader thread already read and converted the points
+        history.resize(width);
+        if (reader.take(subscriptions[s], pointsRead, width))
+            history.started = false;
 
-                switch(type)
-                {
-                case NORMAL:
-                    series->replace(dataPoints);
-                    break;
-                case MINIMUM:
-                    series->replace(minimum(dataPoints));
-                    break;
-                case MAXIMUM:
-                    series->replace(maximum(dataPoints));
-                    break;
-                case AVERAGE:
-                    series->replace(average(dataPoints));
-                    break;
-                case TIMING:
-                    series->replace(timing(dataPoints));
-                    break;
-                default:
-                    Q_ASSERT(!"Unkown series type");
-                }
-                updated = true;
-            }
+        size_t taken = pointsRead.size();
+        if (taken)
+        {
+            // Filters only process new points, not the whole history
+            const QPointF *pbuf = pointsRead.data();
+            for (size_t p = 0; p < taken; p++)
+                history.append(history.filter(type, pbuf[p]));
+            if (maxDuration > 0.0)
+                history.dropBefore(history[history.size() - 1].x()
+                                   - maxDuration);
+
+            decimate(history, columns, history.shown);
+            series->replace(history.shown);
+            updated = true;
         }
 
-        QPointF *pbuf = dataPoints.data();
-        size_t count = dataPoints.size();
-        qreal lastT = pbuf[0].x();
+        // Decimation keeps extremes, so the ranges can use shown points
+        const QPointF *pbuf = history.shown.data();
+        size_t count = history.shown.size();
         for (size_t p = 0; p < count; p++)
         {
             double x = pbuf[p].x();
@@ -361,43 +299,26 @@ void RecorderView::updateSeries()
                 maxT = 0;
                 first = false;
             }
-            else
+            if (maxX < x)
+                maxX = x;
+            if (minX > x)
+                minX = x;
+            if (type == TIMING)
             {
-                if (maxX < x)
-                    maxX = x;
-                if (minX > x)
-                    minX = x;
-                if (type == TIMING)
-                {
-                    double t = (x - lastT) * timeScale;
-                    if (maxT < t)
-                        maxT = t;
-                    lastT = x;
-                }
-                else
-                {
-                    if (maxY < y)
-                        maxY = y;
-                    if (minY > y)
-                        minY = y;
-                }
+                if (maxT < y)
+                    maxT = y;
             }
-        }
-
-        if (maxDuration > 0.0)
-        {
-            minX = maxX - maxDuration;
-            size_t lowP = 0;
-            for (size_t p = 0; p < count; p++)
+            else
             {
-                double x = pbuf[p].x();
-                if (x < minX)
-                    lowP = p;
+                if (maxY < y)
+                    maxY = y;
+                if (minY > y)
+                    minY = y;
             }
-            if (lowP > 0)
-                dataPoints.remove(0, lowP);
         }
     }
+    if (maxDuration > 0.0)
+        minX = maxX - maxDuration;
 
     if (updated)
     {
@@ -510,25 +431,24 @@ void RecorderView::keyPressEvent(QKeyEvent *event)
 
     if (saveImage)
     {
-        bool hasGL = getenv ("RECORDER_NOGL") == NULL;
-
         QPixmap pixmap(size());
         QPainter painter(&pixmap);
         for (auto s : seriesList)
             s->setUseOpenGL(false);
         render(&painter);
         for (auto s : seriesList)
-            s->setUseOpenGL(hasGL);
+            s->setUseOpenGL(useOpenGL);
         pixmap.save(name + ".png");
     }
 
     if (saveCSV)
     {
-        // Use data directly from series, as it may have gone through processing
-        // for example through timing() or average() functions
+        // Use the history of each series rather than the points shown,
+        // which have been decimated. The history has been processed
+        // by the running minimum, maximum, average or timing filters
         QVector<Points> data;
-        for (auto s : seriesList)
-            data.append(s->points());
+        for (auto &history : this->data)
+            data.append(history.points());
 
         QByteArray cname = (name + ".csv").toUtf8();
         FILE *f = fopen(cname.data(), "w");
@@ -558,100 +478,153 @@ void RecorderView::keyPressEvent(QKeyEvent *event)
 }
 
 
-RecorderView::Points RecorderView::minimum(const RecorderView::Points &data)
+RecorderView::Points RecorderView::History::points() const
 // ----------------------------------------------------------------------------
-//   Compute the running minimum for the input values
+//   Return the points in the history, oldest first
 // ----------------------------------------------------------------------------
 {
-    Points result(data);
-    QPointF *pbuf = result.data();
-    size_t count = result.size();
-    qreal min = std::numeric_limits<qreal>::max();
-    qreal r = averagingRatio;
-
+    Points result(count);
     for (size_t p = 0; p < count; p++)
-    {
-        qreal &y = pbuf[p].ry();
-        if (min > y)
-            min = y;
-        else
-            min = r * min + (1-r) * y;
-        y = min;
-    }
-
+        result[p] = (*this)[p];
     return result;
 }
 
 
-RecorderView::Points RecorderView::maximum(const RecorderView::Points &data)
+void RecorderView::History::resize(size_t capacity)
 // ----------------------------------------------------------------------------
-//   Compute the running maximum for the input values
+//   Change the number of points kept, keeping the most recent ones
 // ----------------------------------------------------------------------------
 {
-    Points result(data);
-    QPointF *pbuf = result.data();
-    size_t count = result.size();
-    qreal max = std::numeric_limits<qreal>::min();
-    qreal r = averagingRatio;
+    if (capacity < 1)
+        capacity = 1;
+    if (capacity == (size_t) ring.size())
+        return;
 
-    for (size_t p = 0; p < count; p++)
+    size_t keep = count < capacity ? count : capacity;
+    Points resized(capacity);
+    for (size_t p = 0; p < keep; p++)
+        resized[p] = (*this)[count - keep + p];
+    ring.swap(resized);
+    first = 0;
+    count = keep;
+}
+
+
+void RecorderView::History::append(const QPointF &point)
+// ----------------------------------------------------------------------------
+//   Add a point to the history, replacing the oldest one if full
+// ----------------------------------------------------------------------------
+{
+    size_t capacity = ring.size();
+    ring[(first + count) % capacity] = point;
+    if (count < capacity)
+        count++;
+    else
+        first = (first + 1) % capacity;
+}
+
+
+void RecorderView::History::dropBefore(qreal x)
+// ----------------------------------------------------------------------------
+//   Drop old points, keeping one before 'x' so that the line starts there
+// ----------------------------------------------------------------------------
+{
+    size_t capacity = ring.size();
+    while (count > 1 && (*this)[1].x() < x)
     {
-        qreal &y = pbuf[p].ry();
-        if (max < y)
-            max = y;
-        else
-            max = r * max + (1-r) * y;
-        y = max;
+        first = (first + 1) % capacity;
+        count--;
     }
-
-    return result;
 }
 
 
-RecorderView::Points RecorderView::average(const RecorderView::Points &data)
+QPointF RecorderView::History::filter(series_et type, const QPointF &point)
 // ----------------------------------------------------------------------------
-//   Compute the running average for the input values
+//   Compute the running minimum, maximum, average or timing for a new point
 // ----------------------------------------------------------------------------
 {
-    Points result(data);
-    QPointF *pbuf = result.data();
-    size_t count = result.size();
-    qreal avg = 0.0;
-    for (size_t p = 0; p < count; p++)
-        avg += pbuf[p].y();
-    avg /= count ? count : 1;
+    qreal x = point.x();
+    qreal y = point.y();
     qreal r = averagingRatio;
 
-    for (size_t p = 0; p < count; p++)
+    if (!started)
     {
-        qreal &y = pbuf[p].ry();
-        avg = r * avg + (1-r) * y;
-        y = avg;
+        minimum = maximum = average = y;
+        last = x;
+        started = true;
     }
 
-    return result;
+    switch(type)
+    {
+    case MINIMUM:
+        minimum = minimum > y ? y : r * minimum + (1-r) * y;
+        return QPointF(x, minimum);
+    case MAXIMUM:
+        maximum = maximum < y ? y : r * maximum + (1-r) * y;
+        return QPointF(x, maximum);
+    case AVERAGE:
+        average = r * average + (1-r) * y;
+        return QPointF(x, average);
+    case TIMING:
+        y = (x - last) * timeScale;
+        last = x;
+        return QPointF(x, y);
+    default:
+        return point;
+    }
 }
 
 
-RecorderView::Points RecorderView::timing(const RecorderView::Points &data)
+void RecorderView::decimate(const History &history, size_t columns,
+                            Points &shown)
 // ----------------------------------------------------------------------------
-//   Compute timing information about the input values
+//   Keep only the minimum and maximum points in each pixel column
 // ----------------------------------------------------------------------------
+//   This gives Qt Charts about two points per column, yet spikes and the
+//   range of the values remain visible
 {
-    Points result(data);
-    QPointF *pbuf = result.data();
-    size_t count = result.size();
-    qreal last = data[0].x();
-
-    for (size_t p = 0; p < count; p++)
+    size_t count = history.size();
+    shown.resize(0);
+    if (count <= 2 * columns)
     {
-        qreal t = pbuf[p].x();
-        qreal &y = pbuf[p].ry();
-        y = (t - last) * timeScale;
-        last = t;
+        for (size_t p = 0; p < count; p++)
+            shown.append(history[p]);
+        return;
     }
 
-    return result;
+    qreal  x0     = history[0].x();
+    qreal  x1     = history[count - 1].x();
+    qreal  scale  = x1 > x0 ? columns / (x1 - x0) : 0;
+    size_t column = 0;
+    size_t lo     = 0;
+    size_t hi     = 0;
+
+    for (size_t p = 0; p <= count; p++)
+    {
+        size_t c = column + 1;
+        if (p < count)
+        {
+            qreal offset = (history[p].x() - x0) * scale;
+            c = offset > 0 ? (size_t) offset : 0;
+        }
+        if (p == 0 || c != column)
+        {
+            // Emit the extremes of the previous column in time order
+            if (p > 0)
+            {
+                shown.append(history[lo < hi ? lo : hi]);
+                if (lo != hi)
+                    shown.append(history[lo < hi ? hi : lo]);
+            }
+            column = c;
+            lo = hi = p;
+            continue;
+        }
+        if (history[p].y() < history[lo].y())
+            lo = p;
+        if (history[p].y() > history[hi].y())
+            hi = p;
+    }
 }
 
 
@@ -662,4 +635,5 @@ bool     RecorderView::showNormal     = true;
 bool     RecorderView::showTiming     = false;
 bool     RecorderView::showMinMax     = false;
 bool     RecorderView::showAverage    = false;
+bool     RecorderView::useOpenGL      = getenv("RECORDER_NOGL") == NULL;
 QString  RecorderView::saveBaseName   = "recorder_scope_data-";
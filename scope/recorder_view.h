@@ -37,6 +37,7 @@
 // *****************************************************************************
 
 #include "recorder.h"
+#include "recorder_reader.h"
 
 #include <QtCharts/QChartView>
 #include <QtCharts/QLineSeries>
@@ -58,6 +59,7 @@ class RecorderView : public QChartView
 public:
     explicit RecorderView(const char *filename,
                           recorder_chans_p &chans,
+                          RecorderReader &reader,
                           const char *pattern,
                           QWidget *parent = 0);
     ~RecorderView();
@@ -79,6 +81,7 @@ public:
     static bool              showTiming;
     static bool              showMinMax;
     static bool              showAverage;
+    static bool              useOpenGL;
     static QString           saveBaseName;
 
 private:
@@ -86,14 +89,48 @@ private:
     const char *             filename;
     const char *             pattern;
     recorder_chans_p         &chans;
+    RecorderReader           &reader;
+    unsigned                 generation;
     bool                     sourceChanged;
 
-    typedef QVector<QPointF> Points;
-    QVector<Points>          data;
+    typedef RecorderReader::Points Points;
+
+    struct History
+    // ------------------------------------------------------------------------
+    //   Ring of the latest points of a series, with running filter state
+    // ------------------------------------------------------------------------
+    {
+        History(): first(0), count(0), started(false),
+                   minimum(0), maximum(0), average(0), last(0) {}
+
+        size_t          size() const        { return count; }
+        const QPointF & operator[](size_t index) const
+        {
+            return ring[(first + index) % ring.size()];
+        }
+        Points          points() const;
+        void            resize(size_t capacity);
+        void            append(const QPointF &point);
+        void            dropBefore(qreal x);
+        QPointF         filter(series_et type, const QPointF &point);
+
+        Points          ring;       // Circular buffer of points
+        size_t          first;      // Index of the oldest point in ring
+        size_t          count;      // Number of points in ring
+        Points          shown;      // Decimated points given to the chart
+        bool            started;    // Filters have seen a first point
+        qreal           minimum;    // Running minimum
+        qreal           maximum;    // Running maximum
+        qreal           average;    // Running average
+        qreal           last;       // Time of the last point, for timing
+    };
+
+    QVector<History>         data;
     QVector<QLineSeries *>   seriesList;
     QVector<recorder_chan_p> chanList;
-    QVector<ringidx_t>       readerIndex;
+    QVector<RecorderReader::Subscription *> subscriptions;
     QVector<series_et>       seriesType;
+    Points                   pointsRead;
 
     QChart *                 chart;
     QValueAxis *             xAxis;
@@ -106,10 +143,8 @@ private:
     bool                     viewHasMinMax;
     bool                     viewHasAverage;
 
-    static Points            minimum(const Points &);
-    static Points            maximum(const Points &);
-    static Points            average(const Points &);
-    static Points            timing(const Points &);
+    static void              decimate(const History &, size_t columns,
+                                      Points &shown);
 };
 
 #endif // RECORDER_VIEW_H